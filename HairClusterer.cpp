@@ -1,15 +1,20 @@
 #include "HairClusterer.h"
 
+#include <algorithm>
+
 #include <opencv2/core/core.hpp>
+#include <QTime>
 #include <ANN/ANN.h>
 
-#include "IsochartHeap.h"
 #include "CoordUtil.h"
+#include "ParallelUtil.h"
 
 using namespace std;
 
 
 HairClusterer::HairClusterer()
+	: m_partitionMode(PartitionSerial), m_bucketWidth(0.01f),
+	m_kmeansTolerance(1e-3f), m_kmeansMaxIters(30), m_fitError(0)
 {
 }
 
@@ -29,14 +34,15 @@ bool HairClusterer::clusterK(HairStrandModel& srcModel, int k, HairStrandModel&
 	addPerStrandVariations(srcModel, 0.25f);
 
 	// compute strand neighborhood
-	if (!srcModel.hasNeighborStrandIDs())
+	if (!srcModel.hasRootNbrs())
 	{
 		printf("ERROR: source doesn't have neighborhoods info!\n");
 		return false;
 	}
 
-	// compute feature vectors...(not necessary though)
-	// ...
+	// compute feature vectors
+	if (!m_srcFeatures.build(srcModel, StrandFeatures::RootRelative))
+		return false;
 
 	vector<int>	seedSIDs;	// strand indices of seeds
 	vector<int> strandCIDs;	// cluster indices of strands
@@ -52,55 +58,226 @@ bool HairClusterer::clusterK(HairStrandModel& srcModel, int k, HairStrandModel&
 
 		strandCIDs.assign(srcModel.numStrands(), -1);	// -1 means "unclustered"
 
-		doPartition(srcModel, seedSIDs, strandCIDs);
-		doFitting(srcModel, strandCIDs, k, dstModel);
+		partition(srcModel, seedSIDs, strandCIDs);
 
-		// compute fitting error
-		float err = calcFitError(srcModel, strandCIDs, dstModel);
+		// fit centers and compute fitting error
+		float err = doFitting(srcModel, strandCIDs, k, dstModel);
 		if (err < minErr)
 		{
 			minErr = err;
 			//iter = 0; // NOTE
 		}
 		printf("Fitting err: %f\n", err);
+
+		m_fitError = err;
 	}
 
-	// update clustering result
-	for (int i = 0; i < srcModel.numStrands(); i++)
-		srcModel.getStrandAt(i)->setClusterID(strandCIDs[i]);
+	finishClustering(srcModel, strandCIDs, dstModel);
 
-	fixUnclustered(srcModel);
+	return true;
+}
 
-	// calculate neighborhood of center strands
-	std::vector< std::vector<int> >& dstNbrIDs = dstModel.neighborStrandIDs();
-	dstNbrIDs.resize(dstModel.numStrands());
-	for (int i = 0; i < dstNbrIDs.size(); i++)
-		dstNbrIDs[i].clear();
 
-	const std::vector< std::vector<int> >& srcNbrIDs = srcModel.neighborStrandIDs();
-	for (int i = 0; i < srcNbrIDs.size(); i++)
+// Refine a grown partition by k-means iterations. Each strand only competes
+// among its own cluster and the clusters of its root neighbors, so clusters
+// stay spatially coherent. Hamerly's bounds (distance to the assigned center,
+// and a lower bound on the distance to the other candidates) skip most
+// distance evaluations once the centers settle. Stops when the relative
+// decrease of the fitting error falls below the tolerance.
+bool HairClusterer::clusterKMeans(HairStrandModel& srcModel, int k, HairStrandModel& dstModel)
+{
+	const int ChunkSize = 1024;
+
+	QTime timer;
+	timer.start();
+
+	dstModel.clear();
+
+	if (!srcModel.hasRootNbrs())
+	{
+		printf("ERROR: source doesn't have neighborhoods info!\n");
+		return false;
+	}
+
+	if (!m_srcFeatures.build(srcModel, StrandFeatures::RootRelative))
+		return false;
+
+	const int numStrands = srcModel.numStrands();
+	const StrandNbrGraph& nbrGraph = srcModel.rootNbrGraph();
+
+	if (k < 1 || k > numStrands)
+	{
+		printf("ERROR: cannot make %d clusters of %d strands!\n", k, numStrands);
+		return false;
+	}
+
+	// initial partition by growing from random seeds
+	vector<int>	seedSIDs;
+	vector<int> strandCIDs(numStrands, -1);
+
+	findInitSeeds(srcModel, k, seedSIDs);
+	partition(srcModel, seedSIDs, strandCIDs);
+
+	float err = doFitting(srcModel, strandCIDs, k, dstModel);
+	printf("K-means initial fitting err: %f\n", err);
+
+	vector<int>		prevCIDs;
+	vector<float>	upper(numStrands), lower(numStrands);
+	vector<float>	drifts(k, 0);
+	vector<char>	changed(numStrands, 1);		// all bounds invalid initially
+	vector<char>	exact(numStrands);
+
+	for (int iter = 0; iter < m_kmeansMaxIters; iter++)
 	{
-		const int cId1 = srcModel.getStrandAt(i)->clusterID();
+		// candidates (own and neighbors' clusters) of strands next to a
+		// reassigned strand may have changed: their bounds are invalid
+		ParallelUtil::parallelFor(0, numStrands, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+			{
+				char e = changed[i];
+				const int* nbrs = nbrGraph.neighbors(i);
+				for (int j = 0; j < nbrGraph.degree(i) && !e; j++)
+					e = changed[nbrs[j]];
+				exact[i] = e;
+			}
+		}, 256);
+
+		// assignment step
+		prevCIDs = strandCIDs;
+
+		const int numChunks = ParallelUtil::numChunks(0, numStrands, ChunkSize);
+		vector<int> chunkChanges(numChunks, 0);
 
-		for (int j = 0; j < srcNbrIDs[i].size(); j++)
+		ParallelUtil::parallelForChunks(0, numStrands, ChunkSize, [&](int c, int begin, int end)
 		{
-			const int cId2 = srcModel.getStrandAt(srcNbrIDs[i][j])->clusterID();
+			vector<int> candCIDs;
 
-			if (cId1 != cId2)
+			for (int i = begin; i < end; i++)
 			{
-				dstNbrIDs[cId1].push_back(cId2);
-				dstNbrIDs[cId2].push_back(cId1);
+				const int cId = prevCIDs[i];
+				changed[i] = 0;
+
+				// clusters of neighbors other than its own
+				candCIDs.clear();
+				const int* nbrs = nbrGraph.neighbors(i);
+				for (int j = 0; j < nbrGraph.degree(i); j++)
+				{
+					const int nbrCId = prevCIDs[nbrs[j]];
+					if (nbrCId >= 0 && nbrCId != cId &&
+						std::find(candCIDs.begin(), candCIDs.end(), nbrCId) == candCIDs.end())
+						candCIDs.push_back(nbrCId);
+				}
+
+				if (candCIDs.empty())
+					continue;	// nothing to compete with
+
+				if (!exact[i] && cId >= 0)
+				{
+					float maxDrift = 0;
+					for (int j = 0; j < candCIDs.size(); j++)
+						maxDrift = std::max(maxDrift, drifts[candCIDs[j]]);
+
+					upper[i] += drifts[cId];
+					lower[i] -= maxDrift;
+					if (upper[i] <= lower[i])
+						continue;
+
+					upper[i] = sqrtf(StrandFeatures::sqrDist(m_srcFeatures.feature(i), m_dstFeatures.feature(cId)));
+					if (upper[i] <= lower[i])
+						continue;
+				}
+
+				// exact distances to all candidates (ties go to the lower cluster index)
+				int	  bestCId  = cId;
+				float bestDist = FLT_MAX, secondDist = FLT_MAX;
+				if (cId >= 0)
+					bestDist = sqrtf(StrandFeatures::sqrDist(m_srcFeatures.feature(i), m_dstFeatures.feature(cId)));
+
+				for (int j = 0; j < candCIDs.size(); j++)
+				{
+					const float dist = sqrtf(StrandFeatures::sqrDist(m_srcFeatures.feature(i),
+																	  m_dstFeatures.feature(candCIDs[j])));
+					if (dist < bestDist || (dist == bestDist && candCIDs[j] < bestCId))
+					{
+						secondDist = bestDist;
+						bestDist   = dist;
+						bestCId	   = candCIDs[j];
+					}
+					else
+						secondDist = std::min(secondDist, dist);
+				}
+
+				strandCIDs[i] = bestCId;
+				upper[i]	  = bestDist;
+				lower[i]	  = secondDist;
+
+				if (bestCId != cId)
+				{
+					changed[i] = 1;
+					chunkChanges[c]++;
+				}
 			}
-		}
-	}
-	// remove duplicates
-	for (int i = 0; i < dstNbrIDs.size(); i++)
-	{
-		std::vector<int>& nbrIDs = dstNbrIDs[i];
-		std::sort(nbrIDs.begin(), nbrIDs.end());
-		nbrIDs.erase(std::unique(nbrIDs.begin(), nbrIDs.end()), nbrIDs.end());
+		});
+
+		int numChanges = 0;
+		for (int c = 0; c < numChunks; c++)
+			numChanges += chunkChanges[c];
+
+		// update step
+		m_prevFeatures.swap(m_dstFeatures);
+
+		const float prevErr = err;
+		err = doFitting(srcModel, strandCIDs, k, dstModel);
+
+		for (int j = 0; j < m_reseededSIDs.size(); j++)
+			changed[m_reseededSIDs[j]] = 1;
+
+		for (int cId = 0; cId < k; cId++)
+			drifts[cId] = sqrtf(StrandFeatures::sqrDist(m_prevFeatures.feature(cId), m_dstFeatures.feature(cId)));
+		printf("K-means iter %d: %d reassigned, fitting err: %f\n", iter + 1, numChanges, err);
+
+		if (numChanges == 0 || prevErr - err <= m_kmeansTolerance * prevErr)
+			break;
 	}
 
+	m_fitError = err;
+
+	finishClustering(srcModel, strandCIDs, dstModel);
+
+	printf("K-means clustering DONE. (%.3f s)\n", timer.elapsed() / 1000.0f);
+
+	return true;
+}
+
+
+void HairClusterer::partition(const HairStrandModel& model, const std::vector<int>& seedSIDs,
+							  std::vector<int>& strandCIDs)
+{
+	if (m_partitionMode == PartitionParallel)
+		doPartitionParallel(model, model.rootNbrGraph(), seedSIDs, strandCIDs);
+	else
+		doPartition(model, model.rootNbrGraph(), seedSIDs, strandCIDs);
+}
+
+
+// assign cluster IDs to source strands, fix unclustered ones and build the
+// neighborhood of center strands
+void HairClusterer::finishClustering(HairStrandModel& srcModel, std::vector<int>& strandCIDs,
+									 HairStrandModel& dstModel)
+{
+	// update clustering result
+	for (int i = 0; i < srcModel.numStrands(); i++)
+		srcModel.getStrandAt(i)->setClusterID(strandCIDs[i]);
+
+	fixUnclustered(srcModel, srcModel.rootNbrGraph());
+
+	// calculate neighborhood of center strands
+	for (int i = 0; i < srcModel.numStrands(); i++)
+		strandCIDs[i] = srcModel.getStrandAt(i)->clusterID();
+
+	dstModel.rootNbrGraph().buildQuotient(srcModel.rootNbrGraph(), strandCIDs, dstModel.numStrands());
+
 	// dummy strand color
 	for (int i = 0; i < dstModel.numStrands(); i++)
 	{
@@ -138,8 +315,6 @@ bool HairClusterer::clusterK(HairStrandModel& srcModel, int k, HairStrandModel&
 	//	vertices[0].color = vertices[1].color = XMFLOAT4(
 	//		0.5f*(tangent.x+1.0f), 0.5f*(tangent.y+1.0f), 0.5f*(tangent.z+1.0f), 1.0f);
 	//}
-
-	return true;
 }
 
 
@@ -179,7 +354,7 @@ void HairClusterer::findNextSeeds(const HairStrandModel& srcModel,
 		const int cId = strandCIDs[i];
 		if (cId < 0) continue;
 
-		float dist = calcStrandDist(srcModel.getStrandAt(i), dstModel.getStrandAt(cId));
+		float dist = calcStrandDist(m_srcFeatures.feature(i), m_dstFeatures.feature(cId));
 		if (dist < minDistOfC[cId])
 		{
 			minDistOfC[cId] = dist;
@@ -190,65 +365,189 @@ void HairClusterer::findNextSeeds(const HairStrandModel& srcModel,
 
 
 // perform k-partition on all unclustered strands.
-void HairClusterer::doPartition(const HairStrandModel& model, const std::vector<int>& seedSIDs, 
-					std::vector<int>& strandCIDs)
+void HairClusterer::doPartition(const HairStrandModel& model, const StrandNbrGraph& nbrGraph,
+								const std::vector<int>& seedSIDs, std::vector<int>& strandCIDs)
 {
-	const int MaxNbr = 16;
+	// one slot per strand, keyed by the distance to the seed of the
+	// best cluster found so far (kept in bestCIDs)
+	IndexedHeap<float>& heap = m_heap;
+	vector<int>& bestCIDs = m_bestCIDs;
 
-	// initialize priority queue
-	IsochartHeap* pHeap = new IsochartHeap(model.numStrands()*MaxNbr/seedSIDs.size());
+	if (heap.numSlots() != model.numStrands())
+		heap.reset(model.numStrands());
+	else
+		heap.clear();
+	bestCIDs.resize(model.numStrands());
+
+	// a strand seeding two clusters stays with the first
 	for (int i = 0; i < seedSIDs.size(); i++)
 	{
-		IsochartHeapable* pEntry = new IsochartHeapable;
-		pEntry->vert[0] = seedSIDs[i];
-		pEntry->vert[1] = i;
-		pEntry->cost	= 0;
-		pHeap->insert(pEntry, 0);
+		if (heap.pushOrDecrease(seedSIDs[i], 0))
+			bestCIDs[seedSIDs[i]] = i;
 	}
 
-	const std::vector<std::vector<int> >& nbrStrandIDs = model.neighborStrandIDs();
-
 	// dequeue until empty
-	while (pHeap->top())
+	while (!heap.isEmpty())
+	{
+		const int sId = heap.pop();
+		const int cId = bestCIDs[sId];
+
+		// add current strand to current cluster
+		strandCIDs[sId] = cId;
+
+		// enqueue (or re-key) all unclustered neighbor strands
+		gatherUnclustered(nbrGraph, sId, strandCIDs, m_nbrSIDs);
+		calcStrandDists(m_srcFeatures.feature(seedSIDs[cId]), m_nbrSIDs, m_nbrDists);
+
+		for (int nId = 0; nId < m_nbrSIDs.size(); nId++)
+		{
+			if (heap.pushOrDecrease(m_nbrSIDs[nId], m_nbrDists[nId]))
+				bestCIDs[m_nbrSIDs[nId]] = cId;
+		}
+	}
+}
+
+
+// Parallel version of doPartition. Strands are grouped into buckets by their
+// key (distance to the seed of the best proposing cluster). All unclustered
+// strands of the current bucket are assigned at once, then their neighbors
+// are relaxed in parallel and the proposals are merged in a fixed order, so
+// the result is deterministic. Each strand still takes the cluster of its
+// best proposal from already clustered neighbors; only strands within the
+// same bucket may be assigned in a different order than the serial flood.
+void HairClusterer::doPartitionParallel(const HairStrandModel& model, const StrandNbrGraph& nbrGraph,
+										const std::vector<int>& seedSIDs, std::vector<int>& strandCIDs)
+{
+	const int RelaxChunkSize = 256;
+	const int MaxBucket		 = 1 << 16;
+
+	m_keys.assign(model.numStrands(), FLT_MAX);
+	m_bestCIDs.assign(model.numStrands(), -1);
+	for (int b = 0; b < m_buckets.size(); b++)
+		m_buckets[b].clear();
+
+	// seeds form the first frontier
+	m_frontier.clear();
+	for (int i = 0; i < seedSIDs.size(); i++)
 	{
-		IsochartHeapable* pEntry = pHeap->extract()->obj;
-		const int sId = pEntry->vert[0];
-		const int cId = pEntry->vert[1];
+		m_keys[seedSIDs[i]]		= 0;
+		m_bestCIDs[seedSIDs[i]] = i;
+		m_frontier.push_back(seedSIDs[i]);
+	}
+
+	float bucketWidth = -1;	// set from the proposals of the seeds
+	int	  currBucket  = 0;
+
+	while (!m_frontier.empty())
+	{
+		for (int i = 0; i < m_frontier.size(); i++)
+			strandCIDs[m_frontier[i]] = m_bestCIDs[m_frontier[i]];
+
+		// propose the clusters of the frontier to unclustered neighbors
+		const int numChunks = ParallelUtil::numChunks(0, m_frontier.size(), RelaxChunkSize);
+		if (m_chunkProposals.size() < numChunks)
+			m_chunkProposals.resize(numChunks);
+
+		ParallelUtil::parallelForChunks(0, m_frontier.size(), RelaxChunkSize, [&](int c, int begin, int end)
+		{
+			vector<Proposal>& proposals = m_chunkProposals[c];
+			proposals.clear();
+
+			vector<int>	  nbrSIDs;
+			vector<float> nbrDists;
+
+			for (int i = begin; i < end; i++)
+			{
+				const int sId = m_frontier[i];
+				const int cId = strandCIDs[sId];
+
+				gatherUnclustered(nbrGraph, sId, strandCIDs, nbrSIDs);
+				calcStrandDists(m_srcFeatures.feature(seedSIDs[cId]), nbrSIDs, nbrDists);
+
+				for (int nId = 0; nId < nbrSIDs.size(); nId++)
+				{
+					Proposal p;
+					p.sId  = nbrSIDs[nId];
+					p.cId  = cId;
+					p.cost = nbrDists[nId];
+					proposals.push_back(p);
+				}
+			}
+		});
+
+		if (bucketWidth < 0)
+		{
+			double sum = 0;
+			int count = 0;
+			for (int c = 0; c < numChunks; c++)
+			{
+				for (int i = 0; i < m_chunkProposals[c].size(); i++)
+					sum += m_chunkProposals[c][i].cost;
+				count += m_chunkProposals[c].size();
+			}
+			bucketWidth = count > 0 ? (float)(sum / count) * m_bucketWidth : 0;
+			if (bucketWidth <= 0)
+				bucketWidth = 1.0f;
+		}
 
-		if (strandCIDs[sId] < 0) // unclustered
+		// keep the best proposal of each strand (ties go to the lower cluster index)
+		for (int c = 0; c < numChunks; c++)
 		{
-			// add current strand to current cluster
-			strandCIDs[sId] = cId;
+			const vector<Proposal>& proposals = m_chunkProposals[c];
+			for (int i = 0; i < proposals.size(); i++)
+			{
+				const Proposal& p = proposals[i];
+				if (p.cost > m_keys[p.sId] || (p.cost == m_keys[p.sId] && p.cId >= m_bestCIDs[p.sId]))
+					continue;
+
+				m_keys[p.sId]	  = p.cost;
+				m_bestCIDs[p.sId] = p.cId;
+
+				int b = (int)std::min(p.cost / bucketWidth, (float)MaxBucket);
+				b = std::max(b, currBucket);
+				if (b >= m_buckets.size())
+					m_buckets.resize(b + 1);
+				m_buckets[b].push_back(p.sId);
+			}
+		}
 
-			// enqueue all unclustered neighbor strands
-			const int numNbrs = nbrStrandIDs[sId].size();
-			for (int nId = 0; nId < numNbrs; nId++)
+		// next frontier: unclustered strands of the lowest non-empty bucket
+		m_frontier.clear();
+		for (; currBucket < m_buckets.size(); currBucket++)
+		{
+			vector<int>& bucket = m_buckets[currBucket];
+			for (int i = 0; i < bucket.size(); i++)
 			{
-				const int nbrSId = nbrStrandIDs[sId][nId];
-				if (strandCIDs[nbrSId] >= 0)
-					continue;	// ignore those already clustered
-
-				IsochartHeapable* pNbrEntry = new IsochartHeapable;
-				pNbrEntry->vert[0] = nbrSId;
-				pNbrEntry->vert[1] = cId;
-				pNbrEntry->cost = calcStrandDist(model.getStrandAt(nbrSId),
-												 model.getStrandAt(seedSIDs[cId]));
-				pHeap->insert(pNbrEntry, -pNbrEntry->cost);
+				if (strandCIDs[bucket[i]] < 0)
+					m_frontier.push_back(bucket[i]);
 			}
+			bucket.clear();
+
+			if (!m_frontier.empty())
+				break;
 		}
-		delete pEntry;
+
+		std::sort(m_frontier.begin(), m_frontier.end());
+		m_frontier.erase(std::unique(m_frontier.begin(), m_frontier.end()), m_frontier.end());
 	}
-	delete pHeap;
 }
 
 
-// compute the center strand for each cluster
-void HairClusterer::doFitting(const HairStrandModel& srcModel, 
-							  const std::vector<int>& strandCIDs,
-							  int k,
-							  HairStrandModel& dstModel)
+// Fit cluster centers as the mean of their strands. Per-chunk partial sums of
+// root-relative features, roots and squared feature norms are reduced per
+// cluster in a fixed order (results don't depend on the thread count). The
+// fitting error follows from the same sums:
+//   sum_i |f_i - mean|^2 = sum_i |f_i|^2 - n |mean|^2
+// Empty clusters are reseeded. Also updates m_dstFeatures.
+float HairClusterer::doFitting(const HairStrandModel& srcModel, 
+							   std::vector<int>& strandCIDs,
+							   int k,
+							   HairStrandModel& dstModel)
 {
-	const int numVerts = srcModel.getStrandAt(0)->numVertices();
+	const int Dim	   = StrandFeatures::Dim;
+	const int SumDim   = Dim + 4;				// features, root, squared norm
+	const int numVerts = NUM_UNISAM_VERTICES;
+	const int numStrands = srcModel.numStrands();
 
 	if (dstModel.numStrands() != k)
 	{
@@ -264,84 +563,223 @@ void HairClusterer::doFitting(const HairStrandModel& srcModel,
 			dstModel.getStrandAt(i)->createEmpty(numVerts);
 	}
 
-	std::vector<int> sizeOfC(k, 0);
+	// fixed number of partial sums, bounded in memory
+	const size_t MaxPartialBytes = 64 << 20;
+	const size_t partialBytes	 = sizeof(double) * SumDim * k;
+	int numPartials = (int)std::min<size_t>(16, std::max<size_t>(1, MaxPartialBytes / partialBytes));
+	numPartials = std::max(1, std::min(numPartials, numStrands / 4096));
 
-	for (int sId = 0; sId < srcModel.numStrands(); sId++)
+	const int chunkSize = (numStrands + numPartials - 1) / numPartials;
+	numPartials = ParallelUtil::numChunks(0, numStrands, chunkSize);
+
+	m_partialSums.assign((size_t)numPartials * SumDim * k, 0.0);
+	m_partialSizes.assign((size_t)numPartials * k, 0);
+
+	ParallelUtil::parallelForChunks(0, numStrands, chunkSize, [&](int c, int begin, int end)
 	{
-		const int cId = strandCIDs[sId];
-		if (cId < 0) continue;
+		double* sums  = &m_partialSums[(size_t)c * SumDim * k];
+		int*	sizes = &m_partialSizes[(size_t)c * k];
 
-		const StrandVertex* srcVerts = srcModel.getStrandAt(sId)->vertices();
-		StrandVertex* dstVerts = dstModel.getStrandAt(cId)->vertices();
-		for (int vId = 0; vId < numVerts; vId++)
+		for (int sId = begin; sId < end; sId++)
 		{
-			dstVerts[vId].position.x += srcVerts[vId].position.x;
-			dstVerts[vId].position.y += srcVerts[vId].position.y;
-			dstVerts[vId].position.z += srcVerts[vId].position.z;
+			const int cId = strandCIDs[sId];
+			if (cId < 0) continue;
+
+			const float* f = m_srcFeatures.feature(sId);
+			const XMFLOAT3& root = srcModel.getStrandAt(sId)->vertices()[0].position;
+
+			double* sum = sums + (size_t)cId * SumDim;
+			double sqrNorm = 0;
+			for (int d = 0; d < Dim; d++)
+			{
+				sum[d]	+= f[d];
+				sqrNorm += f[d] * f[d];
+			}
+			sum[Dim]   += root.x;
+			sum[Dim+1] += root.y;
+			sum[Dim+2] += root.z;
+			sum[Dim+3] += sqrNorm;
+
+			sizes[cId]++;
 		}
-		sizeOfC[cId]++;
-	}
+	});
 
+	// merge partial sums into the first one
+	m_clusterSizes.assign(k, 0);
+	ParallelUtil::parallelFor(0, k, [&](int begin, int end)
+	{
+		for (int cId = begin; cId < end; cId++)
+		{
+			double* sum = &m_partialSums[(size_t)cId * SumDim];
+			int size = m_partialSizes[cId];
+			for (int c = 1; c < numPartials; c++)
+			{
+				const double* partial = &m_partialSums[((size_t)c * k + cId) * SumDim];
+				for (int d = 0; d < SumDim; d++)
+					sum[d] += partial[d];
+				size += m_partialSizes[(size_t)c * k + cId];
+			}
+			m_clusterSizes[cId] = size;
+		}
+	}, 16);
+
+	// reseed empty clusters with the strand farthest from the center of the
+	// largest cluster; when no cluster can spare a strand (fewer clustered
+	// strands than clusters), the empty ones share the largest one's center
+	vector<int> centerCIDs(k);
+	for (int cId = 0; cId < k; cId++)
+		centerCIDs[cId] = cId;
+
+	m_reseededSIDs.clear();
+	int numShared = 0;
 	for (int cId = 0; cId < k; cId++)
 	{
-		float size = (float)sizeOfC[cId];
-		for (int vId = 0; vId < numVerts; vId++)
+		if (m_clusterSizes[cId] > 0)
+			continue;
+
+		const int donor = std::max_element(m_clusterSizes.begin(), m_clusterSizes.end()) - m_clusterSizes.begin();
+		if (m_clusterSizes[donor] < 2)
 		{
-			XMFLOAT3& pos = dstModel.getStrandAt(cId)->vertices()[vId].position;
-			pos.x /= size;
-			pos.y /= size;
-			pos.z /= size;
+			centerCIDs[cId] = donor;
+			numShared++;
+			continue;
 		}
+
+		const double* donorSum = &m_partialSums[(size_t)donor * SumDim];
+		std::vector<float> mean(Dim);
+		for (int d = 0; d < Dim; d++)
+			mean[d] = (float)(donorSum[d] / m_clusterSizes[donor]);
+
+		int	  farSId  = -1;
+		float maxDist = -1;
+		for (int sId = 0; sId < numStrands; sId++)
+		{
+			if (strandCIDs[sId] != donor)
+				continue;
+
+			const float* f = m_srcFeatures.feature(sId);
+			float dist = 0;
+			for (int d = 0; d < Dim; d++)
+				dist += (f[d] - mean[d]) * (f[d] - mean[d]);
+			if (dist > maxDist)
+			{
+				maxDist = dist;
+				farSId	= sId;
+			}
+		}
+
+		// move its sums from the donor to the empty cluster
+		const float* f = m_srcFeatures.feature(farSId);
+		const XMFLOAT3& root = srcModel.getStrandAt(farSId)->vertices()[0].position;
+
+		double strandSum[SumDim];
+		double sqrNorm = 0;
+		for (int d = 0; d < Dim; d++)
+		{
+			strandSum[d] = f[d];
+			sqrNorm += f[d] * f[d];
+		}
+		strandSum[Dim]	 = root.x;
+		strandSum[Dim+1] = root.y;
+		strandSum[Dim+2] = root.z;
+		strandSum[Dim+3] = sqrNorm;
+
+		double* sum = &m_partialSums[(size_t)cId * SumDim];
+		double* dSum = &m_partialSums[(size_t)donor * SumDim];
+		for (int d = 0; d < SumDim; d++)
+		{
+			sum[d]	= strandSum[d];
+			dSum[d] -= strandSum[d];
+		}
+
+		strandCIDs[farSId] = cId;
+		m_reseededSIDs.push_back(farSId);
+		m_clusterSizes[cId] = 1;
+		m_clusterSizes[donor]--;
+
+		printf("Reseeded empty cluster %d with strand %d\n", cId, farSId);
 	}
-}
 
+	if (numShared > 0)
+		printf("WARNING: %d empty clusters share the center of another one\n", numShared);
 
-float HairClusterer::calcFitError(const HairStrandModel&	srcModel, 
-								  const std::vector<int>&	strandCIDs,
-								  const HairStrandModel&	dstModel)
-{
-	float totalErr = 0;
+	// centers, their features and fitting errors
+	m_dstFeatures.resize(k, StrandFeatures::RootRelative);
+	std::vector<double> clusterErrs(k, 0.0);
 
-	for (int sId = 0; sId < srcModel.numStrands(); sId++)
+	ParallelUtil::parallelFor(0, k, [&](int begin, int end)
 	{
-		const int cId = strandCIDs[sId];
-		if (cId < 0) continue;
+		for (int cId = begin; cId < end; cId++)
+		{
+			const int centerCID = centerCIDs[cId];
+			const int size = m_clusterSizes[centerCID];
+			float* f = m_dstFeatures.feature(cId);
+			if (size == 0)
+			{
+				std::fill(f, f + Dim, 0.0f);
+				continue;
+			}
 
-		totalErr += calcStrandDist(srcModel.getStrandAt(sId), dstModel.getStrandAt(cId));
-	}
+			const double* sum = &m_partialSums[(size_t)centerCID * SumDim];
+
+			double sqrNorm = 0;
+			for (int d = 0; d < Dim; d++)
+			{
+				const double mean = sum[d] / size;
+				f[d] = (float)mean;
+				sqrNorm += mean * mean;
+			}
+			if (centerCID == cId)
+				clusterErrs[cId] = std::max(0.0, sum[Dim+3] - size * sqrNorm);
+
+			const XMFLOAT3 root((float)(sum[Dim] / size), (float)(sum[Dim+1] / size), (float)(sum[Dim+2] / size));
+			StrandVertex* dstVerts = dstModel.getStrandAt(cId)->vertices();
+			for (int vId = 0; vId < numVerts; vId++)
+			{
+				dstVerts[vId].position = XMFLOAT3(root.x + f[vId*3], root.y + f[vId*3+1], root.z + f[vId*3+2]);
+			}
+		}
+	}, 16);
+
+	double totalErr = 0;
+	for (int cId = 0; cId < k; cId++)
+		totalErr += clusterErrs[cId];
 
-	return totalErr;
+	return (float)(totalErr / NUM_UNISAM_VERTICES);
 }
 
 
-float HairClusterer::calcStrandDist(const Strand* pA, const Strand* pB)
+// mean squared distance of root-aligned vertices
+float HairClusterer::calcStrandDist(const float* pA, const float* pB) const
 {
-	assert(pA->numVertices() == pB->numVertices());
+	return StrandFeatures::sqrDist(pA, pB) / (float)NUM_UNISAM_VERTICES;
+}
 
-	float dist = 0;
 
-	const XMFLOAT3& rootA = pA->vertices()[0].position;
-	const XMFLOAT3& rootB = pB->vertices()[0].position;
+void HairClusterer::calcStrandDists(const float* pA, const vector<int>& sIDs, vector<float>& dists) const
+{
+	dists.resize(sIDs.size());
+	if (sIDs.empty())
+		return;
 
-	const float rootDx = rootB.x - rootA.x;
-	const float rootDy = rootB.y - rootA.y;
-	const float rootDz = rootB.z - rootA.z;
+	m_srcFeatures.sqrDists(pA, sIDs.data(), sIDs.size(), dists.data());
+	for (int i = 0; i < dists.size(); i++)
+		dists[i] /= (float)NUM_UNISAM_VERTICES;
+}
 
-	for (int i = 1; i < pA->numVertices(); i++)
-	{
-		const XMFLOAT3& vA = pA->vertices()[i].position;
-		const XMFLOAT3& vB = pB->vertices()[i].position;
 
-		const float dx = vB.x - rootDx - vA.x;
-		const float dy = vB.y - rootDx - vA.y;
-		const float dz = vB.z - rootDx - vA.z;
+void HairClusterer::gatherUnclustered(const StrandNbrGraph& nbrGraph, int sId,
+									  const vector<int>& strandCIDs, vector<int>& nbrSIDs)
+{
+	nbrSIDs.clear();
 
-		dist += dx*dx + dy*dy + dz*dz;
+	const int  numNbrs = nbrGraph.degree(sId);
+	const int* nbrs	   = nbrGraph.neighbors(sId);
+	for (int nId = 0; nId < numNbrs; nId++)
+	{
+		if (strandCIDs[nbrs[nId]] < 0)
+			nbrSIDs.push_back(nbrs[nId]);
 	}
-
-	dist /= (float)pA->numVertices();
-
-	return dist;
 }
 
 
@@ -388,7 +826,7 @@ void HairClusterer::addPerStrandVariations(HairStrandModel& model, float maxVar)
 }
 
 
-void HairClusterer::fixUnclustered(HairStrandModel& model)
+void HairClusterer::fixUnclustered(HairStrandModel& model, const StrandNbrGraph& nbrGraph)
 {
 	for (int i = 0; i < model. numStrands(); i++)
 	{
@@ -396,9 +834,10 @@ void HairClusterer::fixUnclustered(HairStrandModel& model)
 		if (strand->clusterID() == -1)
 		{
 			bool fixed = false;
-			for (int j = 0; j < model.neighborStrandIDs()[i].size(); j++)
+			const int* nbrSIDs = nbrGraph.neighbors(i);
+			for (int j = 0; j < nbrGraph.degree(i); j++)
 			{
-				const Strand* nbrStrand = model.getStrandAt(model.neighborStrandIDs()[i][j]);
+				const Strand* nbrStrand = model.getStrandAt(nbrSIDs[j]);
 				if (nbrStrand->clusterID() != -1)
 				{
 					strand->setClusterID(nbrStrand->clusterID());
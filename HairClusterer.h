@@ -1,6 +1,8 @@
 #pragma once
 
 #include "HairStrandModel.h"
+#include "IndexedHeap.h"
+#include "StrandFeatures.h"
 
 #include <vector>
 
@@ -11,10 +13,37 @@ public:
 	HairClusterer();
 	~HairClusterer();
 
+	enum PartitionMode
+	{
+		PartitionSerial,	// single best-first flood from all seeds
+		PartitionParallel,	// bucketed frontier expansion, relaxed in parallel
+	};
+
 	bool	clusterK(HairStrandModel& srcModel, int k, HairStrandModel& dstModel);
 
+	// Neighbor-constrained k-means, iterated until the fitting error converges.
+	bool	clusterKMeans(HairStrandModel& srcModel, int k, HairStrandModel& dstModel);
+
+	void	setKMeansParams(float tolerance, int maxIters) { m_kmeansTolerance = tolerance; m_kmeansMaxIters = maxIters; }
+
+	// fitting error of the last clustering (sum of mean squared vertex distances)
+	float	fitError() const { return m_fitError; }
+
+	void			setPartitionMode(PartitionMode mode) { m_partitionMode = mode; }
+	PartitionMode	partitionMode() const { return m_partitionMode; }
+
+	// Bucket width of parallel partitioning, relative to the mean distance of
+	// seed neighbors. Smaller widths follow the serial order more closely.
+	void	setPartitionBucketWidth(float relWidth) { m_bucketWidth = relWidth; }
+
 private:
 
+	void	partition(const HairStrandModel& model, const std::vector<int>& seedSIDs,
+					  std::vector<int>& strandCIDs);
+
+	void	finishClustering(HairStrandModel& srcModel, std::vector<int>& strandCIDs,
+							 HairStrandModel& dstModel);
+
 	void	findInitSeeds(const HairStrandModel& model, int k, 
 						  std::vector<int>& seedSIDs);
 	
@@ -23,20 +52,62 @@ private:
 						  const HairStrandModel& dstModel,
 						  std::vector<int>& seedSIDs);
 
-	void	doPartition(const HairStrandModel& model, const std::vector<int>& seedSIDs, 
-						std::vector<int>& strandCIDs);
+	void	doPartition(const HairStrandModel& model, const StrandNbrGraph& nbrGraph,
+						const std::vector<int>& seedSIDs, std::vector<int>& strandCIDs);
+
+	void	doPartitionParallel(const HairStrandModel& model, const StrandNbrGraph& nbrGraph,
+								const std::vector<int>& seedSIDs, std::vector<int>& strandCIDs);
 	
-	void	doFitting(const HairStrandModel& srcModel, const std::vector<int>& strandCIDs, 
+	// fit centers to their clusters (reseeding empty ones), returns the fitting error
+	float	doFitting(const HairStrandModel& srcModel, std::vector<int>& strandCIDs, 
 					  int k, HairStrandModel& dstModel);
 
-	float	calcFitError(const HairStrandModel& srcModel, const std::vector<int>& strandCIDs,
-						 const HairStrandModel&	dstModel);
+	float	calcStrandDist(const float* pA, const float* pB) const;
 
-	float	calcStrandDist(const Strand* pA, const Strand* pB);
+	// distances from feature pA to the given source strands
+	void	calcStrandDists(const float* pA, const std::vector<int>& sIDs, std::vector<float>& dists) const;
+
+	static void	gatherUnclustered(const StrandNbrGraph& nbrGraph, int sId,
+								  const std::vector<int>& strandCIDs, std::vector<int>& nbrSIDs);
 
 
 	void	addPerStrandVariations(HairStrandModel& model, float maxVar);
 
-	void	fixUnclustered(HairStrandModel& model);
+	void	fixUnclustered(HairStrandModel& model, const StrandNbrGraph& nbrGraph);
+
+	struct Proposal
+	{
+		int		sId;	// unclustered strand
+		int		cId;	// proposed cluster
+		float	cost;	// distance to the cluster's seed
+	};
+
+	PartitionMode	m_partitionMode;
+	float			m_bucketWidth;
+
+	float			m_kmeansTolerance;
+	int				m_kmeansMaxIters;
+
+	float			m_fitError;
+
+	StrandFeatures	m_srcFeatures;	// root-relative features of source strands
+	StrandFeatures	m_dstFeatures;	// ...and of cluster centers
+	StrandFeatures	m_prevFeatures;	// ...of the previous iteration (k-means)
+
+	// fitting workspace
+	std::vector<double>	m_partialSums;		// per chunk and cluster: features, root, squared norm
+	std::vector<int>	m_partialSizes;
+	std::vector<int>	m_clusterSizes;
+	std::vector<int>	m_reseededSIDs;		// strands moved into empty clusters by the last fitting
+
+	// partitioning workspace, reused across clusterK iterations
+	IndexedHeap<float>	m_heap;
+	std::vector<int>	m_bestCIDs;
+	std::vector<float>	m_keys;
+	std::vector<int>	m_frontier;
+	std::vector<int>	m_nbrSIDs;
+	std::vector<float>	m_nbrDists;
+	std::vector<std::vector<int> >		m_buckets;
+	std::vector<std::vector<Proposal> >	m_chunkProposals;
 };
 
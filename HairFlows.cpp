@@ -1,11 +1,17 @@
 #include "HairFlows.h"
 
+#include <algorithm>
+
 #include <QTime>
 #include <ANN/ANN.h>
 
 #include "SimpleInterpolator.h"
+#include "ParallelUtil.h"
+#include "ThreadPool.h"
+#include "StrandTransport.h"
 
 HairFlows::HairFlows()
+	: m_solver(EMDExact), m_numCandidates(128), m_maxExactBytes((size_t)2 << 30), m_cancel(NULL)
 {
 }
 
@@ -15,6 +21,12 @@ HairFlows::~HairFlows()
 }
 
 
+bool HairFlows::isCancelled() const
+{
+	return m_cancel && m_cancel->isCancelled();
+}
+
+
 void HairFlows::calcFlowsEMD(const HairStrandModel& srcModel, 
 							 const HairStrandModel& dstModel,
 							 bool useStrandWeights)
@@ -28,6 +40,18 @@ void HairFlows::calcFlowsEMD(const HairStrandModel& srcModel,
 
 	printf("Calculating flows from %d to %d strands...", srcModel.numStrands(), dstModel.numStrands());
 
+	const size_t exactBytes = exactEMDBytes(srcModel.numStrands(), dstModel.numStrands());
+	if (m_solver == EMDExact && exactBytes > m_maxExactBytes)
+	{
+		printf("exact solver would need %.1f GB, using sparse solver...", exactBytes / (1024.0 * 1024.0 * 1024.0));
+	}
+
+	if (m_solver == EMDSparse || exactBytes > m_maxExactBytes)
+	{
+		calcFlowsSparseEMD(srcModel, dstModel, useStrandWeights);
+		return;
+	}
+
 	// source hair vectors
 	std::vector<Vector<NUM_UNISAM_VERTICES*3,float> > samplesSrc;
 	std::vector<double> weightsSrc;
@@ -69,8 +93,16 @@ void HairFlows::calcFlowsEMD(const HairStrandModel& srcModel,
 	QTime timer;
 	timer.start();
 
+	StrandFeatures srcFeatures, dstFeatures;
+	srcFeatures.build(srcModel, StrandFeatures::Absolute);
+	dstFeatures.build(dstModel, StrandFeatures::Absolute);
+
+	std::vector<float> costs;
+	calcCosts(srcFeatures, NULL, srcModel.numStrands(), dstFeatures, NULL, dstModel.numStrands(), costs);
+
 	//SimpleInterpolator<NUM_UNISAM_VERTICES*3,float> interp(samplesSrc, weightsSrc, samplesDst, weightsDst, sqrStrandDistSmart);
 	SimpleInterpolator<NUM_UNISAM_VERTICES*3,float> interp(samplesSrc, weightsSrc, samplesDst, weightsDst, sqrStrandDistLinear);
+	interp.setCosts(costs.data());
 	interp.precompute();
 	
 	printf("DONE. (%.3f s)\n", (float)timer.elapsed()/1000.0f);
@@ -87,6 +119,49 @@ void HairFlows::calcFlowsEMD(const HairStrandModel& srcModel,
 }
 
 
+void HairFlows::calcFlowsSparseEMD(const HairStrandModel& srcModel, 
+								   const HairStrandModel& dstModel,
+								   bool useStrandWeights)
+{
+	QTime timer;
+	timer.start();
+
+	std::vector<XMFLOAT3> srcRoots(srcModel.numStrands()), dstRoots(dstModel.numStrands());
+	std::vector<double>	  srcWeights(srcModel.numStrands()), dstWeights(dstModel.numStrands());
+
+	for (int i = 0; i < srcModel.numStrands(); i++)
+	{
+		srcRoots[i]	  = srcModel.getStrandAt(i)->vertices()[0].position;
+		srcWeights[i] = useStrandWeights ? srcModel.getStrandAt(i)->weight() : 1.0;
+	}
+	for (int i = 0; i < dstModel.numStrands(); i++)
+	{
+		dstRoots[i]	  = dstModel.getStrandAt(i)->vertices()[0].position;
+		dstWeights[i] = useStrandWeights ? dstModel.getStrandAt(i)->weight() : 1.0;
+	}
+
+	StrandFeatures srcFeatures, dstFeatures;
+	srcFeatures.build(srcModel, StrandFeatures::Absolute);
+	dstFeatures.build(dstModel, StrandFeatures::Absolute);
+
+	StrandTransport transport;
+	transport.setNumCandidates(m_numCandidates);
+
+	std::vector<TsFlow> flows;
+	transport.solve(srcFeatures, srcRoots, srcWeights, dstFeatures, dstRoots, dstWeights, flows);
+
+	printf("DONE. (%d arcs, %.3f s)\n", transport.numArcs(), (float)timer.elapsed()/1000.0f);
+
+	m_flows.resize(flows.size());
+	for (int i = 0; i < flows.size(); i++)
+	{
+		m_flows[i].ids[0] = flows[i].from;
+		m_flows[i].ids[1] = flows[i].to;
+		m_flows[i].amount = flows[i].amount;
+	}
+}
+
+
 void HairFlows::calcFlowsClusteredEMD(const HairStrandModel& srcModel,
 									  const HairStrandModel& dstModel,
 									  const HairFlows& clusterFlows,
@@ -108,73 +183,117 @@ void HairFlows::calcFlowsClusteredEMD(const HairStrandModel& srcModel,
 	calcClusterSIDs(srcModel, srcClusterSIDs);
 	calcClusterSIDs(dstModel, dstClusterSIDs);
 
+	StrandFeatures srcFeatures, dstFeatures;
+	srcFeatures.build(srcModel, StrandFeatures::Absolute);
+	dstFeatures.build(dstModel, StrandFeatures::Absolute);
+
 	m_flows.clear();
-	
-	// TODO: parallelize using OpenMP?????
-	printf("ClusterFlows(%d)...", clusterFlows.numFlows());
-	for (int iCFlow = 0; iCFlow < clusterFlows.numFlows(); iCFlow++)
+
+	// Each cluster flow is an independent transport problem. Solve them on the
+	// thread pool, largest first, each into its own flow buffer; concatenating
+	// the buffers in cluster flow order gives the same output as a serial loop.
+	const int numCFlows = clusterFlows.numFlows();
+	printf("ClusterFlows(%d)...", numCFlows);
+
+	std::vector<std::pair<double, int> > order(numCFlows);
+	for (int iCFlow = 0; iCFlow < numCFlows; iCFlow++)
 	{
 		const int iSrcCId = clusterFlows.m_flows[iCFlow].ids[0];
 		const int iDstCId = clusterFlows.m_flows[iCFlow].ids[1];
+		order[iCFlow].first	 = -(double)srcClusterSIDs[iSrcCId].size() * dstClusterSIDs[iDstCId].size();
+		order[iCFlow].second = iCFlow;
+	}
+	std::sort(order.begin(), order.end());
 
-		// source hair vectors
-		const int srcCSize = srcClusterSIDs[iSrcCId].size();
-		std::vector<Vector<NUM_UNISAM_VERTICES*3,float> > samplesSrc(srcCSize);
-		std::vector<double> weightsSrc(srcCSize);
+	std::vector<std::vector<MyFlow<2> > > pairFlows(numCFlows);
 
-		for (int i = 0; i < srcCSize; i++)
+	TaskGroup group;
+	for (int k = 0; k < numCFlows; k++)
+	{
+		const int iCFlow = order[k].second;
+		group.run([&, iCFlow]()
 		{
-			const int sId = srcClusterSIDs[iSrcCId][i];
-			const StrandVertex* vertices = srcModel.getStrandAt(sId)->vertices();
-			for (int j = 0; j < NUM_UNISAM_VERTICES; j++)
+			if (isCancelled())
+				return;
+
+			const int iSrcCId = clusterFlows.m_flows[iCFlow].ids[0];
+			const int iDstCId = clusterFlows.m_flows[iCFlow].ids[1];
+
+			// source hair vectors
+			const int srcCSize = srcClusterSIDs[iSrcCId].size();
+			std::vector<Vector<NUM_UNISAM_VERTICES*3,float> > samplesSrc(srcCSize);
+			std::vector<double> weightsSrc(srcCSize);
+
+			for (int i = 0; i < srcCSize; i++)
 			{
-				samplesSrc[i][j*3+0] = vertices[j].position.x;
-				samplesSrc[i][j*3+1] = vertices[j].position.y;
-				samplesSrc[i][j*3+2] = vertices[j].position.z;
+				const int sId = srcClusterSIDs[iSrcCId][i];
+				const StrandVertex* vertices = srcModel.getStrandAt(sId)->vertices();
+				for (int j = 0; j < NUM_UNISAM_VERTICES; j++)
+				{
+					samplesSrc[i][j*3+0] = vertices[j].position.x;
+					samplesSrc[i][j*3+1] = vertices[j].position.y;
+					samplesSrc[i][j*3+2] = vertices[j].position.z;
+				}
+				weightsSrc[i] = useStrandWeights ? srcModel.getStrandAt(sId)->weight() : 1.0;
 			}
-			weightsSrc[i] = useStrandWeights ? srcModel.getStrandAt(sId)->weight() : 1.0;
-		}
 
-		// target hair vectors
-		const int dstCSize = dstClusterSIDs[iDstCId].size();
-		std::vector<Vector<NUM_UNISAM_VERTICES*3,float> > samplesDst(dstCSize);
-		std::vector<double> weightsDst(dstCSize);
+			// target hair vectors
+			const int dstCSize = dstClusterSIDs[iDstCId].size();
+			std::vector<Vector<NUM_UNISAM_VERTICES*3,float> > samplesDst(dstCSize);
+			std::vector<double> weightsDst(dstCSize);
 
-		for (int i = 0; i < dstCSize; i++)
-		{
-			const int sId = dstClusterSIDs[iDstCId][i];
-			const StrandVertex* vertices = dstModel.getStrandAt(sId)->vertices();
-			for (int j = 0; j < NUM_UNISAM_VERTICES; j++)
+			for (int i = 0; i < dstCSize; i++)
 			{
-				samplesDst[i][j*3+0] = vertices[j].position.x;
-				samplesDst[i][j*3+1] = vertices[j].position.y;
-				samplesDst[i][j*3+2] = vertices[j].position.z;
+				const int sId = dstClusterSIDs[iDstCId][i];
+				const StrandVertex* vertices = dstModel.getStrandAt(sId)->vertices();
+				for (int j = 0; j < NUM_UNISAM_VERTICES; j++)
+				{
+					samplesDst[i][j*3+0] = vertices[j].position.x;
+					samplesDst[i][j*3+1] = vertices[j].position.y;
+					samplesDst[i][j*3+2] = vertices[j].position.z;
+				}
+				weightsDst[i] = useStrandWeights ? dstModel.getStrandAt(sId)->weight() : 1.0;
 			}
-			weightsDst[i] = useStrandWeights ? dstModel.getStrandAt(sId)->weight() : 1.0;
-		}
 
-		//printf("<%d*%d>", srcCSize, dstCSize);
+			//printf("<%d*%d>", srcCSize, dstCSize);
 
-		//SimpleInterpolator<NUM_UNISAM_VERTICES*3,float> interp(samplesSrc, weightsSrc, samplesDst, weightsDst, sqrStrandDistSmart);
-		SimpleInterpolator<NUM_UNISAM_VERTICES*3,float> interp(samplesSrc, weightsSrc, samplesDst, weightsDst, sqrStrandDistLinear);
-		interp.precompute();
-	
-		// save generated flows
-		const std::vector<TsFlow>& flows = interp.flows();
-		m_flows.reserve(m_flows.size() + flows.size());
-		for (int i = 0; i < flows.size(); i++)
-		{
-			const int srcSId = srcClusterSIDs[iSrcCId][flows[i].from];
-			const int dstSId = dstClusterSIDs[iDstCId][flows[i].to];
-
-			MyFlow<2> flow;
-			flow.ids[0] = srcSId;
-			flow.ids[1] = dstSId;
-			flow.amount = flows[i].amount;
-			m_flows.push_back(flow);
-		}
+			std::vector<float> costs;
+			calcCosts(srcFeatures, srcClusterSIDs[iSrcCId].data(), srcCSize,
+					  dstFeatures, dstClusterSIDs[iDstCId].data(), dstCSize, costs);
+
+			//SimpleInterpolator<NUM_UNISAM_VERTICES*3,float> interp(samplesSrc, weightsSrc, samplesDst, weightsDst, sqrStrandDistSmart);
+			SimpleInterpolator<NUM_UNISAM_VERTICES*3,float> interp(samplesSrc, weightsSrc, samplesDst, weightsDst, sqrStrandDistLinear);
+			interp.setCosts(costs.data());
+			interp.precompute();
+
+			// save generated flows
+			const std::vector<TsFlow>& flows = interp.flows();
+			std::vector<MyFlow<2> >& outFlows = pairFlows[iCFlow];
+			outFlows.resize(flows.size());
+			for (int i = 0; i < flows.size(); i++)
+			{
+				outFlows[i].ids[0] = srcClusterSIDs[iSrcCId][flows[i].from];
+				outFlows[i].ids[1] = dstClusterSIDs[iDstCId][flows[i].to];
+				outFlows[i].amount = flows[i].amount;
+			}
+		});
+	}
+	group.wait();
+
+	if (isCancelled())
+	{
+		printf("CANCELLED.\n");
+		return;
 	}
 
+	size_t numFlows = 0;
+	for (int iCFlow = 0; iCFlow < numCFlows; iCFlow++)
+		numFlows += pairFlows[iCFlow].size();
+
+	m_flows.reserve(numFlows);
+	for (int iCFlow = 0; iCFlow < numCFlows; iCFlow++)
+		m_flows.insert(m_flows.end(), pairFlows[iCFlow].begin(), pairFlows[iCFlow].end());
+
 	printf("DONE. (%.3f s)\n", (float)timer.elapsed()/1000.0f);
 }
 
@@ -291,4 +410,54 @@ void HairFlows::calcClusterSIDs(const HairStrandModel& model,
 	}
 
 	clusterSIDs.resize(numClusters);
+}
+
+
+// Blocked evaluation: a block of source features is compared against a tile
+// of target features, so each target feature is reused from cache for the
+// whole block.
+void HairFlows::calcCosts(const StrandFeatures& srcFeatures, const int* srcIds, int numSrc,
+						  const StrandFeatures& dstFeatures, const int* dstIds, int numDst,
+						  std::vector<float>& costs)
+{
+	const int SrcBlock = 8;
+	const int DstTile  = 128;
+	const float invDim = 1.0f / StrandFeatures::Dim;
+
+	costs.resize((size_t)numSrc * numDst);
+
+	const int numBlocks = ParallelUtil::numChunks(0, numSrc, SrcBlock);
+
+	ParallelUtil::parallelFor(0, numBlocks, [&](int blockBegin, int blockEnd)
+	{
+		const float* pSrc[SrcBlock];
+
+		for (int b = blockBegin; b < blockEnd; b++)
+		{
+			const int iBegin = b * SrcBlock;
+			const int iEnd	 = std::min(iBegin + SrcBlock, numSrc);
+			for (int i = iBegin; i < iEnd; i++)
+				pSrc[i - iBegin] = srcFeatures.feature(srcIds ? srcIds[i] : i);
+
+			for (int jBegin = 0; jBegin < numDst; jBegin += DstTile)
+			{
+				const int jEnd = std::min(jBegin + DstTile, numDst);
+				for (int j = jBegin; j < jEnd; j++)
+				{
+					const float* pDst = dstFeatures.feature(dstIds ? dstIds[j] : j);
+					for (int i = iBegin; i < iEnd; i++)
+						costs[(size_t)i * numDst + j] = StrandFeatures::sqrDist(pSrc[i - iBegin], pDst) * invDim;
+				}
+			}
+		}
+	}, 2);
+}
+
+
+size_t HairFlows::exactEMDBytes(int numSrc, int numDst)
+{
+	// per arc: float cost here, plus quantized cost, flow, endpoints and state
+	// in the network simplex
+	const size_t BytesPerArc = 24;
+	return (size_t)numSrc * numDst * BytesPerArc;
 }
\ No newline at end of file
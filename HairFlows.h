@@ -1,9 +1,12 @@
 #pragma once
 
 #include "HairStrandModel.h"
+#include "StrandFeatures.h"
 
 #include <vector>
 
+class CancelToken;
+
 template<int N>
 struct MyFlow
 {
@@ -16,9 +19,32 @@ struct MyFlow
 class HairFlows
 {
 public:
+
+	enum EMDSolver
+	{
+		EMDExact,	// network simplex on the full bipartite graph
+		EMDSparse,	// StrandTransport on a sparse candidate graph
+	};
+
 	HairFlows();
 	~HairFlows();
 
+	void		setEMDSolver(EMDSolver solver, int numCandidates = 128) { m_solver = solver; m_numCandidates = numCandidates; }
+	EMDSolver	emdSolver() const { return m_solver; }
+	int			numCandidates() const { return m_numCandidates; }
+
+	// Problems whose exact solve would need more memory fall back to the sparse solver.
+	void		setMaxExactMemory(size_t bytes) { m_maxExactBytes = bytes; }
+	size_t		maxExactMemory() const { return m_maxExactBytes; }
+
+	// estimated memory of the exact solver (cost matrix and network simplex arcs)
+	static size_t	exactEMDBytes(int numSrc, int numDst);
+
+	// Clustered flows stop solving cluster pairs once the token is cancelled,
+	// leaving the flows empty (see isCancelled).
+	void	setCancelToken(const CancelToken* token) { m_cancel = token; }
+	bool	isCancelled() const;
+
 	void	calcFlowsEMD(const HairStrandModel& srcModel, 
 						 const HairStrandModel& dstModel,
 						 bool useStrandWeights);
@@ -41,8 +67,24 @@ public:
 
 private:
 	
+	void	calcFlowsSparseEMD(const HairStrandModel& srcModel, 
+							   const HairStrandModel& dstModel,
+							   bool useStrandWeights);
+
 	void	calcClusterSIDs(const HairStrandModel& model, std::vector<std::vector<int> >& clusterSIDs);
 
+	// EMD costs (same as sqrStrandDistLinear) between the given strands, row-major
+	// numSrc x numDst. NULL ids mean all strands of the feature store.
+	static void	calcCosts(const StrandFeatures& srcFeatures, const int* srcIds, int numSrc,
+						  const StrandFeatures& dstFeatures, const int* dstIds, int numDst,
+						  std::vector<float>& costs);
+
 	std::vector<MyFlow<2> >	m_flows;
+
+	EMDSolver	m_solver;		// for calcFlowsEMD
+	int			m_numCandidates;
+	size_t		m_maxExactBytes;
+
+	const CancelToken*	m_cancel;
 };
 
@@ -1,14 +1,16 @@
 #include "HairHierarchy.h"
 
 #include "HairClusterer.h"
+#include "ParallelUtil.h"
 
 #include <opencv2/core/core.hpp>
 
 #include <QTime>
+#include <QFile>
 
 using namespace std;
 
-HairHierarchy::HairHierarchy() : m_currLvlIdx(-1)
+HairHierarchy::HairHierarchy() : m_currLvlIdx(-1), m_clusterBackend(ClusterGrowFit), m_weightsValid(false)
 {
 	m_levels.reserve(3);
 }
@@ -37,7 +39,8 @@ void HairHierarchy::render()
 void HairHierarchy::clear()
 {
 	m_levels.clear();
-	m_currLvlIdx = -1;
+	m_currLvlIdx   = -1;
+	m_weightsValid = false;
 }
 
 
@@ -48,7 +51,9 @@ bool HairHierarchy::load(QString filename, bool updateBuffers)
 
 	if (m_levels[0].load(filename, updateBuffers))
 	{
-		m_currLvlIdx = 0;
+		m_currLvlIdx   = 0;
+		m_filename	   = filename;
+		m_weightsValid = false;
 		return true;
 	}
 	else
@@ -59,6 +64,248 @@ bool HairHierarchy::load(QString filename, bool updateBuffers)
 }
 
 
+namespace
+{
+	const quint32 CacheMagic	= 0x43484848;	// "HHHC"
+	const quint32 CacheVersion	= 2;	// 2: strand weights flag
+
+	const quint64 FNVOffsetBasis = 14695981039346656037ULL;
+	const quint64 FNVPrime		 = 1099511628211ULL;
+
+	quint64 fnv1a(quint64 hash, const void* data, size_t size)
+	{
+		const unsigned char* bytes = (const unsigned char*)data;
+		for (size_t i = 0; i < size; i++)
+		{
+			hash ^= bytes[i];
+			hash *= FNVPrime;
+		}
+		return hash;
+	}
+
+	template <class T>
+	void writeArray(QFile& file, const std::vector<T>& arr)
+	{
+		quint32 size = arr.size();
+		file.write((const char*)&size, sizeof(quint32));
+		if (size > 0)
+			file.write((const char*)arr.data(), sizeof(T) * size);
+	}
+
+	template <class T>
+	bool readArray(QFile& file, std::vector<T>& arr)
+	{
+		quint32 size = 0;
+		if (file.read((char*)&size, sizeof(quint32)) != sizeof(quint32))
+			return false;
+
+		arr.resize(size);
+		if (size == 0)
+			return true;
+		return file.read((char*)arr.data(), sizeof(T) * size) == (qint64)(sizeof(T) * size);
+	}
+}
+
+
+quint64 HairHierarchy::inputKey(const std::vector<int>& buildParams) const
+{
+	quint64 hash = FNVOffsetBasis;
+
+	hash = fnv1a(hash, &CacheVersion, sizeof(CacheVersion));
+	hash = fnv1a(hash, &m_clusterBackend, sizeof(m_clusterBackend));
+	if (!buildParams.empty())
+		hash = fnv1a(hash, buildParams.data(), sizeof(int) * buildParams.size());
+
+	if (m_levels.empty())
+		return hash;
+
+	const HairStrandModel& model = m_levels[0];
+	const int numStrands = model.numStrands();
+	hash = fnv1a(hash, &numStrands, sizeof(int));
+
+	for (int i = 0; i < numStrands; i++)
+	{
+		const Strand* strand = model.getStrandAt(i);
+		const int numVerts = strand->numVertices();
+		hash = fnv1a(hash, &numVerts, sizeof(int));
+
+		for (int j = 0; j < numVerts; j++)
+			hash = fnv1a(hash, &(strand->vertices()[j].position), sizeof(XMFLOAT3));
+	}
+
+	return hash;
+}
+
+
+bool HairHierarchy::saveCache(QString filename, quint64 key) const
+{
+	if (m_levels.empty())
+		return false;
+
+	QTime timer;
+	timer.start();
+
+	QFile file(filename);
+	if (!file.open(QIODevice::WriteOnly))
+	{
+		printf("ERROR: cannot write hierarchy cache %s!\n", filename.toLocal8Bit().constData());
+		return false;
+	}
+
+	const quint32 numLevels = m_levels.size();
+	const quint32 weightsValid = m_weightsValid;
+	file.write((const char*)&CacheMagic, sizeof(quint32));
+	file.write((const char*)&CacheVersion, sizeof(quint32));
+	file.write((const char*)&key, sizeof(quint64));
+	file.write((const char*)&numLevels, sizeof(quint32));
+	file.write((const char*)&weightsValid, sizeof(quint32));
+
+	for (int lvl = 0; lvl < numLevels; lvl++)
+	{
+		const HairStrandModel& model = m_levels[lvl];
+		const int numStrands = model.numStrands();
+
+		// strand attributes and vertices in flat arrays
+		vector<quint32>	 numVerts(numStrands);
+		vector<int>		 clusterIDs(numStrands);
+		vector<float>	 weights(numStrands);
+		vector<XMFLOAT3> positions;
+		vector<XMFLOAT4> colors;
+
+		for (int i = 0; i < numStrands; i++)
+		{
+			const Strand* strand = model.getStrandAt(i);
+			numVerts[i]	  = strand->numVertices();
+			clusterIDs[i] = strand->clusterID();
+			weights[i]	  = strand->weight();
+
+			for (int j = 0; j < strand->numVertices(); j++)
+			{
+				positions.push_back(strand->vertices()[j].position);
+				colors.push_back(strand->vertices()[j].color);
+			}
+		}
+
+		writeArray(file, numVerts);
+		writeArray(file, clusterIDs);
+		writeArray(file, weights);
+		writeArray(file, positions);
+		writeArray(file, colors);
+		writeArray(file, model.rootNbrGraph().offsets());
+		writeArray(file, model.rootNbrGraph().indices());
+	}
+
+	file.close();
+
+	printf("Hierarchy cache saved to %s. (%.3f s)\n", filename.toLocal8Bit().constData(), timer.elapsed()/1000.0f);
+
+	return true;
+}
+
+
+bool HairHierarchy::loadCache(QString filename, quint64 key, bool updateBuffers)
+{
+	QTime timer;
+	timer.start();
+
+	QFile file(filename);
+	if (!file.open(QIODevice::ReadOnly))
+		return false;
+
+	quint32 magic = 0, version = 0, numLevels = 0, weightsValid = 0;
+	quint64 fileKey = 0;
+	file.read((char*)&magic, sizeof(quint32));
+	file.read((char*)&version, sizeof(quint32));
+	file.read((char*)&fileKey, sizeof(quint64));
+	file.read((char*)&numLevels, sizeof(quint32));
+	file.read((char*)&weightsValid, sizeof(quint32));
+
+	if (magic != CacheMagic || version != CacheVersion || fileKey != key || numLevels < 1)
+		return false;
+
+	vector<HairStrandModel> levels(numLevels);
+
+	for (int lvl = 0; lvl < numLevels; lvl++)
+	{
+		vector<quint32>	 numVerts;
+		vector<int>		 clusterIDs;
+		vector<float>	 weights;
+		vector<XMFLOAT3> positions;
+		vector<XMFLOAT4> colors;
+		vector<int>		 nbrOffsets, nbrIndices;
+
+		if (!readArray(file, numVerts)	 || !readArray(file, clusterIDs) ||
+			!readArray(file, weights)	 || !readArray(file, positions)	 ||
+			!readArray(file, colors)	 || !readArray(file, nbrOffsets) ||
+			!readArray(file, nbrIndices))
+		{
+			printf("ERROR: hierarchy cache %s is truncated!\n", filename.toLocal8Bit().constData());
+			return false;
+		}
+
+		const int numStrands = numVerts.size();
+		if (clusterIDs.size() != numStrands || weights.size() != numStrands || 
+			positions.size() != colors.size())
+		{
+			printf("ERROR: hierarchy cache %s is corrupted!\n", filename.toLocal8Bit().constData());
+			return false;
+		}
+
+		// first vertex of each strand
+		vector<size_t> vOffsets(numStrands + 1, 0);
+		for (int i = 0; i < numStrands; i++)
+			vOffsets[i+1] = vOffsets[i] + numVerts[i];
+
+		if (vOffsets[numStrands] != positions.size())
+		{
+			printf("ERROR: hierarchy cache %s is corrupted!\n", filename.toLocal8Bit().constData());
+			return false;
+		}
+
+		HairStrandModel& model = levels[lvl];
+		model.createEmpty(numStrands);
+
+		ParallelUtil::parallelFor(0, numStrands, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+			{
+				Strand* strand = model.getStrandAt(i);
+				strand->createEmpty(numVerts[i]);
+
+				StrandVertex* verts = strand->vertices();
+				for (int j = 0; j < numVerts[i]; j++)
+				{
+					verts[j].position = positions[vOffsets[i] + j];
+					verts[j].color	  = colors[vOffsets[i] + j];
+				}
+				strand->updateLength();
+				strand->setClusterID(clusterIDs[i]);
+				strand->setWeight(weights[i]);
+			}
+		}, 256);
+
+		model.rootNbrGraph().assign(nbrOffsets, nbrIndices);
+	}
+
+	file.close();
+
+	m_levels.swap(levels);
+	if (m_currLvlIdx < 0 || m_currLvlIdx >= m_levels.size())
+		m_currLvlIdx = 0;
+	m_weightsValid = weightsValid != 0;
+
+	if (updateBuffers)
+	{
+		for (int lvl = 0; lvl < m_levels.size(); lvl++)
+			m_levels[lvl].updateBuffers();
+	}
+
+	printf("Hierarchy loaded from cache %s. (%.3f s)\n", filename.toLocal8Bit().constData(), timer.elapsed()/1000.0f);
+
+	return true;
+}
+
+
 void HairHierarchy::buildByFixedK(std::vector<int> levelSizes)
 {
 	const int nLevels = levelSizes.size();
@@ -73,6 +320,8 @@ void HairHierarchy::buildByFixedK(std::vector<int> levelSizes)
 	timer.start();
 	printf("Preprocessing hair model...");
 
+	m_weightsValid = false;
+
 	if (m_levels.size() != nLevels)
 		m_levels.resize(nLevels);
 
@@ -95,7 +344,7 @@ void HairHierarchy::buildByFixedK(std::vector<int> levelSizes)
 		m_levels[0] = model;
 
 		// update neighborhood
-		//m_levels[0].calcRootNbrsByANN(16);
+		//m_levels[0].calcRootNbrs(16);
 	}
 	if (!m_levels[0].isUniformSampled(NUM_UNISAM_VERTICES))
 	{
@@ -109,43 +358,13 @@ void HairHierarchy::buildByFixedK(std::vector<int> levelSizes)
 	// build coarser levels
 	for (int i = 1; i < nLevels; i++)
 	{
-		// HACK!!!: build level-2 from left-right two clusters!
-		if (i == 2)
-		{
-			printf("CREATING 2 CLUSTERS!!\n");
-			const int hwIdx = NUM_UNISAM_VERTICES / 5;
-			for (int sId = 0; sId < m_levels[i-1].numStrands(); sId++)
-			{
-				Strand* strand = m_levels[i-1].getStrandAt(sId);
-
-				XMFLOAT3& pos0 = strand->vertices()[0].position;
-				XMFLOAT3& pos1 = strand->vertices()[hwIdx].position;
-
-				if (pos1.x  < pos0.x)
-				{
-					strand->setClusterID(0);
-					strand->setColor(XMFLOAT4(1,0,0,1));
-				}
-				else
-				{
-					strand->setClusterID(1);
-					strand->setColor(XMFLOAT4(0,0,1,1));
-				}
-			}
-			m_levels[i].createEmptyUnisam(2, NUM_UNISAM_VERTICES);
-			for (int vId = 0; vId < NUM_UNISAM_VERTICES; vId++)
-			{
-				m_levels[i].getStrandAt(0)->vertices()[vId].position = XMFLOAT3(-100,-100,-100);
-				m_levels[i].getStrandAt(1)->vertices()[vId].position = XMFLOAT3(100,100,100);
-			}
-			
-			break;
-		}
-
 		HairClusterer clusterer;
-		clusterer.clusterK(m_levels[i-1], levelSizes[i], m_levels[i]);
+		if (m_clusterBackend == ClusterKMeans)
+			clusterer.clusterKMeans(m_levels[i-1], levelSizes[i], m_levels[i]);
+		else
+			clusterer.clusterK(m_levels[i-1], levelSizes[i], m_levels[i]);
 
-		//m_levels[i].calcRootNbrsByANN(6);
+		//m_levels[i].calcRootNbrs(6);
 	}
 
 	if (m_currLvlIdx >= nLevels)
@@ -157,59 +376,106 @@ void HairHierarchy::buildByFixedK(std::vector<int> levelSizes)
 }
 
 
+// Weights of all levels in one bottom-up pass: level 0 weights are curve
+// lengths, a cluster's weight is the sum of its members' and each level is
+// then normalized by its largest weight. Members are grouped by cluster ID
+// (counting sort), so every cluster sums its own segment without atomics and
+// in a fixed order.
 void HairHierarchy::calcStrandWeights()
 {
 	printf("Calculating strand weights...");
 
-	// For level 0, a strand's weight is its curve length.
-	for (int i = 0; i < m_levels[0].numStrands(); i++)
-	{
-		Strand* strand = m_levels[0].getStrandAt(i);
-		strand->setWeight(strand->updateLength());
-	}
+	QTime timer;
+	timer.start();
+
+	const int nLevels = numLevels();
+	const int ChunkSize = 4096;
 
-	for (int lvl = 1; lvl < numLevels(); lvl++)
+	// unnormalized weights and largest weight of each level
+	vector<vector<float> > rawWeights(nLevels);
+	vector<float> maxWeights(nLevels, 0.0f);
+	vector<float> chunkMax;
+	int numUnclustered = 0;
+
+	for (int lvl = 0; lvl < nLevels; lvl++)
 	{
-		// For level k>0, a strand's weight is the sum of all its member strands' weights
-		for (int i = 0; i < m_levels[lvl].numStrands(); i++)
-			m_levels[lvl].getStrandAt(i)->setWeight(0);
+		HairStrandModel& model = m_levels[lvl];
+		const int numStrands = model.numStrands();
+		rawWeights[lvl].resize(numStrands);
 
-		for (int i = 0; i < m_levels[lvl-1].numStrands(); i++)
+		// members of each cluster in the level below
+		vector<int> memberStart, members;
+		if (lvl > 0)
 		{
-			Strand* memberStrand = m_levels[lvl-1].getStrandAt(i);
-			if (memberStrand->clusterID() < 0)
+			const HairStrandModel& lower = m_levels[lvl-1];
+			memberStart.assign(numStrands + 1, 0);
+			for (int i = 0; i < lower.numStrands(); i++)
 			{
-				printf("!");	// unclustered strand
-				continue;
+				const int c = lower.getStrandAt(i)->clusterID();
+				if (c >= 0 && c < numStrands)
+					memberStart[c+1]++;
+				else
+					numUnclustered++;
 			}
+			for (int c = 0; c < numStrands; c++)
+				memberStart[c+1] += memberStart[c];
 
-			Strand* highLvlStrand = m_levels[lvl].getStrandAt(memberStrand->clusterID());
-			
-			highLvlStrand->setWeight(highLvlStrand->weight() + memberStrand->weight());
+			members.resize(memberStart[numStrands]);
+			vector<int> next(memberStart.begin(), memberStart.end() - 1);
+			for (int i = 0; i < lower.numStrands(); i++)
+			{
+				const int c = lower.getStrandAt(i)->clusterID();
+				if (c >= 0 && c < numStrands)
+					members[next[c]++] = i;
+			}
 		}
+
+		chunkMax.assign(ParallelUtil::numChunks(0, numStrands, ChunkSize), 0.0f);
+		ParallelUtil::parallelForChunks(0, numStrands, ChunkSize, [&](int chunk, int begin, int end)
+		{
+			float maxWeight = 0;
+			for (int i = begin; i < end; i++)
+			{
+				float weight = 0;
+				if (lvl == 0)
+				{
+					// For level 0, a strand's weight is its curve length.
+					weight = model.getStrandAt(i)->updateLength();
+				}
+				else
+				{
+					// For level k>0, a strand's weight is the sum of all its member strands' weights
+					const vector<float>& lowerWeights = rawWeights[lvl-1];
+					for (int m = memberStart[i]; m < memberStart[i+1]; m++)
+						weight += lowerWeights[members[m]];
+				}
+				rawWeights[lvl][i] = weight;
+				maxWeight = std::max(maxWeight, weight);
+			}
+			chunkMax[chunk] = maxWeight;
+		});
+
+		for (int c = 0; c < chunkMax.size(); c++)
+			maxWeights[lvl] = std::max(maxWeights[lvl], chunkMax[c]);
 	}
 
 	// Normalize weight for debugging
-	for (int lvl = 0; lvl < numLevels(); lvl++)
+	for (int lvl = 0; lvl < nLevels; lvl++)
 	{
-		float maxWeight = m_levels[lvl].getStrandAt(0)->weight();
-		for (int i = 1; i < m_levels[lvl].numStrands(); i++)
-		{
-			const float weight = m_levels[lvl].getStrandAt(i)->weight();
-			if (weight > maxWeight)
-				maxWeight = weight;
-		}
+		HairStrandModel& model = m_levels[lvl];
+		const float scale = maxWeights[lvl] > 0 ? 1.0f / maxWeights[lvl] : 0.0f;
 
-		for (int i = 0; i < m_levels[lvl].numStrands(); i++)
+		ParallelUtil::parallelFor(0, model.numStrands(), [&](int begin, int end)
 		{
-			const float weight = m_levels[lvl].getStrandAt(i)->weight() / maxWeight;
-			m_levels[lvl].getStrandAt(i)->setWeight(weight);
-
-			// Colorize by weight for debugging
-			//XMFLOAT4 color(weight, weight, weight, 1);
-			//m_levels[lvl].getStrandAt(i)->setColor(color);
-		}
+			for (int i = begin; i < end; i++)
+				model.getStrandAt(i)->setWeight(rawWeights[lvl][i] * scale);
+		}, 1024);
 	}
 
-	printf("DONE\n");
+	m_weightsValid = true;
+
+	if (numUnclustered > 0)
+		printf("%d unclustered strands...", numUnclustered);
+
+	printf("DONE. (%.3f s)\n", timer.elapsed()/1000.0f);
 }
\ No newline at end of file
@@ -8,11 +8,30 @@
 class HairHierarchy : public QDXObject
 {
 public:
+
+	enum ClusterBackend
+	{
+		ClusterGrowFit,		// HairClusterer::clusterK
+		ClusterKMeans,		// HairClusterer::clusterKMeans
+	};
+
 	HairHierarchy();
 	~HairHierarchy();
 
 	bool	load(QString filename, bool updateBuffers);
 
+	QString	filename() const { return m_filename; }
+
+	// Built hierarchy cache: all levels with cluster IDs, weights and root
+	// neighbor graphs in a versioned binary file. The key identifies the input
+	// (see inputKey); loading fails if the file is missing, of another
+	// version, or was built from different input.
+	bool	saveCache(QString filename, quint64 key) const;
+	bool	loadCache(QString filename, quint64 key, bool updateBuffers);
+
+	// FNV-1a hash of level 0 strands, build parameters and cluster backend
+	quint64	inputKey(const std::vector<int>& buildParams) const;
+
 	int		numLevels() const					{ return m_levels.size(); }
 	
 	int		currentLevelIndex() const			{ return m_currLvlIdx; }
@@ -35,12 +54,26 @@ public:
 	
 	void	buildByFixedK(std::vector<int> levelSizes);
 
+	void			setClusterBackend(ClusterBackend backend) { m_clusterBackend = backend; }
+	ClusterBackend	clusterBackend() const { return m_clusterBackend; }
+
+	// Strand weights of all levels, normalized per level. They are kept with
+	// the hierarchy (and its cache) until invalidated; callers editing the
+	// levels must invalidate them.
 	void	calcStrandWeights();
+	bool	hasStrandWeights() const	{ return m_weightsValid; }
+	void	invalidateStrandWeights()	{ m_weightsValid = false; }
 
 private:
 
 	std::vector<HairStrandModel>	m_levels;
 
 	int		m_currLvlIdx;
+
+	QString	m_filename;
+
+	ClusterBackend	m_clusterBackend;
+
+	bool	m_weightsValid;
 };
 
@@ -19,6 +19,7 @@
 
 #include "HairStrandModel.h"
 #include "HairUtil.h"
+#include "StrandFilter.h"
 
 
 //#include <taucs.h>
@@ -2267,11 +2268,11 @@ void HairImage::sampleStrandColor(const Mat& colorData, const cv::Mat& maskData,
 		return;
 
 	// Pre-compute a filtering kernel
-	float* kernel = NULL;
+	StrandFilter filter;
 	int kernelSize = params.blurRadius*2 + 1;
 	if (kernelSize > 1)
 	{
-		kernel = new float[kernelSize];
+		std::vector<float> kernel(kernelSize);
 		float sumW = 0.0f;
 		for (int i = 0; i < kernelSize; i++)
 		{
@@ -2286,6 +2287,7 @@ void HairImage::sampleStrandColor(const Mat& colorData, const cv::Mat& maskData,
 		{
 			kernel[i] /= sumW;
 		}
+		filter.setKernel(kernel, StrandFilter::BorderReplicate);
 	}
 	
 	// Process strand by strand
@@ -2307,36 +2309,13 @@ void HairImage::sampleStrandColor(const Mat& colorData, const cv::Mat& maskData,
 					(float)HairUtil::sampleLinear<uchar>(maskData, pos.x, pos.y) / 255.0f : 1.0f
 				);
 		}
+	}
 
-		if (params.blurRadius > 0)
-		{
-			// Blur color along each strand
-			Strand newStrand = *pStrand;
+	// Blur color along each strand
+	if (params.blurRadius > 0)
+		filter.apply(*pStrandModel, StrandFilter::AttribColor, firstIdx, lastIdx + 1);
 
-			for (int j = 0; j < pStrand->numVertices(); j++)
-			{
-				XMFLOAT4& dstColor = newStrand.vertices()[j].color;
-				dstColor = XMFLOAT4(0, 0, 0, 0);
-
-				for (int k = 0; k < kernelSize; k++)
-				{
-					int idx = j + k - params.blurRadius;
-					if (idx < 0)
-						idx = 0;
-					else if (idx >= pStrand->numVertices())
-						idx = pStrand->numVertices() - 1;
-
-					XMFLOAT4& srcColor = pStrand->vertices()[idx].color;
-
-					dstColor.x += srcColor.x * kernel[k];
-					dstColor.y += srcColor.y * kernel[k];
-					dstColor.z += srcColor.z * kernel[k];
-					dstColor.w += srcColor.w * kernel[k];
-				}
-			}
-			*pStrand = newStrand;
-		}
-	}
+	pStrandModel->markStrandsDirty(firstIdx, lastIdx + 1);
 }
 
 
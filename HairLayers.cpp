@@ -8,6 +8,12 @@
 #include <QProcess>
 #include <QFileInfo>
 #include <QDebug>
+#include <QProgressDialog>
+#include <QApplication>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 
 #include "QDXCamera.h"
 #include "QDXImageSprite.h"
@@ -24,6 +30,7 @@
 #include "HairMorphHierarchy.h"
 #include "HeadMorphRenderer.h"
 #include "HairMorphRenderer.h"
+#include "MorphPipeline.h"
 
 #include "HairUtil.h"
 
@@ -2499,106 +2506,31 @@ void HairLayers::on_checkBoxShowMorphHead_stateChanged(int i)
 	m_scene->headMorphRenderer()->setVisible((bool)i);
 }
 
-#define PARALLEL_CLUSTERING
-
-int  s_num_levels;
-int  s_cluster_ratios[3];
-bool s_cluster_relative[3];
-
-DWORD WINAPI buildPyramid(LPVOID lpParam)
-{
-	HairHierarchy* pHierarchy = (HairHierarchy*)lpParam;
-
-	// calculate sizes for each level
-	std::vector<int> levelSizes(s_num_levels);
-	int lastSize = pHierarchy->level(0).numStrands();
-	for (int i = 0; i < s_num_levels; i++)
-	{
-		levelSizes[i] = s_cluster_relative[i] ? 
-						lastSize / s_cluster_ratios[i] : s_cluster_ratios[i];
-		lastSize = levelSizes[i];
-	}
-
-	pHierarchy->buildByFixedK(levelSizes);
-
-	// update buffers
-	for (int i = 0; i < s_num_levels; i++)
-		pHierarchy->level(i).updateBuffers();
-
-	return 0;
-}
-
 // build pyramids for all source hair models using fixed k method
 void HairLayers::on_buttonBuildPyrFixK_clicked()
 {
 	// collect parameters from UI
-	s_num_levels = ui.spinBoxNumPyrLevels->value();
+	PyramidParams params;
+	params.numLevels = ui.spinBoxNumPyrLevels->value();
 
-	s_cluster_ratios[0] = ui.spinBoxLvl0ClusterRatio->value();
-	s_cluster_ratios[1] = ui.spinBoxLvl1ClusterRatio->value();
-	s_cluster_ratios[2] = ui.spinBoxLvl2ClusterRatio->value();
+	params.clusterRatios[0] = ui.spinBoxLvl0ClusterRatio->value();
+	params.clusterRatios[1] = ui.spinBoxLvl1ClusterRatio->value();
+	params.clusterRatios[2] = ui.spinBoxLvl2ClusterRatio->value();
 	
-	s_cluster_relative[0] = ui.checkBoxLvl0Relative->isChecked();
-	s_cluster_relative[1] = ui.checkBoxLvl1Relative->isChecked();
-	s_cluster_relative[2] = ui.checkBoxLvl2Relative->isChecked();
+	params.relative[0] = ui.checkBoxLvl0Relative->isChecked();
+	params.relative[1] = ui.checkBoxLvl1Relative->isChecked();
+	params.relative[2] = ui.checkBoxLvl2Relative->isChecked();
 
-	const int numSources = m_scene->hairMorphHierarchy()->numSources();
+	MorphPipeline pipeline(m_scene->hairMorphHierarchy());
+	pipeline.setPyramidParams(params);
 
-	QTime timer;
-	timer.start();
+	const bool ok = runMorphPipeline(pipeline, MorphPipeline::StagePyramids, "Building source pyramids...");
 
-	// resize hair models if necessary
-	std::vector<HairHierarchy>& sources = m_scene->hairMorphHierarchy()->sources();
-	for (int srcIdx = 0; srcIdx < numSources; srcIdx++)
-	{
-		int newSize = s_cluster_ratios[0];
-		if (s_cluster_relative[0])
-			newSize = sources[srcIdx].level(0).numStrands() / newSize;
+	// the jobs leave the device alone; upload even the levels of a cancelled run
+	pipeline.updateBuffers();
 
-		if (newSize != sources[srcIdx].level(0).numStrands())
-		{
-			// randomly pick k strands from level 0 strands and discard others
-			HairStrandModel model;
-			model.reserve(newSize);
-		
-			std::vector<int> indices(sources[srcIdx].level(0).numStrands());
-			for (int i = 0; i < indices.size(); i++)
-				indices[i] = i;
-			for (int i = 0; i < newSize; i++)
-			{
-				int j = cv::theRNG().uniform(i, indices.size());
-				std::swap(indices[i], indices[j]);
-
-				model.addStrand(*(sources[srcIdx].level(0).getStrandAt(indices[i])));
-			}
-			sources[srcIdx].level(0) = model;
-			sources[srcIdx].level(0).calcRootNbrsByANN(32);
-		}
-	}
-
-#ifdef PARALLEL_CLUSTERING
-	HANDLE* threads = new HANDLE[numSources];
-#endif
-
-	for (int i = 0; i < numSources; i++)
-	{
-		HairHierarchy* pHierarchy = &(m_scene->hairMorphHierarchy()->sources()[i]);
-#ifdef PARALLEL_CLUSTERING
-		threads[i] = CreateThread(NULL, 0, buildPyramid, (void*)pHierarchy, 0, NULL);
-#else
-		buildPyramid((void*)pHierarchy);
-#endif
-	}
-
-#ifdef PARALLEL_CLUSTERING
-	WaitForMultipleObjects(numSources, threads, TRUE, INFINITE);
-	for (int i = 0; i < numSources; i++)
-		CloseHandle(threads[i]);
-
-	delete[] threads;
-#endif
-
-	printf("\nAll clustering done. (%.3f)\n", timer.elapsed()/1000.0f);
+	if (!ok && !pipeline.isCancelled())
+		QMessageBox::critical(this, "Error", "Failed to build source pyramids.");
 }
 
 
@@ -2628,7 +2560,10 @@ void HairLayers::on_buttonSingleScaleEMD_clicked()
 
 void HairLayers::on_buttonMultiScaleEMD_clicked()
 {
-	m_scene->hairMorphHierarchy()->calcAllSourceFlows(false);
+	MorphPipeline pipeline(m_scene->hairMorphHierarchy());
+	if (!runMorphPipeline(pipeline, MorphPipeline::StageFlows, "Calculating source flows...") &&
+		!pipeline.isCancelled())
+		QMessageBox::critical(this, "Error", "Failed to calculate source flows.");
 	//if (m_scene->srcHairHierarchy(0)->numLevels() < 2 || 
 	//	m_scene->srcHairHierarchy(0)->numLevels() != m_scene->srcHairHierarchy(1)->numLevels())
 	//{
@@ -2705,35 +2640,35 @@ void HairLayers::on_actionLoadBodyLayer_triggered()
 //////////////////////////////////////////////////////////////////
 
 
-DWORD WINAPI HairLayers::buildPyramidFixK(LPVOID lpParam)
+// Run the pipeline in the background with a progress dialog; the dialog only
+// follows the progress reported by the workers and cancels on request.
+bool HairLayers::runMorphPipeline(MorphPipeline& pipeline, int stages, const QString& label)
 {
-	//HairHierarchy* pHierarchy = (HairHierarchy*)lpParam;
+	// Progress comes from the pipeline threads (source flows included), so it
+	// only publishes the counts; the dialog is updated from this thread below.
+	std::atomic<int> done(0), total(1);
+	pipeline.setProgress([&](MorphPipeline::Stage, int d, int n)
+	{
+		total = std::max(n, 1);
+		done  = d;
+	});
 
-	//// collect parameters from UI
-	//int nLevels = ui.spinBoxNumPyrLevels->value();
-	//int ratios[3] = { ui.spinBoxLvl0ClusterRatio->value(),
-	//					ui.spinBoxLvl1ClusterRatio->value(),
-	//					ui.spinBoxLvl2ClusterRatio->value() };
-	//
-	//bool isRelative[3] = { ui.checkBoxLvl0Relative->isChecked(), 
-	//						ui.checkBoxLvl1Relative->isChecked(), 
-	//						ui.checkBoxLvl2Relative->isChecked() };
-
-	//// calculate sizes for each level
-	//std::vector<int> levelSizes(nLevels);
-	//int lastSize = pHierarchy->level(0).numStrands();
-	//for (int i = 0; i < nLevels; i++)
-	//{
-	//	levelSizes[i] = isRelative[i] ? lastSize / ratios[i] : ratios[i];
-	//	lastSize = levelSizes[i];
-	//}
+	QProgressDialog progressDlg(label, "Cancel", 0, 1, this);
+	progressDlg.setModal(true);
+	progressDlg.show();
 
-	//pHierarchy->buildByFixedK(levelSizes);
+	std::shared_future<bool> result = pipeline.start(stages);
+	while (result.wait_for(std::chrono::milliseconds(50)) != std::future_status::ready)
+	{
+		progressDlg.setMaximum(total);
+		progressDlg.setValue(done);
+		QApplication::processEvents();
+
+		if (progressDlg.wasCanceled())
+			pipeline.cancel();
+	}
 
-	// update buffers
-	//for (int i = 0; i < nLevels; i++)
-	//	pHierarchy->level(i).updateBuffers();
-	return 0;
+	return result.get();
 }
 
 
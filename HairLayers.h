@@ -10,6 +10,7 @@
 class SceneWidget;
 class MyScene;
 class HairHierarchy;
+class MorphPipeline;
 
 class PolygonWidget;
 
@@ -222,7 +223,7 @@ private:
 	void	loadHairStrands(HairStrandModel* pStrandModel, bool includeColor);
 	void	saveHairStrands(HairStrandModel* pStrandModel, bool includeColor);
 
-	DWORD WINAPI	buildPyramidFixK(LPVOID lpParam);
+	bool	runMorphPipeline(MorphPipeline& pipeline, int stages, const QString& label);
 
 
 	Ui::HairLayersClass ui;
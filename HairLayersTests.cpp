@@ -2,6 +2,12 @@
 
 #include <QFileDialog>
 #include <QFileInfo>
+#include <QFile>
+
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
 
 #include "SceneWidget.h"
 #include "MyScene.h"
@@ -17,6 +23,18 @@
 #include "HairHierarchy.h"
 
 #include "HairMorphHierarchy.h"
+#include "StrandBufferBuilder.h"
+#include "ParallelUtil.h"
+#include "StrandFilter.h"
+#include "StrandFrames.h"
+#include "IndexedHeap.h"
+#include "StrandFeatures.h"
+#include "ThreadPool.h"
+#include "HairFlows.h"
+#include "ScreenGrid.h"
+#include "StrokeJournal.h"
+#include "StrokeTools.h"
+#include "MorphPipeline.h"
 
 #include "LxConsole.h"
 
@@ -116,11 +134,1597 @@ void testSdfInterp()
 }
 
 
+//////////////////////////////////////////////////////////////////
+// CPU-side tests (no D3D device required)
+//////////////////////////////////////////////////////////////////
+
+// Compare StrandBufferBuilder output against a straightforward serial assembly,
+// and partial vertex refills against full ones.
+bool testStrandBufferBuilder()
+{
+	cv::RNG rng(20130925);
+
+	std::vector<Strand> strands(1000);
+	for (int i = 0; i < strands.size(); i++)
+	{
+		strands[i].createEmpty(rng.uniform(1, 64));
+		for (int j = 0; j < strands[i].numVertices(); j++)
+			strands[i].vertices()[j].position = XMFLOAT3(rng.uniform(-1.f, 1.f), (float)j, (float)i);
+	}
+
+	StrandBufferBuilder builder;
+	if (!builder.updateLayout(strands) || builder.updateLayout(strands))
+	{
+		printf("ERROR: unexpected layout change status!\n");
+		return false;
+	}
+
+	// reference
+	std::vector<uint> refIndices;
+	std::vector<XMFLOAT2> refTexcoords;
+	for (int i = 0; i < strands.size(); i++)
+	{
+		const uint vBase = refTexcoords.size();
+		const int  n = strands[i].numVertices();
+		for (int j = 0; j < n; j++)
+		{
+			refTexcoords.push_back(XMFLOAT2(0, (j == 0) ? 0.0f : (float)j / (float)(n - 1)));
+			if (j > 0)
+			{
+				const uint vId = vBase + j;
+				refIndices.push_back((j == 1) ? vId - 1 : vId - 2);
+				refIndices.push_back(vId - 1);
+				refIndices.push_back(vId);
+				refIndices.push_back((j == n - 1) ? vId : vId + 1);
+			}
+		}
+	}
+
+	if (builder.numVertices() != refTexcoords.size() || builder.numIndices() != refIndices.size())
+	{
+		printf("ERROR: buffer sizes mismatch!\n");
+		return false;
+	}
+
+	std::vector<uint> indices(builder.numIndices());
+	builder.fillIndices(indices.data());
+	if (indices != refIndices)
+	{
+		printf("ERROR: index data mismatch!\n");
+		return false;
+	}
+
+	std::vector<StrandVertex> vertices(builder.numVertices());
+	builder.fillVertices(strands, 0, strands.size(), vertices.data());
+	for (int i = 0; i < vertices.size(); i++)
+	{
+		if (vertices[i].texcoord.y != refTexcoords[i].y)
+		{
+			printf("ERROR: vertex data mismatch at %d!\n", i);
+			return false;
+		}
+	}
+
+	// partial update of a few strands
+	for (int i = 100; i < 200; i++)
+		strands[i].vertices()[0].position.x += 1.0f;
+
+	std::vector<StrandVertex> partial(vertices);
+	builder.fillVertices(strands, 100, 200, partial.data() + builder.vertexOffset(100));
+	builder.fillVertices(strands, 0, strands.size(), vertices.data());
+	if (memcmp(partial.data(), vertices.data(), sizeof(StrandVertex)*vertices.size()) != 0)
+	{
+		printf("ERROR: partial update mismatch!\n");
+		return false;
+	}
+
+	// topology change
+	strands[10].trim(0);
+	if (!builder.updateLayout(strands) || builder.numIndices() >= refIndices.size())
+	{
+		printf("ERROR: trimmed strand not detected!\n");
+		return false;
+	}
+
+	printf("StrandBufferBuilder test PASSED.\n");
+	return true;
+}
+
+
+// Time serial vs. parallel buffer assembly of a large uniformly sampled model.
+void testStrandBufferAssembly(int numStrands)
+{
+	std::vector<Strand> strands(numStrands);
+	for (int i = 0; i < numStrands; i++)
+		strands[i].createEmpty(NUM_UNISAM_VERTICES);
+
+	StrandBufferBuilder builder;
+	builder.updateLayout(strands);
+
+	std::vector<StrandVertex> vertices(builder.numVertices()), refVertices(builder.numVertices());
+	std::vector<uint>		  indices(builder.numIndices()),   refIndices(builder.numIndices());
+
+	QTime timer;
+	const int numThreads = ParallelUtil::numThreads();
+
+	ParallelUtil::setNumThreads(1);
+	timer.start();
+	builder.assemble(strands, refVertices.data(), refIndices.data());
+	float serialTime = timer.elapsed() / 1000.0f;
+
+	ParallelUtil::setNumThreads(numThreads);
+	timer.start();
+	builder.assemble(strands, vertices.data(), indices.data());
+	float parallelTime = timer.elapsed() / 1000.0f;
+
+	bool same = (indices == refIndices) && 
+		memcmp(vertices.data(), refVertices.data(), sizeof(StrandVertex)*vertices.size()) == 0;
+
+	printf("Buffer assembly of %d strands: serial %.3f s, %d threads %.3f s (%s)\n",
+		numStrands, serialTime, numThreads, parallelTime, same ? "identical" : "MISMATCH");
+}
+
+
+// Compare StrandFilter against per-strand cv::GaussianBlur (the previous implementation).
+bool testStrandFilter()
+{
+	cv::RNG rng(20131002);
+
+	HairStrandModel model;
+	model.createEmpty(500);
+	for (int i = 0; i < model.numStrands(); i++)
+	{
+		Strand* pStrand = model.getStrandAt(i);
+		pStrand->createEmpty(rng.uniform(1, 100));
+		for (int j = 0; j < pStrand->numVertices(); j++)
+		{
+			pStrand->vertices()[j].position = XMFLOAT3(rng.uniform(-1.f, 1.f), rng.uniform(-1.f, 1.f), rng.uniform(-1.f, 1.f));
+			pStrand->vertices()[j].color = XMFLOAT4(rng.uniform(0.f, 1.f), rng.uniform(0.f, 1.f), rng.uniform(0.f, 1.f), 1.0f);
+		}
+	}
+
+	const float sigmas[] = { 0.5f, 1.0f, 2.5f, 8.0f };
+	float maxErr = 0;
+
+	for (int s = 0; s < 4; s++)
+	{
+		HairStrandModel filtered(model);
+
+		StrandFilter filter;
+		filter.setGaussian(sigmas[s]);
+		filter.apply(filtered, StrandFilter::AttribPosition);
+		filter.apply(filtered, StrandFilter::AttribColor);
+
+		for (int i = 0; i < model.numStrands(); i++)
+		{
+			const Strand* pSrc = model.getStrandAt(i);
+			const Strand* pDst = filtered.getStrandAt(i);
+
+			cv::Mat posData(1, pSrc->numVertices(), CV_32FC3);
+			cv::Mat clrData(1, pSrc->numVertices(), CV_32FC4);
+			for (int j = 0; j < pSrc->numVertices(); j++)
+			{
+				const StrandVertex& v = pSrc->vertices()[j];
+				posData.ptr<cv::Vec3f>(0)[j] = cv::Vec3f(v.position.x, v.position.y, v.position.z);
+				clrData.ptr<cv::Vec4f>(0)[j] = cv::Vec4f(v.color.x, v.color.y, v.color.z, v.color.w);
+			}
+			cv::GaussianBlur(posData, posData, cv::Size(-1,-1), sigmas[s]);
+			cv::GaussianBlur(clrData, clrData, cv::Size(-1,-1), sigmas[s]);
+
+			for (int j = 0; j < pSrc->numVertices(); j++)
+			{
+				const StrandVertex& v = pDst->vertices()[j];
+				const cv::Vec3f& p = posData.ptr<cv::Vec3f>(0)[j];
+				const cv::Vec4f& c = clrData.ptr<cv::Vec4f>(0)[j];
+
+				maxErr = std::max(maxErr, fabsf(p[0] - v.position.x));
+				maxErr = std::max(maxErr, fabsf(p[1] - v.position.y));
+				maxErr = std::max(maxErr, fabsf(p[2] - v.position.z));
+				maxErr = std::max(maxErr, fabsf(c[0] - v.color.x));
+				maxErr = std::max(maxErr, fabsf(c[3] - v.color.w));
+			}
+		}
+	}
+
+	printf("StrandFilter vs. cv::GaussianBlur max error: %g\n", maxErr);
+	return maxErr < 1e-5f;
+}
+
+
+// Compare StrandFrames normal transport against chained HairUtil::calcNextNormal
+// (the previous per-vertex implementation) and check frame orthogonality.
+bool testStrandFrames()
+{
+	cv::RNG rng(20131005);
+
+	HairStrandModel model;
+	model.createEmpty(1000);
+	for (int i = 0; i < model.numStrands(); i++)
+	{
+		Strand* pStrand = model.getStrandAt(i);
+		pStrand->createEmpty(rng.uniform(2, 100));
+
+		// smooth random walk
+		XMFLOAT3 pos(rng.uniform(-1.f, 1.f), rng.uniform(-1.f, 1.f), rng.uniform(-1.f, 1.f));
+		XMFLOAT3 dir(0, 1, 0);
+		for (int j = 0; j < pStrand->numVertices(); j++)
+		{
+			pStrand->vertices()[j].position = pos;
+
+			dir.x += rng.uniform(-0.3f, 0.3f);
+			dir.y += rng.uniform(-0.3f, 0.3f);
+			dir.z += rng.uniform(-0.3f, 0.3f);
+			XMStoreFloat3(&dir, XMVector3Normalize(XMLoadFloat3(&dir)));
+
+			pos.x += dir.x * 0.01f;
+			pos.y += dir.y * 0.01f;
+			pos.z += dir.z * 0.01f;
+		}
+	}
+
+	StrandFrames frames;
+	frames.calcTangents(model);
+
+	std::vector<XMFLOAT3> rootNormals(model.numStrands());
+	for (int i = 0; i < model.numStrands(); i++)
+		XMStoreFloat3(&rootNormals[i], HairUtil::randomNormal(XMLoadFloat3(&frames.tangents(i)[0])));
+
+	frames.calcNormals(rootNormals);
+
+	float maxErr = 0, maxDot = 0;
+
+	for (int i = 0; i < model.numStrands(); i++)
+	{
+		const int n = frames.numVertices(i);
+		const XMFLOAT3* tangents = frames.tangents(i);
+		const XMFLOAT3* normals  = frames.normals(i);
+
+		XMVECTOR tangent = XMLoadFloat3(&tangents[0]);
+		XMVECTOR normal  = XMLoadFloat3(&rootNormals[i]);
+
+		for (int j = 1; j < n; j++)
+		{
+			XMVECTOR newTangent = XMLoadFloat3(&tangents[j]);
+			normal	= HairUtil::calcNextNormal(tangent, newTangent, normal);
+			tangent = newTangent;
+
+			XMVECTOR diff = normal - XMLoadFloat3(&normals[j]);
+			maxErr = std::max(maxErr, XMVectorGetX(XMVector3Length(diff)));
+			maxDot = std::max(maxDot, fabsf(XMVectorGetX(XMVector3Dot(tangent, XMLoadFloat3(&normals[j])))));
+		}
+	}
+
+	printf("StrandFrames vs. calcNextNormal max error: %g, max |n.t|: %g\n", maxErr, maxDot);
+	return maxErr < 1e-3f && maxDot < 1e-5f;
+}
+
+
+// Random push/decrease-key sequences on IndexedHeap against a sorted reference.
+bool testIndexedHeap()
+{
+	cv::RNG rng(20131008);
+
+	const int numSlots = 5000;
+
+	IndexedHeap<float> heap(numSlots);
+	std::vector<float> refKeys(numSlots, FLT_MAX);
+
+	bool ok = true;
+	for (int round = 0; round < 3; round++)
+	{
+		// same slot may be offered many times; only the minimum key must survive
+		for (int i = 0; i < numSlots * 4; i++)
+		{
+			const int	slot = rng.uniform(0, numSlots);
+			const float key	 = (float)rng.uniform(0, 1000);	// many equal keys
+
+			heap.pushOrDecrease(slot, key);
+			refKeys[slot] = std::min(refKeys[slot], key);
+		}
+
+		std::vector<std::pair<float, int> > ref;
+		for (int i = 0; i < numSlots; i++)
+		{
+			if (refKeys[i] < FLT_MAX)
+				ref.push_back(std::make_pair(refKeys[i], i));
+		}
+		std::sort(ref.begin(), ref.end());
+
+		// extract half, then clear the rest for the next round
+		ok &= (heap.size() == ref.size());
+		for (int i = 0; i < ref.size() / 2; i++)
+		{
+			ok &= (heap.topKey() == ref[i].first);
+			ok &= (heap.pop() == ref[i].second);
+		}
+		heap.clear();
+		ok &= heap.isEmpty();
+
+		refKeys.assign(numSlots, FLT_MAX);
+	}
+
+	// pushing a slot twice keeps one entry with the smaller key
+	heap.push(7, 5.0f);
+	heap.push(3, 4.0f);
+	heap.push(7, 2.0f);
+	heap.push(3, 6.0f);
+	ok &= (heap.size() == 2 && heap.pop() == 7 && heap.pop() == 3 && heap.isEmpty());
+
+	printf("IndexedHeap test %s\n", ok ? "passed" : "FAILED");
+	return ok;
+}
+
+
+// Synthetic uniformly sampled model: roots on a unit hemisphere with smoothly
+// varying wavy strands, and root neighborhoods.
+static void createWavyModel(int numStrands, HairStrandModel& model)
+{
+	cv::RNG rng(20131010);
+
+	model.createEmptyUnisam(numStrands, NUM_UNISAM_VERTICES);
+	for (int i = 0; i < numStrands; i++)
+	{
+		// roots on a unit hemisphere, smoothly varying wavy strands
+		float theta = rng.uniform(0.0f, XM_PI * 0.5f);
+		float phi	= rng.uniform(0.0f, XM_PI * 2.0f);
+		XMFLOAT3 root(sinf(theta)*cosf(phi), cosf(theta), sinf(theta)*sinf(phi));
+
+		StrandVertex* verts = model.getStrandAt(i)->vertices();
+		for (int j = 0; j < NUM_UNISAM_VERTICES; j++)
+		{
+			float t = (float)j / (NUM_UNISAM_VERTICES - 1);
+			verts[j].position = XMFLOAT3(root.x * (1 + t) + 0.1f * sinf(phi * 3 + t * 8),
+										 root.y - 2.0f * t,
+										 root.z * (1 + t) + 0.1f * cosf(theta * 5 + t * 8));
+		}
+	}
+	model.calcRootNbrs(32);
+}
+
+
+// Two copies of the wavy model, clustered two ways by the tests below.
+static void createClusterModels(int numStrands, HairStrandModel models[2])
+{
+	createWavyModel(numStrands, models[0]);
+	models[1] = models[0];
+}
+
+
+// Compare serial and parallel partitioning in HairClusterer::clusterK on a
+// synthetic model (agreement of the cluster assignment and timings).
+void testParallelPartition(int numStrands, int k)
+{
+	HairStrandModel models[2];
+	createClusterModels(numStrands, models);
+
+	HairStrandModel centers[2];
+	float secs[2];
+
+	for (int m = 0; m < 2; m++)
+	{
+		cv::theRNG() = cv::RNG(20130118);
+
+		HairClusterer clusterer;
+		clusterer.setPartitionMode(m == 0 ? HairClusterer::PartitionSerial : HairClusterer::PartitionParallel);
+
+		QTime timer;
+		timer.start();
+		clusterer.clusterK(models[m], k, centers[m]);
+		secs[m] = timer.elapsed() / 1000.0f;
+	}
+
+	int numSame = 0;
+	for (int i = 0; i < numStrands; i++)
+	{
+		if (models[0].getStrandAt(i)->clusterID() == models[1].getStrandAt(i)->clusterID())
+			numSame++;
+	}
+
+	printf("Partition serial: %.3f s, parallel (%d threads): %.3f s, same cluster: %.2f%%\n",
+		   secs[0], ParallelUtil::numThreads(), secs[1], 100.0f * numSame / numStrands);
+}
+
+
+// Compare the StrandFeatures distance kernel against the scalar strand
+// distances it replaces, and time one-vs-many queries.
+bool testStrandFeatures(int numStrands)
+{
+	cv::RNG rng(20131012);
+
+	HairStrandModel model;
+	model.createEmptyUnisam(numStrands, NUM_UNISAM_VERTICES);
+	for (int i = 0; i < numStrands; i++)
+	{
+		StrandVertex* verts = model.getStrandAt(i)->vertices();
+		for (int j = 0; j < NUM_UNISAM_VERTICES; j++)
+			verts[j].position = XMFLOAT3(rng.uniform(-1.f, 1.f), rng.uniform(-1.f, 1.f), rng.uniform(-1.f, 1.f));
+	}
+
+	StrandFeatures relFeatures, absFeatures;
+	relFeatures.build(model, StrandFeatures::RootRelative);
+	absFeatures.build(model, StrandFeatures::Absolute);
+
+	float maxRelErr = 0;
+	for (int i = 0; i < 1000; i++)
+	{
+		const int a = rng.uniform(0, numStrands);
+		const int b = rng.uniform(0, numStrands);
+		const StrandVertex* vA = model.getStrandAt(a)->vertices();
+		const StrandVertex* vB = model.getStrandAt(b)->vertices();
+
+		// root-aligned and absolute sums of squared vertex distances
+		double relSum = 0, absSum = 0;
+		for (int j = 0; j < NUM_UNISAM_VERTICES; j++)
+		{
+			double dx = vB[j].position.x - vA[j].position.x;
+			double dy = vB[j].position.y - vA[j].position.y;
+			double dz = vB[j].position.z - vA[j].position.z;
+			absSum += dx*dx + dy*dy + dz*dz;
+
+			dx -= vB[0].position.x - vA[0].position.x;
+			dy -= vB[0].position.y - vA[0].position.y;
+			dz -= vB[0].position.z - vA[0].position.z;
+			relSum += dx*dx + dy*dy + dz*dz;
+		}
+
+		maxRelErr = std::max(maxRelErr, (float)fabs(relFeatures.sqrDist(a, relFeatures, b) - relSum) / (float)(relSum + 1e-6));
+		maxRelErr = std::max(maxRelErr, (float)fabs(absFeatures.sqrDist(a, absFeatures, b) - absSum) / (float)(absSum + 1e-6));
+	}
+
+	// one-vs-many
+	std::vector<float> dists(numStrands);
+
+	QTime timer;
+	timer.start();
+	for (int i = 0; i < 100; i++)
+		absFeatures.sqrDists(absFeatures.feature(i), NULL, numStrands, dists.data());
+	float secs = timer.elapsed() / 1000.0f;
+
+	printf("StrandFeatures (%s) max rel. error: %g, %.1f M distances/s\n", StrandFeatures::usesAVX() ? "AVX2" : "SSE",
+		   maxRelErr, secs > 0 ? 100.0f * numStrands / secs / 1e6f : 0.0f);
+	return maxRelErr < 1e-4f;
+}
+
+
+// Compare HairClusterer::clusterK (grow-and-fit) with clusterKMeans on a
+// synthetic model: fitting error and runtime.
+void testKMeansClustering(int numStrands, int k)
+{
+	HairStrandModel models[2];
+	createClusterModels(numStrands, models);
+
+	HairStrandModel centers[2];
+	float secs[2], errs[2];
+
+	for (int m = 0; m < 2; m++)
+	{
+		cv::theRNG() = cv::RNG(20130118);
+
+		HairClusterer clusterer;
+
+		QTime timer;
+		timer.start();
+		if (m == 0)
+			clusterer.clusterK(models[m], k, centers[m]);
+		else
+			clusterer.clusterKMeans(models[m], k, centers[m]);
+		secs[m] = timer.elapsed() / 1000.0f;
+		errs[m] = clusterer.fitError();
+	}
+
+	printf("clusterK: err %f, %.3f s; clusterKMeans: err %f, %.3f s\n",
+		   errs[0], secs[0], errs[1], secs[1]);
+}
+
+
+// Build a hierarchy, save it to the cache and load it back: the loaded levels
+// must match, and a different key must be rejected.
+bool testHierarchyCache(int numStrands)
+{
+	HairStrandModel model;
+	createWavyModel(numStrands, model);
+	model.save("test_hierarchy.shd2");
+
+	HairHierarchy hierarchy;
+	hierarchy.load("test_hierarchy.shd2", false);
+
+	std::vector<int> levelSizes;
+	levelSizes.push_back(numStrands);
+	levelSizes.push_back(numStrands / 50);
+	levelSizes.push_back(numStrands / 1000);
+
+	const quint64 key = hierarchy.inputKey(levelSizes);
+
+	QTime timer;
+	timer.start();
+	hierarchy.buildByFixedK(levelSizes);
+	const float buildSecs = timer.elapsed() / 1000.0f;
+
+	hierarchy.saveCache("test_hierarchy.hhc", key);
+
+	HairHierarchy loaded;
+	timer.restart();
+	bool ok = loaded.loadCache("test_hierarchy.hhc", key, false);
+	const float loadSecs = timer.elapsed() / 1000.0f;
+
+	ok = ok && !loaded.loadCache("test_hierarchy.hhc", key + 1, false);
+	ok = ok && loaded.numLevels() == hierarchy.numLevels();
+
+	for (int lvl = 0; ok && lvl < hierarchy.numLevels(); lvl++)
+	{
+		const HairStrandModel& a = hierarchy.level(lvl);
+		const HairStrandModel& b = loaded.level(lvl);
+
+		ok = a.numStrands() == b.numStrands() &&
+			 a.rootNbrGraph().offsets() == b.rootNbrGraph().offsets() &&
+			 a.rootNbrGraph().indices() == b.rootNbrGraph().indices();
+
+		for (int i = 0; ok && i < a.numStrands(); i++)
+		{
+			const Strand* sA = a.getStrandAt(i);
+			const Strand* sB = b.getStrandAt(i);
+			ok = sA->numVertices() == sB->numVertices() &&
+				 sA->clusterID() == sB->clusterID() && sA->weight() == sB->weight();
+
+			for (int j = 0; ok && j < sA->numVertices(); j++)
+				ok = memcmp(&sA->vertices()[j].position, &sB->vertices()[j].position, sizeof(XMFLOAT3)) == 0;
+		}
+	}
+
+	QFile::remove("test_hierarchy.shd2");
+	QFile::remove("test_hierarchy.hhc");
+
+	printf("Hierarchy cache test %s (build %.3f s, load %.3f s)\n", ok ? "passed" : "FAILED", buildSecs, loadSecs);
+	return ok;
+}
+
+
+// ThreadPool: uneven tasks with nested parallel loops, written into per-task
+// buffers and concatenated, must match the serial result. Waiting on a small
+// group must not run the long tasks of another one, and a task exception must
+// reach wait().
+bool testThreadPool(int numTasks)
+{
+	std::vector<std::vector<int> > serial(numTasks), pooled(numTasks);
+
+	auto work = [](int t, std::vector<int>& out)
+	{
+		const int size = (t * 7919) % 5000 + 1;	// uneven task sizes
+		out.resize(size);
+		ParallelUtil::parallelFor(0, size, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+				out[i] = t * 31 + i * i;
+		}, 64);
+	};
+
+	for (int t = 0; t < numTasks; t++)
+		work(t, serial[t]);
+
+	QTime timer;
+	timer.start();
+	{
+		TaskGroup group;
+		for (int t = 0; t < numTasks; t++)
+			group.run([&, t]() { work(t, pooled[t]); });
+		group.wait();
+	}
+	const float secs = timer.elapsed() / 1000.0f;
+
+	std::vector<int> serialAll, pooledAll;
+	for (int t = 0; t < numTasks; t++)
+	{
+		serialAll.insert(serialAll.end(), serial[t].begin(), serial[t].end());
+		pooledAll.insert(pooledAll.end(), pooled[t].begin(), pooled[t].end());
+	}
+
+	// short group queued behind long foreign tasks
+	float shortSecs = 0;
+	{
+		TaskGroup longGroup, shortGroup;
+		for (int t = 0; t < ThreadPool::global().numWorkers() + 4; t++)
+			longGroup.run([]() { std::this_thread::sleep_for(std::chrono::milliseconds(200)); });
+		shortGroup.run([]() {});
+
+		timer.restart();
+		shortGroup.wait();
+		shortSecs = timer.elapsed() / 1000.0f;
+		longGroup.wait();
+	}
+
+	bool caught = false;
+	{
+		TaskGroup group;
+		group.run([]() { throw std::runtime_error("task failure"); });
+		try
+		{
+			group.wait();
+		}
+		catch (const std::runtime_error&)
+		{
+			caught = true;
+		}
+	}
+
+	const bool ok = serialAll == pooledAll && shortSecs < 0.1f && caught;
+	printf("ThreadPool test %s (%d workers, %.3f s, short wait %.3f s, exception %s)\n", ok ? "passed" : "FAILED",
+		   ThreadPool::global().numWorkers(), secs, shortSecs, caught ? "caught" : "LOST");
+	return ok;
+}
+
+
+// Wavy model with differently bent and slightly shifted strands, as a morph
+// target for createWavyModel.
+static void createBentModel(int numStrands, HairStrandModel& model)
+{
+	createWavyModel(numStrands, model);
+
+	cv::RNG rng(20131014);
+	for (int i = 0; i < numStrands; i++)
+	{
+		const float bend  = rng.uniform(0.1f, 0.4f);
+		const float shift = rng.uniform(-0.05f, 0.05f);
+
+		StrandVertex* verts = model.getStrandAt(i)->vertices();
+		for (int j = 0; j < NUM_UNISAM_VERTICES; j++)
+		{
+			const float t = (float)j / (NUM_UNISAM_VERTICES - 1);
+			verts[j].position.x += shift + bend * t * t;
+			verts[j].position.z += shift;
+		}
+	}
+}
+
+
+// Sparse vs. exact strand EMD between two synthetic models: transport cost
+// gap and speedup. The exact solver needs O(N^2) memory, so above
+// maxExactStrands the sparse cost is compared with twice the candidates.
+bool testSparseEMD(int numStrands, int maxExactStrands)
+{
+	HairStrandModel srcModel, dstModel;
+	createWavyModel(numStrands, srcModel);
+	createBentModel(numStrands, dstModel);
+
+	StrandFeatures srcFeatures, dstFeatures;
+	srcFeatures.build(srcModel, StrandFeatures::Absolute);
+	dstFeatures.build(dstModel, StrandFeatures::Absolute);
+
+	// transport cost and total amount of flows
+	auto flowCost = [&](const HairFlows& flows, double& amount)
+	{
+		double cost = 0;
+		amount = 0;
+		for (int i = 0; i < flows.numFlows(); i++)
+		{
+			const MyFlow<2>& f = flows.flows()[i];
+			cost   += f.amount * srcFeatures.sqrDist(f.ids[0], dstFeatures, f.ids[1]) / StrandFeatures::Dim;
+			amount += f.amount;
+		}
+		return cost;
+	};
+
+	QTime timer;
+
+	HairFlows sparse;
+	sparse.setEMDSolver(HairFlows::EMDSparse);
+	timer.start();
+	sparse.calcFlowsEMD(srcModel, dstModel, false);
+	const float sparseSecs = timer.elapsed() / 1000.0f;
+
+	double sparseAmount;
+	const double sparseCost = flowCost(sparse, sparseAmount);
+	bool ok = fabs(sparseAmount - 1.0) < 1e-3;
+
+	if (numStrands <= maxExactStrands)
+	{
+		HairFlows exact;
+		timer.restart();
+		exact.calcFlowsEMD(srcModel, dstModel, false);
+		const float exactSecs = timer.elapsed() / 1000.0f;
+
+		double exactAmount;
+		const double exactCost = flowCost(exact, exactAmount);
+
+		printf("Sparse EMD (%d strands): cost %f, exact %f (gap %.3f%%), %.3f s vs. %.3f s (%.1fx)\n",
+			   numStrands, sparseCost, exactCost, 100.0 * (sparseCost - exactCost) / exactCost,
+			   sparseSecs, exactSecs, sparseSecs > 0 ? exactSecs / sparseSecs : 0.0f);
+	}
+	else
+	{
+		// too few candidates show as a cost drop with more of them
+		HairFlows denser;
+		denser.setEMDSolver(HairFlows::EMDSparse, 2 * sparse.numCandidates());
+		timer.restart();
+		denser.calcFlowsEMD(srcModel, dstModel, false);
+		const float denserSecs = timer.elapsed() / 1000.0f;
+
+		double denserAmount;
+		const double denserCost = flowCost(denser, denserAmount);
+		ok = ok && fabs(denserAmount - 1.0) < 1e-3;
+
+		printf("Sparse EMD (%d strands): cost %f, %.3f s; %d candidates %f (%+.3f%%), %.3f s (exact solver skipped)\n",
+			   numStrands, sparseCost, sparseSecs, denser.numCandidates(), denserCost,
+			   100.0 * (denserCost - sparseCost) / sparseCost, denserSecs);
+	}
+
+	return ok;
+}
+
+// Displacement interpolation between two 2D blobs on one thread and on the
+// thread pool: the interpolated values must be identical.
+bool testInterpolatorThreads(int gridSize)
+{
+	const int numSamples = gridSize * gridSize;
+
+	std::vector<Vector<2,double> > samplesPos(numSamples);
+	std::vector<double> values1(numSamples), values2(numSamples);
+
+	const double r2 = 0.02 * gridSize * gridSize;
+	for (int y = 0; y < gridSize; y++)
+	{
+		for (int x = 0; x < gridSize; x++)
+		{
+			const double dx1 = x - 0.3 * gridSize, dy1 = y - 0.4 * gridSize;
+			const double dx2 = x - 0.7 * gridSize, dy2 = y - 0.6 * gridSize;
+
+			samplesPos[y*gridSize+x] = Vector<2,double>(x, y);
+			values1[y*gridSize+x] = exp(-(dx1*dx1 + dy1*dy1) / r2);
+			values2[y*gridSize+x] = exp(-(dx2*dx2 + 2*dy2*dy2) / r2) + 0.1;
+		}
+	}
+
+	const int numSteps = 5;
+	std::vector<double> results[2], valuesR;
+	float secs[2];
+
+	QTime timer;
+	const int numThreads = ParallelUtil::numThreads();
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		ParallelUtil::setNumThreads(pass == 0 ? 1 : numThreads);
+		timer.start();
+
+		Interpolator<2,double> interp(samplesPos, values1, samplesPos, values2,
+			sqrDistLinear, rbfFuncLinear, interpolateBinsLinear, 2, 3);
+		interp.precompute();
+
+		for (int p = 0; p < numSteps; p++)
+		{
+			interp.interpolate(p / (numSteps - 1.0), samplesPos, valuesR);
+			results[pass].insert(results[pass].end(), valuesR.begin(), valuesR.end());
+		}
+
+		secs[pass] = timer.elapsed() / 1000.0f;
+	}
+	ParallelUtil::setNumThreads(numThreads);
+
+	const bool same = results[0] == results[1];
+
+	printf("Interpolator (%d samples): 1 thread %.3f s, %d threads %.3f s (%s)\n",
+		   numSamples, secs[0], numThreads, secs[1], same ? "identical" : "MISMATCH");
+	return same;
+}
+
+
+// Pairwise flows of three sources with HairMorphHierarchy::calcAllSourceFlows
+// (concurrent pairs) against the pairs solved one after another, and
+// cancellation after the first finished level.
+void testSourceFlows(int numStrands)
+{
+	HairStrandModel models[3];
+	createWavyModel(numStrands, models[0]);
+	createBentModel(numStrands, models[1]);
+	createWavyModel(numStrands * 3 / 4, models[2]);
+
+	HairMorphHierarchy morph;
+	for (int i = 0; i < 3; i++)
+	{
+		QString filename = QString("test_source_flows_%1.shd2").arg(i);
+		models[i].save(filename);
+
+		std::vector<int> levelSizes;
+		levelSizes.push_back(models[i].numStrands());
+		levelSizes.push_back(models[i].numStrands() / 10);
+		levelSizes.push_back(models[i].numStrands() / 100);
+
+		morph.sources().push_back(HairHierarchy());
+		morph.sources().back().load(filename, false);
+		morph.sources().back().buildByFixedK(levelSizes);
+		QFile::remove(filename);
+	}
+
+	QTime timer;
+	timer.start();
+
+	std::vector<HairFlows> serialFlows;
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = i + 1; j < 3; j++)
+		{
+			HairFlows flows;
+			flows.calcFlowsEMD(morph.sources()[i].level(2), morph.sources()[j].level(2), false);
+			for (int lvl = 1; lvl >= 0; lvl--)
+			{
+				HairFlows clusFlows = flows;
+				flows.calcFlowsClusteredEMD(morph.sources()[i].level(lvl), morph.sources()[j].level(lvl),
+											clusFlows, false);
+			}
+			serialFlows.push_back(flows);
+		}
+	}
+	float serialSecs = timer.elapsed() / 1000.0f;
+
+	timer.restart();
+	bool done = morph.calcAllSourceFlows(false);
+	float concurrentSecs = timer.elapsed() / 1000.0f;
+
+	int numMismatches = 0;
+	for (int i = 0, p = 0; i < 3; i++)
+	{
+		for (int j = i + 1; j < 3; j++, p++)
+		{
+			const std::vector<MyFlow<2> >& a = serialFlows[p].flows();
+			const std::vector<MyFlow<2> >& b = morph.getFlows(i, j)->flows();
+
+			bool same = a.size() == b.size();
+			for (int k = 0; same && k < a.size(); k++)
+				same = a[k].ids[0] == b[k].ids[0] && a[k].ids[1] == b[k].ids[1] && a[k].amount == b[k].amount;
+			if (!same)
+				numMismatches++;
+		}
+	}
+
+	printf("Source flows of 3 pairs: serial %.3f s, concurrent %.3f s (%.1fx), %s, %d pairs differ\n",
+		   serialSecs, concurrentSecs, concurrentSecs > 0 ? serialSecs / concurrentSecs : 0.0f,
+		   done ? "done" : "FAILED", numMismatches);
+
+	// cancel as soon as any pair has finished its coarsest level
+	CancelToken cancel;
+	int numProgress = 0;
+	std::mutex progressMutex;
+	morph.setFlowProgress([&](int srcIdx, int dstIdx, int levelsDone, int numLevels)
+	{
+		std::lock_guard<std::mutex> lock(progressMutex);
+		numProgress++;
+		cancel.cancel();
+	});
+
+	timer.restart();
+	bool completed = morph.calcAllSourceFlows(false, &cancel);
+	float cancelSecs = timer.elapsed() / 1000.0f;
+
+	int numEmpty = 0;
+	for (int i = 0; i < 3; i++)
+		for (int j = i + 1; j < 3; j++)
+			numEmpty += morph.getFlows(i, j)->isEmpty();
+
+	printf("Cancelled run: %s after %.3f s, %d progress calls, %d of 3 pairs empty\n",
+		   completed ? "NOT CANCELLED" : "stopped", cancelSecs, numProgress, numEmpty);
+}
+
+
+// N-way flows of 3 to 5 sources by paths and by chaining: timings, share of
+// the strands of every source used, and reproducibility of two runs.
+void testNWayFlows(int numStrands)
+{
+	HairStrandModel models[5];
+	createWavyModel(numStrands, models[0]);
+	createBentModel(numStrands, models[1]);
+	createWavyModel(numStrands * 3 / 4, models[2]);
+	createBentModel(numStrands * 3 / 4, models[3]);
+	createWavyModel(numStrands / 2, models[4]);
+
+	for (int i = 0; i < 5; i++)
+		models[i].save(QString("test_nway_%1.shd2").arg(i));
+
+	for (int numSources = 3; numSources <= std::min(5, MAX_NUM_MORPH_SRC); numSources++)
+	{
+		HairMorphHierarchy morph;
+		for (int i = 0; i < numSources; i++)
+		{
+			std::vector<int> levelSizes;
+			levelSizes.push_back(models[i].numStrands());
+			levelSizes.push_back(models[i].numStrands() / 10);
+			levelSizes.push_back(models[i].numStrands() / 100);
+
+			morph.sources().push_back(HairHierarchy());
+			morph.sources().back().load(QString("test_nway_%1.shd2").arg(i), false);
+			morph.sources().back().buildByFixedK(levelSizes);
+		}
+		morph.calcAllSourceFlows(false);
+
+		for (int mode = 0; mode < 2; mode++)
+		{
+			morph.setNWayMode(mode == 0 ? HairMorphHierarchy::NWayPaths : HairMorphHierarchy::NWayChained);
+
+			std::vector<NWayFlow> runs[2];
+			float secs = 0;
+			for (int run = 0; run < 2; run++)
+			{
+				QTime timer;
+				timer.start();
+				morph.genNWayFromTwoWays(runs[run]);
+				secs += timer.elapsed() / 2000.0f;
+			}
+
+			bool same = runs[0].size() == runs[1].size();
+			for (int i = 0; same && i < runs[0].size(); i++)
+			{
+				same = runs[0][i].amount == runs[1][i].amount;
+				for (int k = 0; same && k < numSources; k++)
+					same = runs[0][i].ids[k] == runs[1][i].ids[k];
+			}
+
+			// smallest share of used strands over the sources
+			float minCoverage = 1.0f;
+			for (int k = 0; k < numSources; k++)
+			{
+				std::vector<bool> used(models[k].numStrands(), false);
+				for (int i = 0; i < runs[0].size(); i++)
+					used[runs[0][i].ids[k]] = true;
+				minCoverage = std::min(minCoverage, (float)std::count(used.begin(), used.end(), true) / used.size());
+			}
+
+			printf("%d sources, %s: %d flows in %.3f s, %.1f%% strands used, %s\n",
+				   numSources, mode == 0 ? "paths" : "chained", runs[0].size(), secs,
+				   100.0f * minCoverage, same ? "reproducible" : "NOT REPRODUCIBLE");
+		}
+	}
+
+	for (int i = 0; i < 5; i++)
+		QFile::remove(QString("test_nway_%1.shd2").arg(i));
+}
+
+
+void testMorphStreams(int numStrands)
+{
+	HairStrandModel models[3];
+	createWavyModel(numStrands, models[0]);
+	createBentModel(numStrands, models[1]);
+	createWavyModel(numStrands / 2, models[2]);
+
+	for (int i = 0; i < 3; i++)
+		models[i].save(QString("test_streams_%1.shd2").arg(i));
+
+	printf("Strand vertex: %d bytes\n", sizeof(StrandVertex));
+	for (int k = 1; k <= MAX_NUM_MORPH_SRC; k++)
+	{
+		std::vector<D3D11_INPUT_ELEMENT_DESC> elements;
+		MorphStreams::inputElements(k, false, elements);
+		printf("%d sources: %d input elements, %d bytes/vertex (%d with 8-bit colors)\n", k, elements.size(),
+			   MorphStreams::vertexSize(k, false), MorphStreams::vertexSize(k, true));
+	}
+
+	HairMorphHierarchy morph;
+	for (int i = 0; i < 3; i++)
+	{
+		std::vector<int> levelSizes;
+		levelSizes.push_back(models[i].numStrands());
+		levelSizes.push_back(models[i].numStrands() / 10);
+
+		morph.sources().push_back(HairHierarchy());
+		morph.sources().back().load(QString("test_streams_%1.shd2").arg(i), false);
+		morph.sources().back().buildByFixedK(levelSizes);
+	}
+	morph.calcAllSourceFlows(false);
+
+	QTime timer;
+	timer.start();
+	morph.generateStrands();
+	printf("Generated in %.3f s\n", timer.elapsed() / 1000.0f);
+
+	// a unit weight must give back the vertices of that source
+	std::vector<NWayFlow> nwFlows;
+	morph.genNWayFromTwoWays(nwFlows);
+
+	const MorphStreams& streams = morph.morphStreams();
+	bool ok = streams.numSources() == 3 && streams.numStrands() == nwFlows.size();
+	for (int k = 0; ok && k < 3; k++)
+	{
+		std::vector<float> weights(3, 0.0f);
+		weights[k] = 1.0f;
+
+		for (int i = 0; ok && i < nwFlows.size(); i++)
+		{
+			const StrandVertex* verts0 = morph.level(0).getStrandAt(i)->vertices();
+			const StrandVertex* vertsK = morph.sources()[k].level(0).getStrandAt(nwFlows[i].ids[k])->vertices();
+			for (int j = 0; ok && j < NUM_UNISAM_VERTICES; j++)
+			{
+				XMFLOAT3 pos = streams.morphPosition(verts0[j].position, i, j, weights);
+				ok = pos.x == vertsK[j].position.x && pos.y == vertsK[j].position.y && pos.z == vertsK[j].position.z;
+			}
+		}
+	}
+	printf("%d morph strands, unit weights %s\n", streams.numStrands(), ok ? "OK" : "FAILED");
+
+	for (int i = 0; i < 3; i++)
+		QFile::remove(QString("test_streams_%1.shd2").arg(i));
+}
+
+
+void testMorphBlender(int numStrands)
+{
+	HairStrandModel models[MAX_NUM_MORPH_SRC];
+	for (int i = 0; i < MAX_NUM_MORPH_SRC; i++)
+	{
+		if (i % 2 == 0)
+			createWavyModel(numStrands - i * numStrands / 10, models[i]);
+		else
+			createBentModel(numStrands - i * numStrands / 10, models[i]);
+		models[i].save(QString("test_blend_%1.shd2").arg(i));
+	}
+
+	for (int numSources = 1; numSources <= MAX_NUM_MORPH_SRC; numSources++)
+	{
+		HairMorphHierarchy morph;
+		for (int i = 0; i < numSources; i++)
+		{
+			std::vector<int> levelSizes;
+			levelSizes.push_back(models[i].numStrands());
+			levelSizes.push_back(models[i].numStrands() / 10);
+
+			morph.sources().push_back(HairHierarchy());
+			morph.sources().back().load(QString("test_blend_%1.shd2").arg(i), false);
+			morph.sources().back().buildByFixedK(levelSizes);
+		}
+		morph.calcAllSourceFlows(false);
+		morph.generateStrands();
+
+		// trim some strands, as strokes would
+		HairStrandModel& level = morph.level(0);
+		for (int i = 0; i < level.numStrands(); i += 7)
+			level.getStrandAt(i)->trim(i % NUM_UNISAM_VERTICES);
+
+		std::vector<float> weights(numSources);
+		for (int k = 0; k < numSources; k++)
+			weights[k] = (k + 1.0f) / (numSources * (numSources + 1) / 2);
+
+		QTime timer;
+		timer.start();
+		for (int run = 0; run < 10; run++)
+			morph.blendMorphPositions(weights);
+		float blendSecs = timer.elapsed() / 10000.0f;
+
+		// per-vertex reference
+		const MorphStreams& streams = morph.morphStreams();
+		const MorphBlender& blended = morph.blendMorphPositions(weights);
+		float maxDiff = 0;
+		timer.restart();
+		for (int i = 0; i < level.numStrands(); i++)
+		{
+			const StrandVertex* vertices = level.getStrandAt(i)->vertices();
+			for (int j = 0; j < level.getStrandAt(i)->numVertices(); j++)
+			{
+				XMFLOAT3 pos = streams.morphPosition(vertices[j].position, i, j, weights);
+				const XMFLOAT3& bpos = blended.position(i, j);
+				maxDiff = std::max(maxDiff, std::max(fabsf(pos.x - bpos.x), std::max(fabsf(pos.y - bpos.y), fabsf(pos.z - bpos.z))));
+			}
+		}
+		float refSecs = timer.elapsed() / 1000.0f;
+
+		printf("%d sources, %d strands: blend %.4f s, per-vertex %.4f s, max diff %g\n",
+			   numSources, level.numStrands(), blendSecs, refSecs, maxDiff);
+	}
+
+	for (int i = 0; i < MAX_NUM_MORPH_SRC; i++)
+		QFile::remove(QString("test_blend_%1.shd2").arg(i));
+}
+
+
+void testMorphBlendCache(int numStrands)
+{
+	HairStrandModel models[3];
+	createWavyModel(numStrands, models[0]);
+	createBentModel(numStrands, models[1]);
+	createWavyModel(numStrands / 2, models[2]);
+
+	HairMorphHierarchy morph;
+	for (int i = 0; i < 3; i++)
+	{
+		models[i].save(QString("test_cache_%1.shd2").arg(i));
+
+		std::vector<int> levelSizes;
+		levelSizes.push_back(models[i].numStrands());
+		levelSizes.push_back(models[i].numStrands() / 10);
+
+		morph.sources().push_back(HairHierarchy());
+		morph.sources().back().load(QString("test_cache_%1.shd2").arg(i), false);
+		morph.sources().back().buildByFixedK(levelSizes);
+	}
+	morph.calcAllSourceFlows(false);
+	morph.generateStrands();
+
+	const HairStrandModel& level = morph.level(0);
+	std::vector<float> weights(3, 1.0f / 3);
+
+	// drag one weight at a time, as from a slider, and compare with a full blend
+	cv::RNG rng(20131017);
+	int numCached = 0, numDeltas = 0, numFull = 0;
+	float maxDiff = 0, cachedSecs = 0, fullSecs = 0;
+	for (int step = 0; step < 200; step++)
+	{
+		if (step % 10 != 9)
+			weights[step % 3] = rng.uniform(0.0f, 1.0f);
+
+		QTime timer;
+		timer.start();
+		const MorphBlender& cached = morph.blendMorphPositions(weights);
+		cachedSecs += timer.elapsed() / 1000.0f;
+
+		if (cached.numSourcesBlended() == 0)
+			numCached++;
+		else if (cached.numSourcesBlended() < 3)
+			numDeltas++;
+		else
+			numFull++;
+
+		timer.restart();
+		MorphBlender full;
+		full.blend(level, morph.morphStreams(), weights, 0);
+		fullSecs += timer.elapsed() / 1000.0f;
+
+		for (int i = 0; i < level.numStrands(); i++)
+		{
+			for (int j = 0; j < level.getStrandAt(i)->numVertices(); j++)
+			{
+				const XMFLOAT3& a = cached.position(i, j);
+				const XMFLOAT3& b = full.position(i, j);
+				maxDiff = std::max(maxDiff, std::max(fabsf(a.x - b.x), std::max(fabsf(a.y - b.y), fabsf(a.z - b.z))));
+			}
+		}
+	}
+	printf("%d strands: %d cached, %d incremental, %d full blends in %.3f s (%.3f s all full), max diff %g\n",
+		   level.numStrands(), numCached, numDeltas, numFull, cachedSecs, fullSecs, maxDiff);
+
+	// an edit forces a full blend
+	morph.markStrandsEdited();
+	printf("After edit: %d sources blended\n", morph.blendMorphPositions(weights).numSourcesBlended());
+
+	for (int i = 0; i < 3; i++)
+		QFile::remove(QString("test_cache_%1.shd2").arg(i));
+}
+
+
+void testScreenGrid(int numStrands)
+{
+	// strands of varying length hanging from random roots on a 1000x1000 screen
+	cv::RNG rng(20131018);
+	std::vector<XMFLOAT2> points;
+	std::vector<int> strandStart(1, 0);
+	for (int i = 0; i < numStrands; i++)
+	{
+		XMFLOAT2 pos(rng.uniform(0.0f, 1000.0f), rng.uniform(0.0f, 600.0f));
+		const int numVerts = rng.uniform(2, NUM_UNISAM_VERTICES + 1);
+		for (int j = 0; j < numVerts; j++)
+		{
+			points.push_back(pos);
+			pos.x += rng.uniform(-2.0f, 2.0f);
+			pos.y += rng.uniform(0.0f, 8.0f);
+		}
+		strandStart.push_back(points.size());
+	}
+
+	// a wavy stroke across the screen
+	std::vector<XMFLOAT2> stroke;
+	for (int s = 0; s < 300; s++)
+		stroke.push_back(XMFLOAT2(100.0f + s * 2.5f, 500.0f + 80.0f * sinf(s * 0.05f)));
+	const float radius = 8.0f;
+
+	QTime timer;
+	timer.start();
+	ScreenGrid grid;
+	grid.build(points, strandStart, radius);
+	float buildSecs = timer.elapsed() / 1000.0f;
+
+	timer.restart();
+	std::vector<StrokeHit> hits;
+	grid.findStrokeHits(stroke.data(), stroke.size(), radius, hits);
+	float querySecs = timer.elapsed() / 1000.0f;
+
+	// brute force nearest stroke point of every vertex
+	timer.restart();
+	std::vector<StrokeHit> refHits;
+	for (int i = 0; i < numStrands; i++)
+	{
+		for (int p = strandStart[i]; p < strandStart[i + 1]; p++)
+		{
+			StrokeHit hit = { i, p - strandStart[i], -1, radius * radius };
+			for (int s = 0; s < stroke.size(); s++)
+			{
+				const float dx = points[p].x - stroke[s].x;
+				const float dy = points[p].y - stroke[s].y;
+				const float d2 = dx*dx + dy*dy;
+				if (d2 < hit.sqrDist || (d2 == hit.sqrDist && hit.strokePt < 0))
+				{
+					hit.sqrDist	 = d2;
+					hit.strokePt = s;
+				}
+			}
+			if (hit.strokePt >= 0)
+				refHits.push_back(hit);
+		}
+	}
+	float bruteSecs = timer.elapsed() / 1000.0f;
+
+	bool same = hits.size() == refHits.size();
+	for (int h = 0; same && h < hits.size(); h++)
+	{
+		same = hits[h].strandId == refHits[h].strandId && hits[h].vertexId == refHits[h].vertexId &&
+			   hits[h].strokePt == refHits[h].strokePt && hits[h].sqrDist == refHits[h].sqrDist;
+	}
+
+	printf("%d vertices, %d hits: build %.3f s, query %.4f s, brute force %.3f s, %s\n",
+		   grid.numPoints(), hits.size(), buildSecs, querySecs, bruteSecs, same ? "same" : "DIFFERENT");
+}
+
+
+static bool sameStrands(const HairStrandModel& a, const HairStrandModel& b)
+{
+	if (a.numStrands() != b.numStrands())
+		return false;
+
+	for (int i = 0; i < a.numStrands(); i++)
+	{
+		const Strand* sa = a.getStrandAt(i);
+		const Strand* sb = b.getStrandAt(i);
+		if (sa->numVertices() != sb->numVertices() ||
+			memcmp(sa->vertices(), sb->vertices(), sizeof(StrandVertex) * sa->numVertices()) != 0)
+			return false;
+	}
+	return true;
+}
+
+
+// order-dependent sum of the vertex counts and positions of a model
+static double strandChecksum(const HairStrandModel& model)
+{
+	double sum = 0;
+	for (int i = 0; i < model.numStrands(); i++)
+	{
+		const Strand* strand = model.getStrandAt(i);
+		sum += (i % 7 + 1) * 1000.0 * strand->numVertices();
+		for (int j = 0; j < strand->numVertices(); j++)
+		{
+			const XMFLOAT3& p = strand->vertices()[j].position;
+			sum += (j + 1) * (p.x + 2.0 * p.y + 3.0 * p.z);
+		}
+	}
+	return sum;
+}
+
+
+void testStrokeJournal(int numStrands)
+{
+	HairStrandModel model, original;
+	createWavyModel(numStrands, model);
+	original = model;
+
+	// random cut and comb-like strokes on up to 1% of the strands each
+	cv::RNG rng(20131019);
+	StrokeJournal journal;
+	const int numStrokes = 20;
+	std::vector<double> checksums;	// after each stroke
+	for (int stroke = 0; stroke < numStrokes; stroke++)
+	{
+		std::vector<int> strandIds;
+		for (int n = 0; n < numStrands / 100; n++)
+			strandIds.push_back(rng.uniform(0, numStrands));
+		std::sort(strandIds.begin(), strandIds.end());
+		strandIds.erase(std::unique(strandIds.begin(), strandIds.end()), strandIds.end());
+
+		journal.beginStroke(&model, 0, stroke % 2 == 0 ? StrokeJournal::StrokeTrim : StrokeJournal::StrokeMove,
+							strandIds);
+		ParallelUtil::parallelFor(0, strandIds.size(), [&](int begin, int end)
+		{
+			for (int s = begin; s < end; s++)
+			{
+				Strand* strand = model.getStrandAt(strandIds[s]);
+				if (stroke % 2 == 0)
+				{
+					const int newNumVerts = std::max(strand->numVertices() - 1 - strandIds[s] % 8, 1);
+					journal.saveStrand(s, newNumVerts - 2);
+					strand->trim(newNumVerts - 1);
+				}
+				else
+				{
+					journal.saveStrand(s, 2);
+					for (int j = 2; j < strand->numVertices(); j++)
+						strand->vertices()[j].position.x += 0.5f * j;
+				}
+			}
+		});
+		journal.endStroke();
+		checksums.push_back(strandChecksum(model));
+	}
+	HairStrandModel edited = model;
+	printf("%d strokes recorded, %.2f MB (model %.2f MB)\n", journal.numStrokes(), journal.numBytes() / 1048576.0,
+		   (double)numStrands * NUM_UNISAM_VERTICES * sizeof(StrandVertex) / 1048576.0);
+
+	// undo everything, then redo everything
+	bool ok = true;
+	int first, last;
+	for (int stroke = 0; stroke < numStrokes; stroke++)
+		ok = ok && journal.undo(model, first, last) == 0;
+	ok = ok && !journal.canUndo() && sameStrands(model, original);
+
+	for (int stroke = 0; stroke < numStrokes; stroke++)
+		ok = ok && journal.redo(model, first, last) == 0;
+	ok = ok && !journal.canRedo() && sameStrands(model, edited);
+	printf("Undo/redo of all strokes %s\n", ok ? "OK" : "FAILED");
+
+	// bound the journal to about half of it
+	journal.setMaxBytes(journal.numBytes() / 2);
+	printf("Bounded to %.2f MB: %d strokes kept\n", journal.numBytes() / 1048576.0, journal.numStrokes());
+
+	// undo the kept strokes and bound it again: the redo tail goes, and redo
+	// replays the strokes right after the current state
+	const int numKept = journal.numStrokes();
+	while (journal.canUndo())
+		journal.undo(model, first, last);
+	journal.setMaxBytes(journal.numBytes() / 2);
+
+	const int numRedo = journal.numStrokes();
+	while (journal.canRedo())
+		journal.redo(model, first, last);
+	ok = numRedo > 0 && strandChecksum(model) == checksums[numStrokes - numKept + numRedo - 1];
+	printf("Bounded after undo: %d strokes kept, redo %s\n", numRedo, ok ? "OK" : "FAILED");
+}
+
+
+// Delete, cut and comb strokes (StrokeTools, as MyScene applies them) across
+// the screen projection of a wavy model: time of the grid, the hits and the
+// edit of each tool, and undo restoring the model.
+void testStrokeTools(int numStrands)
+{
+	HairStrandModel model, original;
+	createWavyModel(numStrands, model);
+	original = model;
+
+	// model x in [-2, 2] and y in [-1, 1] to a 1000x600 screen
+	XMFLOAT4X4 world;
+	XMStoreFloat4x4(&world, XMMatrixScaling(250, 250, 250) * XMMatrixTranslation(500, -300, 0));
+
+	// a wavy stroke down the middle of the hair
+	std::vector<XMFLOAT2> stroke;
+	for (int s = 0; s < 300; s++)
+		stroke.push_back(XMFLOAT2(500.0f + 60.0f * sinf(s * 0.05f), 50.0f + s * 1.7f));
+	const float radius = 8.0f;
+
+	// the stroke crosses a large part of the dense model: keep it undoable
+	const char* toolNames[3] = { "Delete", "Cut", "Comb" };
+	StrokeJournal journal;
+	journal.setMaxBytes((size_t)1 << 30);
+	for (int tool = 0; tool < 3; tool++)
+	{
+		QTime timer;
+		timer.start();
+
+		ScreenGrid grid;
+		StrokeTools::buildStrokeGrid(model, NULL, world, radius, grid);
+		float gridSecs = timer.elapsed() / 1000.0f;
+
+		timer.restart();
+		std::vector<StrokeHit> hits;
+		grid.findStrokeHits(stroke.data(), stroke.size(), radius, hits);
+		float hitSecs = timer.elapsed() / 1000.0f;
+
+		timer.restart();
+		std::vector<XMFLOAT2> strokePts = stroke;
+		int numChanges, first, last;
+		if (tool == 0)
+			numChanges = StrokeTools::deleteStrands(model, 0, hits, journal);
+		else if (tool == 1)
+			numChanges = StrokeTools::cutStrands(model, 0, hits, 2, 20131019, journal);
+		else
+			numChanges = StrokeTools::combStrands(model, 0, hits, strokePts.data(), strokePts.size(),
+												  radius, 1.0f, world, journal, first, last);
+		float editSecs = timer.elapsed() / 1000.0f;
+
+		const bool undone = journal.undo(model, first, last) == 0 && sameStrands(model, original);
+
+		printf("%s stroke on %d strands: grid %.3f s, %d hits %.4f s, %d changes %.4f s, undo %s\n",
+			   toolNames[tool], numStrands, gridSecs, hits.size(), hitSecs, numChanges, editSecs,
+			   undone ? "OK" : "FAILED");
+	}
+}
+
+
+static bool loadPipelineSources(HairMorphHierarchy& morph, int numSources)
+{
+	morph.sources().clear();
+	for (int i = 0; i < numSources; i++)
+	{
+		morph.sources().push_back(HairHierarchy());
+		if (!morph.sources().back().load(QString("test_pipeline_%1.shd2").arg(i), false))
+			return false;
+	}
+	return true;
+}
+
+
+void testMorphPipeline(int numStrands)
+{
+	const int numSources = 3;
+	HairStrandModel model;
+	for (int i = 0; i < numSources; i++)
+	{
+		if (i % 2 == 0)
+			createWavyModel(numStrands * (4 - i) / 4, model);
+		else
+			createBentModel(numStrands * (4 - i) / 4, model);
+		model.save(QString("test_pipeline_%1.shd2").arg(i));
+		QFile::remove(QString("test_pipeline_%1.shd2.hhc").arg(i));
+	}
+
+	PyramidParams params;
+	params.clusterRatios[0] = 2;
+	params.clusterRatios[1] = 10;
+	params.clusterRatios[2] = 10;
+
+	// headless: build, then again from the caches
+	std::vector<int> numFlows[2];
+	for (int run = 0; run < 2; run++)
+	{
+		HairMorphHierarchy morph;
+		loadPipelineSources(morph, numSources);
+
+		int calls[3] = {0, 0, 0};
+		bool inOrder = true;
+		std::mutex mutex;
+		MorphPipeline pipeline(&morph);
+		pipeline.setPyramidParams(params);
+		pipeline.setProgress([&](MorphPipeline::Stage stage, int done, int total)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			calls[stage / 2]++;
+			inOrder = inOrder && done <= total;
+		});
+
+		QTime timer;
+		timer.start();
+		bool ok = pipeline.run(MorphPipeline::StagePyramids | MorphPipeline::StageFlows);
+		float secs = timer.elapsed() / 1000.0f;
+
+		for (int i = 0; i < numSources; i++)
+		{
+			for (int j = i + 1; j < numSources; j++)
+				numFlows[run].push_back(morph.getFlows(i, j)->numFlows());
+		}
+		printf("Run %d %s in %.3f s: %d pyramid and %d flow progress calls%s\n", run, ok ? "OK" : "FAILED",
+			   secs, calls[0], calls[1], inOrder ? "" : ", OUT OF RANGE");
+	}
+	printf("Flows from cached pyramids %s\n", numFlows[0] == numFlows[1] ? "same" : "DIFFERENT");
+
+	// cancel a background run right away
+	HairMorphHierarchy morph;
+	loadPipelineSources(morph, numSources);
+
+	MorphPipeline pipeline(&morph);
+	pipeline.setPyramidParams(params);
+
+	QTime timer;
+	timer.start();
+	std::shared_future<bool> result = pipeline.start(MorphPipeline::StageFlows);
+	pipeline.cancel();
+	bool ok = result.get();
+	printf("Cancelled run %s after %.3f s\n", ok ? "NOT STOPPED" : "stopped", timer.elapsed() / 1000.0f);
+
+	// the strands need the device, so only run() takes them
+	result = pipeline.start(MorphPipeline::StageStrands);
+	printf("Background strands %s\n", result.get() ? "NOT REFUSED" : "refused");
+
+	// more levels than ratios
+	params.numLevels = PyramidParams::MaxLevels + 1;
+	pipeline.setPyramidParams(params);
+	printf("Pyramids with %d levels %s\n", params.numLevels,
+		   pipeline.run(MorphPipeline::StagePyramids) ? "NOT REFUSED" : "refused");
+}
+
+
+void testStrandWeights(int numStrands)
+{
+	HairStrandModel model;
+	createWavyModel(numStrands, model);
+	model.save("test_weights.shd2");
+
+	std::vector<int> levelSizes;
+	levelSizes.push_back(numStrands);
+	levelSizes.push_back(numStrands / 10);
+	levelSizes.push_back(numStrands / 100);
+
+	HairHierarchy hierarchy;
+	hierarchy.load("test_weights.shd2", false);
+	hierarchy.buildByFixedK(levelSizes);
+
+	QTime timer;
+	timer.start();
+	const int numRuns = 10;
+	for (int run = 0; run < numRuns; run++)
+		hierarchy.calcStrandWeights();
+	float secs = timer.elapsed() / (1000.0f * numRuns);
+
+	// level by level reference
+	std::vector<std::vector<float> > refWeights(hierarchy.numLevels());
+	for (int lvl = 0; lvl < hierarchy.numLevels(); lvl++)
+	{
+		const HairStrandModel& level = hierarchy.level(lvl);
+		refWeights[lvl].assign(level.numStrands(), 0.0f);
+		if (lvl == 0)
+		{
+			for (int i = 0; i < level.numStrands(); i++)
+				refWeights[0][i] = level.getStrandAt(i)->length();
+		}
+		else
+		{
+			const HairStrandModel& lower = hierarchy.level(lvl - 1);
+			for (int i = 0; i < lower.numStrands(); i++)
+			{
+				if (lower.getStrandAt(i)->clusterID() >= 0)
+					refWeights[lvl][lower.getStrandAt(i)->clusterID()] += refWeights[lvl - 1][i];
+			}
+		}
+	}
+
+	float maxError = 0;
+	for (int lvl = 0; lvl < hierarchy.numLevels(); lvl++)
+	{
+		const float maxWeight = *std::max_element(refWeights[lvl].begin(), refWeights[lvl].end());
+		for (int i = 0; i < refWeights[lvl].size(); i++)
+		{
+			const float error = fabs(hierarchy.level(lvl).getStrandAt(i)->weight() - refWeights[lvl][i] / maxWeight);
+			maxError = std::max(maxError, error);
+		}
+	}
+	printf("Strand weights of %d levels in %.4f s, max error %g\n", hierarchy.numLevels(), secs, maxError);
+
+	// weights come back valid from the cache
+	const quint64 key = hierarchy.inputKey(levelSizes);
+	hierarchy.saveCache("test_weights.hhc", key);
+
+	HairHierarchy cached;
+	cached.load("test_weights.shd2", false);
+	bool ok = !cached.hasStrandWeights() && cached.loadCache("test_weights.hhc", key, false) &&
+			  cached.hasStrandWeights();
+	for (int lvl = 0; ok && lvl < cached.numLevels(); lvl++)
+	{
+		for (int i = 0; ok && i < cached.level(lvl).numStrands(); i++)
+			ok = cached.level(lvl).getStrandAt(i)->weight() == hierarchy.level(lvl).getStrandAt(i)->weight();
+	}
+	printf("Cached strand weights %s\n", ok ? "OK" : "FAILED");
+}
+
+
 // Current test function
 void HairLayers::on_actionTest_triggered()
 {
 	m_scene->hairMorphHierarchy()->testSSSEffect();
 
+	//testStrandBufferBuilder();
+	//testStrandBufferAssembly(100000);
+	//testStrandFilter();
+	//testStrandFrames();
+	//testIndexedHeap();
+	//testParallelPartition(100000, 2000);
+	//testStrandFeatures(100000);
+	//testKMeansClustering(100000, 2000);
+	//testHierarchyCache(100000);
+	//testThreadPool(2000);
+	//testSparseEMD(2000, 10000);
+	//testSparseEMD(10000, 10000);
+	//testSparseEMD(50000, 10000);
+	//testInterpolatorThreads(24);
+	//testSourceFlows(20000);
+	//testNWayFlows(10000);
+	//testMorphStreams(10000);
+	//testMorphBlender(20000);
+	//testMorphBlendCache(20000);
+	//testScreenGrid(200000);
+	//testStrokeJournal(100000);
+	//testStrokeTools(200000);
+	//testMorphPipeline(20000);
+	//testStrandWeights(100000);
+
 
 	//HairHierarchy* pHierarchy = m_scene->hairMorphModel()->srcHierarchy();
 	//pHierarchy->setNumLevels(3);
@@ -1,6 +1,13 @@
 #include "HairMorphHierarchy.h"
 
+#include <algorithm>
 #include <list>
+#include <mutex>
+
+#include <QTime>
+
+#include "StrandFrames.h"
+#include "ThreadPool.h"
 
 HairMorphHierarchy::HairMorphHierarchy() : m_currLvlIdx(-1)
 {
@@ -9,6 +16,9 @@ HairMorphHierarchy::HairMorphHierarchy() : m_currLvlIdx(-1)
 	m_pairFlows.reserve(MAX_NUM_MORPH_SRC);
 
 	m_bUseStrandWeights = false;
+	m_bQuantizeMorphColors = false;
+	m_editVersion = 0;
+	m_nwayMode = NWayPaths;
 }
 
 
@@ -23,6 +33,8 @@ void HairMorphHierarchy::release()
 	for (int i = 0; i < numLevels(); i++)
 		m_levels[i].release();
 
+	m_morphStreams.release();
+
 	for (int i = 0; i < m_sources.size(); i++)
 		m_sources[i].release();
 }
@@ -31,7 +43,11 @@ void HairMorphHierarchy::release()
 void HairMorphHierarchy::render()
 {
 	if (m_currLvlIdx >= 0 && m_currLvlIdx < numLevels())
+	{
+		if (m_currLvlIdx == 0)
+			m_morphStreams.bind();
 		m_levels[m_currLvlIdx].render();
+	}
 }
 
 
@@ -39,6 +55,9 @@ void HairMorphHierarchy::clear()
 {
 	m_sources.clear();
 	m_levels.clear();
+	m_morphStreams.clear();
+	m_morphBlender.clear();
+	m_strokeJournal.clear();
 
 	m_pairFlows.clear();
 
@@ -47,7 +66,7 @@ void HairMorphHierarchy::clear()
 
 
 // Calculate all pairwise EMD flows between sources.
-bool HairMorphHierarchy::calcAllSourceFlows(bool useStrandWeights)
+bool HairMorphHierarchy::calcAllSourceFlows(bool useStrandWeights, const CancelToken* cancel)
 {
 	printf("Using strand weights: %d\n", useStrandWeights);
 
@@ -68,44 +87,114 @@ bool HairMorphHierarchy::calcAllSourceFlows(bool useStrandWeights)
 		}
 	}
 
+	m_bUseStrandWeights = useStrandWeights;
+
+	// weights of built or cached pyramids are reused
+	if (m_bUseStrandWeights)
+	{
+		for (int i = 0; i < m_sources.size(); i++)
+		{
+			if (!m_sources[i].hasStrandWeights())
+				m_sources[i].calcStrandWeights();
+		}
+	}
+
+	QTime timer;
+	timer.start();
+
+	// m_pairFlows[i][j] holds the pair (i, i+1+j) whatever the finishing order
+	std::vector<int> pairSrcs, pairDsts;
+	m_pairFlows.clear();
 	m_pairFlows.resize(m_sources.size() - 1);
 	for (int i = 0; i < m_sources.size() - 1; i++)
 	{
-		const int srcIdx  = i;
-		const int numDsts = m_sources.size() - i - 1;
-
-		m_pairFlows[srcIdx].resize(numDsts);
-		for (int j = 0; j < numDsts; j++)
+		m_pairFlows[i].resize(m_sources.size() - i - 1);
+		for (int j = i + 1; j < m_sources.size(); j++)
 		{
-			// calculate flows between each pair of sources
+			pairSrcs.push_back(i);
+			pairDsts.push_back(j);
+		}
+	}
+	const int numPairs = pairSrcs.size();
 
-			const int dstIdx = srcIdx + 1 + j;
+	// largest pairs (finest level) first for balance
+	std::vector<std::pair<double, int> > order(numPairs);
+	for (int p = 0; p < numPairs; p++)
+	{
+		const double size = (double)m_sources[pairSrcs[p]].level(0).numStrands() *
+							m_sources[pairDsts[p]].level(0).numStrands();
+		order[p] = std::make_pair(-size, p);
+	}
+	std::sort(order.begin(), order.end());
 
-			printf("Calculating flow from %d to %d...\n", srcIdx, dstIdx);
+	printf("Calculating flows of %d source pairs...\n", numPairs);
+
+	std::mutex printMutex;
+
+	// Each pair goes from the coarsest level down; the clustered flows of a
+	// level run on the same pool, and a pair waiting for them helps with its
+	// own cluster pairs only (see TaskGroup::wait).
+	TaskGroup group;
+	for (int k = 0; k < numPairs; k++)
+	{
+		const int p = order[k].second;
+		group.run([&, p]()
+		{
+			const int srcIdx = pairSrcs[p];
+			const int dstIdx = pairDsts[p];
+
+			QTime pairTimer;
+			pairTimer.start();
 
-			int lvl = numLevels - 1;
-			printf(">>> LEVEL %d <<<\n", lvl);
 			HairFlows flows;
-			flows.calcFlowsEMD(m_sources[srcIdx].level(lvl), 
-								m_sources[dstIdx].level(lvl), m_bUseStrandWeights);
-			//flows.calcFlowsNearestRoot(m_sources[srcIdx].level(lvl),
-			//							m_sources[dstIdx].level(lvl));
+			flows.setCancelToken(cancel);
 
-			for (lvl = numLevels - 2; lvl >= 0; lvl--)
+			for (int lvl = numLevels - 1; lvl >= 0; lvl--)
 			{
-				printf(">>> LEVEL %d <<<\n", lvl);
+				if (cancel && cancel->isCancelled())
+					return;
 
-				HairFlows clusFlows = flows;
-				flows.calcFlowsClusteredEMD(m_sources[srcIdx].level(lvl),
-											m_sources[dstIdx].level(lvl),
-											clusFlows, m_bUseStrandWeights);
+				if (lvl == numLevels - 1)
+				{
+					flows.calcFlowsEMD(m_sources[srcIdx].level(lvl), 
+									   m_sources[dstIdx].level(lvl), m_bUseStrandWeights);
+					//flows.calcFlowsNearestRoot(m_sources[srcIdx].level(lvl),
+					//							m_sources[dstIdx].level(lvl));
+				}
+				else
+				{
+					HairFlows clusFlows = flows;
+					flows.calcFlowsClusteredEMD(m_sources[srcIdx].level(lvl),
+												m_sources[dstIdx].level(lvl),
+												clusFlows, m_bUseStrandWeights);
+					if (flows.isCancelled())
+						return;
+				}
+
+				if (m_flowProgress)
+				{
+					m_flowProgress(srcIdx, dstIdx, numLevels - lvl, numLevels);
+				}
+				else
+				{
+					std::lock_guard<std::mutex> lock(printMutex);
+					printf("Flow %d -> %d: level %d DONE (%d flows, %.3f s)\n", srcIdx, dstIdx, lvl,
+						   flows.numFlows(), (float)pairTimer.elapsed()/1000.0f);
+				}
 			}
-			m_pairFlows[srcIdx][j] = flows;
 
-			printf("\n");
-		}
+			m_pairFlows[srcIdx][dstIdx - srcIdx - 1] = flows;
+		});
+	}
+	group.wait();
+
+	if (cancel && cancel->isCancelled())
+	{
+		printf("Source flows CANCELLED. (%.3f s)\n", (float)timer.elapsed()/1000.0f);
+		return false;
 	}
 
+	printf("All source flows DONE. (%.3f s)\n", (float)timer.elapsed()/1000.0f);
 	return true;
 }
 
@@ -126,6 +215,10 @@ HairFlows* HairMorphHierarchy::getFlows(int srcIdx, int dstIdx)
 // Generate morphable hair strands based on existing hair flows.
 void HairMorphHierarchy::generateStrands()
 {
+	m_morphStreams.clear();
+	m_strokeJournal.clear();
+	markStrandsEdited();
+
 	if (m_sources.size() < 1)
 	{
 		printf("ERROR: no source hair to generate from!\n");
@@ -140,110 +233,173 @@ void HairMorphHierarchy::generateStrands()
 			m_levels[i].updateBuffers();
 			//m_levels[i].updateDebugBuffers();
 		}
+		m_morphStreams.create(1, m_levels[0].numStrands(), m_bQuantizeMorphColors);
 	}
-	else if (m_sources.size() == 2)
+	else
 	{
-		// 2-way morphing
-		HairFlows* pFlows = getFlows(0, 1);
-		if (!pFlows || pFlows->isEmpty())
-		{
-			printf("ERROR: flows from %d to %d do not exist!\n", 0, 1);
-			return;
-		}
-		m_levels.resize(1);
-		m_levels[0].clear();
-		m_levels[0].createEmptyUnisam(pFlows->numFlows(), NUM_UNISAM_VERTICES);
-
-		printf("Generating %d morphable strands...", pFlows->numFlows());
-
-		for (int iFlow = 0; iFlow < pFlows->numFlows(); iFlow++)
+		std::vector<NWayFlow> nwFlows;
+		if (m_sources.size() == 2)
 		{
-			const int srcSId0 = pFlows->flows()[iFlow].ids[0];
-			const int srcSId1 = pFlows->flows()[iFlow].ids[1];
-
-			StrandVertex* srcVerts0 = m_sources[0].level(0).getStrandAt(srcSId0)->vertices();
-			StrandVertex* srcVerts1 = m_sources[1].level(0).getStrandAt(srcSId1)->vertices();
-			StrandVertex* dstVerts = m_levels[0].getStrandAt(iFlow)->vertices();
+			// 2-way morphing
+			HairFlows* pFlows = getFlows(0, 1);
+			if (!pFlows || pFlows->isEmpty())
+			{
+				printf("ERROR: flows from %d to %d do not exist!\n", 0, 1);
+				return;
+			}
 
-			for (int i = 0; i < NUM_UNISAM_VERTICES; i++)
+			nwFlows.resize(pFlows->numFlows());
+			for (int iFlow = 0; iFlow < pFlows->numFlows(); iFlow++)
 			{
-				dstVerts[i] = srcVerts0[i];
-				dstVerts[i].tangent = srcVerts1[i].position;
-				dstVerts[i].shading = srcVerts1[i].color;
+				nwFlows[iFlow].ids[0] = pFlows->flows()[iFlow].ids[0];
+				nwFlows[iFlow].ids[1] = pFlows->flows()[iFlow].ids[1];
+				nwFlows[iFlow].amount = pFlows->flows()[iFlow].amount;
 			}
 		}
-		m_levels[0].updateBuffers();
-	}
-	else
-	{
-		// N-way morphing...
-		std::vector<NWayFlow> nwFlows;
-		genNWayFromTwoWays(nwFlows);
+		else
+		{
+			// N-way morphing...
+			genNWayFromTwoWays(nwFlows);
+		}
+
+		const int numSources = m_sources.size();
 
 		m_levels.resize(1);
 		m_levels[0].clear();
 		m_levels[0].createEmptyUnisam(nwFlows.size(), NUM_UNISAM_VERTICES);
+		m_morphStreams.create(numSources, nwFlows.size(), m_bQuantizeMorphColors);
 
 		printf("Generating %d morphable strands...", nwFlows.size());
 
-		const int numSources = m_sources.size();
+		// source 0 in the strand vertices, the others in the morph streams
 		for (int flowId = 0; flowId < nwFlows.size(); flowId++)
 		{
-			StrandVertex* vertsSrcs[MAX_NUM_MORPH_SRC];
-			for (int srcId = 0; srcId < numSources; srcId++)
-			{
-				const int strandId = nwFlows[flowId].ids[srcId];
-				vertsSrcs[srcId] = m_sources[srcId].level(0).getStrandAt(strandId)->vertices();
-			}
-			StrandVertex* vertsDst = m_levels[0].getStrandAt(flowId)->vertices();
+			const int strandId0 = nwFlows[flowId].ids[0];
+			const StrandVertex* vertsSrc0 = m_sources[0].level(0).getStrandAt(strandId0)->vertices();
 
+			StrandVertex* vertsDst = m_levels[0].getStrandAt(flowId)->vertices();
 			for (int i = 0; i < NUM_UNISAM_VERTICES; i++)
+				vertsDst[i] = vertsSrc0[i];
+
+			for (int srcId = 1; srcId < numSources; srcId++)
 			{
-				vertsDst[i].position = vertsSrcs[0][i].position;
-				vertsDst[i].color    = vertsSrcs[0][i].color;
-				vertsDst[i].tangent  = vertsSrcs[1][i].position;
-				vertsDst[i].shading  = vertsSrcs[1][i].color;
-#if MAX_NUM_MORPH_SRC > 2
-				if (numSources > 2)
-				{
-					vertsDst[i].pos2   = vertsSrcs[2][i].position;
-					vertsDst[i].color2 = vertsSrcs[2][i].color;
-				}
-#endif
-#if MAX_NUM_MORPH_SRC > 3
-				if (numSources > 3)
-				{
-					vertsDst[i].pos3   = vertsSrcs[3][i].position;
-					vertsDst[i].color3 = vertsSrcs[3][i].color;
-				}
-#endif
-#if MAX_NUM_MORPH_SRC > 4
-				if (numSources > 4)
+				const int strandId = nwFlows[flowId].ids[srcId];
+				const StrandVertex* vertsSrc = m_sources[srcId].level(0).getStrandAt(strandId)->vertices();
+
+				for (int i = 0; i < NUM_UNISAM_VERTICES; i++)
 				{
-					vertsDst[i].pos4   = vertsSrcs[4][i].position;
-					vertsDst[i].color4 = vertsSrcs[4][i].color;
+					m_morphStreams.position(srcId, flowId, i) = vertsSrc[i].position;
+					m_morphStreams.color(srcId, flowId, i)	  = vertsSrc[i].color;
 				}
-#endif
 			}
 		}
-		m_levels[0].updateBuffers();
+		printf("DONE.\n");
+
+		updateMorphBuffers();
 	}
 
 	m_currLvlIdx = 0;
 }
 
 
+bool HairMorphHierarchy::updateMorphBuffers()
+{
+	if (m_levels.empty())
+		return false;
+
+	return m_levels[0].updateBuffers() && m_morphStreams.updateBuffers(m_levels[0]);
+}
+
+
+const MorphBlender& HairMorphHierarchy::blendMorphPositions(const std::vector<float>& weights)
+{
+	if (m_levels.empty())
+		m_morphBlender.clear();
+	else
+		m_morphBlender.blend(m_levels[0], m_morphStreams, weights, m_editVersion);
+
+	return m_morphBlender;
+}
+
+
+bool HairMorphHierarchy::undoStroke()
+{
+	const int levelIdx = m_strokeJournal.undoLevel();
+	if (levelIdx < 0 || levelIdx >= numLevels())
+		return false;
+
+	int first, last;
+	m_strokeJournal.undo(m_levels[levelIdx], first, last);
+	return strokeRestored(levelIdx, first, last);
+}
+
+
+bool HairMorphHierarchy::redoStroke()
+{
+	const int levelIdx = m_strokeJournal.redoLevel();
+	if (levelIdx < 0 || levelIdx >= numLevels())
+		return false;
+
+	int first, last;
+	m_strokeJournal.redo(m_levels[levelIdx], first, last);
+	return strokeRestored(levelIdx, first, last);
+}
+
+
+bool HairMorphHierarchy::strokeRestored(int levelIdx, int first, int last)
+{
+	// restored vertices may be longer than the blended strands
+	markStrandsEdited();
+
+	// only the restored strands need to be uploaded unless lengths changed
+	m_levels[levelIdx].markStrandsDirty(first, last);
+	if (levelIdx == 0)
+		return updateMorphBuffers();
+	else
+		return m_levels[levelIdx].updateBuffers();
+}
+
+
 void HairMorphHierarchy::genNWayFromTwoWays(std::vector<NWayFlow>& nwFlows)
+{
+	nwFlows.clear();
+
+	QTime timer;
+	timer.start();
+
+	if (m_nwayMode == NWayChained)
+	{
+		if (!genNWayChained(nwFlows))
+			return;
+	}
+	else
+	{
+		NodeGraph graph;
+		if (!buildNodeGraph(graph))
+			return;
+
+		genNWayPaths(graph, nwFlows);
+	}
+	printf("%d flows generated. (%.3f s)\n", nwFlows.size(), (float)timer.elapsed()/1000.0f);
+}
+
+
+// Build the node graph from all pairwise flows.
+bool HairMorphHierarchy::buildNodeGraph(NodeGraph& graph)
 {
 	const int numSources = m_sources.size();
 
-	// build a node nbr graph from pairwise flows
 	printf("Building node neighborhoods...");
-	std::vector<std::vector<GNode> > nodeGroups(numSources);
+
+	graph.groupStart.resize(numSources + 1);
+	graph.groupStart[0] = 0;
 	for (int i = 0; i < numSources; i++)
-		nodeGroups[i].resize(m_sources[i].level(0).numStrands());
+		graph.groupStart[i+1] = graph.groupStart[i] + m_sources[i].level(0).numStrands();
 
-	int maxDegree = 0;
+	const int numNodes = graph.groupStart[numSources];
+
+	// count degrees, then fill the rows in flow order
+	graph.nbrStart.assign(numNodes + 1, 0);
 	for (int srcIdx = 0; srcIdx < numSources - 1; srcIdx++)
 	{
 		for (int dstIdx = srcIdx + 1; dstIdx < numSources; dstIdx++)
@@ -252,45 +408,81 @@ void HairMorphHierarchy::genNWayFromTwoWays(std::vector<NWayFlow>& nwFlows)
 			if (!hairFlows)
 			{
 				printf("ERROR: flows from %d to %d do not exist!\n", srcIdx, dstIdx);
-				return;
+				return false;
 			}
 
+			for (int iFlow = 0; iFlow < hairFlows->numFlows(); iFlow++)
+			{
+				const MyFlow<2>& flow = hairFlows->flows()[iFlow];
+				graph.nbrStart[graph.groupStart[srcIdx] + flow.ids[0] + 1]++;
+				graph.nbrStart[graph.groupStart[dstIdx] + flow.ids[1] + 1]++;
+			}
+		}
+	}
+
+	int maxDegree = 0;
+	for (int i = 0; i < numNodes; i++)
+	{
+		maxDegree = std::max(maxDegree, graph.nbrStart[i+1]);
+		graph.nbrStart[i+1] += graph.nbrStart[i];
+	}
+
+	graph.nbrs.resize(graph.nbrStart[numNodes]);
+	std::vector<int> fill(graph.nbrStart.begin(), graph.nbrStart.end() - 1);
+
+	for (int srcIdx = 0; srcIdx < numSources - 1; srcIdx++)
+	{
+		for (int dstIdx = srcIdx + 1; dstIdx < numSources; dstIdx++)
+		{
+			const HairFlows* hairFlows = getFlows(srcIdx, dstIdx);
 			for (int iFlow = 0; iFlow < hairFlows->numFlows(); iFlow++)
 			{
 				const MyFlow<2>& flow = hairFlows->flows()[iFlow];
 
 				// add nbr info and weights to both relevant nodes
-				GNodeNbr nbr;
-				nbr.groupId = dstIdx;
-				nbr.nodeId  = flow.ids[1];
-				nbr.weight  = flow.amount;
-				nodeGroups[srcIdx][flow.ids[0]].nbrs.push_back(nbr);
-
-				nbr.groupId = srcIdx;
-				nbr.nodeId  = flow.ids[0];
-				nodeGroups[dstIdx][flow.ids[1]].nbrs.push_back(nbr);
-
-				// statistics
-				int degree = nodeGroups[srcIdx][flow.ids[0]].nbrCount();
-				if (degree > maxDegree)
-					maxDegree = degree;
+				GNodeNbr& dstNbr = graph.nbrs[fill[graph.groupStart[srcIdx] + flow.ids[0]]++];
+				dstNbr.groupId = dstIdx;
+				dstNbr.nodeId  = flow.ids[1];
+				dstNbr.weight  = flow.amount;
+
+				GNodeNbr& srcNbr = graph.nbrs[fill[graph.groupStart[dstIdx] + flow.ids[1]]++];
+				srcNbr.groupId = srcIdx;
+				srcNbr.nodeId  = flow.ids[0];
+				srcNbr.weight  = flow.amount;
 			}
 		}
 	}
-	// Sort node neighbors by weight
-	for (int groupId = 0; groupId < numSources; groupId++)
+
+	// Sort node neighbors by weight (stable insertion sort: rows are short and
+	// equal weights keep the flow order)
+	for (int i = 0; i < numNodes; i++)
 	{
-		for (int nodeId = 0; nodeId < nodeGroups[groupId].size(); nodeId++)
+		GNodeNbr* row = &graph.nbrs[0] + graph.nbrStart[i];
+		const int degree = graph.nbrStart[i+1] - graph.nbrStart[i];
+		for (int a = 1; a < degree; a++)
 		{
-			std::vector<GNodeNbr>& nbrs = nodeGroups[groupId][nodeId].nbrs;
-			std::sort(nbrs.begin(), nbrs.end(), &HairMorphHierarchy::CompareNbr);
+			GNodeNbr nbr = row[a];
+			int b = a;
+			for (; b > 0 && CompareNbr(nbr, row[b-1]); b--)
+				row[b] = row[b-1];
+			row[b] = nbr;
 		}
 	}
-	// ...
 	printf("DONE. (Max degree = %d)\n", maxDegree);
-	
+
+	return true;
+}
+
+
+// Repeatedly take a path through all sources from each node not yet used,
+// allowing nodes to be reused once more at each pass.
+void HairMorphHierarchy::genNWayPaths(const NodeGraph& graph, std::vector<NWayFlow>& nwFlows)
+{
+	const int numSources = m_sources.size();
 	int numPasses = 16;
 
+	std::vector<int> visitCounts(graph.groupStart[numSources], 0);
+
 	NWayFlow emptyFlow;
 	for (int i = 0; i < MAX_NUM_MORPH_SRC; i++)
 		emptyFlow.ids[i] = -1;
@@ -302,18 +494,18 @@ void HairMorphHierarchy::genNWayFromTwoWays(std::vector<NWayFlow>& nwFlows)
 		int numAdded = 0;
 		for (int groupId = 0; groupId < numSources; groupId++)
 		{
-			const int numNodes = nodeGroups[groupId].size();
+			const int numNodes = graph.groupStart[groupId+1] - graph.groupStart[groupId];
 
 			for (int nodeId = 0; nodeId < numNodes; nodeId++)
 			{
-				if (nodeGroups[groupId][nodeId].visitCount > 0)
+				if (visitCounts[graph.groupStart[groupId] + nodeId] > 0)
 					continue;
 
 				NWayFlow nwFlow = emptyFlow;
-				if (findNWayFlow(nodeGroups, groupId, nodeId, 1, pass, nwFlow))
+				if (findNWayFlow(graph, visitCounts, groupId, nodeId, pass, nwFlow))
 				{
 					for (int i = 0; i < numSources; i++)
-						nodeGroups[i][nwFlow.ids[i]].visitCount++;
+						visitCounts[graph.groupStart[i] + nwFlow.ids[i]]++;
 					nwFlows.push_back(nwFlow);
 					numAdded++;
 				}
@@ -324,34 +516,192 @@ void HairMorphHierarchy::genNWayFromTwoWays(std::vector<NWayFlow>& nwFlows)
 		if (numAdded == 0)
 			break;
 	} // for iPass
-	printf("%d flows generated.\n", nwFlows.size());
 }
 
 
-bool HairMorphHierarchy::findNWayFlow(std::vector<std::vector<GNode> >& nodeGroups,
-									  int groupId, int nodeId, int depth, int pass, 
-									  NWayFlow& flow)
+bool HairMorphHierarchy::findNWayFlow(const NodeGraph& graph, const std::vector<int>& visitCounts,
+									  int groupId, int nodeId, int pass, 
+									  NWayFlow& flow) const
 {
-	GNode& node = nodeGroups[groupId][nodeId];
-	if (flow.ids[groupId] != (-1) || node.visitCount > pass)
+	const int numSources = m_sources.size();
+
+	int node = graph.groupStart[groupId] + nodeId;
+	if (flow.ids[groupId] != (-1) || visitCounts[node] > pass)
 		return false;
 
 	flow.ids[groupId] = nodeId;
-
-	// check whether the flow is already complete
-	if (depth == m_sources.size())
+	if (numSources == 1)
 		return true;
-	
-	for (int i = 0; i < node.nbrCount(); i++)
+
+	// the current path and the next neighbor to try at each of its nodes; a
+	// source taken by an abandoned branch is not tried again
+	int pathNodes[MAX_NUM_MORPH_SRC];
+	int pathNext[MAX_NUM_MORPH_SRC];
+
+	int depth = 1;
+	pathNodes[0] = node;
+	pathNext[0]	 = graph.nbrStart[node];
+
+	while (depth > 0)
 	{
-		GNodeNbr& nbr = node.nbrs[i];
-		if (findNWayFlow(nodeGroups, nbr.groupId, nbr.nodeId, depth+1, pass, flow))
+		const int top = depth - 1;
+		if (pathNext[top] == graph.nbrStart[pathNodes[top] + 1])
+		{
+			depth--;
+			continue;
+		}
+
+		const GNodeNbr& nbr = graph.nbrs[pathNext[top]++];
+		const int nbrNode = graph.groupStart[nbr.groupId] + nbr.nodeId;
+		if (flow.ids[nbr.groupId] != (-1) || visitCounts[nbrNode] > pass)
+			continue;
+
+		flow.ids[nbr.groupId] = nbr.nodeId;
+
+		// check whether the flow is already complete
+		if (depth + 1 == numSources)
 			return true;
+
+		pathNodes[depth] = nbrNode;
+		pathNext[depth]	 = graph.nbrStart[nbrNode];
+		depth++;
 	}
 	return false;
 }
 
 
+// Glue the flows 0->1, 1->2, ..., N-2->N-1 into one multi-marginal plan: the
+// chains arriving at a strand of source k split over the flows leaving it, in
+// order and in proportion to their amounts (clustered flows are normalized
+// per cluster pair, so the totals on both sides of a strand differ). Every
+// strand carrying flow appears in the result.
+bool HairMorphHierarchy::genNWayChained(std::vector<NWayFlow>& nwFlows)
+{
+	const int numSources = m_sources.size();
+
+	printf("Chaining N-way flows...");
+
+	for (int k = 0; k < numSources - 1; k++)
+	{
+		if (!getFlows(k, k+1))
+		{
+			printf("ERROR: flows from %d to %d do not exist!\n", k, k+1);
+			return false;
+		}
+	}
+
+	NWayFlow emptyFlow;
+	for (int i = 0; i < MAX_NUM_MORPH_SRC; i++)
+		emptyFlow.ids[i] = -1;
+	emptyFlow.amount = 0;
+
+	const std::vector<MyFlow<2> >& firstFlows = getFlows(0, 1)->flows();
+	nwFlows.resize(firstFlows.size(), emptyFlow);
+	for (int i = 0; i < firstFlows.size(); i++)
+	{
+		nwFlows[i].ids[0] = firstFlows[i].ids[0];
+		nwFlows[i].ids[1] = firstFlows[i].ids[1];
+		nwFlows[i].amount = firstFlows[i].amount;
+	}
+
+	// shares below this are float rounding
+	const double eps = 1e-6;
+
+	std::vector<NWayFlow> chains;
+	std::vector<int> chainStart, flowStart, chainOrder, flowOrder;
+
+	for (int k = 1; k < numSources - 1; k++)
+	{
+		const std::vector<MyFlow<2> >& flows = getFlows(k, k+1)->flows();
+		const int numNodes = m_sources[k].level(0).numStrands();
+
+		// chains by their strand of source k, flows by their source strand,
+		// both keeping their order (counting sort)
+		chainStart.assign(numNodes + 1, 0);
+		flowStart.assign(numNodes + 1, 0);
+		for (int i = 0; i < nwFlows.size(); i++)
+			chainStart[nwFlows[i].ids[k] + 1]++;
+		for (int i = 0; i < flows.size(); i++)
+			flowStart[flows[i].ids[0] + 1]++;
+		for (int n = 0; n < numNodes; n++)
+		{
+			chainStart[n+1] += chainStart[n];
+			flowStart[n+1]	+= flowStart[n];
+		}
+
+		chainOrder.resize(nwFlows.size());
+		flowOrder.resize(flows.size());
+		for (int i = 0; i < nwFlows.size(); i++)
+			chainOrder[chainStart[nwFlows[i].ids[k]]++] = i;
+		for (int i = 0; i < flows.size(); i++)
+			flowOrder[flowStart[flows[i].ids[0]]++] = i;
+
+		// (the starts now point at the ends of the rows)
+		chains.clear();
+		chains.reserve(nwFlows.size() + flows.size());
+
+		int	   numDropped = 0;
+		double droppedAmount = 0;
+
+		int a = 0, b = 0;
+		for (int n = 0; n < numNodes; n++)
+		{
+			const int aEnd = chainStart[n];
+			const int bEnd = flowStart[n];
+
+			double totalA = 0, totalB = 0;
+			for (int i = a; i < aEnd; i++)
+				totalA += nwFlows[chainOrder[i]].amount;
+			for (int i = b; i < bEnd; i++)
+				totalB += flows[flowOrder[i]].amount;
+
+			// chains ending at a strand without outgoing flow (or with zero
+			// amounts on either side) cannot be split and are dropped
+			if (totalA <= 0 || totalB <= 0)
+			{
+				numDropped	  += aEnd - a;
+				droppedAmount += totalA;
+				a = aEnd;
+				b = bEnd;
+				continue;
+			}
+
+			// walk both sides by their shares of the strand totals
+			double restA = a < aEnd ? nwFlows[chainOrder[a]].amount / totalA : 0;
+			double restB = b < bEnd ? flows[flowOrder[b]].amount / totalB : 0;
+			while (a < aEnd && b < bEnd)
+			{
+				const double share = std::min(restA, restB);
+
+				NWayFlow chain = nwFlows[chainOrder[a]];
+				chain.ids[k+1] = flows[flowOrder[b]].ids[1];
+				chain.amount   = (float)(share * totalA);
+				chains.push_back(chain);
+
+				restA -= share;
+				restB -= share;
+
+				if (restA <= eps && ++a < aEnd)
+					restA = nwFlows[chainOrder[a]].amount / totalA;
+				if (restB <= eps && ++b < bEnd)
+					restB = flows[flowOrder[b]].amount / totalB;
+			}
+
+			a = aEnd;
+			b = bEnd;
+		}
+
+		if (numDropped > 0)
+			printf("\nWARNING: %d chains (amount %.6f) dropped at source %d\n", numDropped, droppedAmount, k);
+
+		nwFlows.swap(chains);
+	}
+	printf("DONE.\n");
+
+	return true;
+}
+
+
 void HairMorphHierarchy::testClusterEffect()
 {
 	if (m_levels.size() < 2)
@@ -362,8 +712,9 @@ void HairMorphHierarchy::testClusterEffect()
 
 	printf("Calculating coordinate frames along cluster centers...\n");
 
-	for (int i = 0; i < m_levels[1].numStrands(); i++)
-		m_levels[1].getStrandAt(i)->calcReferenceFrames();
+	StrandFrames frames;
+	frames.calcTangents(m_levels[1]);
+	frames.calcNormals(XMFLOAT3(0,1,0), XMFLOAT3(1,0,0));
 
 	printf("Representing strands by relative coords...\n");
 
@@ -391,9 +742,7 @@ void HairMorphHierarchy::testClusterEffect()
 		{
 			XMFLOAT3& pos      = strand->vertices()[vId].position;
 			XMFLOAT3& refPos   = cluster->vertices()[vId].position;
-			XMFLOAT3& tangent  = cluster->vertices()[vId].pos2;
-			XMFLOAT3& normal   = cluster->vertices()[vId].pos3;
-			XMFLOAT3& binormal = cluster->vertices()[vId].pos4;
+			const XMFLOAT3& normal = frames.normals(strand->clusterID())[vId];
 
 			if (sId == 100)
 			{
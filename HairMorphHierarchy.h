@@ -2,9 +2,15 @@
 
 #include "HairHierarchy.h"
 #include "HairFlows.h"
+#include "MorphStreams.h"
+#include "MorphBlender.h"
+#include "StrokeJournal.h"
 
+#include <functional>
 #include <vector>
 
+class CancelToken;
+
 typedef MyFlow<MAX_NUM_MORPH_SRC> NWayFlow;
 
 // Hierarchy of HairMorphModels
@@ -38,12 +44,59 @@ public:
 
 	// calculate EMD flows
 
-	bool	calcAllSourceFlows(bool useStrandWeights);
+	// Called after each level of a source pair is done (levelsDone of numLevels),
+	// from the thread solving that pair (a pool thread), so it must be thread
+	// safe and a UI callback must not touch widgets itself.
+	typedef std::function<void(int srcIdx, int dstIdx, int levelsDone, int numLevels)> FlowProgressFunc;
+
+	// The source pairs are solved concurrently on the thread pool. Returns false
+	// if cancelled; the flows of unfinished pairs are then left empty.
+	bool	calcAllSourceFlows(bool useStrandWeights, const CancelToken* cancel = NULL);
+
+	// default (NULL) prints a line per level and pair
+	void	setFlowProgress(const FlowProgressFunc& func)	{ m_flowProgress = func; }
 
 	// morphable strands generation
 
+	enum NWayMode
+	{
+		NWayPaths,		// paths through the pairwise flow graph, strongest flows first (up to 16 passes)
+		NWayChained,	// multi-marginal plan chaining the flows 0->1->...->N-1
+	};
+
+	void		setNWayMode(NWayMode mode)	{ m_nwayMode = mode; }
+	NWayMode	nwayMode() const			{ return m_nwayMode; }
+
 	void	generateStrands();
 
+	// Per-source vertex streams of the generated strands (level 0)
+	const MorphStreams&	morphStreams() const	{ return m_morphStreams; }
+
+	// 8-bit colors of the sources in the morph streams (from the next generateStrands)
+	void	setQuantizeMorphColors(bool quantize)	{ m_bQuantizeMorphColors = quantize; }
+
+	// Upload level 0 and its morph streams, e.g. after strands were trimmed
+	bool	updateMorphBuffers();
+
+	// Morphed positions of level 0 for the given weights, blended into a
+	// buffer reused from call to call. Only the sources whose weight changed
+	// since the last call are blended again, until strands are edited.
+	const MorphBlender&	blendMorphPositions(const std::vector<float>& weights);
+
+	// Call after moving vertices of level 0 (not needed after trimming)
+	void	markStrandsEdited()		{ m_editVersion++; }
+	int		editVersion() const		{ return m_editVersion; }
+
+	// Stroke edits of the levels (cleared when strands are generated)
+	StrokeJournal&	strokeJournal()		{ return m_strokeJournal; }
+
+	// Undo (redo) the last stroke and update the buffers of its level
+	bool	undoStroke();
+	bool	redoStroke();
+
+	// N-way flows between all sources, from the pairwise flows (see NWayMode)
+	void	genNWayFromTwoWays(std::vector<NWayFlow>& nwFlows);
+
 	HairFlows*	getFlows(int srcIdx, int dstIdx);
 
 	void	testClusterEffect();
@@ -60,22 +113,30 @@ private:
 		GNodeNbr() : groupId(-1), nodeId(-1), weight(0) {}
 	};
 
-	static bool CompareNbr(GNodeNbr a, GNodeNbr b) { return a.weight > b.weight; }
+	static bool CompareNbr(const GNodeNbr& a, const GNodeNbr& b) { return a.weight > b.weight; }
 
-	struct GNode
+	// Pairwise flow graph of all sources in compressed rows. Strand n of source
+	// g is node i = groupStart[g] + n, whose neighbors are
+	// nbrs[nbrStart[i] .. nbrStart[i+1]) sorted by decreasing weight.
+	struct NodeGraph
 	{
-		std::vector<GNodeNbr> nbrs;
-		int		visitCount;
-
-		GNode() : visitCount(0) {}
-		int		nbrCount() const { return nbrs.size(); }
+		std::vector<int>		groupStart;		// numSources + 1
+		std::vector<int>		nbrStart;		// numNodes + 1
+		std::vector<GNodeNbr>	nbrs;
 	};
 
+	bool	buildNodeGraph(NodeGraph& graph);
 
-	void	genNWayFromTwoWays(std::vector<NWayFlow>& nwFlows);
+	// update after strands [first, last) of a level were restored
+	bool	strokeRestored(int levelIdx, int first, int last);
 
-	bool	findNWayFlow(std::vector<std::vector<GNode> >& nodeGroups,
-						 int groupId, int nodeId, int depth, int pass, NWayFlow& flow);
+	void	genNWayPaths(const NodeGraph& graph, std::vector<NWayFlow>& nwFlows);
+	bool	genNWayChained(std::vector<NWayFlow>& nwFlows);
+
+	// Depth-first search of a path through one node of each source, from the
+	// given node and skipping nodes visited more than pass times.
+	bool	findNWayFlow(const NodeGraph& graph, const std::vector<int>& visitCounts,
+						 int groupId, int nodeId, int pass, NWayFlow& flow) const;
 
 	// pair-wise flows: m_pairFlows[i][j] is the flow from source i to i+1+j;
 	std::vector<std::vector<HairFlows> >	m_pairFlows;
@@ -83,8 +144,20 @@ private:
 	std::vector<HairHierarchy>		m_sources;
 	std::vector<HairStrandModel>	m_levels;
 
+	MorphStreams	m_morphStreams;		// sources 1.. of level 0
+	MorphBlender	m_morphBlender;		// blended positions of level 0
+
 	int		m_currLvlIdx;
 
 	bool	m_bUseStrandWeights;
+	bool	m_bQuantizeMorphColors;
+
+	int		m_editVersion;			// of the vertex positions of level 0
+
+	StrokeJournal	m_strokeJournal;
+
+	FlowProgressFunc	m_flowProgress;
+
+	NWayMode			m_nwayMode;
 };
 
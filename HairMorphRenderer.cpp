@@ -1,14 +1,25 @@
 #include "HairMorphRenderer.h"
 
+#include <algorithm>
+
+#include <QString>
+
 #include "HeadMorphMesh.h"
 #include "HairStrandModel.h"
+#include "HairMorphHierarchy.h"
 #include "MorphController.h"
 
 HairMorphRenderer::HairMorphRenderer(MorphController* pMorphCtrl)
-	: m_pVertexLayout(NULL), m_pMorphCtrl(pMorphCtrl)
+	: m_pMorphCtrl(pMorphCtrl)
 {
 	setName("HairMorphRenderer");
 
+	for (int k = 0; k < MAX_NUM_MORPH_SRC; k++)
+	{
+		m_hTechniques[k] = NULL;
+		m_pVertexLayouts[k][0] = m_pVertexLayouts[k][1] = NULL;
+	}
+
 	m_strandRandWeight = 0;
 	m_hairWidth = 1.0f;
 }
@@ -24,18 +35,29 @@ bool HairMorphRenderer::create(ID3DX11Effect* pEffect)
 {
 	release();
 
-	m_hTechnique	= pEffect->GetTechniqueByName("StrandMorphColor");
 	m_hWorld		= pEffect->GetVariableByName("g_world")->AsMatrix();
 	m_hHairWidth	= pEffect->GetVariableByName("g_hairWidth")->AsScalar();
 	m_hStrandRandWeight	= pEffect->GetVariableByName("g_strandRandWeight")->AsScalar();
 	m_hMorphWeights = pEffect->GetVariableByName("g_morphWeights")->AsScalar();
 	m_hNumSources	= pEffect->GetVariableByName("g_numSources")->AsScalar();
 
-	if (!QDXUT::createInputLayoutFromTechnique(m_hTechnique, 0, StrandVertex::s_elemDesc,
-		StrandVertex::s_numElem, &m_pVertexLayout))
+	// one technique per number of sources, with layouts for both color formats
+	std::vector<D3D11_INPUT_ELEMENT_DESC> elements;
+	for (int k = 0; k < MAX_NUM_MORPH_SRC; k++)
 	{
-		release();
-		return false;
+		QString name = QString("StrandMorphColor%1").arg(k + 1);
+		m_hTechniques[k] = pEffect->GetTechniqueByName(name.toLocal8Bit().constData());
+
+		for (int quantized = 0; quantized < 2; quantized++)
+		{
+			MorphStreams::inputElements(k + 1, quantized != 0, elements);
+			if (!QDXUT::createInputLayoutFromTechnique(m_hTechniques[k], 0, elements.data(),
+				elements.size(), &m_pVertexLayouts[k][quantized]))
+			{
+				release();
+				return false;
+			}
+		}
 	}
 
 	return true;
@@ -44,9 +66,12 @@ bool HairMorphRenderer::create(ID3DX11Effect* pEffect)
 
 void HairMorphRenderer::release()
 {
-	SAFE_RELEASE(m_pVertexLayout);
-
-	m_hTechnique = NULL;
+	for (int k = 0; k < MAX_NUM_MORPH_SRC; k++)
+	{
+		SAFE_RELEASE(m_pVertexLayouts[k][0]);
+		SAFE_RELEASE(m_pVertexLayouts[k][1]);
+		m_hTechniques[k] = NULL;
+	}
 }
 
 
@@ -54,12 +79,17 @@ void HairMorphRenderer::render()
 {
 	ID3D11DeviceContext* pContext = QDXUT::immediateContext();
 
-	pContext->IASetInputLayout(m_pVertexLayout);
-
 	foreach (QDXObject* obj, m_objects)
 	{
-		if (obj->isVisible())
+		// only morph hierarchies carry the streams the techniques expect
+		HairMorphHierarchy* pHierarchy = dynamic_cast<HairMorphHierarchy*>(obj);
+		if (pHierarchy && pHierarchy->isVisible())
 		{
+			// the technique and layout matching the object's morph streams
+			const MorphStreams& streams = pHierarchy->morphStreams();
+			const int k = std::max(streams.numSources(), 1) - 1;
+			pContext->IASetInputLayout(m_pVertexLayouts[k][streams.hasQuantizedColors()]);
+
 			// Set *interpolated* world transform here
 			m_hWorld->SetMatrix((float*)m_pMorphCtrl->worldTransform());
 			
@@ -72,8 +102,8 @@ void HairMorphRenderer::render()
 
 			m_hHairWidth->SetFloat(m_hairWidth);//pModel->morphStrandModel()->strandWidth());
 
-			m_hTechnique->GetPassByIndex(0)->Apply(0, pContext);
-			obj->render();
+			m_hTechniques[k]->GetPassByIndex(0)->Apply(0, pContext);
+			pHierarchy->render();
 		}
 	}
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "QDXRenderGroup.h"
+#include "MorphDef.h"
 
 class MorphController;
 
@@ -20,7 +21,11 @@ public:
 
 private:
 
-	ID3DX11EffectTechnique*			m_hTechnique;
+	// StrandMorphColor<K> and its input layouts (float and 8-bit source colors)
+	// for K = 1..MAX_NUM_MORPH_SRC sources
+	ID3DX11EffectTechnique*			m_hTechniques[MAX_NUM_MORPH_SRC];
+	ID3D11InputLayout*				m_pVertexLayouts[MAX_NUM_MORPH_SRC][2];
+
 	ID3DX11EffectMatrixVariable*	m_hWorld;
 	ID3DX11EffectScalarVariable*	m_hHairWidth;
 	ID3DX11EffectScalarVariable*	m_hStrandRandWeight;
@@ -28,8 +33,6 @@ private:
 	ID3DX11EffectScalarVariable*	m_hMorphWeights;
 	ID3DX11EffectScalarVariable*	m_hNumSources;
 
-	ID3D11InputLayout*				m_pVertexLayout;
-
 	MorphController*				m_pMorphCtrl;
 
 	float							m_strandRandWeight;
@@ -4,11 +4,12 @@
 #include <QIODevice>
 
 #include <opencv2/core/core.hpp>
-#include <opencv2/imgproc/imgproc.hpp>
-
-#include <ANN/ANN.h>
 
 #include "HairUtil.h"
+#include "ParallelUtil.h"
+#include "StrandBufferBuilder.h"
+#include "StrandFilter.h"
+#include "StrandFrames.h"
 
 ////////////////////////////////////////////////////////
 
@@ -19,19 +20,6 @@ const D3D11_INPUT_ELEMENT_DESC StrandVertex::s_elemDesc[] =
 	{"COLOR",	 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0},
 	{"TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0},
 	{"TEXCOORD", 1, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0},
-
-#if MAX_NUM_MORPH_SRC > 2
-	{"TEXCOORD", 2, DXGI_FORMAT_R32G32B32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0},
-	{"TEXCOORD", 3, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0},
-#endif
-#if MAX_NUM_MORPH_SRC > 3
-	{"TEXCOORD", 4, DXGI_FORMAT_R32G32B32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0},
-	{"TEXCOORD", 5, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0},
-#endif
-#if MAX_NUM_MORPH_SRC > 4
-	{"TEXCOORD", 6, DXGI_FORMAT_R32G32B32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0},
-	{"TEXCOORD", 7, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0},
-#endif
 };
 
 const int StrandVertex::s_numElem = sizeof(s_elemDesc) / sizeof(s_elemDesc[0]);
@@ -159,97 +147,16 @@ void Strand::trim(int vId)
 		m_vertices.back().color.w = 0;
 		m_vertices[m_vertices.size()-2].color.w *= 0.5f;
 		//m_vertices.back().shading.w = 0;
-		//m_vertices.back().color2.w = 0;
-		//m_vertices.back().color3.w = 0;
-		//m_vertices.back().color4.w = 0;
-	}
-}
-
-
-void Strand::calcReferenceFrames()
-{
-	XMFLOAT3 stdTangent(0,1,0);
-	XMFLOAT3 stdNormal(1,0,0);
-	XMFLOAT3 stdBinormal(0,0,1);
-
-	// root frame
-	XMFLOAT3 tangent, normal, binormal;
-	XMStoreFloat3(&tangent, XMVector3Normalize(XMLoadFloat3(&m_vertices[1].position) - 
-											   XMLoadFloat3(&m_vertices[0].position)));
-	calcFrameByRotate(stdTangent, stdNormal, stdBinormal, tangent, normal, binormal);
-
-	m_vertices[0].pos2 = tangent;
-	m_vertices[0].pos3 = normal;
-	m_vertices[0].pos4 = binormal;
-
-	const int numVerts = m_vertices.size();
-
-	// middle frames
-	for (int i = 1; i < numVerts - 1; i++)
-	{
-		XMStoreFloat3(&tangent, XMVector3Normalize(XMLoadFloat3(&m_vertices[i+1].position) -
-												   XMLoadFloat3(&m_vertices[i-1].position)));
-		calcFrameByRotate(m_vertices[i-1].pos2, m_vertices[i-1].pos3, m_vertices[i-1].pos4,
-						  tangent, normal, binormal);
-		m_vertices[i].pos2 = tangent;
-		m_vertices[i].pos3 = normal;
-		m_vertices[i].pos4 = binormal;
 	}
-
-	// tip frame
-	XMStoreFloat3(&tangent, XMVector3Normalize(XMLoadFloat3(&m_vertices[numVerts-1].position) -
-											   XMLoadFloat3(&m_vertices[numVerts-2].position)));
-	calcFrameByRotate(m_vertices[numVerts-2].pos2, m_vertices[numVerts-2].pos3, 
-					  m_vertices[numVerts-2].pos4, tangent, normal, binormal);
-	m_vertices[numVerts-1].pos2 = tangent;
-	m_vertices[numVerts-1].pos3 = normal;
-	m_vertices[numVerts-1].pos4 = binormal;
 }
 
 
-void Strand::calcFrameByRotate(const XMFLOAT3& srcTangent, const XMFLOAT3& srcNormal, const XMFLOAT3& srcBinormal,
-							  const XMFLOAT3& dstTangent, XMFLOAT3& dstNormal, XMFLOAT3& dstBinormal)
+void Strand::setVertices(int first, const StrandVertex* pVertices, int numVerts)
 {
-	XMFLOAT4X4 mat;
-	calcMinRotation(srcTangent, dstTangent, mat);
-	XMMATRIX M = XMLoadFloat4x4(&mat);
-
-	// rotate normal/binormal
-	XMVECTOR Normal = XMVector3TransformCoord(XMLoadFloat3(&srcNormal), M);
-	XMVECTOR Binorm = XMVector3TransformCoord(XMLoadFloat3(&srcBinormal), M);
-
-	// normalize
-	XMStoreFloat3(&dstNormal, XMVector3Normalize(Normal));
-	XMStoreFloat3(&dstBinormal, XMVector3Normalize(Binorm));
-}
-
+	first = std::min(std::max(first, 0), (int)m_vertices.size());
 
-void Strand::calcMinRotation(const XMFLOAT3& vec1, const XMFLOAT3& vec2, XMFLOAT4X4& mat)
-{
-	// axis of rotation
-	XMVECTOR v1 = XMLoadFloat3(&vec1);
-	XMVECTOR v2 = XMLoadFloat3(&vec2);
-	XMVECTOR vA = XMVector3Normalize(XMVector3Cross(v1, v2));
-
-	XMFLOAT3 a;
-	XMStoreFloat3(&a, vA);
-
-	// helper variables
-	float sq_x = a.x*a.x,   sq_y = a.y*a.y,   sq_z = a.z*a.z;
-	float cos = XMVectorGetX(XMVector3Dot(v1, v2));
-	if (cos > 1.0f) cos = 1.0f;
-	else if (cos < -1.0f) cos = -1.0f;
-	float cos1 = 1.0f - cos;
-	float xycos1 = a.x*a.y*cos1,   yzcos1 = a.y*a.z*cos1,   zxcos1 = a.x*a.z*cos1;
-	float sin = sqrtf(1 - cos*cos);
-	float xsin = a.x*sin,    ysin = a.y*sin,    zsin = a.z*sin;
-
-	// matrix
-	memset(&mat, 0, sizeof(float)*16);
-	mat._11 = sq_x + (1-sq_x)*cos;	mat._12 = xycos1 + zsin;			mat._13 = zxcos1 - ysin;
-	mat._21 = xycos1 - zsin;		mat._22 = sq_y + (1-sq_y)*cos;		mat._23 = yzcos1 + xsin;
-	mat._31 = zxcos1 + ysin;		mat._32 = yzcos1 - xsin;			mat._33 = sq_z + (1-sq_z)*cos;
-	mat._44 = 1.0f;
+	m_vertices.resize(first);
+	m_vertices.insert(m_vertices.end(), pVertices, pVertices + numVerts);
 }
 
 
@@ -257,8 +164,11 @@ void Strand::calcMinRotation(const XMFLOAT3& vec1, const XMFLOAT3& vec2, XMFLOAT
 
 HairStrandModel::HairStrandModel()
 	: m_pVertexBuffer(NULL), m_pIndexBuffer(NULL), 
-	m_vertexCount(0), m_indexCount(0)
+	m_vertexCount(0), m_indexCount(0), m_pStagingBuffer(NULL), m_stagingCount(0),
+	m_dirtyBegin(0), m_dirtyEnd(0)
 {
+	m_pBufferBuilder = new StrandBufferBuilder;
+
 	m_strandWidth = 1.0f;
 	setScale(1, -1, 1);
 }
@@ -267,16 +177,22 @@ HairStrandModel::HairStrandModel()
 HairStrandModel::~HairStrandModel()
 {
 	release();
+
+	SAFE_DELETE(m_pBufferBuilder);
 }
 
 
 // copy ctor 
 HairStrandModel::HairStrandModel(const HairStrandModel& model)
 	: QDXObject(model), m_pVertexBuffer(NULL), m_pIndexBuffer(NULL),
-	m_vertexCount(0), m_indexCount(0)
+	m_vertexCount(0), m_indexCount(0), m_pStagingBuffer(NULL), m_stagingCount(0),
+	m_dirtyBegin(0), m_dirtyEnd(0)
 {
+	m_pBufferBuilder = new StrandBufferBuilder;
+
 	m_strands = model.m_strands;
 	m_strandWidth = model.m_strandWidth;
+	m_rootNbrs = model.m_rootNbrs;
 
 	if (model.m_pVertexBuffer && model.m_pIndexBuffer)
 		updateBuffers();
@@ -290,6 +206,7 @@ HairStrandModel& HairStrandModel::operator=(const HairStrandModel& model)
 	clear();
 	m_strands = model.m_strands;
 	m_strandWidth = model.m_strandWidth;
+	m_rootNbrs = model.m_rootNbrs;
 
 	if (model.m_pVertexBuffer && model.m_pIndexBuffer)
 		updateBuffers();
@@ -305,7 +222,7 @@ void HairStrandModel::createEmpty(int numStrands)
 	Strand strand;
 	m_strands.assign(numStrands, strand);
 
-	m_nbrStrandIDs.clear();
+	m_rootNbrs.clear();
 }
 
 
@@ -317,7 +234,7 @@ void HairStrandModel::createEmptyUnisam(int numStrands, int vertsPerStrand)
 	strand.createEmpty(vertsPerStrand);
 	m_strands.assign(numStrands, strand);
 
-	m_nbrStrandIDs.clear();
+	m_rootNbrs.clear();
 }
 
 
@@ -368,7 +285,7 @@ bool HairStrandModel::load(QString filename, bool updateBuffs)
 
 	printf("Hair loaded in %.3f seconds.\n", (float)timer.elapsed()/1000.f);
 
-	calcRootNbrsByANN(32);
+	calcRootNbrs(32);
 
 	return true;
 }
@@ -493,8 +410,14 @@ void HairStrandModel::release()
 {
 	SAFE_RELEASE(m_pVertexBuffer);
 	SAFE_RELEASE(m_pIndexBuffer);
-	m_vertexCount = 0;
-	m_indexCount  = 0;
+	SAFE_RELEASE(m_pStagingBuffer);
+	m_vertexCount  = 0;
+	m_indexCount   = 0;
+	m_stagingCount = 0;
+
+	// force a full rebuild next time
+	m_pBufferBuilder->clear();
+	m_dirtyBegin = m_dirtyEnd = 0;
 }
 
 
@@ -524,89 +447,86 @@ void HairStrandModel::addStrand(const Strand& strand)
 void HairStrandModel::clear()
 {
 	m_strands.clear();
-	m_nbrStrandIDs.clear();
+	m_rootNbrs.clear();
 	release();
 }
 
 
 bool HairStrandModel::updateBuffers()
 {
-	// TODO: if vertex/index count haven't been changed...
-
-	release();
-
-	srand(20130119);
+	// rebuild everything if strand count or lengths have changed
+	const bool layoutChanged = m_pBufferBuilder->updateLayout(m_strands);
 
-	//calcTangents();
+	if (layoutChanged || !m_pVertexBuffer || !m_pIndexBuffer)
+		return createBuffers();
 
-	// Calculate total vertex/index count
-	uint numVertices = 0;
-	uint numIndices  = 0;
-	for (int i = 0; i < numStrands(); i++)
+	// otherwise only re-upload the modified vertices
+	int first = m_dirtyBegin, last = m_dirtyEnd;
+	if (first >= last)
 	{
-		numVertices += m_strands[i].numVertices();
-		numIndices  += (m_strands[i].numVertices() - 1) * 4; // with adjacency
+		first = 0;
+		last  = numStrands();
 	}
+	m_dirtyBegin = m_dirtyEnd = 0;
 
-	if (numVertices < 1 || numIndices < 2)
-		return true;
+	return updateVertexRange(first, last);
+}
 
-	// Create vertex and index buffer data
-	StrandVertex* pVertexData = new StrandVertex[numVertices];
-	uint*		  pIndexData  = new uint[numIndices];
 
-	int vId = 0, iId = 0;
-	for (int i = 0; i < numStrands(); i++)
-	{
-		const StrandVertex* pVerts = m_strands[i].vertices();
+void HairStrandModel::markStrandsDirty(int first, int last)
+{
+	first = std::max(first, 0);
+	last  = std::min(last, numStrands());
+	if (first >= last)
+		return;
 
-		// Add root vertex of this strand
-		pVertexData[vId] = pVerts[0];
+	if (m_dirtyBegin >= m_dirtyEnd)
+	{
+		m_dirtyBegin = first;
+		m_dirtyEnd	 = last;
+	}
+	else
+	{
+		m_dirtyBegin = std::min(m_dirtyBegin, first);
+		m_dirtyEnd	 = std::max(m_dirtyEnd, last);
+	}
+}
 
-		float randNum = (float)rand() / (float)RAND_MAX;
-		pVertexData[vId].texcoord.x = randNum;
-		pVertexData[vId].texcoord.y = 0.0f;
 
-		vId++;
+// (Re)create vertex and index buffers from the current buffer layout.
+bool HairStrandModel::createBuffers()
+{
+	SAFE_RELEASE(m_pVertexBuffer);
+	SAFE_RELEASE(m_pIndexBuffer);
+	m_vertexCount = 0;
+	m_indexCount  = 0;
+	m_dirtyBegin = m_dirtyEnd = 0;
 
-		// Add each segment
-		for (int j = 1; j < m_strands[i].numVertices(); j++)
-		{
-			// index data
-			pIndexData[iId++] = (j == 1) ? vId - 1 : vId - 2;
-			pIndexData[iId++] = vId - 1;
-			pIndexData[iId++] = vId;
-			pIndexData[iId++] = (j == m_strands[i].numVertices()-1) ? vId : vId + 1;
+	const uint numVertices = m_pBufferBuilder->numVertices();
+	const uint numIndices  = m_pBufferBuilder->numIndices();
 
-			// vertex data
-			pVertexData[vId] = pVerts[j];
+	if (numVertices < 1 || numIndices < 2)
+		return true;
 
-			pVertexData[vId].texcoord.x = randNum;
-			pVertexData[vId].texcoord.y = (float)j / (float)(m_strands[i].numVertices() - 1);
-			//pVertexData[vId].texcoord.y = (float)qMin(j, m_strands[i].numVertices() - 1 - j);
+	// Create vertex and index buffer data (assembled in parallel)
+	std::vector<StrandVertex> vertexData(numVertices);
+	std::vector<uint>		  indexData(numIndices);
 
-			vId++;
-		}
-	}
-	Q_ASSERT(vId == numVertices);
-	Q_ASSERT(iId == numIndices);
+	m_pBufferBuilder->assemble(m_strands, vertexData.data(), indexData.data());
 
 	// Create D3D vertex buffer
 	
 	D3D11_BUFFER_DESC buffDesc = {0};
 	buffDesc.BindFlags		= D3D11_BIND_VERTEX_BUFFER;
 	buffDesc.ByteWidth		= sizeof(StrandVertex)*numVertices;
-	//buffDesc.Usage		= D3D11_USAGE_IMMUTABLE;
 	buffDesc.Usage			= D3D11_USAGE_DEFAULT;
 	buffDesc.CPUAccessFlags = 0;
 
 	D3D11_SUBRESOURCE_DATA initData;
-	initData.pSysMem = pVertexData;
+	initData.pSysMem = vertexData.data();
 
 	if (S_OK != QDXUT::device()->CreateBuffer(&buffDesc, &initData, &m_pVertexBuffer))
 	{
-		SAFE_DELETE_ARRAY(pVertexData);
-		SAFE_DELETE_ARRAY(pIndexData);
 		release();
 		return false;
 	}
@@ -618,19 +538,14 @@ bool HairStrandModel::updateBuffers()
 	buffDesc.Usage		= D3D11_USAGE_IMMUTABLE;
 	buffDesc.CPUAccessFlags = 0;
 
-	initData.pSysMem	= pIndexData;
+	initData.pSysMem	= indexData.data();
 
 	if (S_OK != QDXUT::device()->CreateBuffer(&buffDesc, &initData, &m_pIndexBuffer))
 	{
-		SAFE_DELETE_ARRAY(pVertexData);
-		SAFE_DELETE_ARRAY(pIndexData);
 		release();
 		return false;
 	}
 
-	SAFE_DELETE_ARRAY(pVertexData);
-	SAFE_DELETE_ARRAY(pIndexData);
-
 	m_vertexCount = numVertices;
 	m_indexCount  = numIndices;
 
@@ -638,6 +553,62 @@ bool HairStrandModel::updateBuffers()
 }
 
 
+void HairStrandModel::assembleBufferData(std::vector<StrandVertex>& vertices,
+										 std::vector<uint>& indices) const
+{
+	StrandBufferBuilder builder;
+	builder.updateLayout(m_strands);
+
+	vertices.resize(builder.numVertices());
+	indices.resize(builder.numIndices());
+
+	builder.assemble(m_strands, vertices.data(), indices.data());
+}
+
+
+// Re-upload the vertices of strands [first, last) through a staging buffer.
+bool HairStrandModel::updateVertexRange(int first, int last)
+{
+	const uint vStart = m_pBufferBuilder->vertexOffset(first);
+	const uint vCount = m_pBufferBuilder->vertexOffset(last) - vStart;
+	if (vCount < 1)
+		return true;
+
+	// (re)allocate staging buffer if it's too small
+	if (!m_pStagingBuffer || m_stagingCount < vCount)
+	{
+		SAFE_RELEASE(m_pStagingBuffer);
+		m_stagingCount = 0;
+
+		D3D11_BUFFER_DESC buffDesc = {0};
+		buffDesc.BindFlags		= 0;
+		buffDesc.ByteWidth		= sizeof(StrandVertex)*vCount;
+		buffDesc.Usage			= D3D11_USAGE_STAGING;
+		buffDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+
+		if (S_OK != QDXUT::device()->CreateBuffer(&buffDesc, NULL, &m_pStagingBuffer))
+			return false;
+
+		m_stagingCount = vCount;
+	}
+
+	ID3D11DeviceContext* pContext = QDXUT::immediateContext();
+
+	D3D11_MAPPED_SUBRESOURCE mapped;
+	if (S_OK != pContext->Map(m_pStagingBuffer, 0, D3D11_MAP_WRITE, 0, &mapped))
+		return false;
+
+	m_pBufferBuilder->fillVertices(m_strands, first, last, (StrandVertex*)mapped.pData);
+
+	pContext->Unmap(m_pStagingBuffer, 0);
+
+	D3D11_BOX box = {0, 0, 0, sizeof(StrandVertex)*vCount, 1, 1};
+	pContext->CopySubresourceRegion(m_pVertexBuffer, 0, sizeof(StrandVertex)*vStart, 0, 0,
+									m_pStagingBuffer, 0, &box);
+	return true;
+}
+
+
 // for DEBUG purpose
 bool HairStrandModel::updateDebugBuffers()
 {
@@ -741,22 +712,11 @@ bool HairStrandModel::updateDebugBuffers()
 // Filter hair strands depth
 void HairStrandModel::filterDepth(const HairFilterParam& params)
 {
-	for (int i = 0; i < m_strands.size(); i++)
-	{
-		cv::Mat depthData(1, m_strands[i].numVertices(), CV_32FC1);
-
-		for (int j = 0; j < depthData.cols; j++)
-		{
-			depthData.ptr<float>(0)[j] = m_strands[i].vertices()[j].position.z;
-		}
-
-		cv::GaussianBlur(depthData, depthData, cv::Size(-1,-1), params.sigmaDepth);
+	StrandFilter filter;
+	filter.setGaussian(params.sigmaDepth);
+	filter.apply(*this, StrandFilter::AttribDepth);
 
-		for (int j = 0; j < depthData.cols; j++)
-		{
-			m_strands[i].vertices()[j].position.z = depthData.ptr<float>(0)[j];
-		}
-	}
+	markAllStrandsDirty();
 }
 
 
@@ -767,129 +727,78 @@ void HairStrandModel::reverseOrder()
 
 void HairStrandModel::filterGeometry(const HairFilterParam& params)
 {
-	for (int i = 0; i < m_strands.size(); i++)
-	{
-		cv::Mat depthData(1, m_strands[i].numVertices(), CV_32FC3);
-
-		for (int j = 0; j < depthData.cols; j++)
-		{
-			depthData.ptr<cv::Vec3f>(0)[j] = cv::Vec3f(
-				m_strands[i].vertices()[j].position.x,
-				m_strands[i].vertices()[j].position.y,
-				m_strands[i].vertices()[j].position.z);
-		}
-
-		cv::GaussianBlur(depthData, depthData, cv::Size(-1,-1), params.sigmaDepth);
-
-		for (int j = 0; j < depthData.cols; j++)
-		{
-			cv::Vec3f& pos = depthData.ptr<cv::Vec3f>(0)[j];
-			m_strands[i].vertices()[j].position = XMFLOAT3(pos[0], pos[1], pos[2]);
-		}
-	}
+	StrandFilter filter;
+	filter.setGaussian(params.sigmaDepth);
+	filter.apply(*this, StrandFilter::AttribPosition);
 
+	markAllStrandsDirty();
 	updateBuffers();
 }
 
 void HairStrandModel::filterColorAlpha(const HairFilterParam& params)
 {
-	for (int i = 0; i < m_strands.size(); i++)
-	{
-		cv::Mat depthData(1, m_strands[i].numVertices(), CV_32FC4);
-
-		for (int j = 0; j < depthData.cols; j++)
-		{
-			depthData.ptr<cv::Vec4f>(0)[j] = cv::Vec4f(
-				m_strands[i].vertices()[j].color.x,
-				m_strands[i].vertices()[j].color.y,
-				m_strands[i].vertices()[j].color.z,
-				m_strands[i].vertices()[j].color.w);
-		}
-
-		cv::GaussianBlur(depthData, depthData, cv::Size(-1,-1), params.sigmaDepth);
-
-		for (int j = 0; j < depthData.cols; j++)
-		{
-			cv::Vec4f& color = depthData.ptr<cv::Vec4f>(0)[j];
-			m_strands[i].vertices()[j].color = XMFLOAT4(color[0], color[1], color[2], color[3]);
-		}
-	}
+	StrandFilter filter;
+	filter.setGaussian(params.sigmaDepth);
+	filter.apply(*this, StrandFilter::AttribColor);
 
+	markAllStrandsDirty();
 	updateBuffers();
 }
 
 void HairStrandModel::calcTangents()
 {
-	for (int i = 0; i < m_strands.size(); i++)
-	{
-		StrandVertex* verts = m_strands[i].vertices();
-		int			  n		= m_strands[i].numVertices();
-
-		// First vertex
-		//
-		XMVECTOR v0 = XMLoadFloat3(&verts[0].position);
-		XMVECTOR v1 = XMLoadFloat3(&verts[1].position);
-		XMVECTOR tangent = XMVector3Normalize(v1 - v0);
-
-		XMStoreFloat3(&verts[0].tangent, tangent);
-
-		// Intermediate vertices
-		for (int j = 1; j < n - 1; j++)
-		{
-			v0 = XMLoadFloat3(&verts[j-1].position);
-			v1 = XMLoadFloat3(&verts[j+1].position);
-			tangent = XMVector3Normalize(v1 - v0);
-
-			XMStoreFloat3(&verts[j].tangent, tangent);
-		}
-
-		// Last vertex
-		//
-		v0 = XMLoadFloat3(&verts[n-2].position);
-		v1 = XMLoadFloat3(&verts[n-1].position);
-		tangent = XMVector3Normalize(v1 - v0);
-
-		XMStoreFloat3(&verts[n-1].tangent, tangent);
-	}
+	StrandFrames frames;
+	frames.calcTangents(*this);
+	frames.storeTangents(*this);
 }
 
 
 // Add geometric noise as in [Bonneel et al. 09]
 void HairStrandModel::addGeometryNoise(const HairGeoNoiseParam& params)
 {
-	for (int i = 0; i < m_strands.size(); i++)
+	const int numStrands = m_strands.size();
+
+	// frames of the original geometry
+	StrandFrames frames;
+	frames.calcTangents(*this);
+
+	// random phases and root normals (serial, to keep the rand() sequence)
+	std::vector<float>	  phases(numStrands);
+	std::vector<XMFLOAT3> rootNormals(numStrands);
+
+	for (int i = 0; i < numStrands; i++)
 	{
-		StrandVertex* verts = m_strands[i].vertices();
-		int			  n		= m_strands[i].numVertices();
+		phases[i] = 2.0f * XM_PI * (float)rand()/(float)RAND_MAX;
 
-		float phase = 2.0f * XM_PI * (float)rand()/(float)RAND_MAX;
+		XMVECTOR tangent = XMLoadFloat3(&frames.tangents(i)[0]);
+		XMStoreFloat3(&rootNormals[i], HairUtil::randomNormal(tangent));
+	}
 
-		// Handle first vertex separately
-		XMVECTOR tangent = XMLoadFloat3(&verts[0].tangent);
-		XMVECTOR normal  = HairUtil::randomNormal(tangent);
+	frames.calcNormals(rootNormals);
 
-		for (int j = 1; j < n; j++)
+	ParallelUtil::parallelFor(0, numStrands, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
 		{
-			float t = float(j) / float(n - 1);
+			StrandVertex*	verts	= m_strands[i].vertices();
+			const XMFLOAT3* normals = frames.normals(i);
+			const int		n		= m_strands[i].numVertices();
 
-			XMVECTOR newTangent = XMLoadFloat3(&verts[j].tangent);
-			XMVECTOR newNormal  = HairUtil::calcNextNormal(
-								  tangent, newTangent, normal);
+			for (int j = 1; j < n; j++)
+			{
+				float offset = params.amplitude * 
+							   sinf(2.0f * XM_PI * (float)j * params.frequency + phases[i]);
 
-			float offset = params.amplitude * 
-						   sinf(2.0f * XM_PI * (float)j * params.frequency + phase);
+				XMVECTOR pos = XMLoadFloat3(&verts[j].position);
 
-			XMVECTOR pos = XMLoadFloat3(&verts[j].position);
-			
-			pos += offset * newNormal;
-			
-			XMStoreFloat3(&verts[j].position, pos);
+				pos += offset * XMLoadFloat3(&normals[j]);
 
-			tangent = newTangent;
-			normal  = newNormal;
+				XMStoreFloat3(&verts[j].position, pos);
+			}
 		}
-	}
+	}, 64);
 
+	markAllStrandsDirty();
 	updateBuffers();
 }
 
@@ -957,70 +866,26 @@ bool HairStrandModel::isUniformSampled(int nVertsPerStrand) const
 }
 
 
-void HairStrandModel::calcRootNbrsByANN(int numNbrs)
+// Build the symmetric k-nearest root neighborhood of all strands.
+void HairStrandModel::calcRootNbrs(int numNbrs)
 {
-	printf("Finding root neighbors using ANN...");
-
-	// fill in root points
-	ANNpointArray	annPts = annAllocPts(numStrands(), 3);
-	for (int i = 0; i < numStrands(); i++)
-	{
-		const XMFLOAT3& pos = m_strands[i].vertices()[0].position;
-		annPts[i][0] = pos.x;
-		annPts[i][1] = pos.y;
-		annPts[i][2] = pos.z;
-	}
+	printf("Finding root neighbors...");
 
-	ANNpoint		queryPt = annAllocPt(3);
-	ANNidxArray		nnIdx   = new ANNidx[numNbrs+1];
-	ANNdistArray	dists	= new ANNdist[numNbrs+1];
-	
-	ANNkd_tree*		kdTree  = new ANNkd_tree(annPts, numStrands(), 3);
-
-	m_nbrStrandIDs.resize(numStrands());
-	for (int i = 0; i < numStrands(); i++)
-		m_nbrStrandIDs[i].clear();
-
-	for (int i = 0; i < numStrands(); i++)
-	{
-		kdTree->annkSearch(annPts[i], numNbrs+1, nnIdx, dists);
-
-		for (int j = 0; j < numNbrs+1; j++)
-		{
-			if (nnIdx[j] != i)
-			{
-				m_nbrStrandIDs[i].push_back(nnIdx[j]);
-
-				// also add i to the nbrs of nnIdx[j]
-				m_nbrStrandIDs[nnIdx[j]].push_back(i);
-			}
-		}
-	}
-
-	// remove duplicates...
-	printf("...and...");
+	QTime timer;
+	timer.start();
 
+	std::vector<XMFLOAT3> roots(numStrands());
 	for (int i = 0; i < numStrands(); i++)
-	{
-		std::vector<int>& nbrIDs = m_nbrStrandIDs[i];
-		std::sort(nbrIDs.begin(), nbrIDs.end());
-		nbrIDs.erase(std::unique(nbrIDs.begin(), nbrIDs.end()), nbrIDs.end());
-	}
-
-	printf("DONE.\n");
+		roots[i] = m_strands[i].vertices()[0].position;
 
-	delete[] nnIdx;
-	delete[] dists;
-	delete kdTree;
+	m_rootNbrs.buildKNearest(roots, numNbrs);
 
-	annDeallocPts(annPts);
-	annDeallocPt(queryPt);
-	annClose();
+	printf("DONE. (%.3f s)\n", (float)timer.elapsed()/1000.f);
 }
 
 
 void HairStrandModel::clearRootNbrs()
 {
-	m_nbrStrandIDs.clear();
+	m_rootNbrs.clear();
 }
 
@@ -6,6 +6,9 @@
 #include "QDXObject.h"
 
 #include "MorphController.h"
+#include "StrandNbrGraph.h"
+
+class StrandBufferBuilder;
 
 
 // uniform sampled strand vertex count
@@ -14,25 +17,11 @@
 // A single vertex in a strand
 struct StrandVertex
 {
-	XMFLOAT3	position;		// pos 0
-	XMFLOAT3	tangent;		// pos 1
-	XMFLOAT4	color;			// color 0
+	XMFLOAT3	position;
+	XMFLOAT3	tangent;
+	XMFLOAT4	color;
 	XMFLOAT2	texcoord;
-	XMFLOAT4	shading;		// color 1
-
-// for N-way morphing
-#if MAX_NUM_MORPH_SRC > 2
-	XMFLOAT3	pos2;			
-	XMFLOAT4	color2;
-#endif
-#if MAX_NUM_MORPH_SRC > 3
-	XMFLOAT3	pos3;
-	XMFLOAT4	color3;
-#endif
-#if MAX_NUM_MORPH_SRC > 4
-	XMFLOAT3	pos4;
-	XMFLOAT4	color4;
-#endif
+	XMFLOAT4	shading;
 
 	static const D3D11_INPUT_ELEMENT_DESC	s_elemDesc[];
 	static const int						s_numElem;
@@ -86,15 +75,11 @@ public:
 
 	void				trim(int vId);
 
-	void				calcReferenceFrames();
+	// Replace the vertices from first on by numVerts given ones
+	void				setVertices(int first, const StrandVertex* pVertices, int numVerts);
 
 private:
 
-	void	calcFrameByRotate(const XMFLOAT3& srcTangent, const XMFLOAT3& srcNormal, const XMFLOAT3& srcBinormal,
-							  const XMFLOAT3& dstTangent, XMFLOAT3& dstNormal, XMFLOAT3& dstBinormal);
-
-	void	calcMinRotation(const XMFLOAT3& vec1, const XMFLOAT3& vec2, XMFLOAT4X4& mat);
-
 	std::vector<StrandVertex>	m_vertices;
 	float				m_length;
 
@@ -154,30 +139,52 @@ public:
 	bool	isUniformSampled(int nVertsPerStrand) const;
 
 
+	// Upload strands to the GPU. The index buffer is only rebuilt when strand
+	// count or lengths have changed, otherwise only the vertices of strands marked
+	// dirty (all strands if none marked) are re-uploaded.
 	bool	updateBuffers();
 	bool	updateDebugBuffers();
 
+	void	markStrandsDirty(int first, int last);
+	void	markAllStrandsDirty() { markStrandsDirty(0, numStrands()); }
+
+	const StrandBufferBuilder*	bufferBuilder() const { return m_pBufferBuilder; }
+
+	// CPU-side render buffer data (e.g. for exporting without a device)
+	void	assembleBufferData(std::vector<StrandVertex>& vertices, std::vector<uint>& indices) const;
 
-	void	calcRootNbrsByANN(int numNbrs);
+
+	void	calcRootNbrs(int numNbrs);
 	void	clearRootNbrs();
-	bool	hasNeighborStrandIDs() const { return !m_nbrStrandIDs.empty(); }
+	bool	hasRootNbrs() const { return !m_rootNbrs.isEmpty(); }
 
-	std::vector< std::vector<int> >& neighborStrandIDs() { return m_nbrStrandIDs; }
-	const std::vector< std::vector<int> >& neighborStrandIDs() const { return m_nbrStrandIDs; }
+	StrandNbrGraph&			rootNbrGraph()		 { return m_rootNbrs; }
+	const StrandNbrGraph&	rootNbrGraph() const { return m_rootNbrs; }
 
 protected:
 
 	void	calcTangents();
 
+	bool	createBuffers();
+	bool	updateVertexRange(int first, int last);
+
 	std::vector<Strand>	m_strands;
 
-	std::vector< std::vector<int> >	m_nbrStrandIDs;
+	StrandNbrGraph	m_rootNbrs;		// symmetric root k-NN graph
 
 	ID3D11Buffer*	m_pVertexBuffer;
 	ID3D11Buffer*	m_pIndexBuffer;
 	uint			m_vertexCount;
 	uint			m_indexCount;
 
+	StrandBufferBuilder*	m_pBufferBuilder;
+
+	ID3D11Buffer*	m_pStagingBuffer;	// for partial vertex updates
+	uint			m_stagingCount;
+
+	int				m_dirtyBegin;		// range of strands modified since last upload
+	int				m_dirtyEnd;
+
 	float			m_strandWidth;
 };
 
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include <QtCore/QtGlobal>
+
+// Indexed d-ary min-heap over a fixed set of integer slots [0, numSlots).
+// Each slot is in the heap at most once and carries its own key, which can be
+// decreased in place, so no entries are allocated or duplicated while the heap
+// is used. Equal keys are ordered by slot index, making extraction order
+// deterministic. Replaces IsochartHeap (a max-heap of heap-allocated entries)
+// for priority flooding over strands.
+template <class Key, int D = 4>
+class IndexedHeap
+{
+public:
+	IndexedHeap() {}
+	explicit IndexedHeap(int numSlots) { reset(numSlots); }
+
+	// Empty the heap and set the number of slots.
+	void	reset(int numSlots)
+	{
+		m_heap.clear();
+		m_heap.reserve(numSlots);
+		m_pos.assign(numSlots, NotInHeap);
+		m_keys.resize(numSlots);
+	}
+
+	// Empty the heap, keeping the slots (cost is proportional to the current size).
+	void	clear()
+	{
+		for (int i = 0; i < (int)m_heap.size(); i++)
+			m_pos[m_heap[i]] = NotInHeap;
+		m_heap.clear();
+	}
+
+	int		numSlots() const	{ return m_pos.size(); }
+	int		size() const		{ return m_heap.size(); }
+	bool	isEmpty() const		{ return m_heap.empty(); }
+
+	bool	contains(int slot) const { return m_pos[slot] != NotInHeap; }
+	const Key&	key(int slot) const	 { return m_keys[slot]; }
+
+	int			top() const		{ return m_heap[0]; }
+	const Key&	topKey() const	{ return m_keys[m_heap[0]]; }
+
+	// Insert a slot; one already in the heap only has its key decreased.
+	void	push(int slot, const Key& key)
+	{
+		if (contains(slot))
+		{
+			decrease(slot, key);
+			return;
+		}
+
+		m_keys[slot] = key;
+		m_pos[slot]	 = m_heap.size();
+		m_heap.push_back(slot);
+		siftUp(m_pos[slot]);
+	}
+
+	// Decrease the key of a slot in the heap (larger keys are ignored).
+	void	decrease(int slot, const Key& key)
+	{
+		Q_ASSERT(contains(slot));
+
+		if (!(key < m_keys[slot]))
+			return;
+
+		m_keys[slot] = key;
+		siftUp(m_pos[slot]);
+	}
+
+	// Insert the slot, or decrease its key if already in the heap.
+	// Returns true if the slot was inserted or its key decreased.
+	bool	pushOrDecrease(int slot, const Key& key)
+	{
+		if (!contains(slot))
+		{
+			push(slot, key);
+			return true;
+		}
+		if (key < m_keys[slot])
+		{
+			m_keys[slot] = key;
+			siftUp(m_pos[slot]);
+			return true;
+		}
+		return false;
+	}
+
+	// Remove and return the slot with the minimum key.
+	int		pop()
+	{
+		Q_ASSERT(!isEmpty());
+
+		const int slot = m_heap[0];
+		const int last = m_heap.back();
+
+		m_heap.pop_back();
+		m_pos[slot] = NotInHeap;
+
+		if (!m_heap.empty())
+		{
+			m_heap[0]	= last;
+			m_pos[last] = 0;
+			siftDown(0);
+		}
+		return slot;
+	}
+
+private:
+
+	enum { NotInHeap = -1 };
+
+	bool	less(int slotA, int slotB) const
+	{
+		if (m_keys[slotA] < m_keys[slotB]) return true;
+		if (m_keys[slotB] < m_keys[slotA]) return false;
+		return slotA < slotB;
+	}
+
+	void	siftUp(int i)
+	{
+		const int slot = m_heap[i];
+		while (i > 0)
+		{
+			const int parent = (i - 1) / D;
+			if (!less(slot, m_heap[parent]))
+				break;
+
+			m_heap[i] = m_heap[parent];
+			m_pos[m_heap[i]] = i;
+			i = parent;
+		}
+		m_heap[i] = slot;
+		m_pos[slot] = i;
+	}
+
+	void	siftDown(int i)
+	{
+		const int n	   = m_heap.size();
+		const int slot = m_heap[i];
+		for (;;)
+		{
+			const int first = i * D + 1;
+			if (first >= n)
+				break;
+
+			// smallest child
+			int best = first;
+			const int last = std::min(first + D, n);
+			for (int c = first + 1; c < last; c++)
+			{
+				if (less(m_heap[c], m_heap[best]))
+					best = c;
+			}
+
+			if (!less(m_heap[best], slot))
+				break;
+
+			m_heap[i] = m_heap[best];
+			m_pos[m_heap[i]] = i;
+			i = best;
+		}
+		m_heap[i] = slot;
+		m_pos[slot] = i;
+	}
+
+	std::vector<int>	m_heap;	// slots in heap order
+	std::vector<int>	m_pos;	// heap position of each slot (NotInHeap if absent)
+	std::vector<Key>	m_keys;	// key of each slot
+};
@@ -17,8 +17,9 @@
 // rather than to be "clean" or efficient. It is thus a single header file 
 // encompassing all the necessary classes, originally in multiple files.
 // Many classes are present for the sole purpose of passing data to 
-// windows threads, which make the code even uglier. 
-// For Linux users, multi-threading is not supported here.
+// the worker functions, which make the code even uglier. 
+// Multi-threading runs on the portable ThreadPool (see runConcurrently),
+// the results do not depend on the number of threads.
 //
 // This code is distributed in the hope that it will be useful,
 // but WITHOUT ANY WARRANTY; without even the implied warranty 
@@ -36,6 +37,9 @@
 //  
 // HISTORY:
 // 
+// Replaced the windows threads by tasks on the global ThreadPool and
+// parallel loops over samples, so that Linux builds are multi-threaded too.
+//
 // 13/02/2012 : Fixed a bug when Nlevels==0. Bug not present in the submission.
 // Fixed the helper function Slerp, not actually used here (does not compile if used).
 // Fixed the Vector class when DIM==3 (does not compile if used)
@@ -71,13 +75,10 @@ extern "C"
 #include "nnls.h"
 }
 
-#ifdef WIN32
-#include <windows.h>
-#else
-#define WINAPI 
-#define LPVOID void*
-#define DWORD int
-#endif
+#include <functional>
+
+#include "ThreadPool.h"
+#include "ParallelUtil.h"
 
 using namespace lemon;
 template<int DIM, typename TYPE> class Vector;
@@ -105,11 +106,11 @@ template<int DIM, typename SAMPLESTYPE> struct	RBFData;
 template<int DIM, typename SAMPLESTYPE> struct KernelData;
 template<int DIM, typename SAMPLESTYPE> struct FilteringData;
 template<int DIM, typename SAMPLESTYPE> struct InterpModeData;
-template<int DIM, typename SAMPLESTYPE> DWORD WINAPI computeRBFs(LPVOID lpParam );
-template<int DIM, typename SAMPLESTYPE> DWORD WINAPI computeNNdist( LPVOID lpParam );
-template<int DIM, typename SAMPLESTYPE> DWORD WINAPI computeKernelMatrix( LPVOID lpParam );
-template<int DIM, typename SAMPLESTYPE> DWORD WINAPI filterSamples(LPVOID lpParam );
-template<int DIM, typename SAMPLESTYPE> DWORD WINAPI interpMode(LPVOID lpParam );
+template<int DIM, typename SAMPLESTYPE> void computeRBFs(RBFData<DIM,SAMPLESTYPE>* argData);
+template<int DIM, typename SAMPLESTYPE> void computeNNdist(NNDistData<DIM,SAMPLESTYPE>* argData);
+template<int DIM, typename SAMPLESTYPE> void computeKernelMatrix(KernelData<DIM,SAMPLESTYPE>* argData);
+template<int DIM, typename SAMPLESTYPE> void filterSamples(FilteringData<DIM,SAMPLESTYPE>* argData);
+template<int DIM, typename SAMPLESTYPE> void interpMode(InterpModeData<DIM,SAMPLESTYPE>* argData);
 double meanVec(const std::vector<double> &vec);
 void minVec(std::vector<double> &vec, double val);
 void maxVec(std::vector<double> &vec, double val);
@@ -123,6 +124,25 @@ std::vector<double> operator-(const std::vector<double> &vec1, const std::vector
 template<typename T> inline T my_min(T x, T y) {return x<y?x:y;};
 template<typename T> inline T my_max(T x, T y) {return x>y?x:y;};
 
+// runs func(i) for i in [0, numTasks) as tasks on the global thread pool
+// (serially if ParallelUtil is limited to one thread). The tasks must write
+// disjoint data.
+inline void runConcurrently(int numTasks, const std::function<void(int)> &func)
+{
+	if (ParallelUtil::numThreads() <= 1) {
+		for (int i=0; i<numTasks; i++)
+			func(i);
+		return;
+	}
+
+	TaskGroup group;
+	for (int i=1; i<numTasks; i++)
+		group.run([&func, i]() { func(i); });
+	if (numTasks > 0)
+		func(0);
+	group.wait();
+}
+
 
 // and the interpolation class itself
 template<int DIM, typename SAMPLESTYPE=double>
@@ -169,23 +189,10 @@ public:
 			NNDistData<DIM, SAMPLESTYPE> dataA(A, numberOfNN, allNNA, allNNidA, sqrDist);
 			NNDistData<DIM, SAMPLESTYPE> dataB(B, numberOfNN, allNNB, allNNidB, sqrDist);
 
-#ifdef WIN32
-			SYSTEM_INFO sysinfo;
-			GetSystemInfo( &sysinfo );
-			mProcessNum = sysinfo.dwNumberOfProcessors;  //number of cores
-
-			HANDLE threads[2];
-
 			// find variances of RBF based on Nearest Neighbors (NN)
-			threads[0] = CreateThread( NULL, 0, computeNNdist<DIM,SAMPLESTYPE>, (void*) &dataA, 0, NULL);  
-			threads[1] = CreateThread( NULL, 0, computeNNdist<DIM,SAMPLESTYPE>, (void*) &dataB, 0, NULL);  
-			WaitForMultipleObjects( 2, threads, TRUE, INFINITE);
-			CloseHandle(threads[0]);
-			CloseHandle(threads[1]);
-#else
-			computeNNdist<DIM,SAMPLESTYPE>((void*) &dataA);
-			computeNNdist<DIM,SAMPLESTYPE>((void*) &dataB);
-#endif
+			runConcurrently(2, [&](int i) {
+				computeNNdist<DIM,SAMPLESTYPE>(i==0 ? &dataA : &dataB);
+			});
 
 			int id = (int)floor(kNNDist);
 			double frac = kNNDist - id;
@@ -203,16 +210,9 @@ public:
 
 			KernelData<DIM, SAMPLESTYPE> dataKerA(A, variancesA, kernelMatrixA, kernel);
 			KernelData<DIM, SAMPLESTYPE> dataKerB(B, variancesB, kernelMatrixB, kernel);
-#ifdef WIN32
-			threads[0] = CreateThread( NULL, 0, computeKernelMatrix<DIM,SAMPLESTYPE>, (void*) &dataKerA, 0, NULL);  
-			threads[1] = CreateThread( NULL, 0, computeKernelMatrix<DIM,SAMPLESTYPE>, (void*) &dataKerB, 0, NULL);  
-			WaitForMultipleObjects( 2, threads, TRUE, INFINITE);
-			CloseHandle(threads[0]);
-			CloseHandle(threads[1]);
-#else
-			computeKernelMatrix<DIM,SAMPLESTYPE>((void*) &dataKerA);
-			computeKernelMatrix<DIM,SAMPLESTYPE>((void*) &dataKerB);
-#endif
+			runConcurrently(2, [&](int i) {
+				computeKernelMatrix<DIM,SAMPLESTYPE>(i==0 ? &dataKerA : &dataKerB);
+			});
 
 			std::vector<double> savedwA(wA);
 			std::vector<double> savedwB(wB);
@@ -260,16 +260,9 @@ public:
 					{
 						FilteringData<DIM, SAMPLESTYPE> filtDataA(allNNidA, A,savedwA, filteredwA,  band, sqrDist, kernel);
 						FilteringData<DIM, SAMPLESTYPE> filtDataB(allNNidB, B,  savedwB, filteredwB, band, sqrDist, kernel);
-#ifdef WIN32
-						threads[0] = CreateThread( NULL, 0, filterSamples<DIM,SAMPLESTYPE>, (void*) &filtDataA, 0, NULL);  
-						threads[1] = CreateThread( NULL, 0, filterSamples<DIM,SAMPLESTYPE>, (void*) &filtDataB, 0, NULL);  
-						WaitForMultipleObjects( 2, threads, TRUE, INFINITE);
-						CloseHandle(threads[0]);
-						CloseHandle(threads[1]);
-#else
-						filterSamples<DIM,SAMPLESTYPE>((void*) &filtDataA);
-						filterSamples<DIM,SAMPLESTYPE>((void*) &filtDataB);
-#endif
+						runConcurrently(2, [&](int i) {
+							filterSamples<DIM,SAMPLESTYPE>(i==0 ? &filtDataA : &filtDataB);
+						});
 						signalA = previousResolutionA - filteredwA;
 						signalB = previousResolutionB - filteredwB;
 						previousResolutionA = filteredwA;
@@ -312,16 +305,9 @@ public:
 					RBFData<DIM, SAMPLESTYPE> rbfA(A, wA, wRBFA[funcID], kernelMatrixA, epsilonThreshold);
 					RBFData<DIM, SAMPLESTYPE> rbfB(B, wB, wRBFB[funcID], kernelMatrixB, epsilonThreshold);
 
-#ifdef WIN32
-					threads[0] = CreateThread( NULL, 0, computeRBFs<DIM,SAMPLESTYPE>, (void*) &rbfA, 0, NULL);  					
-					threads[1] = CreateThread( NULL, 0, computeRBFs<DIM,SAMPLESTYPE>, (void*) &rbfB, 0, NULL);  	
-					WaitForMultipleObjects( 2, threads, TRUE, INFINITE);	
-					CloseHandle(threads[0]);
-					CloseHandle(threads[1]);
-#else
-					computeRBFs<DIM,SAMPLESTYPE>(&rbfA);
-					computeRBFs<DIM,SAMPLESTYPE>(&rbfB);
-#endif
+					runConcurrently(2, [&](int i) {
+						computeRBFs<DIM,SAMPLESTYPE>(i==0 ? &rbfA : &rbfB);
+					});
 
 					funcID++;
 				}
@@ -385,42 +371,15 @@ public:
 				std::fill(modes[i].begin(), modes[i].end(), 0.);
 			}
 
-#ifdef WIN32
-			unsigned int nLaunch = min(mProcessNum, resultFlow.size());
-			HANDLE* threads = new HANDLE[nLaunch];
-#endif
-
-			unsigned int numMode = 0;
-			while(numMode<resultFlow.size())
-			{
-#ifdef WIN32
-				unsigned int numLaunchReal = min(nLaunch, resultFlow.size()-numMode);
-
-				std::vector<InterpModeData<DIM, SAMPLESTYPE> > dataProc(numLaunchReal, InterpModeData<DIM, SAMPLESTYPE>(0,alpha,resultFlow, interpolateBins, modes, kernel, variancesA, variancesB, A, B, sumWA, sumWB, samples)) ;
-				for (unsigned int k=0; k<numLaunchReal; k++) {
-					dataProc[k].i = numMode;
-					numMode++;
-				}
-				for (unsigned int k=0; k<numLaunchReal; k++)
-					threads[k] = CreateThread( NULL, 0, interpMode<DIM,SAMPLESTYPE>, (void*) &dataProc[k], 0, NULL);  
-
-				WaitForMultipleObjects( numLaunchReal, threads, TRUE, INFINITE);
-				for (unsigned int k=0; k<numLaunchReal; k++)
-					CloseHandle(threads[k]);
-#else
-				InterpModeData<DIM, SAMPLESTYPE> data(numMode,alpha,resultFlow, interpolateBins, modes, kernel, variancesA, variancesB, A, B, sumWA, sumWB, samples);
-				interpMode<DIM,SAMPLESTYPE>((void*) &data);
-				numMode++;
-#endif
-			}
+			// each mode only writes its own row of modes
+			runConcurrently((int)resultFlow.size(), [&](int i) {
+				InterpModeData<DIM, SAMPLESTYPE> data(i,alpha,resultFlow, interpolateBins, modes, kernel, variancesA, variancesB, A, B, sumWA, sumWB, samples);
+				interpMode<DIM,SAMPLESTYPE>(&data);
+			});
 
 			for (unsigned int i=0; i<modes.size(); i++)
 				for (unsigned int n=0; n<samples.size(); n++)
 					wResult[n]+=modes[i][n];
-
-#ifdef WIN32
-			delete[] threads;
-#endif
 		}
 	
 
@@ -559,7 +518,6 @@ private:
 	std::vector<double> wB;
 	std::vector<double> sumWA, sumWB;
 	double epsilonThreshold;
-	unsigned int mProcessNum; // number of cores
 	unsigned int NLevels;
 
 	std::vector<double> variancesA;			// the variance actually used for the RBF
@@ -858,9 +816,8 @@ void nonZerosRBFs(std::vector<Vector<DIM,SAMPLESTYPE> > &A, std::vector<double>
 
 
 template<int DIM, typename SAMPLESTYPE>
-DWORD WINAPI interpMode(LPVOID lpParam )
+void interpMode(InterpModeData<DIM,SAMPLESTYPE>* argData)
 {
-	InterpModeData<DIM,SAMPLESTYPE>* argData = (InterpModeData<DIM,SAMPLESTYPE>*) lpParam;
 	int i = argData->i; // mode number
 	double alpha = argData->alpha;
 	const std::vector<std::vector<TsFlow> > &resultFlow = argData->resultFlow;
@@ -889,24 +846,25 @@ DWORD WINAPI interpMode(LPVOID lpParam )
 		radii[n] = variancesA[from]*(1.-alpha)+variancesB[to]*alpha; // we interpolate the variance
 	}
 
+	// blocks of samples in parallel, the sum over m keeps its order for each sample
 	double powi = (i%2==0)?1.:-1.;
-	for (unsigned int m=0; m<resultWeights.size(); m++)	{
-		if (fabs(resultWeights[m])<1E-13) continue;
-		for (unsigned int n=0; n<samples.size(); n++) {
-			double w = kernel(resultCenters[m], samples[n], radii[m]);	
-			modes[i][n]+=w*resultWeights[m]*powi;
+	ParallelUtil::parallelFor(0, (int)samples.size(), [&](int begin, int end) {
+		for (unsigned int m=0; m<resultWeights.size(); m++)	{
+			if (fabs(resultWeights[m])<1E-13) continue;
+			for (int n=begin; n<end; n++) {
+				double w = kernel(resultCenters[m], samples[n], radii[m]);	
+				modes[i][n]+=w*resultWeights[m]*powi;
+			}
 		}
-	}
-	return 0;
+	}, 256);
 }
 
 
 
 
 template<int DIM, typename SAMPLESTYPE>
-DWORD WINAPI filterSamples(LPVOID lpParam ) // smoothing operator
+void filterSamples(FilteringData<DIM,SAMPLESTYPE>* argData) // smoothing operator
 {
-	FilteringData<DIM,SAMPLESTYPE>* argData = (FilteringData<DIM,SAMPLESTYPE>*) lpParam;
 	std::vector<std::vector<int> > &allNNid  = argData->allNNid;
 	std::vector<Vector<DIM,SAMPLESTYPE> > &samples  = argData->samples;
 	std::vector<double> &weights = argData->weights;
@@ -918,47 +876,47 @@ DWORD WINAPI filterSamples(LPVOID lpParam ) // smoothing operator
 
 	unsigned int numNN = allNNid.size();
 	result.resize(samples.size());
-	for (unsigned int i=0; i<samples.size(); i++) {
-		double vari = sqrDist(samples[i], samples[allNNid[numNN-1][i]])*varFilter;
-		double sumker = 0.;
-		double sumfunc = 0.;
-		for (unsigned int j=0; j<allNNid.size(); j++) {
-			double ker = kernel(samples[i], samples[allNNid[j][i]], vari); 
-			sumker+=ker;
-			sumfunc+=ker*weights[allNNid[j][i]];
+	ParallelUtil::parallelFor(0, (int)samples.size(), [&](int begin, int end) {
+		for (int i=begin; i<end; i++) {
+			double vari = sqrDist(samples[i], samples[allNNid[numNN-1][i]])*varFilter;
+			double sumker = 0.;
+			double sumfunc = 0.;
+			for (unsigned int j=0; j<allNNid.size(); j++) {
+				double ker = kernel(samples[i], samples[allNNid[j][i]], vari); 
+				sumker+=ker;
+				sumfunc+=ker*weights[allNNid[j][i]];
+			}
+			if (sumker!=0)
+				result[i] = sumfunc/sumker;
+			else
+				result[i] = weights[i];
 		}
-		if (sumker!=0)
-			result[i] = sumfunc/sumker;
-		else
-			result[i] = weights[i];
-	}
-	return 0;
+	}, 64);
 }
 
 template<int DIM, typename SAMPLESTYPE>
-DWORD WINAPI computeKernelMatrix( LPVOID lpParam )
+void computeKernelMatrix(KernelData<DIM,SAMPLESTYPE>* argData)
 {
-	KernelData<DIM,SAMPLESTYPE> *argData = (KernelData<DIM,SAMPLESTYPE>*) lpParam;
 	std::vector<Vector<DIM,SAMPLESTYPE> > &samples =  argData->samples;
 	std::vector<double> &variances =  argData->variances;
 	std::vector<float> &result =  argData->result;
 	double (*kernel)(const Vector<DIM,SAMPLESTYPE> &, const Vector<DIM,SAMPLESTYPE> &, double) = argData->kernel;
 
 	result.resize(samples.size()*samples.size());
-	for( unsigned int rItr=0; rItr<samples.size(); rItr++ ) {
-		for (unsigned int c=0; c<samples.size(); c++) {
-			double v = kernel(samples[c], samples[rItr],variances[c]);
-			result[rItr*samples.size()+c] = (float)v;
-		}		
-	}
-	return 0;
+	ParallelUtil::parallelFor(0, (int)samples.size(), [&](int begin, int end) {
+		for (int rItr=begin; rItr<end; rItr++) {
+			for (unsigned int c=0; c<samples.size(); c++) {
+				double v = kernel(samples[c], samples[rItr],variances[c]);
+				result[rItr*samples.size()+c] = (float)v;
+			}		
+		}
+	}, 16);
 }
 
 
 template<int DIM, typename SAMPLESTYPE>
-DWORD WINAPI computeRBFs(LPVOID lpParam )
+void computeRBFs(RBFData<DIM,SAMPLESTYPE>* argData)
 {
-	RBFData<DIM,SAMPLESTYPE>* argData = (RBFData<DIM,SAMPLESTYPE>*) lpParam;
 	std::vector<Vector<DIM,SAMPLESTYPE> > &samples = argData->samples;
 	std::vector<double> &values = argData->values;
 	std::vector<double> &wRBF = argData->wRBF;
@@ -999,7 +957,6 @@ DWORD WINAPI computeRBFs(LPVOID lpParam )
 		wRBF[i] = sol[idx];
 		idx++;
 	}
-	return 0;
 }
 
 
@@ -1009,9 +966,8 @@ DWORD WINAPI computeRBFs(LPVOID lpParam )
 // and for the laplacian pyramid
 // highly unoptimized code
 template<int DIM, typename SAMPLESTYPE>
-DWORD WINAPI computeNNdist( LPVOID lpParam )
+void computeNNdist(NNDistData<DIM,SAMPLESTYPE>* argData)
 {
-	NNDistData<DIM,SAMPLESTYPE> *argData = (NNDistData<DIM,SAMPLESTYPE>*) lpParam;
 	std::vector<Vector<DIM,SAMPLESTYPE> > &samples =  argData->samples;
 	unsigned int NnearD =  argData->NnearD;								// number of neasrest neighbors to gather at each sample
 	std::vector<std::vector<double> > &dists = argData->dists;
@@ -1019,103 +975,105 @@ DWORD WINAPI computeNNdist( LPVOID lpParam )
 	double (*sqrDist)(const Vector<DIM,SAMPLESTYPE>&, const Vector<DIM,SAMPLESTYPE>&) = argData->sqrDist;
 
 	unsigned int N = (unsigned int) samples.size();
+	dists.resize(NnearD, std::vector<double>(N, 1.E9));
+	nnid.resize(NnearD, std::vector<int>(N, 0));
+
+	// each sample gathers its own neighbors, blocks of samples run in parallel
 	if (NnearD>800) // in that case a quick sort over all the data may probably faster than keeping a heap
 	{		
-		std::vector<std::vector<std::pair<double,int> > > alldists(N);
-		for (unsigned int i=0; i<N; i++) {
-			alldists[i].resize(N);
-			for (unsigned int j=0; j<N; j++) {
-				double curDist = sqrDist(samples[i], samples[j]);
-				alldists[i][j] = std::make_pair(curDist,j);					
-			}
-			std::sort(alldists[i].begin(), alldists[i].end());
-			alldists[i].resize(NnearD); //clear some memory
-		}
+		ParallelUtil::parallelFor(0, (int)N, [&](int begin, int end) {
+			std::vector<std::pair<double,int> > alldists(N);
+			for (int i=begin; i<end; i++) {
+				for (unsigned int j=0; j<N; j++) {
+					double curDist = sqrDist(samples[i], samples[j]);
+					alldists[j] = std::make_pair(curDist,j);					
+				}
+				// fewer samples than neighbors: the rest keep their initial values
+				const size_t numNear = std::min<size_t>(NnearD, alldists.size());
+				std::partial_sort(alldists.begin(), alldists.begin()+numNear, alldists.end());
 
-		dists.resize(NnearD, std::vector<double>(N, 1.E9));
-		nnid.resize(NnearD, std::vector<int>(N, 0));
-		for (unsigned int i=0; i<N; i++)
-			for (unsigned int j=0; j<NnearD; j++) {
-				dists[j][i] = alldists[i][j].first;
-				nnid[j][i] = alldists[i][j].second;
+				for (unsigned int j=0; j<numNear; j++) {
+					dists[j][i] = alldists[j].first;
+					nnid[j][i] = alldists[j].second;
+				}
 			}
+		}, 16);
 	}
 	else
 	if (NnearD>20) { // in that case maintaining a heap is probably faster than insertion
-		std::vector<std::vector<std::pair<double,int> > > alldists(N);
-		
-		for (unsigned int i=0; i<N; i++) {
-			alldists[i].reserve(NnearD+1);
-
-			// keeps a heap of the NnearD closest
-			bool haspopped = false;
-			bool remakeheap;
-			for (unsigned int j=0; j<N; j++) {
-				double curDist = sqrDist(samples[i], samples[j]);
-				if (alldists[i].size()<=NnearD) {
-					alldists[i].push_back(std::make_pair(curDist,j));	
-					remakeheap = true;
-				} else {
-					if (curDist<alldists[i][0].first) {
-						alldists[i][NnearD] = std::make_pair(curDist,j);					
+		ParallelUtil::parallelFor(0, (int)N, [&](int begin, int end) {
+			std::vector<std::pair<double,int> > alldists;
+			alldists.reserve(NnearD+1);
+
+			for (int i=begin; i<end; i++) {
+				alldists.clear();
+
+				// keeps a heap of the NnearD closest
+				bool haspopped = false;
+				bool remakeheap;
+				for (unsigned int j=0; j<N; j++) {
+					double curDist = sqrDist(samples[i], samples[j]);
+					if (alldists.size()<=NnearD) {
+						alldists.push_back(std::make_pair(curDist,j));	
 						remakeheap = true;
-					} else
-						remakeheap = false;
-				}
+					} else {
+						if (curDist<alldists[0].first) {
+							alldists[NnearD] = std::make_pair(curDist,j);					
+							remakeheap = true;
+						} else
+							remakeheap = false;
+					}
 
-				if (remakeheap) {
-					push_heap( alldists[i].begin(), alldists[i].end() );
-					haspopped = false;
-					if (alldists[i].size()>=NnearD+1) {
-						pop_heap( alldists[i].begin(), alldists[i].end() );	
-						haspopped = true;
+					if (remakeheap) {
+						push_heap( alldists.begin(), alldists.end() );
+						haspopped = false;
+						if (alldists.size()>=NnearD+1) {
+							pop_heap( alldists.begin(), alldists.end() );	
+							haspopped = true;
+						}
 					}
 				}
+				if (haspopped)
+					std::sort_heap(alldists.begin(), alldists.end()-1 );
+				else
+					std::sort_heap(alldists.begin(), alldists.end());
+
+				for (unsigned int j=0; j<NnearD; j++) {
+					dists[j][i] = alldists[j].first;
+					nnid[j][i] = alldists[j].second;
+				}
 			}
-			if (haspopped)
-				std::sort_heap(alldists[i].begin(), alldists[i].end()-1 );
-			else
-				std::sort_heap(alldists[i].begin(), alldists[i].end());
-		}
-
-		dists.resize(NnearD, std::vector<double>(N, 1.E9));
-		nnid.resize(NnearD, std::vector<int>(N, 0));
-		for (unsigned int i=0; i<N; i++)
-			for (unsigned int j=0; j<NnearD; j++) {
-				dists[j][i] = alldists[i][j].first;
-				nnid[j][i] = alldists[i][j].second;
-			}
+		}, 16);
 	}
 	else
 	{
-		dists.resize(NnearD, std::vector<double>(N, 1.E9));
-		nnid.resize(NnearD, std::vector<int>(N, 0));
-		std::vector<double> nearestDists(NnearD, 1.E9);
-		std::vector<int> nearestIds(NnearD, 0);
-		for (unsigned int j=0; j<N; j++) {
-			std::fill(nearestDists.begin(), nearestDists.end(), 1.E9);
-			for (unsigned int k=0; k<N; k++) {
-				//if (j==k) continue;
-				double curDist = sqrDist(samples[j], samples[k]);
-				for (unsigned int p=0; p<NnearD; p++) {
-					if (curDist<nearestDists[p]) {
-						if (p!=NnearD-1) {
-							memmove(&nearestDists[p+1],&nearestDists[p], (NnearD-p-1)*sizeof(nearestDists[0]));
-							memmove(&nearestIds[p+1],&nearestIds[p], (NnearD-p-1)*sizeof(nearestIds[0]));
+		ParallelUtil::parallelFor(0, (int)N, [&](int begin, int end) {
+			std::vector<double> nearestDists(NnearD, 1.E9);
+			std::vector<int> nearestIds(NnearD, 0);
+			for (int j=begin; j<end; j++) {
+				std::fill(nearestDists.begin(), nearestDists.end(), 1.E9);
+				for (unsigned int k=0; k<N; k++) {
+					//if (j==k) continue;
+					double curDist = sqrDist(samples[j], samples[k]);
+					for (unsigned int p=0; p<NnearD; p++) {
+						if (curDist<nearestDists[p]) {
+							if (p!=NnearD-1) {
+								memmove(&nearestDists[p+1],&nearestDists[p], (NnearD-p-1)*sizeof(nearestDists[0]));
+								memmove(&nearestIds[p+1],&nearestIds[p], (NnearD-p-1)*sizeof(nearestIds[0]));
+							}
+							nearestDists[p] = curDist;
+							nearestIds[p] = k;
+							break;
 						}
-						nearestDists[p] = curDist;
-						nearestIds[p] = k;
-						break;
 					}
 				}
+				for (unsigned int k=0; k<NnearD; k++) {
+					dists[k][j] = nearestDists[k];
+					nnid[k][j] = nearestIds[k];
+				}
 			}
-			for (unsigned int k=0; k<NnearD; k++) {
-				dists[k][j] = nearestDists[k];
-				nnid[k][j] = nearestIds[k];
-			}
-		}
+		}, 16);
 	}
-	return 0;
 }
 
 
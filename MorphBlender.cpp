@@ -0,0 +1,191 @@
+#include "MorphBlender.h"
+
+#include <algorithm>
+
+#include <xmmintrin.h>
+
+#include "MorphStreams.h"
+#include "ParallelUtil.h"
+
+
+namespace
+{
+	// incremental updates before a full blend clears the rounding drift
+	const int MaxDeltas = 64;
+
+	// The blend loops round the used floats of a strand up to whole 4-float
+	// blocks, which must not run into the next strand.
+	static_assert((NUM_UNISAM_VERTICES*3) % 4 == 0, "strand positions must fill whole 4-float blocks");
+}
+
+
+MorphBlender::MorphBlender()
+	: m_numStrands(0), m_numSources(0), m_editVersion(-1), m_numDeltas(0), m_numSourcesBlended(0)
+{
+}
+
+
+void MorphBlender::clear()
+{
+	m_numStrands = 0;
+	std::vector<XMFLOAT3>().swap(m_positions);
+
+	invalidate();
+}
+
+
+void MorphBlender::blend(const HairStrandModel& model, const MorphStreams& streams,
+						 const std::vector<float>& weights, int editVersion)
+{
+	const int numSources = std::max(std::min(streams.numSources(), MAX_NUM_MORPH_SRC), 1);
+	if (numSources > 1 && streams.numStrands() != model.numStrands())
+	{
+		printf("ERROR: morph streams have %d strands, model has %d!\n", streams.numStrands(), model.numStrands());
+		clear();
+		return;
+	}
+
+	float w[MAX_NUM_MORPH_SRC];
+	for (int k = 0; k < MAX_NUM_MORPH_SRC; k++)
+		w[k] = k < weights.size() ? weights[k] : 0.0f;
+
+	// sources whose weight changed since the cached blend
+	int   changed[MAX_NUM_MORPH_SRC];
+	float dw[MAX_NUM_MORPH_SRC];
+	int   numChanged = 0;
+
+	const bool cached = m_editVersion >= 0 && m_editVersion == editVersion &&
+						m_numSources == numSources && m_numStrands == model.numStrands();
+	if (cached)
+	{
+		for (int k = 0; k < numSources; k++)
+		{
+			if (w[k] != m_weights[k])
+			{
+				changed[numChanged] = k;
+				dw[numChanged++] = w[k] - m_weights[k];
+			}
+		}
+	}
+
+	m_numSourcesBlended = numChanged;
+	if (cached && numChanged == 0)
+		return;
+
+	for (int k = 0; k < MAX_NUM_MORPH_SRC; k++)
+		m_weights[k] = w[k];
+
+	if (cached && numChanged < numSources && m_numDeltas < MaxDeltas)
+	{
+		m_numDeltas++;
+		ParallelUtil::parallelFor(0, m_numStrands, [&](int begin, int end)
+		{
+			addDeltas(model, streams, changed, dw, numChanged, begin, end);
+		}, 64);
+		return;
+	}
+
+	m_numStrands		= model.numStrands();
+	m_numSources		= numSources;
+	m_editVersion		= editVersion;
+	m_numDeltas			= 0;
+	m_numSourcesBlended = numSources;
+	m_positions.resize(m_numStrands * NUM_UNISAM_VERTICES);
+
+	ParallelUtil::parallelFor(0, m_numStrands, [&](int begin, int end)
+	{
+		switch (numSources)
+		{
+		case 1: blendStrands<1>(model, streams, w, begin, end); break;
+		case 2: blendStrands<2>(model, streams, w, begin, end); break;
+#if MAX_NUM_MORPH_SRC > 2
+		case 3: blendStrands<3>(model, streams, w, begin, end); break;
+#endif
+#if MAX_NUM_MORPH_SRC > 3
+		case 4: blendStrands<4>(model, streams, w, begin, end); break;
+#endif
+#if MAX_NUM_MORPH_SRC > 4
+		case 5: blendStrands<5>(model, streams, w, begin, end); break;
+#endif
+		default: break;
+		}
+	}, 64);
+}
+
+
+template <int K>
+void MorphBlender::blendStrands(const HairStrandModel& model, const MorphStreams& streams,
+								const float* weights, int begin, int end)
+{
+	__m128 w[K];
+	for (int k = 0; k < K; k++)
+		w[k] = _mm_set1_ps(weights[k]);
+
+	const float* pSrc[K];
+
+	for (int i = begin; i < end; i++)
+	{
+		const Strand* strand = model.getStrandAt(i);
+		const StrandVertex* vertices = strand->vertices();
+		const int numVerts = std::min(strand->numVertices(), NUM_UNISAM_VERTICES);
+
+		// source 0 comes interleaved with the other vertex data
+		float* pDst = (float*)&m_positions[i*NUM_UNISAM_VERTICES];
+		for (int j = 0; j < numVerts; j++)
+		{
+			pDst[j*3]	  = vertices[j].position.x;
+			pDst[j*3 + 1] = vertices[j].position.y;
+			pDst[j*3 + 2] = vertices[j].position.z;
+		}
+
+		pSrc[0] = pDst;
+		for (int k = 1; k < K; k++)
+			pSrc[k] = (const float*)&streams.position(k, i, 0);
+
+		// whole 4-float blocks of the used vertices, the rest of the strand
+		// being padding of both the streams and the blend
+		const int numFloats = (numVerts*3 + 3) & ~3;
+		for (int f = 0; f < numFloats; f += 4)
+		{
+			__m128 sum = _mm_mul_ps(w[0], _mm_loadu_ps(pSrc[0] + f));
+			for (int k = 1; k < K; k++)
+				sum = _mm_add_ps(sum, _mm_mul_ps(w[k], _mm_loadu_ps(pSrc[k] + f)));
+			_mm_storeu_ps(pDst + f, sum);
+		}
+	}
+}
+
+
+void MorphBlender::addDeltas(const HairStrandModel& model, const MorphStreams& streams,
+							 const int* sources, const float* dw, int numChanged, int begin, int end)
+{
+	for (int i = begin; i < end; i++)
+	{
+		const Strand* strand = model.getStrandAt(i);
+		const int numVerts = std::min(strand->numVertices(), NUM_UNISAM_VERTICES);
+		const int numFloats = (numVerts*3 + 3) & ~3;
+
+		float* pDst = (float*)&m_positions[i*NUM_UNISAM_VERTICES];
+
+		for (int c = 0; c < numChanged; c++)
+		{
+			if (sources[c] == 0)
+			{
+				const StrandVertex* vertices = strand->vertices();
+				for (int j = 0; j < numVerts; j++)
+				{
+					pDst[j*3]	  += dw[c] * vertices[j].position.x;
+					pDst[j*3 + 1] += dw[c] * vertices[j].position.y;
+					pDst[j*3 + 2] += dw[c] * vertices[j].position.z;
+				}
+			}
+			else
+			{
+				const float* pSrc = (const float*)&streams.position(sources[c], i, 0);
+				const __m128 w = _mm_set1_ps(dw[c]);
+				for (int f = 0; f < numFloats; f += 4)
+					_mm_storeu_ps(pDst + f, _mm_add_ps(_mm_loadu_ps(pDst + f), _mm_mul_ps(w, _mm_loadu_ps(pSrc + f))));
+			}
+		}
+	}
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+
+#include "QDXUT.h"
+#include "MorphDef.h"
+#include "HairStrandModel.h"
+
+class MorphStreams;
+
+// Morphed positions of all vertices of a morph level, blended in one pass so
+// stroke tools can look them up instead of blending vertex by vertex. The
+// blend is specialized for each number of sources (no per-vertex branching)
+// and runs 4 floats at a time with SSE.
+//
+// Positions are kept per strand with a stride of NUM_UNISAM_VERTICES, like the
+// morph streams; those past the end of a trimmed strand are meaningless.
+//
+// The last blend is cached with its weights and the edit version of the
+// strands. Blending again with the same version only adds dw*pos of the
+// sources whose weight changed (nothing if none did); a new version, i.e.
+// edited vertex positions, forces a full blend. Trimming strands does not
+// need a new version.
+class MorphBlender
+{
+public:
+	MorphBlender();
+
+	// Blend source 0 (vertices of the model) with the other sources of the
+	// streams. Missing weights count as 0.
+	void	blend(const HairStrandModel& model, const MorphStreams& streams,
+				  const std::vector<float>& weights, int editVersion);
+	void	clear();
+	void	invalidate()		{ m_editVersion = -1; }
+
+	bool	isEmpty() const		{ return m_numStrands < 1; }
+	int		numStrands() const	{ return m_numStrands; }
+
+	// sources evaluated by the last blend: 0 if cached, all if full
+	int		numSourcesBlended() const	{ return m_numSourcesBlended; }
+
+	// morphed (model space) position of vertex j of strand i
+	const XMFLOAT3&	position(int i, int j) const	{ return m_positions[i*NUM_UNISAM_VERTICES + j]; }
+
+private:
+
+	template <int K>
+	void	blendStrands(const HairStrandModel& model, const MorphStreams& streams,
+						 const float* weights, int begin, int end);
+
+	// add dw[c]*pos of the changed sources[c]
+	void	addDeltas(const HairStrandModel& model, const MorphStreams& streams,
+					  const int* sources, const float* dw, int numChanged, int begin, int end);
+
+	int						m_numStrands;
+	std::vector<XMFLOAT3>	m_positions;
+
+	// cached blend
+	int		m_numSources;
+	int		m_editVersion;
+	float	m_weights[MAX_NUM_MORPH_SRC];
+	int		m_numDeltas;			// incremental updates since the last full blend
+	int		m_numSourcesBlended;
+};
@@ -3,7 +3,7 @@
 #include <QFile>
 
 MorphController::MorphController(void)
-	: m_lockTransform(false)
+	: m_lockTransform(false), m_transformDirty(true)
 {
 }
 
@@ -19,13 +19,20 @@ void MorphController::setWeights(const std::vector<float>& weights)
 		printf("WARNING: weights.size do not match!\n");
 
 	const int minSize = std::min(m_weights.size(), weights.size());
-	for (int i = 0; i < minSize; i++)
-		m_weights[i] = weights[i];
-	for (int i = minSize; i < m_weights.size(); i++)
-		m_weights[i] = 0;
+	for (int i = 0; i < m_weights.size(); i++)
+	{
+		const float w = i < minSize ? weights[i] : 0;
+		if (w != m_weights[i])
+			m_transformDirty = true;
+		m_weights[i] = w;
+	}
 
-	if (!m_lockTransform)
+	// the transforms only depend on the weights
+	if (m_transformDirty && !m_lockTransform)
+	{
 		updateCurrTransforms();
+		m_transformDirty = false;
+	}
 }
 
 
@@ -107,6 +114,7 @@ bool MorphController::addSourceFromFile(QString coefFileName, int imgHeight)
 	m_srcTransforms.push_back(transform);
 
 	m_weights.resize(m_srcTransforms.size());
+	m_transformDirty = true;
 
 	return true;
 }
@@ -116,6 +124,7 @@ void MorphController::clear()
 {
 	m_srcTransforms.clear();
 	m_weights.clear();
+	m_transformDirty = true;
 }
 
 //bool MorphController::loadTransforms(QString srcFileName, int srcImgHeight, QString dstFileName, int dstImgHeight)
@@ -47,5 +47,6 @@ private:
 	XMFLOAT4X4	m_mWorld;
 
 	bool		m_lockTransform;
+	bool		m_transformDirty;	// weights changed since the last updateCurrTransforms
 };
 
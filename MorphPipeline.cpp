@@ -0,0 +1,302 @@
+#include "MorphPipeline.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+#include <QTime>
+
+#include <opencv2/core/core.hpp>
+
+#include "HairMorphHierarchy.h"
+
+
+PyramidParams::PyramidParams()
+	: numLevels(3)
+{
+	for (int i = 0; i < MaxLevels; i++)
+	{
+		clusterRatios[i] = 1;
+		relative[i] = true;
+	}
+}
+
+
+bool PyramidParams::isValid() const
+{
+	if (numLevels < 1 || numLevels > MaxLevels)
+		return false;
+
+	for (int i = 0; i < numLevels; i++)
+	{
+		if (clusterRatios[i] < 1)
+			return false;
+	}
+	return true;
+}
+
+
+std::vector<int> PyramidParams::levelSizes(int numStrands) const
+{
+	std::vector<int> sizes(std::min(std::max(numLevels, 1), (int)MaxLevels));
+
+	int lastSize = numStrands;
+	for (int i = 0; i < sizes.size(); i++)
+	{
+		sizes[i] = relative[i] ? lastSize / clusterRatios[i] : clusterRatios[i];
+		lastSize = sizes[i];
+	}
+	return sizes;
+}
+
+
+std::vector<int> PyramidParams::buildParams() const
+{
+	std::vector<int> params;
+	params.push_back(numLevels);
+	for (int i = 0; i < MaxLevels; i++)
+	{
+		params.push_back(clusterRatios[i]);
+		params.push_back(relative[i]);
+	}
+	return params;
+}
+
+
+MorphPipeline::MorphPipeline(HairMorphHierarchy* pHierarchy)
+	: m_pHierarchy(pHierarchy), m_bUseStrandWeights(false)
+{
+}
+
+
+MorphPipeline::~MorphPipeline()
+{
+	if (m_result.valid())
+	{
+		cancel();
+		m_result.wait();
+	}
+}
+
+
+bool MorphPipeline::run(int stages)
+{
+	wait();
+
+	m_cancel.reset();
+	return execute(stages);
+}
+
+
+std::shared_future<bool> MorphPipeline::start(int stages)
+{
+	wait();
+
+	if (stages & StageStrands)
+	{
+		printf("ERROR: morph strands cannot be generated in the background!\n");
+		std::promise<bool> refused;
+		refused.set_value(false);
+		m_result = refused.get_future().share();
+		return m_result;
+	}
+
+	m_cancel.reset();
+	m_result = std::async(std::launch::async, [this, stages]() { return execute(stages); }).share();
+	return m_result;
+}
+
+
+bool MorphPipeline::isRunning() const
+{
+	return m_result.valid() &&
+		   m_result.wait_for(std::chrono::milliseconds(0)) != std::future_status::ready;
+}
+
+
+bool MorphPipeline::wait()
+{
+	return m_result.valid() ? m_result.get() : true;
+}
+
+
+void MorphPipeline::updateBuffers()
+{
+	QTime timer;
+	timer.start();
+
+	std::vector<HairHierarchy>& sources = m_pHierarchy->sources();
+	for (int srcIdx = 0; srcIdx < sources.size(); srcIdx++)
+	{
+		for (int i = 0; i < sources[srcIdx].numLevels(); i++)
+			sources[srcIdx].level(i).updateBuffers();
+	}
+
+	printf("Source buffers updated. (%.3f s)\n", timer.elapsed()/1000.0f);
+}
+
+
+bool MorphPipeline::execute(int stages)
+{
+	if ((stages & StagePyramids) && !buildPyramids())
+		return false;
+	if ((stages & StageFlows) && !calcFlows())
+		return false;
+	if ((stages & StageStrands) && !generateStrands())
+		return false;
+
+	return true;
+}
+
+
+void MorphPipeline::reportProgress(Stage stage, int done, int total) const
+{
+	if (m_progress)
+		m_progress(stage, done, total);
+}
+
+
+// build pyramids for all source hair models using fixed k method
+bool MorphPipeline::buildPyramids()
+{
+	const int numSources = m_pHierarchy->numSources();
+	if (numSources < 1)
+	{
+		printf("ERROR: no source hair to build pyramids for!\n");
+		return false;
+	}
+	if (!m_params.isValid())
+	{
+		printf("ERROR: pyramids need 1 to %d levels with positive cluster ratios!\n", (int)PyramidParams::MaxLevels);
+		return false;
+	}
+
+	QTime timer;
+	timer.start();
+
+	reportProgress(StagePyramids, 0, numSources);
+
+	// one job per source, the slowest ones being unknown
+	std::atomic<int> numDone(0);
+	std::atomic<bool> failed(false);
+	TaskGroup group;
+	for (int srcIdx = 0; srcIdx < numSources; srcIdx++)
+	{
+		group.run([&, srcIdx]()
+		{
+			if (m_cancel.isCancelled())
+				return;
+
+			if (!buildPyramid(srcIdx))
+				failed = true;
+
+			reportProgress(StagePyramids, ++numDone, numSources);
+		});
+	}
+	group.wait();
+
+	if (m_cancel.isCancelled())
+	{
+		printf("\nClustering CANCELLED.\n");
+		return false;
+	}
+
+	printf("\nAll clustering done. (%.3f)\n", timer.elapsed()/1000.0f);
+	return !failed;
+}
+
+
+bool MorphPipeline::buildPyramid(int srcIdx)
+{
+	HairHierarchy& source = m_pHierarchy->sources()[srcIdx];
+	if (source.isEmpty() || source.level(0).numStrands() < 1)
+	{
+		printf("ERROR: source %d is empty!\n", srcIdx);
+		return false;
+	}
+
+	// load cached pyramid built from the same input and parameters (buffers
+	// are updated after the run, the immediate context being single-threaded)
+	const quint64 key = source.inputKey(m_params.buildParams());
+	if (!source.filename().isEmpty() &&
+		source.loadCache(source.filename() + ".hhc", key, false))
+		return true;
+
+	// level sizes from the input, level 0 being a random subset of it
+	const std::vector<int> levelSizes = m_params.levelSizes(source.level(0).numStrands());
+	const int newSize = levelSizes[0];
+
+	// resize hair model if necessary
+	if (newSize != source.level(0).numStrands())
+	{
+		// randomly pick k strands from level 0 strands and discard others
+		cv::RNG rng(srcIdx + 1);
+		HairStrandModel model;
+		model.reserve(newSize);
+
+		std::vector<int> indices(source.level(0).numStrands());
+		for (int i = 0; i < indices.size(); i++)
+			indices[i] = i;
+		for (int i = 0; i < newSize; i++)
+		{
+			int j = rng.uniform(i, (int)indices.size());
+			std::swap(indices[i], indices[j]);
+
+			model.addStrand(*(source.level(0).getStrandAt(indices[i])));
+		}
+		source.level(0) = model;
+		source.invalidateStrandWeights();
+		source.level(0).calcRootNbrs(32);
+	}
+
+	if (m_cancel.isCancelled())
+		return false;
+
+	// clustering starts from the default seed, as on a thread of its own,
+	// whichever worker runs it
+	cv::theRNG() = cv::RNG();
+
+	source.buildByFixedK(levelSizes);
+
+	if (!source.filename().isEmpty())
+		source.saveCache(source.filename() + ".hhc", key);
+
+	return true;
+}
+
+
+bool MorphPipeline::calcFlows()
+{
+	const int numSources = m_pHierarchy->numSources();
+	const int numPairs = numSources * (numSources - 1) / 2;
+	const int total = numPairs * (numSources > 0 ? m_pHierarchy->sources()[0].numLevels() : 0);
+
+	reportProgress(StageFlows, 0, total);
+
+	// levels done over all pairs
+	std::atomic<int> numDone(0);
+	m_pHierarchy->setFlowProgress([&](int, int, int, int)
+	{
+		reportProgress(StageFlows, ++numDone, total);
+	});
+
+	const bool ok = m_pHierarchy->calcAllSourceFlows(m_bUseStrandWeights, &m_cancel);
+
+	m_pHierarchy->setFlowProgress(HairMorphHierarchy::FlowProgressFunc());
+
+	return ok && !m_cancel.isCancelled();
+}
+
+
+bool MorphPipeline::generateStrands()
+{
+	if (m_cancel.isCancelled())
+		return false;
+
+	reportProgress(StageStrands, 0, 1);
+
+	m_pHierarchy->generateStrands();
+
+	reportProgress(StageStrands, 1, 1);
+	return m_pHierarchy->numLevels() > 0;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <functional>
+#include <future>
+#include <vector>
+
+#include "ThreadPool.h"
+
+class HairMorphHierarchy;
+
+// Sizes of the source pyramid levels. Level i keeps 1/clusterRatios[i] of the
+// strands of the level above (of the input for level 0) if relative[i], else
+// clusterRatios[i] strands.
+struct PyramidParams
+{
+	enum { MaxLevels = 3 };
+
+	int		numLevels;
+	int		clusterRatios[MaxLevels];
+	bool	relative[MaxLevels];
+
+	PyramidParams();
+
+	// 1 to MaxLevels levels with positive ratios
+	bool	isValid() const;
+
+	// sizes of the first numLevels levels (at most MaxLevels)
+	std::vector<int>	levelSizes(int numStrands) const;
+
+	// parameters identifying the build in the hierarchy cache
+	std::vector<int>	buildParams() const;
+};
+
+
+// Morph preprocessing as jobs on the thread pool: the source pyramids (loaded
+// from their cache or built concurrently), the pairwise flows and the morph
+// strands. It runs blocking, e.g. in batch, or in the background with a future
+// for the result. Callers only subscribe to progress, reported from worker
+// threads, and may cancel between jobs. The pyramid and flow jobs only touch
+// the CPU side; the device buffers are left to updateBuffers.
+class MorphPipeline
+{
+public:
+
+	enum Stage
+	{
+		StagePyramids	= 1,
+		StageFlows		= 2,
+		StageStrands	= 4,	// uploads buffers, so run() on the UI thread only
+		StageAll		= 7,
+	};
+
+	// work done of total in a stage (source pyramids, flow levels, strands)
+	typedef std::function<void(Stage stage, int done, int total)> ProgressFunc;
+
+	explicit MorphPipeline(HairMorphHierarchy* pHierarchy);
+	~MorphPipeline();		// cancels and waits for a background run
+
+	void	setPyramidParams(const PyramidParams& params)	{ m_params = params; }
+	void	setProgress(const ProgressFunc& func)			{ m_progress = func; }
+
+	void	setUseStrandWeights(bool use)		{ m_bUseStrandWeights = use; }
+
+	// Run the given stages (Stage flags) and return false if one failed or
+	// was cancelled.
+	bool	run(int stages);
+
+	// Same in the background; the future holds the result. StageStrands is
+	// refused, it needs the immediate context.
+	std::shared_future<bool>	start(int stages);
+
+	// Upload the buffers of all source pyramid levels, on the UI thread once
+	// a run is over (whether or not it succeeded).
+	void	updateBuffers();
+
+	bool	isRunning() const;
+	bool	wait();					// result of the background run
+
+	void	cancel()				{ m_cancel.cancel(); }
+	bool	isCancelled() const		{ return m_cancel.isCancelled(); }
+
+private:
+
+	MorphPipeline(const MorphPipeline&);
+	MorphPipeline& operator=(const MorphPipeline&);
+
+	bool	execute(int stages);
+
+	bool	buildPyramids();
+	bool	buildPyramid(int srcIdx);
+	bool	calcFlows();
+	bool	generateStrands();
+
+	void	reportProgress(Stage stage, int done, int total) const;
+
+	HairMorphHierarchy*		m_pHierarchy;
+
+	PyramidParams	m_params;
+	ProgressFunc	m_progress;
+	bool			m_bUseStrandWeights;
+
+	CancelToken					m_cancel;
+	std::shared_future<bool>	m_result;
+};
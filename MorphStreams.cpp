@@ -0,0 +1,290 @@
+#include "MorphStreams.h"
+
+#include <algorithm>
+#include <cstddef>
+
+#include "StrandBufferBuilder.h"
+#include "ParallelUtil.h"
+
+
+namespace
+{
+	inline uint quantizeChannel(float c)
+	{
+		return (uint)(std::min(std::max(c, 0.0f), 1.0f) * 255.0f + 0.5f);
+	}
+
+	// DXGI_FORMAT_R8G8B8A8_UNORM
+	inline uint packColor(const XMFLOAT4& c)
+	{
+		return quantizeChannel(c.x) | (quantizeChannel(c.y) << 8) |
+			   (quantizeChannel(c.z) << 16) | (quantizeChannel(c.w) << 24);
+	}
+
+	// filled with UpdateSubresource
+	bool createStream(uint numBytes, ID3D11Buffer** ppBuffer)
+	{
+		D3D11_BUFFER_DESC buffDesc = {0};
+		buffDesc.BindFlags		= D3D11_BIND_VERTEX_BUFFER;
+		buffDesc.ByteWidth		= numBytes;
+		buffDesc.Usage			= D3D11_USAGE_DEFAULT;
+		buffDesc.CPUAccessFlags = 0;
+
+		return S_OK == QDXUT::device()->CreateBuffer(&buffDesc, NULL, ppBuffer);
+	}
+}
+
+
+MorphStreams::MorphStreams()
+	: m_numSources(0), m_numStrands(0), m_quantizeColors(false)
+{
+	for (int k = 0; k < MAX_NUM_MORPH_SRC; k++)
+	{
+		m_pPositionBuffers[k] = NULL;
+		m_pColorBuffers[k]	  = NULL;
+	}
+}
+
+
+MorphStreams::~MorphStreams()
+{
+	release();
+}
+
+
+void MorphStreams::create(int numSources, int numStrands, bool quantizeColors)
+{
+	clear();
+
+	m_numSources	 = std::min(std::max(numSources, 0), MAX_NUM_MORPH_SRC);
+	m_numStrands	 = numStrands;
+	m_quantizeColors = quantizeColors;
+
+	for (int k = 1; k < m_numSources; k++)
+	{
+		m_positions[k].resize(numStrands * NUM_UNISAM_VERTICES);
+		m_colors[k].resize(numStrands * NUM_UNISAM_VERTICES);
+	}
+}
+
+
+void MorphStreams::clear()
+{
+	release();
+
+	for (int k = 0; k < MAX_NUM_MORPH_SRC; k++)
+	{
+		std::vector<XMFLOAT3>().swap(m_positions[k]);
+		std::vector<XMFLOAT4>().swap(m_colors[k]);
+	}
+	m_numSources = 0;
+	m_numStrands = 0;
+}
+
+
+void MorphStreams::release()
+{
+	for (int k = 0; k < MAX_NUM_MORPH_SRC; k++)
+	{
+		SAFE_RELEASE(m_pPositionBuffers[k]);
+		SAFE_RELEASE(m_pColorBuffers[k]);
+	}
+	m_uploadOffsets.clear();
+}
+
+
+XMFLOAT3 MorphStreams::morphPosition(const XMFLOAT3& pos0, int i, int j,
+									 const std::vector<float>& weights) const
+{
+	const int numSources = std::min(m_numSources, (int)weights.size());
+
+	XMFLOAT3 pos(pos0.x * weights[0], pos0.y * weights[0], pos0.z * weights[0]);
+	for (int k = 1; k < numSources; k++)
+	{
+		const XMFLOAT3& posK = position(k, i, j);
+		pos.x += posK.x * weights[k];
+		pos.y += posK.y * weights[k];
+		pos.z += posK.z * weights[k];
+	}
+	return pos;
+}
+
+
+bool MorphStreams::updateBuffers(const HairStrandModel& model)
+{
+	const StrandBufferBuilder* pLayout = model.bufferBuilder();
+	if (m_numSources < 2 || pLayout->numVertices() < 1)
+	{
+		release();
+		return true;
+	}
+
+	if (pLayout->numStrands() != m_numStrands)
+	{
+		printf("ERROR: morph streams have %d strands, model has %d!\n", m_numStrands, pLayout->numStrands());
+		release();
+		return false;
+	}
+
+	if (!m_pPositionBuffers[1])
+		return createBuffers(pLayout);
+
+	// strands before the first one whose length changed keep their place
+	int first = 0;
+	while (first < m_numStrands && m_uploadOffsets[first + 1] == pLayout->vertexOffset(first + 1))
+		first++;
+
+	return first == m_numStrands || updateStrandRange(pLayout, first);
+}
+
+
+bool MorphStreams::createBuffers(const StrandBufferBuilder* pLayout)
+{
+	release();
+
+	// room for all strands at full length
+	const uint capacity = m_numStrands * NUM_UNISAM_VERTICES;
+
+	for (int k = 1; k < m_numSources; k++)
+	{
+		const bool created =
+			createStream(sizeof(XMFLOAT3)*capacity, &m_pPositionBuffers[k]) &&
+			createStream((m_quantizeColors ? sizeof(uint) : sizeof(XMFLOAT4))*capacity, &m_pColorBuffers[k]);
+		if (!created)
+		{
+			release();
+			return false;
+		}
+	}
+
+	return updateStrandRange(pLayout, 0);
+}
+
+
+// Gather strands [first, numStrands) of every source in buffer order and
+// upload them from the vertex of strand first on.
+bool MorphStreams::updateStrandRange(const StrandBufferBuilder* pLayout, int first)
+{
+	const uint vStart	= pLayout->vertexOffset(first);
+	const uint numVerts = pLayout->numVertices() - vStart;
+	if (pLayout->numVertices() > m_numStrands * NUM_UNISAM_VERTICES)
+	{
+		printf("ERROR: morph strands are longer than %d vertices!\n", NUM_UNISAM_VERTICES);
+		release();
+		return false;
+	}
+
+	std::vector<XMFLOAT3> positions(numVerts);
+	std::vector<XMFLOAT4> colors(m_quantizeColors ? 0 : numVerts);
+	std::vector<uint>	  colors8(m_quantizeColors ? numVerts : 0);
+
+	ID3D11DeviceContext* pContext = QDXUT::immediateContext();
+
+	for (int k = 1; k < m_numSources; k++)
+	{
+		ParallelUtil::parallelFor(first, m_numStrands, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+			{
+				const uint dst = pLayout->vertexOffset(i) - vStart;
+				const int  n   = pLayout->vertexOffset(i + 1) - pLayout->vertexOffset(i);
+				const int  src = i * NUM_UNISAM_VERTICES;
+
+				std::copy(m_positions[k].begin() + src, m_positions[k].begin() + src + n,
+						  positions.begin() + dst);
+
+				if (m_quantizeColors)
+				{
+					for (int j = 0; j < n; j++)
+						colors8[dst + j] = packColor(m_colors[k][src + j]);
+				}
+				else
+				{
+					std::copy(m_colors[k].begin() + src, m_colors[k].begin() + src + n,
+							  colors.begin() + dst);
+				}
+			}
+		}, 64);
+
+		D3D11_BOX box = {sizeof(XMFLOAT3)*vStart, 0, 0, sizeof(XMFLOAT3)*(vStart + numVerts), 1, 1};
+		pContext->UpdateSubresource(m_pPositionBuffers[k], 0, &box, positions.data(), 0, 0);
+
+		const uint colorSize = m_quantizeColors ? sizeof(uint) : sizeof(XMFLOAT4);
+		box.left  = colorSize*vStart;
+		box.right = colorSize*(vStart + numVerts);
+		pContext->UpdateSubresource(m_pColorBuffers[k], 0, &box,
+									m_quantizeColors ? (const void*)colors8.data() : (const void*)colors.data(), 0, 0);
+	}
+
+	m_uploadOffsets.resize(m_numStrands + 1);
+	for (int i = first; i <= m_numStrands; i++)
+		m_uploadOffsets[i] = pLayout->vertexOffset(i);
+
+	return true;
+}
+
+
+void MorphStreams::bind() const
+{
+	if (m_numSources < 2 || !m_pPositionBuffers[1])
+		return;
+
+	ID3D11DeviceContext* pContext = QDXUT::immediateContext();
+
+	const UINT positionStride = sizeof(XMFLOAT3);
+	const UINT colorStride	  = m_quantizeColors ? sizeof(uint) : sizeof(XMFLOAT4);
+	const UINT offset		  = 0;
+
+	for (int k = 1; k < m_numSources; k++)
+	{
+		pContext->IASetVertexBuffers(k, 1, &m_pPositionBuffers[k], &positionStride, &offset);
+		pContext->IASetVertexBuffers(m_numSources - 1 + k, 1, &m_pColorBuffers[k], &colorStride, &offset);
+	}
+}
+
+
+uint MorphStreams::vertexSize(int numSources, bool quantizeColors)
+{
+	// source 0 reads position, color and texcoord of the strand vertex
+	const uint size0 = sizeof(XMFLOAT3) + sizeof(XMFLOAT4) + sizeof(XMFLOAT2);
+	return size0 + (numSources - 1) * (sizeof(XMFLOAT3) + (quantizeColors ? sizeof(uint) : sizeof(XMFLOAT4)));
+}
+
+
+void MorphStreams::inputElements(int numSources, bool quantizeColors,
+								 std::vector<D3D11_INPUT_ELEMENT_DESC>& elements)
+{
+	elements.clear();
+
+	D3D11_INPUT_ELEMENT_DESC elem = {"POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0};
+
+	// source 0 and texcoords from the strand vertex buffer
+	elem.AlignedByteOffset = offsetof(StrandVertex, position);
+	elements.push_back(elem);
+
+	elem.SemanticName	   = "COLOR";
+	elem.Format			   = DXGI_FORMAT_R32G32B32A32_FLOAT;
+	elem.AlignedByteOffset = offsetof(StrandVertex, color);
+	elements.push_back(elem);
+
+	elem.SemanticName	   = "TEXCOORD";
+	elem.Format			   = DXGI_FORMAT_R32G32_FLOAT;
+	elem.AlignedByteOffset = offsetof(StrandVertex, texcoord);
+	elements.push_back(elem);
+
+	// one position and one color stream per other source
+	elem.AlignedByteOffset = 0;
+	for (int k = 1; k < numSources; k++)
+	{
+		elem.SemanticName  = "POSITION";
+		elem.SemanticIndex = k;
+		elem.Format		   = DXGI_FORMAT_R32G32B32_FLOAT;
+		elem.InputSlot	   = k;
+		elements.push_back(elem);
+
+		elem.SemanticName  = "COLOR";
+		elem.Format		   = quantizeColors ? DXGI_FORMAT_R8G8B8A8_UNORM : DXGI_FORMAT_R32G32B32A32_FLOAT;
+		elem.InputSlot	   = numSources - 1 + k;
+		elements.push_back(elem);
+	}
+}
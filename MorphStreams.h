@@ -0,0 +1,79 @@
+#pragma once
+
+#include <vector>
+
+#include "QDXUT.h"
+#include "MorphDef.h"
+#include "HairStrandModel.h"
+
+// Vertex streams of the morphable strands. Source 0 is the strand model itself
+// (position and color of its StrandVertex buffer, input slot 0). Each other
+// source k has its own position stream (slot k) and color stream (slot
+// numSources-1+k), optionally quantized to 8-bit RGBA, so the vertex size grows
+// with the number of sources and plain strand models carry none of it.
+//
+// Stream data are kept per strand with a stride of NUM_UNISAM_VERTICES, so
+// trimming strands of the model leaves them valid; only the upload follows the
+// model's buffer layout.
+class MorphStreams
+{
+public:
+	MorphStreams();
+	~MorphStreams();
+
+	void	create(int numSources, int numStrands, bool quantizeColors);
+	void	clear();
+	void	release();
+
+	bool	isEmpty() const				{ return m_numSources < 1; }
+
+	int		numSources() const			{ return m_numSources; }
+	int		numStrands() const			{ return m_numStrands; }
+	bool	hasQuantizedColors() const	{ return m_quantizeColors; }
+
+	// vertex j of strand i in source k (1 <= k < numSources)
+	XMFLOAT3&		position(int k, int i, int j)		{ return m_positions[k][i*NUM_UNISAM_VERTICES + j]; }
+	const XMFLOAT3&	position(int k, int i, int j) const	{ return m_positions[k][i*NUM_UNISAM_VERTICES + j]; }
+	XMFLOAT4&		color(int k, int i, int j)			{ return m_colors[k][i*NUM_UNISAM_VERTICES + j]; }
+	const XMFLOAT4&	color(int k, int i, int j) const	{ return m_colors[k][i*NUM_UNISAM_VERTICES + j]; }
+
+	// Morphed position of vertex j of strand i, pos0 being its source 0 position
+	XMFLOAT3	morphPosition(const XMFLOAT3& pos0, int i, int j, const std::vector<float>& weights) const;
+
+	// Upload the streams in the buffer layout of the model (after its
+	// updateBuffers), and bind them to their input slots before rendering it.
+	// The stream data do not change with the model, so once uploaded only a
+	// new layout is followed, from the first strand whose length changed.
+	bool	updateBuffers(const HairStrandModel& model);
+	void	bind() const;
+
+	// Bytes per vertex of a morph vertex (all slots, source 0 included)
+	static uint	vertexSize(int numSources, bool quantizeColors);
+
+	// Input elements of the streams for the given number of sources, matching
+	// StrandMorphVertexIn<numSources> of the StrandMorphColor<numSources> technique
+	static void	inputElements(int numSources, bool quantizeColors,
+							  std::vector<D3D11_INPUT_ELEMENT_DESC>& elements);
+
+private:
+
+	MorphStreams(const MorphStreams&);
+	MorphStreams& operator=(const MorphStreams&);
+
+	bool	createBuffers(const StrandBufferBuilder* pLayout);
+	bool	updateStrandRange(const StrandBufferBuilder* pLayout, int first);
+
+	int		m_numSources;
+	int		m_numStrands;
+	bool	m_quantizeColors;
+
+	// sources 1..numSources-1 (index 0 unused)
+	std::vector<XMFLOAT3>	m_positions[MAX_NUM_MORPH_SRC];
+	std::vector<XMFLOAT4>	m_colors[MAX_NUM_MORPH_SRC];
+
+	// sized for full strands, so trimming or restoring them keeps the buffers
+	ID3D11Buffer*	m_pPositionBuffers[MAX_NUM_MORPH_SRC];
+	ID3D11Buffer*	m_pColorBuffers[MAX_NUM_MORPH_SRC];
+
+	std::vector<uint>	m_uploadOffsets;	// vertex offsets of the uploaded layout
+};
@@ -6,12 +6,11 @@
 #include <QImage>
 #include <QSettings>
 #include <QMessageBox>
+#include <QTime>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
-#include <ANN/ANN.h>
-
 #include "QDXMeshObject.h"
 #include "QDXCamera.h"
 #include "QDXLight.h"
@@ -36,6 +35,7 @@
 #include "HairHierarchy.h"
 #include "HeadMorphRenderer.h"
 #include "HairMorphRenderer.h"
+#include "StrokeTools.h"
 
 
 MyScene::MyScene(void)
@@ -167,6 +167,11 @@ MyScene::MyScene(void)
 	m_strokeIntensity = 1;
 	m_strokeFuzziness = 2;
 	m_strokeLevel = 0;
+
+	m_strokeGridLevel = -1;
+	m_strokeGridMorphed = false;
+	m_strokeGridVersion = -1;
+	m_strokeGridCellSize = 0;
 }
 
 
@@ -442,6 +447,18 @@ bool MyScene::handleEvent(QEvent* event)
 			m_strokeMode = CutStroke;
 			printf("CutStroke selected.\n");
 		}
+		else if (keyEvent->key() == Qt::Key_Z && (keyEvent->modifiers() & Qt::ControlModifier))
+		{
+			if (m_pMorphHierarchy->undoStroke())
+				printf("Stroke undone.\n");
+			return true;
+		}
+		else if (keyEvent->key() == Qt::Key_Y && (keyEvent->modifiers() & Qt::ControlModifier))
+		{
+			if (m_pMorphHierarchy->redoStroke())
+				printf("Stroke redone.\n");
+			return true;
+		}
 	}
 
 	return false;
@@ -2079,124 +2096,52 @@ void MyScene::strokeDrawn()
 }
 
 
-void calcMorphVertexPosition(const StrandVertex& vertex, const std::vector<float>& weights, XMFLOAT3& pos)
+const ScreenGrid& MyScene::strokeGrid(int levelIdx, bool morphed)
 {
-	pos = vertex.position;
-	pos.x *= weights[0];
-	pos.y *= weights[0];
-	pos.z *= weights[0];
-	
-	const int numSources = weights.size();
-	switch (numSources)
-	{
-	case 2:
-		pos.x += vertex.tangent.x * weights[1];
-		pos.y += vertex.tangent.y * weights[1];
-		pos.z += vertex.tangent.z * weights[1];
-		break;
-
-	case 3:
-		pos.x += vertex.tangent.x * weights[1];
-		pos.y += vertex.tangent.y * weights[1];
-		pos.z += vertex.tangent.z * weights[1];
-		pos.x += vertex.pos2.x * weights[2];
-		pos.y += vertex.pos2.y * weights[2];
-		pos.z += vertex.pos2.z * weights[2];
-		break;
-
-	case 4:
-		pos.x += vertex.tangent.x * weights[1];
-		pos.y += vertex.tangent.y * weights[1];
-		pos.z += vertex.tangent.z * weights[1];
-		pos.x += vertex.pos2.x * weights[2];
-		pos.y += vertex.pos2.y * weights[2];
-		pos.z += vertex.pos2.z * weights[2];
-		pos.x += vertex.pos3.x * weights[3];
-		pos.y += vertex.pos3.y * weights[3];
-		pos.z += vertex.pos3.z * weights[3];
-		break;
-
-	case 5:
-		pos.x += vertex.tangent.x * weights[1];
-		pos.y += vertex.tangent.y * weights[1];
-		pos.z += vertex.tangent.z * weights[1];
-		pos.x += vertex.pos2.x * weights[2];
-		pos.y += vertex.pos2.y * weights[2];
-		pos.z += vertex.pos2.z * weights[2];
-		pos.x += vertex.pos3.x * weights[3];
-		pos.y += vertex.pos3.y * weights[3];
-		pos.z += vertex.pos3.z * weights[3];
-		pos.x += vertex.pos4.x * weights[4];
-		pos.y += vertex.pos4.y * weights[4];
-		pos.z += vertex.pos4.z * weights[4];
-		break;
-	}
+	const HairStrandModel& model = m_pMorphHierarchy->level(levelIdx);
+	const XMFLOAT4X4& world = *m_morphCtrl.worldTransform();
+	const std::vector<float>& weights = m_morphCtrl.weights();
+	const float cellSize = (float)std::max(m_strokeRadius, 1);
+
+	// same view, weights and strands as the last stroke?
+	if (m_strokeGridLevel == levelIdx && m_strokeGridMorphed == morphed &&
+		m_strokeGridVersion == m_pMorphHierarchy->editVersion() &&
+		m_strokeGrid.numStrands() == model.numStrands() && m_strokeGridCellSize == cellSize &&
+		memcmp(&m_strokeGridWorld, &world, sizeof(XMFLOAT4X4)) == 0 &&
+		(!morphed || m_strokeGridWeights == weights))
+		return m_strokeGrid;
+
+	const MorphBlender* pBlended = morphed ? &m_pMorphHierarchy->blendMorphPositions(weights) : NULL;
+	StrokeTools::buildStrokeGrid(model, pBlended, world, cellSize, m_strokeGrid);
+
+	m_strokeGridLevel	 = levelIdx;
+	m_strokeGridMorphed	 = morphed;
+	m_strokeGridVersion	 = m_pMorphHierarchy->editVersion();
+	m_strokeGridCellSize = cellSize;
+	m_strokeGridWorld	 = world;
+	m_strokeGridWeights	 = weights;
+
+	return m_strokeGrid;
 }
 
 
 void MyScene::deleteStrokeDrawn()
 {
 	printf("Applying delete stroke...");
-	const int numPts = m_pStrokesSprite->numPoints();
-
-	// add stroke points to a kd-tree
-	ANNpointArray annPts = annAllocPts(numPts, 2);
-	for (int i = 0; i < numPts; i++)
-	{
-		annPts[i][0] = m_pStrokesSprite->point(i).x;
-		annPts[i][1] = m_pStrokesSprite->point(i).y;
-	}
-	ANNkd_tree* kdTree = new ANNkd_tree(annPts, numPts, 2);
-	ANNpoint query = annAllocPt(2);
-	ANNidx annIdx[1];
-	ANNdist annDist[1];
+	QTime timer;
+	timer.start();
 
-	// Get transform matrices
-	XMMATRIX world = XMLoadFloat4x4(m_morphCtrl.worldTransform());
+	std::vector<StrokeHit> hits;
+	strokeGrid(0, true).findStrokeHits(m_pStrokesSprite->points(), m_pStrokesSprite->numPoints(),
+									   (float)m_strokeRadius, hits);
 
-	const float sqRad = m_strokeRadius * m_strokeRadius;
-
-	int numSources = m_pMorphHierarchy->numSources();
-
-	// for each hair strand	
-	int numChanges = 0;
-	HairStrandModel& model = m_pMorphHierarchy->level(0);
-	for (int i = 0; i < model.numStrands(); i++)
-	{
-		StrandVertex* vertices = model.getStrandAt(i)->vertices();
-
-		// for each vertex...
-		for (int j = 0; j < model.getStrandAt(i)->numVertices(); j++)
-		{
-			// transform vertex to screen space...
-			XMFLOAT3 pos;
-			calcMorphVertexPosition(vertices[j], m_morphCtrl.weights(), pos);
-
-			XMVECTOR vec = XMLoadFloat3(&pos);
-			vec = XMVector3Transform(vec, world);
-
-			XMStoreFloat3(&pos, vec);
-
-			query[0] = pos.x;
-			query[1] = -pos.y;
-
-			if (kdTree->annkFRSearch(query, sqRad, 1, annIdx, annDist) > 0)
-			{
-				// found a valid vertex!
-				model.getStrandAt(i)->trim(0);
-				numChanges++;
-			}
-		}
-	}
-
-	delete kdTree;
-	annDeallocPt(query);
-	annDeallocPts(annPts);
+	const int numChanges = StrokeTools::deleteStrands(m_pMorphHierarchy->level(0), 0, hits,
+													  m_pMorphHierarchy->strokeJournal());
 
 	if (numChanges > 0)
-		model.updateBuffers();
+		m_pMorphHierarchy->updateMorphBuffers();
 
-	printf("DONE.\n");
+	printf("DONE. (%d strands, %.3f s)\n", numChanges, (float)timer.elapsed()/1000.0f);
 }
 
 void MyScene::combStrokeDrawn()
@@ -2208,290 +2153,57 @@ void MyScene::combStrokeDrawn()
 	}
 
 	printf("Applying combing stroke...");
-	const int numPts = m_pStrokesSprite->numPoints();
-	XMFLOAT2* strokePts = m_pStrokesSprite->points();
+	QTime timer;
+	timer.start();
 
-	// add stroke points to a kd-tree
-	ANNpointArray annPts = annAllocPts(numPts, 2);
-	for (int i = 0; i < numPts; i++)
-	{
-		annPts[i][0] = m_pStrokesSprite->point(i).x;
-		annPts[i][1] = m_pStrokesSprite->point(i).y;
-	}
-	ANNkd_tree* kdTree = new ANNkd_tree(annPts, numPts, 2);
-	ANNpoint query = annAllocPt(2);
-	ANNidx annIdx[1];
-	ANNdist annDist[1];
-
-	// Get transform matrices
-	XMMATRIX world = XMLoadFloat4x4(m_morphCtrl.worldTransform());
-
-	// Compute inverse transform
-	XMVECTOR det;
-	XMMATRIX invWorld = XMMatrixInverse(&det, world);
-
-	// smooth stroke
-	std::vector<XMFLOAT2> tempPts(numPts);
-	tempPts.front() = strokePts[0];
-	tempPts.back() = strokePts[numPts-1];
-	for (int pass = 0; pass < 5; pass++)
-	{
-		for (int i = 1; i < numPts - 1; i++)
-		{
-			tempPts[i].x = strokePts[i-1].x*0.25f + strokePts[i].x*0.5f + strokePts[i+1].x*0.25f;
-			tempPts[i].y = strokePts[i-1].y*0.25f + strokePts[i].y*0.5f + strokePts[i+1].y*0.25f;
-		}
-		memcpy(strokePts, tempPts.data(), sizeof(XMFLOAT2)*numPts);
-	}
+	// vertices under the (unsmoothed) stroke
+	std::vector<StrokeHit> hits;
+	strokeGrid(m_strokeLevel, false).findStrokeHits(m_pStrokesSprite->points(), m_pStrokesSprite->numPoints(),
+													(float)m_strokeRadius, hits);
 
-	// compute direction at each stroke point
-	std::vector<XMFLOAT2> strokeDirs(numPts);
-	strokeDirs[0].x = strokePts[1].x - strokePts[0].x;
-	strokeDirs[0].y = strokePts[1].y - strokePts[0].y;
-	for (int i = 1; i < numPts; i++)
-	{
-		strokeDirs[i].x = strokePts[i].x - strokePts[i-1].x;
-		strokeDirs[i].y = strokePts[i].y - strokePts[i-1].y;
-		strokeDirs[i].y = -strokeDirs[i].y;
-	}
-	// smooth direction
-	std::vector<XMFLOAT2> tempDirs(numPts);
-	tempDirs.front() = strokeDirs.front();
-	tempDirs.back() = strokeDirs.back();
-	for (int pass = 0; pass < 8; pass++)
-	{
-		tempDirs[0].x = 0.5f*(strokeDirs[0].x + strokeDirs[1].x);
-		tempDirs[0].y = 0.5f*(strokeDirs[0].y + strokeDirs[1].y);
-		tempDirs.back().x = 0.5f*(strokeDirs[numPts-1].x + strokeDirs[numPts-2].x);
-		tempDirs.back().x = 0.5f*(strokeDirs[numPts-1].y + strokeDirs[numPts-2].y);
-		for (int i = 1; i < numPts - 1; i++)
-		{
-			tempDirs[i].x = 0.333f*(strokeDirs[i-1].x + strokeDirs[i].x + strokeDirs[i+1].x);
-			tempDirs[i].y = 0.333f*(strokeDirs[i-1].y + strokeDirs[i].y + strokeDirs[i+1].y);
-		}
-		memcpy(strokeDirs.data(), tempDirs.data(), sizeof(XMFLOAT2)*numPts);
-	}
-	// normalize and apply intensity
-	for (int i = 0; i < numPts; i++)
-	{
-		float len = sqrtf(strokeDirs[i].x*strokeDirs[i].x + strokeDirs[i].y*strokeDirs[i].y);
-		if (len > 0.00001f)
-		{
-			strokeDirs[i].x *= m_strokeIntensity / len;
-			strokeDirs[i].y *= m_strokeIntensity / len;
-		}
-	}
-
-
-	const float sqRad = m_strokeRadius * m_strokeRadius;
-
-	// for each hair strand	
-	int numChanges = 0;
 	HairStrandModel& model = m_pMorphHierarchy->level(m_strokeLevel);
 
-	std::vector<XMFLOAT3> projPos, newProjPos;
-	projPos.reserve(NUM_UNISAM_VERTICES);
-	newProjPos.reserve(NUM_UNISAM_VERTICES);
-
-	for (int i = 0; i < model.numStrands(); i++)
-	{
-		Strand* strand = model.getStrandAt(i);
-		StrandVertex* vertices = strand->vertices();
-
-		// Transform to world space
-		projPos.resize(strand->numVertices());
-		for (int j = 0; j < strand->numVertices(); j++)
-		{
-			XMVECTOR vec = XMLoadFloat3(&(vertices[j].position));
-			XMStoreFloat3(&(projPos[j]), XMVector3Transform(vec, world));
-		}
-
-		newProjPos.resize(strand->numVertices());
-		newProjPos[0] = projPos[0];
-		newProjPos[1] = projPos[1];
-
-		// for each intermediate vertex...
-		bool isModified = false;
-		for (int j = 1; j < strand->numVertices() - 1; j++)
-		{
-			query[0] = projPos[j].x;
-			query[1] = -projPos[j].y;
-
-			if (kdTree->annkFRSearch(query, sqRad, 1, annIdx, annDist) > 0)
-			{
-				XMFLOAT2 newDir;
-				transformJointAngleXY(projPos.data(), newProjPos.data(), j, &newDir);
-
-				float dirLen = sqrtf(newDir.x*newDir.x + newDir.y*newDir.y);
-				if (dirLen > 0.0000001f)
-				{
-					newDir.x /= dirLen;
-					newDir.y /= dirLen;
-				}
-
-				// Add comb's influence (with a fall-off from stroke center)
-				float w = expf(-3.0f*annDist[0]/sqRad);
-				newDir.x += strokeDirs[annIdx[0]].x * w;
-				newDir.y += strokeDirs[annIdx[0]].y * w;
-
-				normalizeFloat2(newDir);
-				
-				// update next vertex
-				newProjPos[j+1].x = newProjPos[j].x + newDir.x*dirLen;
-				newProjPos[j+1].y = newProjPos[j].y + newDir.y*dirLen;
-				newProjPos[j+1].z = projPos[j+1].z;
-
-				isModified = true;
-				numChanges++;
-			}
-			else
-			{
-				if (isModified)
-				{
-					XMFLOAT2 newDir;
-					transformJointAngleXY(projPos.data(), newProjPos.data(), j, &newDir);
-
-					newProjPos[j+1].x = newProjPos[j].x + newDir.x;
-					newProjPos[j+1].y = newProjPos[j].y + newDir.y;
-					newProjPos[j+1].z = projPos[j+1].z;
-				}
-				else
-					newProjPos[j+1] = projPos[j+1];
-			}
-		} // end for each vertex
-
-		// transform back to world space
-		for (int j = 2; j < strand->numVertices(); j++)
-		{
-			XMVECTOR vec = XMLoadFloat3(&(newProjPos[j]));
-			XMStoreFloat3(&(vertices[j].position), XMVector3Transform(vec, invWorld));
-
-		}
-	} // end for each strand
-
-	delete kdTree;
-	annDeallocPt(query);
-	annDeallocPts(annPts);
+	int firstModified, lastModified;
+	const int numChanges = StrokeTools::combStrands(model, m_strokeLevel, hits,
+													m_pStrokesSprite->points(), m_pStrokesSprite->numPoints(),
+													(float)m_strokeRadius, m_strokeIntensity,
+													*m_morphCtrl.worldTransform(), m_pMorphHierarchy->strokeJournal(),
+													firstModified, lastModified);
 
 	if (numChanges > 0)
-		model.updateBuffers();
-
-	printf("DONE.\n");
-}
-
-
-inline void MyScene::normalizeFloat2(XMFLOAT2& vec)
-{
-	float len = vec.x*vec.x + vec.y*vec.y;
-	if (len > 0.0000001f)
 	{
-		vec.x /= len;
-		vec.y /= len;
-	}
-}
-
+		// only the combed strands need to be uploaded
+		model.markStrandsDirty(firstModified, lastModified + 1);
+		model.updateBuffers();
 
-void MyScene::transformJointAngleXY(const XMFLOAT3* origVerts, const XMFLOAT3* newVerts,
-										int vId, XMFLOAT2* pNewDir)
-{
-	XMFLOAT2 origDir(origVerts[vId+1].x - origVerts[vId].x, 
-					 origVerts[vId+1].y - origVerts[vId].y);
+		if (m_strokeLevel == 0)
+			m_pMorphHierarchy->markStrandsEdited();
 
-	XMFLOAT2 origTangent(origVerts[vId].x - origVerts[vId-1].x, 
-						 origVerts[vId].y - origVerts[vId-1].y);
-	float origLen = sqrtf(origTangent.x*origTangent.x + origTangent.y*origTangent.y);
-	if (origLen < 0.000001f)
-	{
-		*pNewDir = origDir;
-		return;
+		// vertices moved
+		m_strokeGridLevel = -1;
 	}
 
-	XMFLOAT2 newTangent(newVerts[vId].x - newVerts[vId-1].x, 
-						newVerts[vId].y - newVerts[vId-1].y);
-	float newLen = sqrtf(newTangent.x*newTangent.x + newTangent.y*newTangent.y);
-	if (newLen < 0.0000001f)
-	{
-		*pNewDir = origDir;
-		return;
-	}
-
-	// relative input angle
-	origDir.x /= origLen;
-	origDir.y /= origLen;
-	XMFLOAT2 origNormal(origTangent.y, -origTangent.x);
-	XMFLOAT2 origRelDir(origDir.x*origTangent.x + origDir.y*origTangent.y,
-						origDir.x*origNormal.x  + origDir.y*origNormal.y);
-
-	// absolute new angle
-	newTangent.x /= newLen;
-	newTangent.y /= newLen;
-	XMFLOAT2 newNormal(newTangent.y, -newTangent.x);
-	pNewDir->x = origRelDir.x*newTangent.x + origRelDir.y*newNormal.x;
-	pNewDir->y = origRelDir.x*newTangent.y + origRelDir.y*newNormal.y;
+	printf("DONE. (%d vertices, %.3f s)\n", numChanges, (float)timer.elapsed()/1000.0f);
 }
 
 void MyScene::cutStrokeDrawn()
 {
 	printf("Applying cut stroke...");
-	const int numPts = m_pStrokesSprite->numPoints();
+	QTime timer;
+	timer.start();
 
-	// add stroke points to a kd-tree
-	ANNpointArray annPts = annAllocPts(numPts, 2);
-	for (int i = 0; i < numPts; i++)
-	{
-		annPts[i][0] = m_pStrokesSprite->point(i).x;
-		annPts[i][1] = m_pStrokesSprite->point(i).y;
-	}
-	ANNkd_tree* kdTree = new ANNkd_tree(annPts, numPts, 2);
-	ANNpoint query = annAllocPt(2);
-	ANNidx annIdx[1];
-	ANNdist annDist[1];
+	std::vector<StrokeHit> hits;
+	strokeGrid(0, true).findStrokeHits(m_pStrokesSprite->points(), m_pStrokesSprite->numPoints(),
+									   (float)m_strokeRadius, hits);
 
-	// Get transform matrices
-	XMMATRIX world = XMLoadFloat4x4(m_morphCtrl.worldTransform());
+	// cut locations are random per strand, so they do not depend on threads
+	const unsigned strokeSeed = cv::theRNG().next();
 
-	const float sqRad = m_strokeRadius * m_strokeRadius;
-
-	// for each hair strand	
-	int numChanges = 0;
-	HairStrandModel& model = m_pMorphHierarchy->level(0);
-	for (int i = 0; i < model.numStrands(); i++)
-	{
-		StrandVertex* vertices = model.getStrandAt(i)->vertices();
-
-		// for each vertex...
-		for (int j = 0; j < model.getStrandAt(i)->numVertices(); j++)
-		{
-			// transform vertex to screen space...
-			XMFLOAT3 pos;
-			calcMorphVertexPosition(vertices[j], m_morphCtrl.weights(), pos);
-
-			XMVECTOR vec = XMLoadFloat3(&pos);
-			vec = XMVector3Transform(vec, world);
-
-			XMStoreFloat3(&pos, vec);
-
-			query[0] = pos.x;
-			query[1] = -pos.y;
-
-			if (kdTree->annkFRSearch(query, sqRad, 1, annIdx, annDist) > 0)
-			{
-				// found a valid vertex!
-
-				// random location
-				int d = cv::theRNG().uniform(-m_strokeFuzziness, m_strokeFuzziness+1);
-				model.getStrandAt(i)->trim(j+d);
-				numChanges++;
-			}
-		}
-	}
-
-	delete kdTree;
-	annDeallocPt(query);
-	annDeallocPts(annPts);
+	const int numChanges = StrokeTools::cutStrands(m_pMorphHierarchy->level(0), 0, hits, m_strokeFuzziness,
+												   strokeSeed, m_pMorphHierarchy->strokeJournal());
 
 	if (numChanges > 0)
-		model.updateBuffers();
+		m_pMorphHierarchy->updateMorphBuffers();
 
-	printf("DONE.\n");
+	printf("DONE. (%d cuts, %.3f s)\n", numChanges, (float)timer.elapsed()/1000.0f);
 }
\ No newline at end of file
@@ -146,26 +146,27 @@ struct HeadMorphVertexIn
 };
 
 
-struct StrandMorphVertexIn
-{
-	float3	pos0		: POSITION;
-	float3	pos1		: TANGENT;
-	float4	color0		: COLOR0;
-	float2	texcoord	: TEXCOORD0;
-	float4	color1		: TEXCOORD1;
+// Morph vertex of K sources: position and color of source k in POSITIONk and
+// COLORk (see MorphStreams::inputElements)
+#define DECLARE_STRAND_MORPH_VERTEX_IN(K)	\
+struct StrandMorphVertexIn##K				\
+{											\
+	float3	pos[K]		: POSITION0;		\
+	float4	color[K]	: COLOR0;			\
+	float2	texcoord	: TEXCOORD0;		\
+};
+
+DECLARE_STRAND_MORPH_VERTEX_IN(1)
+DECLARE_STRAND_MORPH_VERTEX_IN(2)
 #if MAX_NUM_MORPH_SRC > 2
-	float3	pos2		: TEXCOORD2;
-	float4	color2		: TEXCOORD3;
+DECLARE_STRAND_MORPH_VERTEX_IN(3)
 #endif
 #if MAX_NUM_MORPH_SRC > 3
-	float3	pos3		: TEXCOORD4;
-	float4	color3		: TEXCOORD5;
+DECLARE_STRAND_MORPH_VERTEX_IN(4)
 #endif
 #if MAX_NUM_MORPH_SRC > 4
-	float3	pos4		: TEXCOORD6;
-	float4	color4		: TEXCOORD7;
+DECLARE_STRAND_MORPH_VERTEX_IN(5)
 #endif
-};
 
 
 ///////////////////////////////////////////////////////////
@@ -640,41 +641,10 @@ StrandVertexOut StrandMorphSimpleAlphaVS( StrandVertexIn input )
 }
 
 
-StrandVertexOut StrandMorphVS( StrandMorphVertexIn input )
+StrandVertexOut StrandMorphOut( float3 interPos, float4 interClr, float2 texcoord )
 {
 	StrandVertexOut output;
 	
-	float3 interPos = input.pos0*g_morphWeights[0];
-	float4 interClr = input.color0*g_morphWeights[0];
-
-	if (g_numSources > 1)
-	{
-		interPos += input.pos1*g_morphWeights[1];
-		interClr += input.color1*g_morphWeights[1];
-	}
-
-#if MAX_NUM_MORPH_SRC > 2
-	if (g_numSources > 2)
-	{
-		interPos += input.pos2*g_morphWeights[2];
-		interClr += input.color2*g_morphWeights[2];
-	}
-#endif
-#if MAX_NUM_MORPH_SRC > 3
-	if (g_numSources > 3)
-	{
-		interPos += input.pos3*g_morphWeights[3];
-		interClr += input.color3*g_morphWeights[3];
-	}
-#endif
-#if MAX_NUM_MORPH_SRC > 4
-	if (g_numSources > 4)
-	{
-		interPos += input.pos4*g_morphWeights[4];
-		interClr += input.color4*g_morphWeights[4];
-	}
-#endif
-
 	float4 worldPos = mul(float4(interPos, 1), g_world);
 	float4 viewPos  = mul(worldPos, g_view);
 	output.position = mul(viewPos, g_projection);                                                                                           
@@ -683,7 +653,7 @@ StrandVertexOut StrandMorphVS( StrandMorphVertexIn input )
 	
 	output.tangent		= 0;
 	output.color		= interClr;
-	output.texcoord		= input.texcoord;
+	output.texcoord		= texcoord;
 	output.distToCenter	= 0.5f * g_hairWidth * g_projection._11 / d;
 	output.marcoord		= 0.0.xxx;
 
@@ -691,6 +661,34 @@ StrandVertexOut StrandMorphVS( StrandMorphVertexIn input )
 }
 
 
+#define DECLARE_STRAND_MORPH_VS(K)										\
+StrandVertexOut StrandMorphVS##K( StrandMorphVertexIn##K input )		\
+{																		\
+	float3 interPos = 0;												\
+	float4 interClr = 0;												\
+																		\
+	[unroll]															\
+	for (int k = 0; k < K; k++)											\
+	{																	\
+		interPos += input.pos[k]*g_morphWeights[k];						\
+		interClr += input.color[k]*g_morphWeights[k];					\
+	}																	\
+	return StrandMorphOut(interPos, interClr, input.texcoord);			\
+}
+
+DECLARE_STRAND_MORPH_VS(1)
+DECLARE_STRAND_MORPH_VS(2)
+#if MAX_NUM_MORPH_SRC > 2
+DECLARE_STRAND_MORPH_VS(3)
+#endif
+#if MAX_NUM_MORPH_SRC > 3
+DECLARE_STRAND_MORPH_VS(4)
+#endif
+#if MAX_NUM_MORPH_SRC > 4
+DECLARE_STRAND_MORPH_VS(5)
+#endif
+
+
 float4 StrandMorphSimpleAlphaColorPS( StrandVertexOut input ) : SV_TARGET0
 {
 	float  wStrandRand = 1.0f + g_strandRandWeight*(input.texcoord.x - 0.5f);
@@ -1034,17 +1032,31 @@ technique11 HeadMorphSimple
 //---------------------------------------------------------
 
 
-technique11 StrandMorphColor
-{
-	pass P0
-	{
-		SetRasterizerState(rsDefault);
-		SetDepthStencilState(dsHairDepthStencil, 1);
-		SetBlendState(bsAlphaToCoverage, float4(0,0,0,0), 0xffffffff);
-
-		SetVertexShader(CompileShader(vs_4_0, StrandMorphVS()));
-		SetGeometryShader(CompileShader(gs_4_0, StrandWorldWidthGS()));
-		SetPixelShader(CompileShader(ps_4_0, StrandMorphColorPS()));
-	}
+// StrandMorphColor<K> for K sources
+#define DECLARE_STRAND_MORPH_COLOR(K)										\
+technique11 StrandMorphColor##K												\
+{																			\
+	pass P0																	\
+	{																		\
+		SetRasterizerState(rsDefault);										\
+		SetDepthStencilState(dsHairDepthStencil, 1);						\
+		SetBlendState(bsAlphaToCoverage, float4(0,0,0,0), 0xffffffff);		\
+																			\
+		SetVertexShader(CompileShader(vs_4_0, StrandMorphVS##K()));			\
+		SetGeometryShader(CompileShader(gs_4_0, StrandWorldWidthGS()));		\
+		SetPixelShader(CompileShader(ps_4_0, StrandMorphColorPS()));		\
+	}																		\
 }
 
+DECLARE_STRAND_MORPH_COLOR(1)
+DECLARE_STRAND_MORPH_COLOR(2)
+#if MAX_NUM_MORPH_SRC > 2
+DECLARE_STRAND_MORPH_COLOR(3)
+#endif
+#if MAX_NUM_MORPH_SRC > 3
+DECLARE_STRAND_MORPH_COLOR(4)
+#endif
+#if MAX_NUM_MORPH_SRC > 4
+DECLARE_STRAND_MORPH_COLOR(5)
+#endif
+
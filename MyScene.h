@@ -7,6 +7,7 @@
 
 #include "HairRenderer.h"
 #include "MorphController.h"
+#include "ScreenGrid.h"
 
 class QDXCoordFrame;
 class QDXRenderGroup;
@@ -158,10 +159,9 @@ private:
 	void		combStrokeDrawn();
 	void		cutStrokeDrawn();
 
-	void		transformJointAngleXY(const XMFLOAT3* origVerts, const XMFLOAT3* newVerts,
-										int vId, XMFLOAT2* pNewDir);
-
-	void		normalizeFloat2(XMFLOAT2& vec);
+	// Screen-space grid of the vertices of a morph level (blended positions of
+	// level 0 if morphed), rebuilt only when the view, weights or strands changed
+	const ScreenGrid&	strokeGrid(int levelIdx, bool morphed);
 
 	QDXModelCamera*		m_pCamera;
 	QDXImageSprite*		m_pImgSprite;
@@ -175,6 +175,15 @@ private:
 	int					m_strokeFuzziness;
 	int					m_strokeLevel;
 
+	// stroke grid and the state it was built for
+	ScreenGrid			m_strokeGrid;
+	int					m_strokeGridLevel;		// -1 if invalid
+	bool				m_strokeGridMorphed;
+	int					m_strokeGridVersion;
+	float				m_strokeGridCellSize;
+	XMFLOAT4X4			m_strokeGridWorld;
+	std::vector<float>	m_strokeGridWeights;
+
 	QDXImageSprite*		m_pBgLayerSprite;
 	QDXImageSprite*		m_pLargeBgLayerSprite;
 	QDXImageSprite*		m_pOrigLayerSprite;
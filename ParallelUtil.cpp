@@ -0,0 +1,111 @@
+#include "ParallelUtil.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "ThreadPool.h"
+
+#ifdef _MSC_VER
+#define PARALLEL_TLS	__declspec(thread)
+#else
+#define PARALLEL_TLS	__thread
+#endif
+
+int ParallelUtil::s_numThreads = 0;
+
+// set while the current thread executes a parallel loop body
+static PARALLEL_TLS int s_inParallelLoop = 0;
+
+
+int ParallelUtil::numThreads()
+{
+	if (s_numThreads > 0)
+		return s_numThreads;
+
+	int n = (int)std::thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+
+void ParallelUtil::setNumThreads(int n)
+{
+	s_numThreads = std::max(n, 0);
+}
+
+
+// Run func(taskIdx) for taskIdx in [0, numTasks) on the calling thread and up
+// to numThreads()-1 workers of the global pool.
+static void runTasks(int numTasks, const std::function<void(int)>& func)
+{
+	const int numWorkers = std::min(ParallelUtil::numThreads(), numTasks);
+
+	if (numWorkers <= 1 || s_inParallelLoop)
+	{
+		for (int i = 0; i < numTasks; i++)
+			func(i);
+		return;
+	}
+
+	std::atomic<int> nextTask(0);
+
+	auto worker = [&]()
+	{
+		s_inParallelLoop++;
+		for (int i = nextTask++; i < numTasks; i = nextTask++)
+			func(i);
+		s_inParallelLoop--;
+	};
+
+	TaskGroup group;
+	for (int i = 0; i < numWorkers - 1; i++)
+		group.run(worker);
+
+	worker();
+
+	group.wait();
+}
+
+
+void ParallelUtil::parallelFor(int first, int last, const std::function<void(int, int)>& func,
+							   int grain /* = 1 */)
+{
+	const int count = last - first;
+	if (count <= 0)
+		return;
+
+	// a few chunks per thread for load balancing
+	const int chunkSize = std::max(std::max(grain, 1), count / (numThreads() * 8));
+	const int nChunks = numChunks(first, last, chunkSize);
+
+	runTasks(nChunks, [&](int c)
+	{
+		const int begin = first + c * chunkSize;
+		func(begin, std::min(begin + chunkSize, last));
+	});
+}
+
+
+int ParallelUtil::numChunks(int first, int last, int chunkSize)
+{
+	if (last <= first)
+		return 0;
+
+	chunkSize = std::max(chunkSize, 1);
+	return (last - first + chunkSize - 1) / chunkSize;
+}
+
+
+void ParallelUtil::parallelForChunks(int first, int last, int chunkSize,
+									 const std::function<void(int, int, int)>& func)
+{
+	chunkSize = std::max(chunkSize, 1);
+	const int nChunks = numChunks(first, last, chunkSize);
+
+	runTasks(nChunks, [&](int c)
+	{
+		const int begin = first + c * chunkSize;
+		func(c, begin, std::min(begin + chunkSize, last));
+	});
+}
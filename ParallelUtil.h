@@ -0,0 +1,31 @@
+#pragma once
+
+// Simple fork-join helpers for data-parallel loops over strands, running on
+// the global ThreadPool.
+
+#include <functional>
+
+class ParallelUtil
+{
+public:
+
+	// Number of threads used by parallel loops (defaults to hardware concurrency)
+	static int		numThreads();
+	static void		setNumThreads(int n);	// n <= 0 restores the default
+
+	// Calls func(begin, end) on disjoint sub-ranges of [first, last).
+	// Nested calls from inside a parallel loop run serially.
+	static void		parallelFor(int first, int last, const std::function<void(int, int)>& func,
+								int grain = 1);
+
+	// Splits [first, last) into fixed chunks of chunkSize items and calls
+	// func(chunkIdx, begin, end) for each of them. Chunk boundaries only depend
+	// on the range and chunk size (not on the thread count), so per-chunk
+	// partial results can be merged in a deterministic order.
+	static int		numChunks(int first, int last, int chunkSize);
+	static void		parallelForChunks(int first, int last, int chunkSize,
+									  const std::function<void(int, int, int)>& func);
+
+private:
+	static int		s_numThreads;
+};
@@ -0,0 +1,213 @@
+#include "RootGrid.h"
+
+#include <algorithm>
+
+
+RootGrid::RootGrid()
+	: m_origin(0, 0, 0), m_cellSize(1.0f), m_dimX(0), m_dimY(0), m_dimZ(0)
+{
+}
+
+
+void RootGrid::clear()
+{
+	m_points.clear();
+	m_cellStart.clear();
+	m_cellPoints.clear();
+	m_dimX = m_dimY = m_dimZ = 0;
+}
+
+
+void RootGrid::build(const std::vector<XMFLOAT3>& points, int pointsPerCell /* = 8 */)
+{
+	clear();
+
+	const int n = points.size();
+	if (n < 1)
+		return;
+
+	m_points = points;
+
+	// bounding box
+	XMFLOAT3 minPt = points[0], maxPt = points[0];
+	for (int i = 1; i < n; i++)
+	{
+		minPt.x = std::min(minPt.x, points[i].x);	maxPt.x = std::max(maxPt.x, points[i].x);
+		minPt.y = std::min(minPt.y, points[i].y);	maxPt.y = std::max(maxPt.y, points[i].y);
+		minPt.z = std::min(minPt.z, points[i].z);	maxPt.z = std::max(maxPt.z, points[i].z);
+	}
+	m_origin = minPt;
+
+	const float extent = std::max(std::max(maxPt.x - minPt.x, maxPt.y - minPt.y),
+								  std::max(maxPt.z - minPt.z, 1e-6f));
+
+	// initial guess assumes the points fill the bounding volume...
+	m_cellSize = extent / std::max(powf((float)n, 1.0f/3.0f), 1.0f);
+
+	// ...then count occupied cells to adapt to the (surface) distribution
+	m_dimX = (int)((maxPt.x - minPt.x) / m_cellSize) + 1;
+	m_dimY = (int)((maxPt.y - minPt.y) / m_cellSize) + 1;
+	m_dimZ = (int)((maxPt.z - minPt.z) / m_cellSize) + 1;
+	{
+		std::vector<char> occupied(m_dimX * m_dimY * m_dimZ, 0);
+		int numOccupied = 0;
+		for (int i = 0; i < n; i++)
+		{
+			int cx, cy, cz;
+			cellCoord(points[i], cx, cy, cz);
+			char& occ = occupied[cellIndex(cx, cy, cz)];
+			if (!occ)
+			{
+				occ = 1;
+				numOccupied++;
+			}
+		}
+		m_cellSize *= sqrtf((float)std::max(pointsPerCell, 1) * (float)numOccupied / (float)n);
+	}
+
+	// limit the total number of cells
+	const double maxCells = 8.0 * n + 64.0;
+	for (;;)
+	{
+		m_dimX = (int)((maxPt.x - minPt.x) / m_cellSize) + 1;
+		m_dimY = (int)((maxPt.y - minPt.y) / m_cellSize) + 1;
+		m_dimZ = (int)((maxPt.z - minPt.z) / m_cellSize) + 1;
+
+		double numCells = (double)m_dimX * m_dimY * m_dimZ;
+		if (numCells <= maxCells)
+			break;
+		m_cellSize *= (float)pow(numCells / maxCells, 1.0/3.0) * 1.01f;
+	}
+
+	// counting sort of points into cells
+	const int numCells = m_dimX * m_dimY * m_dimZ;
+	std::vector<int> pointCells(n);
+	m_cellStart.assign(numCells + 1, 0);
+	for (int i = 0; i < n; i++)
+	{
+		int cx, cy, cz;
+		cellCoord(points[i], cx, cy, cz);
+		pointCells[i] = cellIndex(cx, cy, cz);
+		m_cellStart[pointCells[i] + 1]++;
+	}
+	for (int c = 0; c < numCells; c++)
+		m_cellStart[c + 1] += m_cellStart[c];
+
+	m_cellPoints.resize(n);
+	std::vector<int> cursor(m_cellStart.begin(), m_cellStart.end() - 1);
+	for (int i = 0; i < n; i++)
+		m_cellPoints[cursor[pointCells[i]]++] = i;
+}
+
+
+void RootGrid::cellCoord(const XMFLOAT3& pos, int& cx, int& cy, int& cz) const
+{
+	cx = std::min(std::max((int)((pos.x - m_origin.x) / m_cellSize), 0), m_dimX - 1);
+	cy = std::min(std::max((int)((pos.y - m_origin.y) / m_cellSize), 0), m_dimY - 1);
+	cz = std::min(std::max((int)((pos.z - m_origin.z) / m_cellSize), 0), m_dimZ - 1);
+}
+
+
+int RootGrid::findKNearest(const XMFLOAT3& pos, int k, int* nnIdx, float* nnSqrDist,
+						   int excludeId /* = -1 */) const
+{
+	if (k < 1 || isEmpty())
+		return 0;
+
+	int cx, cy, cz;
+	cellCoord(pos, cx, cy, cz);
+
+	const int maxRing = std::max(std::max(m_dimX, m_dimY), m_dimZ);
+
+	int numFound = 0;
+
+	for (int r = 0; r <= maxRing; r++)
+	{
+		// visit all cells on the shell with Chebyshev distance r
+		for (int dz = -r; dz <= r; dz++)
+		{
+			const int z = cz + dz;
+			if (z < 0 || z >= m_dimZ) continue;
+
+			for (int dy = -r; dy <= r; dy++)
+			{
+				const int y = cy + dy;
+				if (y < 0 || y >= m_dimY) continue;
+
+				const bool onShell = (dz == -r || dz == r || dy == -r || dy == r);
+				const int  dxStep  = (onShell || r == 0) ? 1 : 2 * r;
+
+				for (int dx = -r; dx <= r; dx += dxStep)
+				{
+					const int x = cx + dx;
+					if (x < 0 || x >= m_dimX) continue;
+
+					const int c = cellIndex(x, y, z);
+					for (int p = m_cellStart[c]; p < m_cellStart[c + 1]; p++)
+					{
+						const int id = m_cellPoints[p];
+						if (id == excludeId) continue;
+
+						const XMFLOAT3& pt = m_points[id];
+						const float ddx = pt.x - pos.x;
+						const float ddy = pt.y - pos.y;
+						const float ddz = pt.z - pos.z;
+						const float d2  = ddx*ddx + ddy*ddy + ddz*ddz;
+
+						if (numFound == k && (d2 > nnSqrDist[k-1] ||
+							(d2 == nnSqrDist[k-1] && id > nnIdx[k-1])))
+							continue;
+
+						// insertion into the sorted k-best list
+						int j = (numFound < k) ? numFound++ : k - 1;
+						while (j > 0 && (nnSqrDist[j-1] > d2 || (nnSqrDist[j-1] == d2 && nnIdx[j-1] > id)))
+						{
+							nnSqrDist[j] = nnSqrDist[j-1];
+							nnIdx[j]	 = nnIdx[j-1];
+							j--;
+						}
+						nnSqrDist[j] = d2;
+						nnIdx[j]	 = id;
+					}
+				}
+			}
+		}
+
+		// any point outside ring r is at least r cells away
+		const float bound = (float)r * m_cellSize;
+		if (numFound == k && nnSqrDist[k-1] < bound * bound)
+			break;
+	}
+
+	return numFound;
+}
+
+
+void RootGrid::findInRadius(const XMFLOAT3& pos, float radius, std::vector<int>& ids) const
+{
+	ids.clear();
+	if (isEmpty())
+		return;
+
+	int x0, y0, z0, x1, y1, z1;
+	cellCoord(XMFLOAT3(pos.x - radius, pos.y - radius, pos.z - radius), x0, y0, z0);
+	cellCoord(XMFLOAT3(pos.x + radius, pos.y + radius, pos.z + radius), x1, y1, z1);
+
+	const float sqrRad = radius * radius;
+
+	for (int z = z0; z <= z1; z++)
+	for (int y = y0; y <= y1; y++)
+	for (int x = x0; x <= x1; x++)
+	{
+		const int c = cellIndex(x, y, z);
+		for (int p = m_cellStart[c]; p < m_cellStart[c + 1]; p++)
+		{
+			const XMFLOAT3& pt = m_points[m_cellPoints[p]];
+			const float dx = pt.x - pos.x;
+			const float dy = pt.y - pos.y;
+			const float dz = pt.z - pos.z;
+			if (dx*dx + dy*dy + dz*dz <= sqrRad)
+				ids.push_back(m_cellPoints[p]);
+		}
+	}
+}
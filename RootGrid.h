@@ -0,0 +1,45 @@
+#pragma once
+
+#include "QDXUT.h"
+
+#include <vector>
+
+// Uniform 3D grid over a point set (typically strand roots) for k-nearest
+// neighbor queries. Hair roots lie on the scalp surface, so the cell size is
+// adapted to the number of occupied cells rather than to the bounding volume.
+// Queries only read the grid and may be issued from multiple threads.
+class RootGrid
+{
+public:
+	RootGrid();
+
+	void	build(const std::vector<XMFLOAT3>& points, int pointsPerCell = 8);
+	void	clear();
+
+	bool	isEmpty() const { return m_points.empty(); }
+	int		numPoints() const { return m_points.size(); }
+
+	const XMFLOAT3&	point(int i) const { return m_points[i]; }
+
+	// Find up to k nearest points to pos, ordered by (distance, index).
+	// Point 'excludeId' is skipped (-1 to keep all). Returns the number found.
+	int		findKNearest(const XMFLOAT3& pos, int k, int* nnIdx, float* nnSqrDist,
+						 int excludeId = -1) const;
+
+	// Collect all points within the given radius (unordered).
+	void	findInRadius(const XMFLOAT3& pos, float radius, std::vector<int>& ids) const;
+
+private:
+
+	void	cellCoord(const XMFLOAT3& pos, int& cx, int& cy, int& cz) const;
+	int		cellIndex(int cx, int cy, int cz) const { return (cz * m_dimY + cy) * m_dimX + cx; }
+
+	std::vector<XMFLOAT3>	m_points;
+
+	XMFLOAT3	m_origin;
+	float		m_cellSize;
+	int			m_dimX, m_dimY, m_dimZ;
+
+	std::vector<int>	m_cellStart;	// CSR: points of cell c are m_cellPoints[m_cellStart[c]..m_cellStart[c+1])
+	std::vector<int>	m_cellPoints;
+};
@@ -0,0 +1,176 @@
+#include "ScreenGrid.h"
+
+#include <algorithm>
+
+#include "ParallelUtil.h"
+
+
+namespace
+{
+	bool CompareHit(const StrokeHit& a, const StrokeHit& b)
+	{
+		return a.strandId < b.strandId || (a.strandId == b.strandId && a.vertexId < b.vertexId);
+	}
+}
+
+
+ScreenGrid::ScreenGrid()
+	: m_origin(0, 0), m_cellSize(1.0f), m_dimX(0), m_dimY(0)
+{
+}
+
+
+void ScreenGrid::clear()
+{
+	m_points.clear();
+	m_strandStart.clear();
+	m_cellStart.clear();
+	m_cellPoints.clear();
+	m_dimX = m_dimY = 0;
+}
+
+
+void ScreenGrid::build(const std::vector<XMFLOAT2>& points, const std::vector<int>& strandStart, float cellSize)
+{
+	clear();
+
+	const int n = points.size();
+	if (n < 1)
+		return;
+
+	m_points = points;
+	m_strandStart = strandStart;
+
+	// bounding box
+	XMFLOAT2 minPt = points[0], maxPt = points[0];
+	for (int i = 1; i < n; i++)
+	{
+		minPt.x = std::min(minPt.x, points[i].x);	maxPt.x = std::max(maxPt.x, points[i].x);
+		minPt.y = std::min(minPt.y, points[i].y);	maxPt.y = std::max(maxPt.y, points[i].y);
+	}
+	m_origin = minPt;
+
+	// limit the total number of cells
+	m_cellSize = std::max(cellSize, 1e-6f);
+	const double maxCells = 4.0 * n + 64.0;
+	for (;;)
+	{
+		m_dimX = (int)((maxPt.x - minPt.x) / m_cellSize) + 1;
+		m_dimY = (int)((maxPt.y - minPt.y) / m_cellSize) + 1;
+
+		double numCells = (double)m_dimX * m_dimY;
+		if (numCells <= maxCells)
+			break;
+		m_cellSize *= (float)sqrt(numCells / maxCells) * 1.01f;
+	}
+
+	// counting sort of points into cells
+	const int numCells = m_dimX * m_dimY;
+	std::vector<int> pointCells(n);
+	m_cellStart.assign(numCells + 1, 0);
+	for (int i = 0; i < n; i++)
+	{
+		int cx, cy;
+		cellCoord(points[i].x, points[i].y, cx, cy);
+		pointCells[i] = cellIndex(cx, cy);
+		m_cellStart[pointCells[i] + 1]++;
+	}
+	for (int c = 0; c < numCells; c++)
+		m_cellStart[c + 1] += m_cellStart[c];
+
+	m_cellPoints.resize(n);
+	std::vector<int> cursor(m_cellStart.begin(), m_cellStart.end() - 1);
+	for (int i = 0; i < n; i++)
+		m_cellPoints[cursor[pointCells[i]]++] = i;
+}
+
+
+void ScreenGrid::cellCoord(float x, float y, int& cx, int& cy) const
+{
+	cx = std::min(std::max((int)floorf((x - m_origin.x) / m_cellSize), 0), m_dimX - 1);
+	cy = std::min(std::max((int)floorf((y - m_origin.y) / m_cellSize), 0), m_dimY - 1);
+}
+
+
+void ScreenGrid::findStrokeHits(const XMFLOAT2* strokePts, int numStrokePts, float radius,
+								std::vector<StrokeHit>& hits) const
+{
+	hits.clear();
+	if (isEmpty() || numStrokePts < 1)
+		return;
+
+	const float sqrRad = radius * radius;
+
+	// (cell, stroke point) for the cells under each stroke disc, so that each
+	// vertex is visited once with the stroke points that may reach it
+	std::vector<std::pair<int, int> > cellPts;
+	for (int s = 0; s < numStrokePts; s++)
+	{
+		const XMFLOAT2& pt = strokePts[s];
+		if (pt.x + radius < m_origin.x || pt.y + radius < m_origin.y ||
+			pt.x - radius > m_origin.x + m_dimX * m_cellSize || pt.y - radius > m_origin.y + m_dimY * m_cellSize)
+			continue;
+
+		int x0, y0, x1, y1;
+		cellCoord(pt.x - radius, pt.y - radius, x0, y0);
+		cellCoord(pt.x + radius, pt.y + radius, x1, y1);
+
+		for (int y = y0; y <= y1; y++)
+			for (int x = x0; x <= x1; x++)
+				cellPts.push_back(std::make_pair(cellIndex(x, y), s));
+	}
+	std::sort(cellPts.begin(), cellPts.end());
+
+	std::vector<int> cellRuns;		// start of each cell's run in cellPts
+	for (int r = 0; r < cellPts.size(); r++)
+	{
+		if (r == 0 || cellPts[r].first != cellPts[r - 1].first)
+			cellRuns.push_back(r);
+	}
+	cellRuns.push_back(cellPts.size());
+
+	const int numRuns = cellRuns.size() - 1;
+	const int chunkSize = 16;
+	std::vector<std::vector<StrokeHit> > chunkHits(ParallelUtil::numChunks(0, numRuns, chunkSize));
+
+	ParallelUtil::parallelForChunks(0, numRuns, chunkSize, [&](int chunk, int begin, int end)
+	{
+		std::vector<StrokeHit>& out = chunkHits[chunk];
+		for (int r = begin; r < end; r++)
+		{
+			const int c = cellPts[cellRuns[r]].first;
+			for (int p = m_cellStart[c]; p < m_cellStart[c + 1]; p++)
+			{
+				const int id = m_cellPoints[p];
+				const XMFLOAT2& pos = m_points[id];
+
+				StrokeHit hit;
+				hit.strokePt = -1;
+				hit.sqrDist	 = sqrRad;
+				for (int q = cellRuns[r]; q < cellRuns[r + 1]; q++)
+				{
+					const XMFLOAT2& pt = strokePts[cellPts[q].second];
+					const float dx = pos.x - pt.x;
+					const float dy = pos.y - pt.y;
+					const float d2 = dx*dx + dy*dy;
+					if (d2 < hit.sqrDist || (d2 == hit.sqrDist && hit.strokePt < 0))
+					{
+						hit.sqrDist	 = d2;
+						hit.strokePt = cellPts[q].second;
+					}
+				}
+				if (hit.strokePt < 0)
+					continue;
+
+				hit.strandId = std::upper_bound(m_strandStart.begin(), m_strandStart.end(), id) - m_strandStart.begin() - 1;
+				hit.vertexId = id - m_strandStart[hit.strandId];
+				out.push_back(hit);
+			}
+		}
+	});
+
+	for (int c = 0; c < chunkHits.size(); c++)
+		hits.insert(hits.end(), chunkHits[c].begin(), chunkHits[c].end());
+
+	std::sort(hits.begin(), hits.end(), CompareHit);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "QDXUT.h"
+
+#include <algorithm>
+#include <vector>
+
+// Vertex j of strand strandId within the radius of the stroke, with its
+// nearest stroke point
+struct StrokeHit
+{
+	int		strandId;
+	int		vertexId;
+	int		strokePt;
+	float	sqrDist;
+};
+
+
+// Uniform 2D grid over the screen-space vertices of a strand model, for the
+// stroke tools. The grid is built once for a view and morph state; a stroke
+// only visits the cells under its discs, so its cost depends on the vertices
+// near the stroke rather than on the whole model. Queries only read the grid
+// and may be issued from multiple threads.
+class ScreenGrid
+{
+public:
+	ScreenGrid();
+
+	// Points of strand i are points[strandStart[i] .. strandStart[i+1]).
+	// A cell size near the stroke radius works best.
+	void	build(const std::vector<XMFLOAT2>& points, const std::vector<int>& strandStart, float cellSize);
+	void	clear();
+
+	bool	isEmpty() const		{ return m_points.empty(); }
+	int		numPoints() const	{ return m_points.size(); }
+	int		numStrands() const	{ return std::max((int)m_strandStart.size() - 1, 0); }
+
+	// All vertices within the radius of any stroke point, each with its
+	// nearest stroke point (lowest index among equals), sorted by strand and
+	// vertex.
+	void	findStrokeHits(const XMFLOAT2* strokePts, int numStrokePts, float radius,
+						   std::vector<StrokeHit>& hits) const;
+
+private:
+
+	void	cellCoord(float x, float y, int& cx, int& cy) const;
+	int		cellIndex(int cx, int cy) const { return cy * m_dimX + cx; }
+
+	std::vector<XMFLOAT2>	m_points;
+	std::vector<int>		m_strandStart;
+
+	XMFLOAT2	m_origin;
+	float		m_cellSize;
+	int			m_dimX, m_dimY;
+
+	std::vector<int>	m_cellStart;	// CSR: points of cell c are m_cellPoints[m_cellStart[c]..m_cellStart[c+1])
+	std::vector<int>	m_cellPoints;
+};
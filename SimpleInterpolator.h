@@ -2,6 +2,7 @@
 #define SIMPLE_INTERPOLATOR_H
 
 #include <Interpolator.h>
+#include <climits>
 
 
 // tailored version of Bonneel's displacement interpolator class.
@@ -18,9 +19,14 @@ public:
 										  const Vector<DIM,SAMPLESTYPE> &)) :
 		m_A(pA), m_B(pB),        // the location in space of each sample point
 		m_wA(pwA), m_wB(pwB),    // the value of each sample point
-		sqrDist(pSqrDist)   // the cost of the particle travelling, typically a squared geodesic distance
+		sqrDist(pSqrDist),  // the cost of the particle travelling, typically a squared geodesic distance
+		m_pCosts(NULL)
 	{ };
 
+	// Use precomputed costs (row-major, m_A.size() x m_B.size(), must outlive
+	// precompute()) instead of evaluating sqrDist for every pair.
+	void setCosts(const float* pCosts) { m_pCosts = pCosts; }
+
 	////////////////////////////////////////////////////////////////////////
 	/////////////////// Core of the distribution interpolation /////////////
 	////////////////////////////////////////////////////////////////////////
@@ -45,7 +51,7 @@ public:
 				w2[i] = m_wB[i] / m_sumWB;
 
 		double dAB;
-		minCostFlow(m_A, m_B, w1, w2, sqrDist, m_resultFlow, dAB);
+		minCostFlow(m_A, m_B, w1, w2, sqrDist, m_pCosts, m_resultFlow, dAB);
 	}
 
 
@@ -54,11 +60,14 @@ public:
 		samples.resize(m_resultFlow.size());
 		weights.resize(m_resultFlow.size());
 
-		for (int i = 0; i < m_resultFlow.size(); i++)
+		ParallelUtil::parallelFor(0, (int)m_resultFlow.size(), [&](int begin, int end)
 		{
-			samples[i] = m_A[m_resultFlow[i].from]*(1.0-alpha) + m_B[m_resultFlow[i].to]*alpha;
-			weights[i] = m_resultFlow[i].amount*(m_sumWA*(1.0-alpha) + m_sumWB*alpha);
-		}
+			for (int i = begin; i < end; i++)
+			{
+				samples[i] = m_A[m_resultFlow[i].from]*(1.0-alpha) + m_B[m_resultFlow[i].to]*alpha;
+				weights[i] = m_resultFlow[i].amount*(m_sumWA*(1.0-alpha) + m_sumWB*alpha);
+			}
+		}, 1024);
 	}
 	
 
@@ -67,9 +76,8 @@ public:
 private:
 
 	// normalize and quantize the two histograms, and make sure that the first one has the smallest sum (the two sums should be equals, but due to the quantization, this may not be the case, and it can lead to bugs in LEMON)
-	static bool normalizeAndSwap(std::vector<Vector<DIM,SAMPLESTYPE> > &samples1, 
-								 std::vector<Vector<DIM,SAMPLESTYPE> > &samples2, 
-								 std::vector<double> &weights1, 
+	// (only the weights are swapped, the caller swaps its view of the samples)
+	static bool normalizeAndSwap(std::vector<double> &weights1, 
 								 std::vector<double> &weights2, 
 								 double &stretchVal, 
 								 double &stretchDist)
@@ -110,18 +118,18 @@ private:
 		if (diff>0)
 		{
 			swap(weights1, weights2);
-			swap(samples1, samples2);
 			swapped = true;
 		}
 		return swapped;
 	}
 
-	static void minCostFlow(std::vector<Vector<DIM,SAMPLESTYPE> > samples1, 
-							std::vector<Vector<DIM,SAMPLESTYPE> > samples2, 
+	static void minCostFlow(const std::vector<Vector<DIM,SAMPLESTYPE> >& samplesA, 
+							const std::vector<Vector<DIM,SAMPLESTYPE> >& samplesB, 
 							std::vector<double> weights1, 
 							std::vector<double> weights2, 
 							double (*distance)(const Vector<DIM,SAMPLESTYPE> &, 
 											   const Vector<DIM,SAMPLESTYPE> &), 
+							const float* pCosts,
 							std::vector<TsFlow> &flow, 
 							double &resultdist)
 	{
@@ -130,17 +138,40 @@ private:
 
 		double stretchVal;
 		double stretchDist;
-		bool swapped = normalizeAndSwap(samples1, samples2, weights1, weights2, stretchVal, stretchDist);
+		bool swapped = normalizeAndSwap(weights1, weights2, stretchVal, stretchDist);
 
-		Digraph di((int)samples1.size(), (int)samples2.size());
+		const std::vector<Vector<DIM,SAMPLESTYPE> >& samples1 = swapped ? samplesB : samplesA;
+		const std::vector<Vector<DIM,SAMPLESTYPE> >& samples2 = swapped ? samplesA : samplesB;
+
+		const size_t n1 = samples1.size(), n2 = samples2.size();
+
+		if (pCosts)
+		{
+			// Fixed-point costs using the full integer range: the largest cost
+			// maps to the largest value for which node potentials (sums of at
+			// most n1+n2 arc costs) can't overflow.
+			float maxCost = 0;
+			for (size_t k = 0; k < n1 * n2; k++)
+				maxCost = my_max(maxCost, pCosts[k]);
+
+			const double maxQuantCost = my_min(1e6, (double)INT_MAX / (4.0 * (n1 + n2)));
+			if (maxCost > 0)
+				stretchDist = maxQuantCost / maxCost;
+		}
+
+		Digraph di((int)n1, (int)n2);
 		NetworkSimplexSimple<Digraph,int,int, unsigned short int> net(di, true);
 
 		int idarc = 0;
-		for (unsigned int i=0; i<samples1.size(); i++)
+		for (size_t i=0; i<n1; i++)
 		{
-			for (unsigned int j=0; j<samples2.size(); j++)
+			// row of precomputed costs (column if swapped)
+			const float* pRow = pCosts ? (swapped ? pCosts + i : pCosts + i*n2) : NULL;
+			const size_t step = swapped ? n1 : 1;
+
+			for (size_t j=0; j<n2; j++)
 			{
-				double d = distance(samples1[i], samples2[j]);
+				const double d = pRow ? pRow[j*step] : distance(samples1[i], samples2[j]);
 				net.setCost(di.arcFromId(idarc), (int) (stretchDist*d+0.5)); // quantize the cost
 				idarc++;
 			}
@@ -158,22 +189,28 @@ private:
 
 		// solve!
 		int ret = net.run(NetworkSimplexSimple<Digraph,int,int, unsigned short int>::BLOCK_SEARCH);
-		resultdist = net.totalCost()/(stretchVal*stretchDist);
-		flow.reserve(samples1.size() + samples2.size() - 1);
+		flow.reserve(n1 + n2 - 1);
 
-		// save results
-		for (unsigned int i=0; i<samples1.size(); i++) 
+		// save results (the distance is summed in double, the integer total may overflow)
+		resultdist = 0;
+		for (size_t i=0; i<n1; i++) 
 		{
-			for (unsigned int j=0; j<samples2.size(); j++)
+			for (size_t j=0; j<n2; j++)
 			{
+				const int arcFlow = net.flow(di.arcFromId((int)(i*n2+j)));
+				if (arcFlow == 0)
+					continue;
+
 				TsFlow f;
-				f.amount = net.flow(di.arcFromId(i*(unsigned int)samples2.size()+j))/stretchVal;
+				f.amount = arcFlow/stretchVal;
+				resultdist += f.amount * (pCosts ? (swapped ? pCosts[j*n1+i] : pCosts[i*n2+j])
+												 : distance(samples1[i], samples2[j]));
 				if (swapped) {
-					f.from = j;
-					f.to = i;
+					f.from = (int)j;
+					f.to = (int)i;
 				} else {
-					f.from = i;
-					f.to = j;
+					f.from = (int)i;
+					f.to = (int)j;
 				}
 				if (fabs(f.amount)>1E-18)
 					flow.push_back(f);
@@ -191,6 +228,8 @@ private:
 	double m_sumWA, m_sumWB;
 
 	std::vector<TsFlow> m_resultFlow;  // EMD flow between m_A and m_B
+
+	const float* m_pCosts;	// optional precomputed pair costs
 };
 
 
@@ -0,0 +1,173 @@
+#include "StrandBufferBuilder.h"
+
+#include <algorithm>
+
+#include <opencv2/core/core.hpp>
+
+#include "ParallelUtil.h"
+
+
+StrandBufferBuilder::StrandBufferBuilder()
+{
+}
+
+
+void StrandBufferBuilder::clear()
+{
+	m_vertexOffsets.clear();
+	m_indexOffsets.clear();
+	m_strandRands.clear();
+}
+
+
+bool StrandBufferBuilder::updateLayout(const std::vector<Strand>& strands)
+{
+	const int n = strands.size();
+
+	// compare against the cached layout (per chunk, in parallel)
+	if (numStrands() == n && !isEmpty())
+	{
+		const int numChunks = ParallelUtil::numChunks(0, n, LayoutChunkSize);
+		std::vector<char> chunkChanged(numChunks, 0);
+
+		ParallelUtil::parallelForChunks(0, n, LayoutChunkSize, [&](int c, int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+			{
+				if (m_vertexOffsets[i+1] - m_vertexOffsets[i] != strands[i].numVertices())
+				{
+					chunkChanged[c] = 1;
+					break;
+				}
+			}
+		});
+
+		if (std::find(chunkChanged.begin(), chunkChanged.end(), 1) == chunkChanged.end())
+			return false;
+	}
+
+	m_vertexOffsets.resize(n + 1);
+	m_indexOffsets.resize(n + 1);
+
+	calcOffsets(strands);
+
+	// per-strand random numbers, same sequence for every rebuild; a local
+	// generator so the global rand() state is left alone
+	if (m_strandRands.size() != n)
+	{
+		cv::RNG rng(20130119);
+
+		m_strandRands.resize(n);
+		for (int i = 0; i < n; i++)
+			m_strandRands[i] = rng.uniform(0.0f, 1.0f);
+	}
+
+	return true;
+}
+
+
+// Exclusive prefix sums of per-strand vertex/index counts: chunk totals are
+// summed in parallel, scanned serially, then each chunk is scanned in parallel.
+void StrandBufferBuilder::calcOffsets(const std::vector<Strand>& strands)
+{
+	const int n = strands.size();
+	const int numChunks = ParallelUtil::numChunks(0, n, LayoutChunkSize);
+
+	std::vector<uint> chunkVerts(numChunks + 1, 0);
+	std::vector<uint> chunkIndices(numChunks + 1, 0);
+
+	ParallelUtil::parallelForChunks(0, n, LayoutChunkSize, [&](int c, int begin, int end)
+	{
+		uint numVerts = 0, numIndices = 0;
+		for (int i = begin; i < end; i++)
+		{
+			numVerts   += strands[i].numVertices();
+			numIndices += numIndicesOf(strands[i].numVertices());
+		}
+		chunkVerts[c + 1]	= numVerts;
+		chunkIndices[c + 1] = numIndices;
+	});
+
+	for (int c = 0; c < numChunks; c++)
+	{
+		chunkVerts[c + 1]	+= chunkVerts[c];
+		chunkIndices[c + 1] += chunkIndices[c];
+	}
+
+	m_vertexOffsets[0] = 0;
+	m_indexOffsets[0]  = 0;
+
+	ParallelUtil::parallelForChunks(0, n, LayoutChunkSize, [&](int c, int begin, int end)
+	{
+		uint vOffset = chunkVerts[c], iOffset = chunkIndices[c];
+		for (int i = begin; i < end; i++)
+		{
+			vOffset += strands[i].numVertices();
+			iOffset += numIndicesOf(strands[i].numVertices());
+
+			m_vertexOffsets[i+1] = vOffset;
+			m_indexOffsets[i+1]	 = iOffset;
+		}
+	});
+}
+
+
+void StrandBufferBuilder::assemble(const std::vector<Strand>& strands,
+								   StrandVertex* pVertexDst, uint* pIndexDst)
+{
+	updateLayout(strands);
+
+	if (pVertexDst)
+		fillVertices(strands, 0, strands.size(), pVertexDst);
+	if (pIndexDst)
+		fillIndices(pIndexDst);
+}
+
+
+void StrandBufferBuilder::fillVertices(const std::vector<Strand>& strands, int first, int last,
+									   StrandVertex* pDst) const
+{
+	StrandVertex* pVertexData = pDst - m_vertexOffsets[first];
+
+	ParallelUtil::parallelFor(first, last, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			const StrandVertex* pVerts = strands[i].vertices();
+			const int numVerts = strands[i].numVertices();
+			const float randNum = m_strandRands[i];
+
+			uint vId = m_vertexOffsets[i];
+			for (int j = 0; j < numVerts; j++, vId++)
+			{
+				pVertexData[vId] = pVerts[j];
+
+				pVertexData[vId].texcoord.x = randNum;
+				pVertexData[vId].texcoord.y = (j == 0) ? 0.0f : (float)j / (float)(numVerts - 1);
+			}
+		}
+	}, 64);
+}
+
+
+void StrandBufferBuilder::fillIndices(uint* pDst) const
+{
+	ParallelUtil::parallelFor(0, numStrands(), [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			const int numVerts = m_vertexOffsets[i+1] - m_vertexOffsets[i];
+
+			uint* pIndexData = pDst + m_indexOffsets[i];
+			uint  vId = m_vertexOffsets[i] + 1;
+
+			for (int j = 1; j < numVerts; j++, vId++)
+			{
+				*pIndexData++ = (j == 1) ? vId - 1 : vId - 2;
+				*pIndexData++ = vId - 1;
+				*pIndexData++ = vId;
+				*pIndexData++ = (j == numVerts - 1) ? vId : vId + 1;
+			}
+		}
+	}, 64);
+}
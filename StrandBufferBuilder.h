@@ -0,0 +1,58 @@
+#pragma once
+
+#include "HairStrandModel.h"
+
+#include <vector>
+
+// Assembles the CPU-side vertex/index data of a strand model for rendering
+// with LINELIST_ADJ topology. It caches the buffer layout (per-strand vertex
+// and index offsets) so that topology-preserving edits only need to refill
+// the vertices of the modified strands. Independent of any D3D device, so it
+// can also be used for headless export. Filling is done in parallel over
+// strands; the destination may be mapped GPU memory.
+class StrandBufferBuilder
+{
+public:
+	StrandBufferBuilder();
+
+	void	clear();
+
+	// Update the cached layout for the given strands. Returns true if the
+	// layout (strand count or any strand's vertex count) has changed.
+	bool	updateLayout(const std::vector<Strand>& strands);
+
+	bool	isEmpty() const			{ return m_vertexOffsets.empty(); }
+	int		numStrands() const		{ return m_vertexOffsets.empty() ? 0 : (int)m_vertexOffsets.size() - 1; }
+
+	uint	numVertices() const		{ return m_vertexOffsets.empty() ? 0 : m_vertexOffsets.back(); }
+	uint	numIndices() const		{ return m_indexOffsets.empty() ? 0 : m_indexOffsets.back(); }
+
+	// first vertex/index of strand i (i == numStrands() gives the totals)
+	uint	vertexOffset(int i) const { return m_vertexOffsets[i]; }
+	uint	indexOffset(int i) const  { return m_indexOffsets[i]; }
+
+	// Update the layout and fill complete vertex and index data
+	// (numVertices()/numIndices() entries). Either pointer may be NULL.
+	void	assemble(const std::vector<Strand>& strands, StrandVertex* pVertexDst, uint* pIndexDst);
+
+	// Fill the vertices of strands [first, last). pDst points to the vertex
+	// of strand 'first', i.e. vertexOffset(first) in the full buffer.
+	void	fillVertices(const std::vector<Strand>& strands, int first, int last,
+						 StrandVertex* pDst) const;
+
+	// Fill the indices of all strands (numIndices() entries).
+	void	fillIndices(uint* pDst) const;
+
+	static uint	numIndicesOf(int numVerts) { return numVerts > 1 ? (numVerts - 1) * 4 : 0; } // with adjacency
+
+private:
+
+	enum { LayoutChunkSize = 4096 };
+
+	void	calcOffsets(const std::vector<Strand>& strands);
+
+	std::vector<uint>	m_vertexOffsets;
+	std::vector<uint>	m_indexOffsets;
+
+	std::vector<float>	m_strandRands;	// per-strand random texcoord.x
+};
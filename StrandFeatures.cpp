@@ -0,0 +1,197 @@
+#include "StrandFeatures.h"
+
+#include <algorithm>
+
+#include <intrin.h>
+#include <immintrin.h>
+
+#include "ParallelUtil.h"
+
+
+namespace
+{
+	// AVX2 and FMA supported by both CPU and OS (ymm state saved)
+	bool detectAVX2()
+	{
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+			return false;
+
+		__cpuid(info, 1);
+		const bool hasFMA	  = (info[2] & (1 << 12)) != 0;
+		const bool hasOSXSAVE = (info[2] & (1 << 27)) != 0;
+		const bool hasAVX	  = (info[2] & (1 << 28)) != 0;
+		if (!hasFMA || !hasOSXSAVE || !hasAVX)
+			return false;
+
+		if ((_xgetbv(0) & 6) != 6)
+			return false;
+
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+	}
+
+	// The distance kernels take 16 floats per step with aligned loads and
+	// have no remainder loop.
+	static_assert(StrandFeatures::Dim % 16 == 0, "strand features must fill whole 16-float blocks");
+
+	float sqrDistSSE(const float* pA, const float* pB)
+	{
+		__m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+		__m128 sum2 = _mm_setzero_ps(), sum3 = _mm_setzero_ps();
+
+		for (int k = 0; k < StrandFeatures::Dim; k += 16)
+		{
+			__m128 d0 = _mm_sub_ps(_mm_load_ps(pA + k),		_mm_load_ps(pB + k));
+			__m128 d1 = _mm_sub_ps(_mm_load_ps(pA + k + 4),	_mm_load_ps(pB + k + 4));
+			__m128 d2 = _mm_sub_ps(_mm_load_ps(pA + k + 8),	_mm_load_ps(pB + k + 8));
+			__m128 d3 = _mm_sub_ps(_mm_load_ps(pA + k + 12), _mm_load_ps(pB + k + 12));
+
+			sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+			sum1 = _mm_add_ps(sum1, _mm_mul_ps(d1, d1));
+			sum2 = _mm_add_ps(sum2, _mm_mul_ps(d2, d2));
+			sum3 = _mm_add_ps(sum3, _mm_mul_ps(d3, d3));
+		}
+
+		__m128 sum = _mm_add_ps(_mm_add_ps(sum0, sum1), _mm_add_ps(sum2, sum3));
+		sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+		sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+		return _mm_cvtss_f32(sum);
+	}
+
+	float sqrDistAVX2(const float* pA, const float* pB)
+	{
+		__m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+
+		for (int k = 0; k < StrandFeatures::Dim; k += 16)
+		{
+			__m256 d0 = _mm256_sub_ps(_mm256_load_ps(pA + k),	  _mm256_load_ps(pB + k));
+			__m256 d1 = _mm256_sub_ps(_mm256_load_ps(pA + k + 8), _mm256_load_ps(pB + k + 8));
+
+			sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+			sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+		}
+
+		__m256 sum8 = _mm256_add_ps(sum0, sum1);
+		__m128 sum	= _mm_add_ps(_mm256_castps256_ps128(sum8), _mm256_extractf128_ps(sum8, 1));
+		sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+		sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+		return _mm_cvtss_f32(sum);
+	}
+
+	const bool s_hasAVX2 = detectAVX2();
+
+	float (* const s_sqrDistFunc)(const float*, const float*) = s_hasAVX2 ? sqrDistAVX2 : sqrDistSSE;
+}
+
+
+StrandFeatures::StrandFeatures()
+	: m_pData(NULL), m_numStrands(0), m_capacity(0), m_mode(RootRelative)
+{
+}
+
+
+StrandFeatures::~StrandFeatures()
+{
+	_mm_free(m_pData);
+}
+
+
+void StrandFeatures::clear()
+{
+	_mm_free(m_pData);
+
+	m_pData		= NULL;
+	m_numStrands = 0;
+	m_capacity	= 0;
+}
+
+
+void StrandFeatures::swap(StrandFeatures& other)
+{
+	std::swap(m_pData, other.m_pData);
+	std::swap(m_numStrands, other.m_numStrands);
+	std::swap(m_capacity, other.m_capacity);
+	std::swap(m_mode, other.m_mode);
+}
+
+
+void StrandFeatures::resize(int numStrands, Mode mode)
+{
+	if (numStrands > m_capacity)
+	{
+		_mm_free(m_pData);
+		m_pData	   = (float*)_mm_malloc(sizeof(float) * Dim * numStrands, 32);
+		m_capacity = numStrands;
+	}
+	m_numStrands = numStrands;
+	m_mode		 = mode;
+}
+
+
+bool StrandFeatures::build(const HairStrandModel& model, Mode mode)
+{
+	if (!model.isUniformSampled(NUM_UNISAM_VERTICES))
+	{
+		printf("ERROR: strand features require uniformly sampled strands!\n");
+		return false;
+	}
+
+	resize(model.numStrands(), mode);
+
+	ParallelUtil::parallelFor(0, m_numStrands, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+			update(i, *model.getStrandAt(i));
+	}, 256);
+
+	return true;
+}
+
+
+void StrandFeatures::update(int i, const Strand& strand)
+{
+	Q_ASSERT(strand.numVertices() == NUM_UNISAM_VERTICES);
+
+	const StrandVertex* verts = strand.vertices();
+	float* pDst = feature(i);
+
+	XMFLOAT3 origin(0, 0, 0);
+	if (m_mode == RootRelative)
+		origin = verts[0].position;
+
+	for (int j = 0; j < NUM_UNISAM_VERTICES; j++)
+	{
+		pDst[j*3+0] = verts[j].position.x - origin.x;
+		pDst[j*3+1] = verts[j].position.y - origin.y;
+		pDst[j*3+2] = verts[j].position.z - origin.z;
+	}
+}
+
+
+float StrandFeatures::sqrDist(const float* pA, const float* pB)
+{
+	return s_sqrDistFunc(pA, pB);
+}
+
+
+void StrandFeatures::sqrDists(const float* pA, const int* ids, int count, float* pDists) const
+{
+	if (ids)
+	{
+		for (int i = 0; i < count; i++)
+			pDists[i] = s_sqrDistFunc(pA, feature(ids[i]));
+	}
+	else
+	{
+		for (int i = 0; i < count; i++)
+			pDists[i] = s_sqrDistFunc(pA, feature(i));
+	}
+}
+
+
+bool StrandFeatures::usesAVX()
+{
+	return s_hasAVX2;
+}
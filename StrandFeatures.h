@@ -0,0 +1,64 @@
+#pragma once
+
+#include "HairStrandModel.h"
+
+// Packed per-strand feature vectors of a uniformly sampled model for fast
+// strand distance evaluation. Each strand is stored as NUM_UNISAM_VERTICES*3
+// contiguous floats (x,y,z per vertex), 32-byte aligned, either relative to
+// its root or in absolute coordinates. Squared distances use an AVX2/FMA
+// kernel when the CPU supports it and SSE otherwise.
+class StrandFeatures
+{
+public:
+
+	enum Mode
+	{
+		RootRelative,	// vertex positions minus root position (strand shape)
+		Absolute,		// vertex positions as is
+	};
+
+	enum { Dim = NUM_UNISAM_VERTICES * 3 };
+
+	StrandFeatures();
+	~StrandFeatures();
+
+	void	clear();
+	void	swap(StrandFeatures& other);
+
+	// Extract features of all strands. Fails if the model isn't uniformly sampled.
+	bool	build(const HairStrandModel& model, Mode mode = RootRelative);
+
+	// Allocate features of numStrands strands (contents are undefined).
+	void	resize(int numStrands, Mode mode);
+
+	// Re-extract the feature of strand i (e.g. after its vertices changed).
+	void	update(int i, const Strand& strand);
+
+	bool	isEmpty() const		{ return m_numStrands == 0; }
+	int		numStrands() const	{ return m_numStrands; }
+	Mode	mode() const		{ return m_mode; }
+
+	const float*	feature(int i) const { return m_pData + (size_t)i * Dim; }
+	float*			feature(int i)		 { return m_pData + (size_t)i * Dim; }
+
+	// Sum of squared component differences of two features (Dim floats each, 32-byte aligned).
+	static float	sqrDist(const float* pA, const float* pB);
+
+	float	sqrDist(int i, const StrandFeatures& other, int j) const { return sqrDist(feature(i), other.feature(j)); }
+
+	// Squared distances from pA to strands ids[0..count) of this store, or to
+	// strands [0, count) if ids is NULL.
+	void	sqrDists(const float* pA, const int* ids, int count, float* pDists) const;
+
+	static bool		usesAVX();
+
+private:
+
+	StrandFeatures(const StrandFeatures&);
+	StrandFeatures& operator=(const StrandFeatures&);
+
+	float*	m_pData;
+	int		m_numStrands;
+	int		m_capacity;
+	Mode	m_mode;
+};
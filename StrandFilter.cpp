@@ -0,0 +1,162 @@
+#include "StrandFilter.h"
+
+#include <emmintrin.h>
+
+#include "ParallelUtil.h"
+
+
+StrandFilter::StrandFilter()
+	: m_border(BorderReflect101)
+{
+	m_kernel.assign(1, 1.0f);
+}
+
+
+// Mirrors cv::getGaussianKernel with the kernel size chosen by cv::GaussianBlur
+// for floating point images.
+void StrandFilter::calcGaussianKernel(float sigma, std::vector<float>& kernel)
+{
+	if (sigma <= 0)
+	{
+		kernel.assign(1, 1.0f);
+		return;
+	}
+
+	// same rounding as cvRound()
+	const int ksize = _mm_cvtsd_si32(_mm_set_sd(sigma * 4 * 2 + 1)) | 1;
+
+	kernel.resize(ksize);
+
+	const double scale2X = -0.5 / ((double)sigma * sigma);
+	double sum = 0;
+	for (int i = 0; i < ksize; i++)
+	{
+		double x = i - (ksize - 1) * 0.5;
+		kernel[i] = (float)exp(scale2X * x * x);
+		sum += kernel[i];
+	}
+
+	sum = 1.0 / sum;
+	for (int i = 0; i < ksize; i++)
+		kernel[i] = (float)(kernel[i] * sum);
+}
+
+
+void StrandFilter::setGaussian(float sigma, BorderMode border /* = BorderReflect101 */)
+{
+	calcGaussianKernel(sigma, m_kernel);
+	m_border = border;
+}
+
+
+void StrandFilter::setKernel(const std::vector<float>& kernel, BorderMode border)
+{
+	Q_ASSERT(kernel.size() % 2 == 1);
+
+	m_kernel = kernel;
+	m_border = border;
+}
+
+
+int StrandFilter::borderIndex(int idx, int len, BorderMode border)
+{
+	if (idx >= 0 && idx < len)
+		return idx;
+
+	if (border == BorderReplicate || len == 1)
+		return idx < 0 ? 0 : len - 1;
+
+	// reflect (without repeating the border vertex) until inside
+	do
+	{
+		if (idx < 0)
+			idx = -idx;
+		else
+			idx = 2 * len - 2 - idx;
+	} while (idx < 0 || idx >= len);
+
+	return idx;
+}
+
+
+void StrandFilter::apply(Strand& strand, Attribute attrib, XMFLOAT4* scratch) const
+{
+	const int n = strand.numVertices();
+	const int r = radius();
+
+	if (n < 1 || m_kernel.size() < 2)
+		return;
+
+	StrandVertex* verts = strand.vertices();
+
+	// gather attribute
+	for (int j = 0; j < n; j++)
+	{
+		if (attrib == AttribColor)
+			scratch[j] = verts[j].color;
+		else
+			scratch[j] = XMFLOAT4(verts[j].position.x, verts[j].position.y, verts[j].position.z, 0);
+	}
+
+	const float* kernel = m_kernel.data();
+	const int	 ksize	= m_kernel.size();
+
+	for (int j = 0; j < n; j++)
+	{
+		XMVECTOR sum = XMVectorZero();
+
+		if (j - r >= 0 && j + r < n)
+		{
+			const XMFLOAT4* src = scratch + j - r;
+			for (int k = 0; k < ksize; k++)
+				sum = XMVectorMultiplyAdd(XMVectorReplicate(kernel[k]), XMLoadFloat4(&src[k]), sum);
+		}
+		else
+		{
+			for (int k = 0; k < ksize; k++)
+			{
+				const int idx = borderIndex(j - r + k, n, m_border);
+				sum = XMVectorMultiplyAdd(XMVectorReplicate(kernel[k]), XMLoadFloat4(&scratch[idx]), sum);
+			}
+		}
+
+		// scatter attribute
+		switch (attrib)
+		{
+		case AttribPosition:
+			XMStoreFloat3(&verts[j].position, sum);
+			break;
+		case AttribDepth:
+			verts[j].position.z = XMVectorGetZ(sum);
+			break;
+		case AttribColor:
+			XMStoreFloat4(&verts[j].color, sum);
+			break;
+		}
+	}
+}
+
+
+void StrandFilter::apply(HairStrandModel& model, Attribute attrib, int first /* = 0 */, int last /* = -1 */) const
+{
+	if (last < 0 || last > model.numStrands())
+		last = model.numStrands();
+
+	if (m_kernel.size() < 2)
+		return;
+
+	ParallelUtil::parallelFor(first, last, [&](int begin, int end)
+	{
+		std::vector<XMFLOAT4> scratch;
+
+		for (int i = begin; i < end; i++)
+		{
+			Strand* pStrand = model.getStrandAt(i);
+
+			if (scratch.size() < pStrand->numVertices())
+				scratch.resize(pStrand->numVertices());
+
+			apply(*pStrand, attrib, scratch.data());
+		}
+	}, 64);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "HairStrandModel.h"
+
+#include <vector>
+
+// Batched 1D filtering of per-vertex strand attributes. The kernel is
+// precomputed once and applied to all strands in parallel, with all channels
+// of an attribute filtered together as one SIMD vector.
+class StrandFilter
+{
+public:
+
+	enum BorderMode
+	{
+		BorderReflect101,	// gfedcb|abcdefgh|gfedcba (OpenCV default, as used by cv::GaussianBlur)
+		BorderReplicate,	// aaaaaa|abcdefgh|hhhhhhh (clamp to end vertices)
+	};
+
+	enum Attribute
+	{
+		AttribPosition,		// position.xyz
+		AttribDepth,		// position.z only
+		AttribColor,		// color.xyzw
+	};
+
+	StrandFilter();
+
+	// Same kernel as cv::GaussianBlur(src, dst, Size(-1,-1), sigma) on float data.
+	void	setGaussian(float sigma, BorderMode border = BorderReflect101);
+
+	// Arbitrary odd-sized kernel (weights are used as given).
+	void	setKernel(const std::vector<float>& kernel, BorderMode border);
+
+	const std::vector<float>&	kernel() const { return m_kernel; }
+	int		radius() const { return m_kernel.size() / 2; }
+
+	// Filter the attribute along strands [first, last) of the model (last < 0: all strands).
+	void	apply(HairStrandModel& model, Attribute attrib, int first = 0, int last = -1) const;
+
+	// Filter a single strand attribute in place (scratch must hold numVertices() entries).
+	void	apply(Strand& strand, Attribute attrib, XMFLOAT4* scratch) const;
+
+	static void	calcGaussianKernel(float sigma, std::vector<float>& kernel);
+
+	static int	borderIndex(int idx, int len, BorderMode border);
+
+private:
+
+	std::vector<float>	m_kernel;
+	BorderMode			m_border;
+};
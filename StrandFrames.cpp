@@ -0,0 +1,170 @@
+#include "StrandFrames.h"
+
+#include "ParallelUtil.h"
+
+
+StrandFrames::StrandFrames()
+{
+}
+
+
+void StrandFrames::clear()
+{
+	m_offsets.clear();
+	m_tangents.clear();
+	m_normals.clear();
+}
+
+
+// Rodrigues rotation about k = t0 x t1 without normalizing the axis:
+// n' = n*cos + k x n + k*(k.n)/(1+cos)
+XMVECTOR StrandFrames::transportNormal(FXMVECTOR normal, FXMVECTOR t0, FXMVECTOR t1)
+{
+	XMVECTOR k	 = XMVector3Cross(t0, t1);
+	XMVECTOR cos = XMVector3Dot(t0, t1);
+
+	// opposite tangents: no unique rotation, flip as the axis-angle matrix would
+	const float c = XMVectorGetX(cos);
+	if (c < -0.9999f)
+		return XMVectorNegate(normal);
+
+	XMVECTOR kn = XMVectorScale(XMVector3Dot(k, normal), 1.0f / (1.0f + c));
+
+	XMVECTOR n = XMVectorMultiplyAdd(normal, cos, XMVector3Cross(k, normal));
+	n = XMVectorMultiplyAdd(k, kn, n);
+
+	// keep the frame orthonormal despite rounding
+	n = XMVectorNegativeMultiplySubtract(t1, XMVector3Dot(n, t1), n);
+	return XMVector3Normalize(n);
+}
+
+
+void StrandFrames::calcStrandTangents(const Strand& strand, XMFLOAT3* tangents)
+{
+	const StrandVertex* verts = strand.vertices();
+	const int n = strand.numVertices();
+
+	if (n < 2)
+	{
+		if (n == 1)
+			tangents[0] = XMFLOAT3(0, 0, 0);
+		return;
+	}
+
+	XMVECTOR prev = XMLoadFloat3(&verts[0].position);
+	XMVECTOR curr = XMLoadFloat3(&verts[1].position);
+
+	// first vertex
+	XMStoreFloat3(&tangents[0], XMVector3Normalize(curr - prev));
+
+	// intermediate vertices
+	for (int j = 1; j < n - 1; j++)
+	{
+		XMVECTOR next = XMLoadFloat3(&verts[j+1].position);
+		XMStoreFloat3(&tangents[j], XMVector3Normalize(next - prev));
+
+		prev = curr;
+		curr = next;
+	}
+
+	// last vertex
+	XMStoreFloat3(&tangents[n-1], XMVector3Normalize(curr - prev));
+}
+
+
+void StrandFrames::calcStrandNormals(const XMFLOAT3* tangents, int numVerts, FXMVECTOR rootNormal,
+									 XMFLOAT3* normals)
+{
+	if (numVerts < 1)
+		return;
+
+	XMVECTOR tangent = XMLoadFloat3(&tangents[0]);
+	XMVECTOR normal	 = XMVector3Normalize(
+					   XMVectorNegativeMultiplySubtract(tangent, XMVector3Dot(rootNormal, tangent), rootNormal));
+
+	XMStoreFloat3(&normals[0], normal);
+
+	for (int j = 1; j < numVerts; j++)
+	{
+		XMVECTOR newTangent = XMLoadFloat3(&tangents[j]);
+
+		normal	= transportNormal(normal, tangent, newTangent);
+		tangent = newTangent;
+
+		XMStoreFloat3(&normals[j], normal);
+	}
+}
+
+
+void StrandFrames::calcTangents(const HairStrandModel& model)
+{
+	const int numStrands = model.numStrands();
+
+	m_offsets.resize(numStrands + 1);
+	m_offsets[0] = 0;
+	for (int i = 0; i < numStrands; i++)
+		m_offsets[i+1] = m_offsets[i] + model.getStrandAt(i)->numVertices();
+
+	m_tangents.resize(m_offsets.back());
+	m_normals.clear();
+
+	ParallelUtil::parallelFor(0, numStrands, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+			calcStrandTangents(*model.getStrandAt(i), m_tangents.data() + m_offsets[i]);
+	}, 64);
+}
+
+
+void StrandFrames::calcNormals(const std::vector<XMFLOAT3>& rootNormals)
+{
+	Q_ASSERT(rootNormals.size() == numStrands());
+
+	m_normals.resize(m_tangents.size());
+
+	ParallelUtil::parallelFor(0, numStrands(), [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+			calcStrandNormals(tangents(i), numVertices(i), XMLoadFloat3(&rootNormals[i]),
+							  m_normals.data() + m_offsets[i]);
+	}, 64);
+}
+
+
+void StrandFrames::calcNormals(const XMFLOAT3& refTangent, const XMFLOAT3& refNormal)
+{
+	m_normals.resize(m_tangents.size());
+
+	const XMVECTOR t0 = XMVector3Normalize(XMLoadFloat3(&refTangent));
+	const XMVECTOR n0 = XMVector3Normalize(XMLoadFloat3(&refNormal));
+
+	ParallelUtil::parallelFor(0, numStrands(), [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			if (numVertices(i) < 1)
+				continue;
+
+			XMVECTOR rootNormal = transportNormal(n0, t0, XMLoadFloat3(&tangents(i)[0]));
+			calcStrandNormals(tangents(i), numVertices(i), rootNormal, m_normals.data() + m_offsets[i]);
+		}
+	}, 64);
+}
+
+
+void StrandFrames::storeTangents(HairStrandModel& model) const
+{
+	Q_ASSERT(model.numStrands() == numStrands());
+
+	ParallelUtil::parallelFor(0, numStrands(), [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			StrandVertex*	verts = model.getStrandAt(i)->vertices();
+			const XMFLOAT3* src	  = tangents(i);
+
+			for (int j = 0; j < numVertices(i); j++)
+				verts[j].tangent = src[j];
+		}
+	}, 64);
+}
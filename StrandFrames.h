@@ -0,0 +1,51 @@
+#pragma once
+
+#include "HairStrandModel.h"
+
+#include <vector>
+
+// Per-vertex tangents and rotation minimizing (parallel transport) frames of
+// all strands in a model, stored as separate tangent/normal streams indexed by
+// strand. The binormal of a frame is normal x tangent.
+class StrandFrames
+{
+public:
+	StrandFrames();
+
+	void	clear();
+
+	// Unit tangents of all strands (central differences, one-sided at both ends).
+	void	calcTangents(const HairStrandModel& model);
+
+	// Transport one normal per strand from the root along the strand.
+	// Requires tangents; root normals are made orthogonal to the root tangent.
+	void	calcNormals(const std::vector<XMFLOAT3>& rootNormals);
+
+	// Same, with root normals obtained by rotating a reference frame onto each root tangent.
+	void	calcNormals(const XMFLOAT3& refTangent, const XMFLOAT3& refNormal);
+
+	bool	hasTangents() const { return !m_tangents.empty(); }
+	bool	hasNormals() const	{ return !m_normals.empty(); }
+
+	int		numStrands() const	{ return m_offsets.empty() ? 0 : (int)m_offsets.size() - 1; }
+	int		numVertices(int i) const { return m_offsets[i+1] - m_offsets[i]; }
+
+	const XMFLOAT3*	tangents(int i) const { return m_tangents.data() + m_offsets[i]; }
+	const XMFLOAT3*	normals(int i) const  { return m_normals.data() + m_offsets[i]; }
+
+	// Write the tangent stream into StrandVertex::tangent.
+	void	storeTangents(HairStrandModel& model) const;
+
+	// Rotate normal by the minimum rotation taking unit vector t0 to t1.
+	static XMVECTOR	transportNormal(FXMVECTOR normal, FXMVECTOR t0, FXMVECTOR t1);
+
+	static void		calcStrandTangents(const Strand& strand, XMFLOAT3* tangents);
+	static void		calcStrandNormals(const XMFLOAT3* tangents, int numVerts, FXMVECTOR rootNormal,
+									  XMFLOAT3* normals);
+
+private:
+
+	std::vector<int>		m_offsets;
+	std::vector<XMFLOAT3>	m_tangents;
+	std::vector<XMFLOAT3>	m_normals;
+};
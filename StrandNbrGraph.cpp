@@ -0,0 +1,173 @@
+#include "StrandNbrGraph.h"
+
+#include <algorithm>
+
+#include "RootGrid.h"
+#include "ParallelUtil.h"
+
+
+void StrandNbrGraph::buildKNearest(const std::vector<XMFLOAT3>& roots, int numNbrs)
+{
+	clear();
+
+	const int n = roots.size();
+	if (n < 1)
+		return;
+
+	const int k = std::max(std::min(numNbrs, n - 1), 0);
+	if (k == 0)
+	{
+		m_offsets.assign(n + 1, 0);
+		return;
+	}
+
+	RootGrid grid;
+	grid.build(roots);
+
+	// k nearest neighbors of each root (in parallel, queries are read-only)
+	std::vector<int> knnIdx(n * k, -1);
+	std::vector<int> knnCount(n, 0);
+
+	ParallelUtil::parallelFor(0, n, [&](int begin, int end)
+	{
+		std::vector<float> sqrDists(k + 1);
+		for (int i = begin; i < end; i++)
+			knnCount[i] = grid.findKNearest(roots[i], k, knnIdx.data() + i*k, sqrDists.data(), i);
+	}, 256);
+
+	// flag the edges i->j whose reverse j->i is not found by the kNN search of j
+	std::vector<char> needReverse(n * k, 0);
+
+	ParallelUtil::parallelFor(0, n, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			for (int m = 0; m < knnCount[i]; m++)
+			{
+				const int  j    = knnIdx[i*k + m];
+				const int* nbrJ = knnIdx.data() + j*k;
+				needReverse[i*k + m] = (std::find(nbrJ, nbrJ + knnCount[j], i) == nbrJ + knnCount[j]);
+			}
+		}
+	}, 256);
+
+	// row sizes and offsets
+	m_offsets.assign(n + 1, 0);
+	for (int i = 0; i < n; i++)
+	{
+		m_offsets[i + 1] += knnCount[i];
+		for (int m = 0; m < knnCount[i]; m++)
+		{
+			if (needReverse[i*k + m])
+				m_offsets[knnIdx[i*k + m] + 1]++;
+		}
+	}
+	for (int i = 0; i < n; i++)
+		m_offsets[i + 1] += m_offsets[i];
+
+	m_indices.resize(m_offsets[n]);
+
+	// forward edges go to the front of each row...
+	ParallelUtil::parallelFor(0, n, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+			std::copy(knnIdx.data() + i*k, knnIdx.data() + i*k + knnCount[i], m_indices.data() + m_offsets[i]);
+	}, 256);
+
+	// ...followed by the missing reverse edges
+	std::vector<int> cursor(n);
+	for (int i = 0; i < n; i++)
+		cursor[i] = m_offsets[i] + knnCount[i];
+
+	for (int i = 0; i < n; i++)
+	{
+		for (int m = 0; m < knnCount[i]; m++)
+		{
+			if (needReverse[i*k + m])
+				m_indices[cursor[knnIdx[i*k + m]]++] = i;
+		}
+	}
+
+	sortRows();
+}
+
+
+void StrandNbrGraph::buildQuotient(const StrandNbrGraph& nodeGraph, const std::vector<int>& clusterIDs,
+								   int numClusters)
+{
+	clear();
+
+	if (numClusters < 1)
+		return;
+
+	const int n = nodeGraph.numNodes();
+
+	// upper bound of each row: number of crossing edges
+	std::vector<int> rowStart(numClusters + 1, 0);
+	for (int i = 0; i < n; i++)
+	{
+		const int cId1 = clusterIDs[i];
+		if (cId1 < 0) continue;
+
+		const int* nbrs = nodeGraph.neighbors(i);
+		for (int j = 0; j < nodeGraph.degree(i); j++)
+		{
+			const int cId2 = clusterIDs[nbrs[j]];
+			if (cId2 >= 0 && cId2 != cId1)
+				rowStart[cId1 + 1]++;
+		}
+	}
+	for (int c = 0; c < numClusters; c++)
+		rowStart[c + 1] += rowStart[c];
+
+	std::vector<int> crossNbrs(rowStart[numClusters]);
+	std::vector<int> cursor(rowStart.begin(), rowStart.end() - 1);
+	for (int i = 0; i < n; i++)
+	{
+		const int cId1 = clusterIDs[i];
+		if (cId1 < 0) continue;
+
+		const int* nbrs = nodeGraph.neighbors(i);
+		for (int j = 0; j < nodeGraph.degree(i); j++)
+		{
+			const int cId2 = clusterIDs[nbrs[j]];
+			if (cId2 >= 0 && cId2 != cId1)
+				crossNbrs[cursor[cId1]++] = cId2;
+		}
+	}
+
+	// remove duplicates per row (the node graph is symmetric, so is the result)
+	std::vector<int> rowSize(numClusters);
+	ParallelUtil::parallelFor(0, numClusters, [&](int begin, int end)
+	{
+		for (int c = begin; c < end; c++)
+		{
+			int* first = crossNbrs.data() + rowStart[c];
+			int* last  = crossNbrs.data() + rowStart[c + 1];
+			std::sort(first, last);
+			rowSize[c] = std::unique(first, last) - first;
+		}
+	}, 64);
+
+	m_offsets.assign(numClusters + 1, 0);
+	for (int c = 0; c < numClusters; c++)
+		m_offsets[c + 1] = m_offsets[c] + rowSize[c];
+
+	m_indices.resize(m_offsets[numClusters]);
+	ParallelUtil::parallelFor(0, numClusters, [&](int begin, int end)
+	{
+		for (int c = begin; c < end; c++)
+			std::copy(crossNbrs.begin() + rowStart[c], crossNbrs.begin() + rowStart[c] + rowSize[c],
+					  m_indices.begin() + m_offsets[c]);
+	}, 256);
+}
+
+
+void StrandNbrGraph::sortRows()
+{
+	ParallelUtil::parallelFor(0, numNodes(), [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+			std::sort(m_indices.begin() + m_offsets[i], m_indices.begin() + m_offsets[i + 1]);
+	}, 256);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "QDXUT.h"
+
+#include <vector>
+
+// Symmetric strand adjacency in compressed sparse row form: the neighbors of
+// node i are indices()[offsets()[i] .. offsets()[i+1]), sorted ascending.
+class StrandNbrGraph
+{
+public:
+	StrandNbrGraph() {}
+
+	// k-nearest root neighbors, symmetrized (j in N(i) <=> i in N(j))
+	void	buildKNearest(const std::vector<XMFLOAT3>& roots, int numNbrs);
+
+	// Cluster-level graph: clusters A and B are adjacent if any of their
+	// member nodes are adjacent in nodeGraph. Nodes with cluster ID < 0 are ignored.
+	void	buildQuotient(const StrandNbrGraph& nodeGraph, const std::vector<int>& clusterIDs,
+						  int numClusters);
+
+	void	clear() { m_offsets.clear(); m_indices.clear(); }
+
+	bool	isEmpty() const { return m_offsets.empty(); }
+	int		numNodes() const { return m_offsets.empty() ? 0 : (int)m_offsets.size() - 1; }
+	int		numEdges() const { return m_indices.size(); }
+
+	int			degree(int i) const		{ return m_offsets[i+1] - m_offsets[i]; }
+	const int*	neighbors(int i) const	{ return m_indices.data() + m_offsets[i]; }
+
+	const std::vector<int>&	offsets() const { return m_offsets; }
+	const std::vector<int>&	indices() const { return m_indices; }
+
+	// for (de)serialization
+	void	assign(const std::vector<int>& offsets, const std::vector<int>& indices)
+			{ m_offsets = offsets; m_indices = indices; }
+
+private:
+
+	void	sortRows();
+
+	std::vector<int>	m_offsets;
+	std::vector<int>	m_indices;
+};
@@ -0,0 +1,290 @@
+#include "StrandTransport.h"
+
+#include <algorithm>
+
+#include "Interpolator.h"
+#include <lemon/smart_graph.h>
+#include <lemon/network_simplex.h>
+
+#include "RootGrid.h"
+#include "ParallelUtil.h"
+
+namespace
+{
+	// Quantize weights to integers summing exactly to total (rounding the
+	// cumulative sums keeps every value >= 0). Weights summing to zero are
+	// taken as uniform.
+	void quantizeWeights(const std::vector<double>& weights, int total, std::vector<int>& quantized)
+	{
+		double sum = 0;
+		for (int i = 0; i < weights.size(); i++)
+			sum += weights[i];
+
+		quantized.resize(weights.size());
+
+		if (sum <= 0)
+		{
+			const int n = weights.size();
+			for (int i = 0; i < n; i++)
+				quantized[i] = (int)((long long)(i + 1) * total / n - (long long)i * total / n);
+			return;
+		}
+
+		double cum = 0;
+		long long prev = 0;
+		for (int i = 0; i < weights.size(); i++)
+		{
+			cum += weights[i];
+			const long long curr = (i + 1 == weights.size()) ? total : (long long)(cum / sum * total + 0.5);
+			quantized[i] = (int)(curr - prev);
+			prev = curr;
+		}
+	}
+
+	void growBox(const std::vector<XMFLOAT3>& points, XMFLOAT3& lo, XMFLOAT3& hi)
+	{
+		for (int i = 0; i < points.size(); i++)
+		{
+			lo.x = std::min(lo.x, points[i].x);	hi.x = std::max(hi.x, points[i].x);
+			lo.y = std::min(lo.y, points[i].y);	hi.y = std::max(hi.y, points[i].y);
+			lo.z = std::min(lo.z, points[i].z);	hi.z = std::max(hi.z, points[i].z);
+		}
+	}
+
+	// spread the low 10 bits of v to every third bit
+	unsigned int spreadBits(unsigned int v)
+	{
+		v = (v | (v << 16)) & 0x030000FF;
+		v = (v | (v <<  8)) & 0x0300F00F;
+		v = (v | (v <<  4)) & 0x030C30C3;
+		v = (v | (v <<  2)) & 0x09249249;
+		return v;
+	}
+
+	// Morton (Z-order) codes of points in the box [lo, hi], 10 bits per axis
+	void mortonCodes(const std::vector<XMFLOAT3>& points, const XMFLOAT3& lo, const XMFLOAT3& hi,
+					 std::vector<unsigned int>& codes)
+	{
+		const float sx = hi.x > lo.x ? 1024.0f / (hi.x - lo.x) : 0.0f;
+		const float sy = hi.y > lo.y ? 1024.0f / (hi.y - lo.y) : 0.0f;
+		const float sz = hi.z > lo.z ? 1024.0f / (hi.z - lo.z) : 0.0f;
+
+		codes.resize(points.size());
+		for (int i = 0; i < points.size(); i++)
+		{
+			const unsigned int x = std::min(1023, (int)((points[i].x - lo.x) * sx));
+			const unsigned int y = std::min(1023, (int)((points[i].y - lo.y) * sy));
+			const unsigned int z = std::min(1023, (int)((points[i].z - lo.z) * sz));
+			codes[i] = spreadBits(x) | (spreadBits(y) << 1) | (spreadBits(z) << 2);
+		}
+	}
+
+	struct CodeLess
+	{
+		const std::vector<unsigned int>& codes;
+		CodeLess(const std::vector<unsigned int>& c) : codes(c) {}
+		bool operator()(int a, int b) const
+		{
+			return codes[a] < codes[b] || (codes[a] == codes[b] && a < b);
+		}
+	};
+}
+
+
+StrandTransport::StrandTransport()
+	: m_numCandidates(128), m_rootFactor(4), m_numArcs(0), m_cost(0)
+{
+}
+
+
+// For each 'from' strand, the m_numCandidates 'to' strands nearest in feature
+// distance among those with the nearest roots. Arc keys are src*numDst+dst.
+void StrandTransport::findCandidates(const StrandFeatures& fromFeatures, const std::vector<XMFLOAT3>& fromRoots,
+									 const StrandFeatures& toFeatures, const std::vector<XMFLOAT3>& toRoots,
+									 bool reversed, std::vector<long long>& arcKeys) const
+{
+	const int numFrom = fromRoots.size();
+	const int numTo	  = toRoots.size();
+	const int k		  = std::min(m_numCandidates, numTo);
+	const int numNear = std::min(m_numCandidates * m_rootFactor, numTo);
+
+	RootGrid grid;
+	grid.build(toRoots);
+
+	std::vector<int> candIds((size_t)numFrom * k);
+
+	ParallelUtil::parallelFor(0, numFrom, [&](int begin, int end)
+	{
+		std::vector<int>	nearIds(numNear);
+		std::vector<float>	nearDists(numNear);
+		std::vector<std::pair<float, int> > cands(numNear);
+
+		for (int i = begin; i < end; i++)
+		{
+			const int numFound = grid.findKNearest(fromRoots[i], numNear, nearIds.data(), nearDists.data());
+
+			toFeatures.sqrDists(fromFeatures.feature(i), nearIds.data(), numFound, nearDists.data());
+			for (int j = 0; j < numFound; j++)
+				cands[j] = std::make_pair(nearDists[j], nearIds[j]);
+
+			const int numKept = std::min(k, numFound);
+			std::partial_sort(cands.begin(), cands.begin() + numKept, cands.begin() + numFound);
+
+			for (int j = 0; j < k; j++)
+				candIds[(size_t)i * k + j] = j < numKept ? cands[j].second : -1;
+		}
+	}, 64);
+
+	const int numDst = reversed ? numFrom : numTo;
+	for (int i = 0; i < numFrom; i++)
+	{
+		for (int j = 0; j < k; j++)
+		{
+			const int to = candIds[(size_t)i * k + j];
+			if (to < 0)
+				continue;
+
+			if (reversed)
+				arcKeys.push_back((long long)to * numDst + i);
+			else
+				arcKeys.push_back((long long)i * numDst + to);
+		}
+	}
+}
+
+
+bool StrandTransport::solve(const StrandFeatures& srcFeatures, const std::vector<XMFLOAT3>& srcRoots,
+							const std::vector<double>& srcWeights,
+							const StrandFeatures& dstFeatures, const std::vector<XMFLOAT3>& dstRoots,
+							const std::vector<double>& dstWeights,
+							std::vector<TsFlow>& flows)
+{
+	typedef lemon::SmartDigraph Digraph;
+	typedef lemon::NetworkSimplex<Digraph, int, long long> Solver;
+
+	flows.clear();
+	m_numArcs = 0;
+	m_cost	  = 0;
+
+	const int numSrc = srcRoots.size();
+	const int numDst = dstRoots.size();
+	if (numSrc < 1 || numDst < 1)
+		return false;
+
+	// integer supplies and demands with equal totals
+	const int totalSupply = std::max(1000000, 100 * std::max(numSrc, numDst));
+
+	std::vector<int> supplies, demands;
+	quantizeWeights(srcWeights, totalSupply, supplies);
+	quantizeWeights(dstWeights, totalSupply, demands);
+
+	// candidate arcs in both directions
+	std::vector<long long> arcKeys;
+	arcKeys.reserve((size_t)(numSrc + numDst) * m_numCandidates + numSrc + numDst);
+
+	findCandidates(srcFeatures, srcRoots, dstFeatures, dstRoots, false, arcKeys);
+	findCandidates(dstFeatures, dstRoots, srcFeatures, srcRoots, true, arcKeys);
+
+	// North-west corner arcs over strands sorted along a Morton curve of their
+	// roots: a feasible solution whose arcs mostly join nearby roots, so the
+	// flow the candidates can't carry doesn't cross the whole scalp.
+	XMFLOAT3 lo = srcRoots[0], hi = srcRoots[0];
+	growBox(srcRoots, lo, hi);
+	growBox(dstRoots, lo, hi);
+
+	std::vector<unsigned int> srcCodes, dstCodes;
+	mortonCodes(srcRoots, lo, hi, srcCodes);
+	mortonCodes(dstRoots, lo, hi, dstCodes);
+
+	std::vector<int> srcOrder(numSrc), dstOrder(numDst);
+	for (int i = 0; i < numSrc; i++) srcOrder[i] = i;
+	for (int i = 0; i < numDst; i++) dstOrder[i] = i;
+	std::sort(srcOrder.begin(), srcOrder.end(), CodeLess(srcCodes));
+	std::sort(dstOrder.begin(), dstOrder.end(), CodeLess(dstCodes));
+
+	int si = 0, di = 0;
+	int srcLeft = supplies[srcOrder[0]], dstLeft = demands[dstOrder[0]];
+	while (si < numSrc && di < numDst)
+	{
+		arcKeys.push_back((long long)srcOrder[si] * numDst + dstOrder[di]);
+
+		const int amount = std::min(srcLeft, dstLeft);
+		srcLeft -= amount;
+		dstLeft -= amount;
+
+		if (srcLeft == 0 && ++si < numSrc)
+			srcLeft = supplies[srcOrder[si]];
+		if (dstLeft == 0 && ++di < numDst)
+			dstLeft = demands[dstOrder[di]];
+	}
+
+	std::sort(arcKeys.begin(), arcKeys.end());
+	arcKeys.erase(std::unique(arcKeys.begin(), arcKeys.end()), arcKeys.end());
+	m_numArcs = arcKeys.size();
+
+	// arc costs
+	std::vector<float> arcCosts(m_numArcs);
+	ParallelUtil::parallelFor(0, m_numArcs, [&](int begin, int end)
+	{
+		for (int a = begin; a < end; a++)
+		{
+			const int s = (int)(arcKeys[a] / numDst);
+			const int d = (int)(arcKeys[a] % numDst);
+			arcCosts[a] = StrandFeatures::sqrDist(srcFeatures.feature(s), dstFeatures.feature(d)) / StrandFeatures::Dim;
+		}
+	}, 1024);
+
+	const float maxCost = *std::max_element(arcCosts.begin(), arcCosts.end());
+	const double costScale = maxCost > 0 ? 1e9 / maxCost : 1.0;
+
+	// sparse network
+	Digraph graph;
+	graph.reserveNode(numSrc + numDst);
+	graph.reserveArc(m_numArcs);
+
+	for (int i = 0; i < numSrc + numDst; i++)
+		graph.addNode();
+
+	Digraph::ArcMap<long long> costMap(graph);
+	Digraph::NodeMap<int>	   supplyMap(graph);
+
+	for (int a = 0; a < m_numArcs; a++)
+	{
+		const int s = (int)(arcKeys[a] / numDst);
+		const int d = (int)(arcKeys[a] % numDst);
+		Digraph::Arc arc = graph.addArc(graph.nodeFromId(s), graph.nodeFromId(numSrc + d));
+		costMap[arc] = (long long)(arcCosts[a] * costScale + 0.5);
+	}
+
+	for (int i = 0; i < numSrc; i++)
+		supplyMap[graph.nodeFromId(i)] = supplies[i];
+	for (int i = 0; i < numDst; i++)
+		supplyMap[graph.nodeFromId(numSrc + i)] = -demands[i];
+
+	Solver solver(graph);
+	solver.costMap(costMap).supplyMap(supplyMap);
+
+	if (solver.run() != Solver::OPTIMAL)
+	{
+		printf("ERROR: sparse strand transport is infeasible!\n");
+		return false;
+	}
+
+	// collect flows
+	for (int a = 0; a < m_numArcs; a++)
+	{
+		const int amount = solver.flow(graph.arcFromId(a));
+		if (amount <= 0)
+			continue;
+
+		TsFlow flow;
+		flow.from	= (int)(arcKeys[a] / numDst);
+		flow.to		= (int)(arcKeys[a] % numDst);
+		flow.amount = (double)amount / totalSupply;
+		flows.push_back(flow);
+
+		m_cost += flow.amount * arcCosts[a];
+	}
+
+	return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "QDXUT.h"
+#include "StrandFeatures.h"
+
+#include <vector>
+
+struct TsFlow;
+
+// Sparse approximation of the strand EMD. Instead of the full bipartite graph
+// (one arc per source/target pair), the transport problem is solved on a
+// candidate graph holding
+//   - for each source, the k targets nearest in feature distance among the
+//     rootFactor*k targets with the nearest roots (and vice versa), and
+//   - the north-west corner solution of strands sorted along a Morton curve
+//     of their roots, which makes the problem feasible whatever the candidates.
+// Memory and time grow with (N+M)*k instead of N*M. Costs are squared feature
+// distances divided by StrandFeatures::Dim, as in HairFlows.
+class StrandTransport
+{
+public:
+	StrandTransport();
+
+	void	setNumCandidates(int k, int rootFactor = 4) { m_numCandidates = k; m_rootFactor = rootFactor; }
+
+	// Flow amounts are fractions of the total (normalized) weight. Features
+	// must be absolute. Returns false if the inputs are empty.
+	bool	solve(const StrandFeatures& srcFeatures, const std::vector<XMFLOAT3>& srcRoots,
+				  const std::vector<double>& srcWeights,
+				  const StrandFeatures& dstFeatures, const std::vector<XMFLOAT3>& dstRoots,
+				  const std::vector<double>& dstWeights,
+				  std::vector<TsFlow>& flows);
+
+	// statistics of the last solve
+	int		numArcs() const { return m_numArcs; }
+	double	cost() const	{ return m_cost; }
+
+private:
+
+	void	findCandidates(const StrandFeatures& fromFeatures, const std::vector<XMFLOAT3>& fromRoots,
+						   const StrandFeatures& toFeatures, const std::vector<XMFLOAT3>& toRoots,
+						   bool reversed, std::vector<long long>& arcKeys) const;
+
+	int		m_numCandidates;
+	int		m_rootFactor;
+
+	int		m_numArcs;
+	double	m_cost;
+};
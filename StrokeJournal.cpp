@@ -0,0 +1,273 @@
+#include "StrokeJournal.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <QtCore/QtGlobal>
+
+#include "ParallelUtil.h"
+
+
+StrokeJournal::StrokeJournal()
+	: m_numApplied(0), m_maxBytes(256 << 20), m_numBytes(0), m_pModel(NULL), m_levelIdx(-1), m_kind(StrokeTrim)
+{
+}
+
+
+void StrokeJournal::clear()
+{
+	m_strokes.clear();
+	m_numApplied = 0;
+	m_numBytes = 0;
+
+	m_pModel = NULL;
+	m_slotStrands.clear();
+	m_slots.clear();
+}
+
+
+void StrokeJournal::setMaxBytes(size_t bytes)
+{
+	m_maxBytes = bytes;
+	trim();
+}
+
+
+void StrokeJournal::beginStroke(HairStrandModel* pModel, int levelIdx, StrokeKind kind,
+								const std::vector<int>& strandIds)
+{
+	m_pModel = pModel;
+	m_levelIdx = levelIdx;
+	m_kind = kind;
+	m_slotStrands = strandIds;
+
+	m_slots.resize(strandIds.size());
+	for (int s = 0; s < m_slots.size(); s++)
+	{
+		m_slots[s].firstVertex = -1;
+		m_slots[s].positions.clear();
+		m_slots[s].colors.clear();
+	}
+}
+
+
+void StrokeJournal::saveStrand(int slot, int firstVertex)
+{
+	StrandSlot& saved = m_slots[slot];
+	const Strand* strand = m_pModel->getStrandAt(m_slotStrands[slot]);
+	const StrandVertex* vertices = strand->vertices();
+
+	firstVertex = std::min(std::max(firstVertex, 0), strand->numVertices());
+
+	// vertices before the saved range have not been modified yet
+	const int end = saved.firstVertex < 0 ? strand->numVertices() : saved.firstVertex;
+	if (firstVertex >= end && saved.firstVertex >= 0)
+		return;
+
+	const int count = end - firstVertex;
+	saved.positions.insert(saved.positions.begin(), count, XMFLOAT3());
+	for (int j = 0; j < count; j++)
+		saved.positions[j] = vertices[firstVertex + j].position;
+
+	if (m_kind == StrokeTrim)
+	{
+		saved.colors.insert(saved.colors.begin(), count, XMFLOAT4());
+		for (int j = 0; j < count; j++)
+			saved.colors[j] = vertices[firstVertex + j].color;
+	}
+	saved.firstVertex = firstVertex;
+}
+
+
+bool StrokeJournal::endStroke()
+{
+	if (!m_pModel)
+		return false;
+
+	// slots in strand order (as the stroke tools list them)
+	std::vector<int> order(m_slots.size());
+	for (int s = 0; s < order.size(); s++)
+		order[s] = s;
+	if (!std::is_sorted(m_slotStrands.begin(), m_slotStrands.end()))
+		std::sort(order.begin(), order.end(), [&](int a, int b) { return m_slotStrands[a] < m_slotStrands[b]; });
+
+	// edits and their place in the saved arrays, then the arrays in parallel
+	std::vector<StrandEdit> edits;
+	std::vector<int> editSlots;
+	int numSaved = 0;
+	for (int o = 0; o < order.size(); o++)
+	{
+		const StrandSlot& saved = m_slots[order[o]];
+		if (saved.firstVertex < 0)
+			continue;
+
+		const Strand* strand = m_pModel->getStrandAt(m_slotStrands[order[o]]);
+
+		StrandEdit edit;
+		edit.strandId	 = m_slotStrands[order[o]];
+		edit.firstVertex = saved.firstVertex;
+		edit.numBefore	 = saved.positions.size();
+		edit.numAfter	 = std::max(strand->numVertices() - saved.firstVertex, 0);
+		edit.offset		 = numSaved;
+		edits.push_back(edit);
+		editSlots.push_back(order[o]);
+
+		Q_ASSERT(m_kind == StrokeTrim || edit.numAfter == edit.numBefore);
+		numSaved += edit.numBefore + edit.numAfter;
+	}
+
+	if (edits.empty())
+	{
+		m_pModel = NULL;
+		m_slotStrands.clear();
+		m_slots.clear();
+		return false;
+	}
+
+	// a new stroke drops the strokes undone before it
+	while (m_strokes.size() > m_numApplied)
+	{
+		m_numBytes -= m_strokes.back().numBytes();
+		m_strokes.pop_back();
+	}
+
+	m_strokes.push_back(StrokeRecord());
+	StrokeRecord& stroke = m_strokes.back();
+	stroke.levelIdx = m_levelIdx;
+	stroke.kind		= m_kind;
+	stroke.edits.swap(edits);
+	stroke.positions.resize(numSaved);
+	stroke.colors.resize(m_kind == StrokeTrim ? numSaved : 0);
+
+	ParallelUtil::parallelFor(0, stroke.edits.size(), [&](int begin, int end)
+	{
+		for (int e = begin; e < end; e++)
+		{
+			const StrandEdit& edit = stroke.edits[e];
+			const StrandSlot& saved = m_slots[editSlots[e]];
+			const StrandVertex* after = m_pModel->getStrandAt(edit.strandId)->vertices() + edit.firstVertex;
+
+			XMFLOAT3* positions = stroke.positions.data() + edit.offset;
+			std::copy(saved.positions.begin(), saved.positions.end(), positions);
+			for (int j = 0; j < edit.numAfter; j++)
+				positions[edit.numBefore + j] = after[j].position;
+
+			if (m_kind == StrokeTrim)
+			{
+				XMFLOAT4* colors = stroke.colors.data() + edit.offset;
+				std::copy(saved.colors.begin(), saved.colors.end(), colors);
+				for (int j = 0; j < edit.numAfter; j++)
+					colors[edit.numBefore + j] = after[j].color;
+			}
+		}
+	}, 256);
+
+	m_pModel = NULL;
+	m_slotStrands.clear();
+	m_slots.clear();
+
+	m_numBytes += stroke.numBytes();
+	m_numApplied++;
+
+	trim();
+	return true;
+}
+
+
+void StrokeJournal::trim()
+{
+	// undone strokes go first: redo must replay the strokes in order, right
+	// after the applied ones
+	while (m_strokes.size() > m_numApplied && m_numBytes > m_maxBytes)
+	{
+		m_numBytes -= m_strokes.back().numBytes();
+		m_strokes.pop_back();
+	}
+
+	while (!m_strokes.empty() && m_numBytes > m_maxBytes)
+	{
+		m_numBytes -= m_strokes.front().numBytes();
+		m_strokes.pop_front();
+		m_numApplied = std::max(m_numApplied - 1, 0);
+	}
+}
+
+
+int StrokeJournal::undo(HairStrandModel& model, int& first, int& last)
+{
+	if (!canUndo())
+		return -1;
+
+	const StrokeRecord& stroke = m_strokes[--m_numApplied];
+	restore(stroke, false, model, first, last);
+	return stroke.levelIdx;
+}
+
+
+int StrokeJournal::redo(HairStrandModel& model, int& first, int& last)
+{
+	if (!canRedo())
+		return -1;
+
+	const StrokeRecord& stroke = m_strokes[m_numApplied++];
+	restore(stroke, true, model, first, last);
+	return stroke.levelIdx;
+}
+
+
+void StrokeJournal::restore(const StrokeRecord& stroke, bool after, HairStrandModel& model,
+							int& first, int& last) const
+{
+	first = model.numStrands();
+	last  = 0;
+
+	// edits are sorted by strand
+	for (int e = 0; e < stroke.edits.size() && stroke.edits[e].strandId < model.numStrands(); e++)
+	{
+		first = std::min(first, stroke.edits[e].strandId);
+		last  = stroke.edits[e].strandId + 1;
+	}
+
+	ParallelUtil::parallelFor(0, stroke.edits.size(), [&](int begin, int end)
+	{
+		std::vector<StrandVertex> vertices;
+
+		for (int e = begin; e < end; e++)
+		{
+			const StrandEdit& edit = stroke.edits[e];
+			if (edit.strandId >= model.numStrands())
+				continue;
+
+			const int offset = after ? edit.offset + edit.numBefore : edit.offset;
+			const int count	 = after ? edit.numAfter : edit.numBefore;
+			const XMFLOAT3* positions = stroke.positions.data() + offset;
+
+			Strand* strand = model.getStrandAt(edit.strandId);
+			if (stroke.kind == StrokeMove)
+			{
+				StrandVertex* dst = strand->vertices() + edit.firstVertex;
+				const int n = std::min(count, strand->numVertices() - edit.firstVertex);
+				for (int j = 0; j < n; j++)
+					dst[j].position = positions[j];
+				continue;
+			}
+
+			// vertices still in the strand keep their other attributes
+			StrandVertex zero;
+			memset(&zero, 0, sizeof(zero));
+			vertices.assign(count, zero);
+
+			const int numKept = std::max(std::min(count, strand->numVertices() - edit.firstVertex), 0);
+			std::copy(strand->vertices() + edit.firstVertex, strand->vertices() + edit.firstVertex + numKept,
+					  vertices.begin());
+
+			const XMFLOAT4* colors = stroke.colors.data() + offset;
+			for (int j = 0; j < count; j++)
+			{
+				vertices[j].position = positions[j];
+				vertices[j].color	 = colors[j];
+			}
+			strand->setVertices(edit.firstVertex, vertices.data(), count);
+		}
+	}, 64);
+}
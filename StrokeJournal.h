@@ -0,0 +1,110 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+
+#include "HairStrandModel.h"
+
+// Undo/redo log of the stroke edits of a strand model. A stroke only saves the
+// strands it modifies, copy-on-write: before a strand is changed its vertices
+// from the first one affected are copied once, and when the stroke ends the
+// same range is copied again as the redo state. Undo and redo then only
+// restore these ranges, and report the touched strands for an incremental
+// buffer update.
+//
+// Only the attributes a stroke can change are saved: positions and colors of
+// trimming strokes (the range sizes give the lengths), positions of moving
+// ones. Models keep no other vertex data (see HairStrandModel::load), so
+// vertices restored past the end of a strand have them zeroed.
+//
+// Once the saved vertices exceed maxBytes, undone strokes are dropped from the
+// last one, then applied strokes from the oldest one.
+class StrokeJournal
+{
+public:
+	StrokeJournal();
+
+	void	clear();
+
+	void	setMaxBytes(size_t bytes);
+	size_t	maxBytes() const	{ return m_maxBytes; }
+	size_t	numBytes() const	{ return m_numBytes; }
+
+	int		numStrokes() const	{ return m_strokes.size(); }
+	bool	canUndo() const		{ return m_numApplied > 0; }
+	bool	canRedo() const		{ return m_numApplied < m_strokes.size(); }
+
+	enum StrokeKind
+	{
+		StrokeTrim,		// shortens strands and changes their colors
+		StrokeMove,		// moves vertices, keeping lengths and colors
+	};
+
+	// Recording a stroke on level levelIdx of a model: call beginStroke with
+	// the strands it may modify (each once), saveStrand before modifying the
+	// strand of a slot, then endStroke. saveStrand may be called from several
+	// threads for different slots, and again with a lower firstVertex.
+	void	beginStroke(HairStrandModel* pModel, int levelIdx, StrokeKind kind,
+						const std::vector<int>& strandIds);
+	void	saveStrand(int slot, int firstVertex);
+	bool	endStroke();	// false if nothing was modified
+
+	// Restore the strands of the last (next) stroke in model. Returns the level
+	// of the stroke and the range [first, last) of strands touched, or -1 if
+	// there is nothing to undo (redo).
+	int		undo(HairStrandModel& model, int& first, int& last);
+	int		redo(HairStrandModel& model, int& first, int& last);
+
+	// level of the stroke undo (redo) would restore, -1 if none
+	int		undoLevel() const	{ return canUndo() ? m_strokes[m_numApplied - 1].levelIdx : -1; }
+	int		redoLevel() const	{ return canRedo() ? m_strokes[m_numApplied].levelIdx : -1; }
+
+private:
+
+	// vertices [firstVertex, ...) of a strand before and after a stroke; the
+	// before vertices come first in the stroke's arrays
+	struct StrandEdit
+	{
+		int		strandId;
+		int		firstVertex;
+		int		numBefore;
+		int		numAfter;
+		int		offset;
+	};
+
+	struct StrokeRecord
+	{
+		int							levelIdx;
+		StrokeKind					kind;
+		std::vector<StrandEdit>		edits;		// sorted by strand
+		std::vector<XMFLOAT3>		positions;
+		std::vector<XMFLOAT4>		colors;		// trimming strokes only
+
+		size_t	numBytes() const { return edits.size()*sizeof(StrandEdit) + positions.size()*sizeof(XMFLOAT3) +
+										  colors.size()*sizeof(XMFLOAT4); }
+	};
+
+	// saved vertices of a strand of the stroke being recorded
+	struct StrandSlot
+	{
+		int						firstVertex;	// -1 if not saved
+		std::vector<XMFLOAT3>	positions;
+		std::vector<XMFLOAT4>	colors;
+	};
+
+	void	restore(const StrokeRecord& stroke, bool after, HairStrandModel& model, int& first, int& last) const;
+	void	trim();
+
+	std::deque<StrokeRecord>	m_strokes;
+	int							m_numApplied;	// strokes before the undo position
+
+	size_t	m_maxBytes;
+	size_t	m_numBytes;
+
+	// stroke being recorded
+	HairStrandModel*			m_pModel;
+	int							m_levelIdx;
+	StrokeKind					m_kind;
+	std::vector<int>			m_slotStrands;
+	std::vector<StrandSlot>		m_slots;
+};
@@ -0,0 +1,384 @@
+#include "StrokeTools.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include <opencv2/core/core.hpp>
+
+#include "MorphBlender.h"
+#include "ParallelUtil.h"
+#include "StrokeJournal.h"
+
+namespace
+{
+	void normalizeFloat2(XMFLOAT2& vec)
+	{
+		float len = vec.x*vec.x + vec.y*vec.y;
+		if (len > 0.0000001f)
+		{
+			vec.x /= len;
+			vec.y /= len;
+		}
+	}
+
+
+	void transformJointAngleXY(const XMFLOAT3* origVerts, const XMFLOAT3* newVerts,
+							   int vId, XMFLOAT2* pNewDir)
+	{
+		XMFLOAT2 origDir(origVerts[vId+1].x - origVerts[vId].x,
+						 origVerts[vId+1].y - origVerts[vId].y);
+
+		XMFLOAT2 origTangent(origVerts[vId].x - origVerts[vId-1].x,
+							 origVerts[vId].y - origVerts[vId-1].y);
+		float origLen = sqrtf(origTangent.x*origTangent.x + origTangent.y*origTangent.y);
+		if (origLen < 0.000001f)
+		{
+			*pNewDir = origDir;
+			return;
+		}
+
+		XMFLOAT2 newTangent(newVerts[vId].x - newVerts[vId-1].x,
+							newVerts[vId].y - newVerts[vId-1].y);
+		float newLen = sqrtf(newTangent.x*newTangent.x + newTangent.y*newTangent.y);
+		if (newLen < 0.0000001f)
+		{
+			*pNewDir = origDir;
+			return;
+		}
+
+		// relative input angle
+		origDir.x /= origLen;
+		origDir.y /= origLen;
+		XMFLOAT2 origNormal(origTangent.y, -origTangent.x);
+		XMFLOAT2 origRelDir(origDir.x*origTangent.x + origDir.y*origTangent.y,
+							origDir.x*origNormal.x  + origDir.y*origNormal.y);
+
+		// absolute new angle
+		newTangent.x /= newLen;
+		newTangent.y /= newLen;
+		XMFLOAT2 newNormal(newTangent.y, -newTangent.x);
+		pNewDir->x = origRelDir.x*newTangent.x + origRelDir.y*newNormal.x;
+		pNewDir->y = origRelDir.x*newTangent.y + origRelDir.y*newNormal.y;
+	}
+}
+
+
+void StrokeTools::buildStrokeGrid(const HairStrandModel& model, const MorphBlender* pBlended,
+								  const XMFLOAT4X4& world, float cellSize, ScreenGrid& grid)
+{
+	std::vector<int> strandStart(model.numStrands() + 1, 0);
+	for (int i = 0; i < model.numStrands(); i++)
+		strandStart[i + 1] = strandStart[i] + model.getStrandAt(i)->numVertices();
+
+	// transform vertices to screen space...
+	std::vector<XMFLOAT2> points(strandStart.back());
+	const XMMATRIX mWorld = XMLoadFloat4x4(&world);
+	ParallelUtil::parallelFor(0, model.numStrands(), [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			const StrandVertex* vertices = model.getStrandAt(i)->vertices();
+			for (int j = 0; j < model.getStrandAt(i)->numVertices(); j++)
+			{
+				XMVECTOR vec = XMLoadFloat3(pBlended ? &pBlended->position(i, j) : &vertices[j].position);
+				vec = XMVector3Transform(vec, mWorld);
+
+				points[strandStart[i] + j] = XMFLOAT2(XMVectorGetX(vec), -XMVectorGetY(vec));
+			}
+		}
+	}, 64);
+
+	grid.build(points, strandStart, cellSize);
+}
+
+
+void StrokeTools::findStrokeRuns(const std::vector<StrokeHit>& hits, std::vector<int>& runStart,
+								 std::vector<int>& strandIds)
+{
+	runStart.clear();
+	strandIds.clear();
+	for (int h = 0; h < hits.size(); h++)
+	{
+		if (h == 0 || hits[h].strandId != hits[h - 1].strandId)
+		{
+			runStart.push_back(h);
+			strandIds.push_back(hits[h].strandId);
+		}
+	}
+	runStart.push_back(hits.size());
+}
+
+
+int StrokeTools::deleteStrands(HairStrandModel& model, int levelIdx, const std::vector<StrokeHit>& hits,
+							   StrokeJournal& journal)
+{
+	std::vector<int> runStart, strandIds;
+	findStrokeRuns(hits, runStart, strandIds);
+
+	journal.beginStroke(&model, levelIdx, StrokeJournal::StrokeTrim, strandIds);
+
+	// for each hair strand under the stroke...
+	int numChanges = 0;
+	for (int r = 0; r < strandIds.size(); r++)
+	{
+		Strand* strand = model.getStrandAt(strandIds[r]);
+		for (int h = runStart[r]; h < runStart[r + 1]; h++)
+		{
+			if (hits[h].vertexId < strand->numVertices())
+			{
+				// found a valid vertex!
+				journal.saveStrand(r, 0);
+				strand->trim(0);
+				numChanges++;
+				break;
+			}
+		}
+	}
+
+	journal.endStroke();
+
+	return numChanges;
+}
+
+
+int StrokeTools::cutStrands(HairStrandModel& model, int levelIdx, const std::vector<StrokeHit>& hits,
+							int fuzziness, unsigned seed, StrokeJournal& journal)
+{
+	std::vector<int> runStart, strandIds;
+	findStrokeRuns(hits, runStart, strandIds);
+
+	journal.beginStroke(&model, levelIdx, StrokeJournal::StrokeTrim, strandIds);
+
+	// for each hair strand under the stroke
+	std::atomic<int> numChanges(0);
+	ParallelUtil::parallelFor(0, strandIds.size(), [&](int begin, int end)
+	{
+		for (int r = begin; r < end; r++)
+		{
+			const int strandId = strandIds[r];
+			Strand* strand = model.getStrandAt(strandId);
+			cv::RNG rng(((unsigned long long)seed << 32) ^ (unsigned long long)(strandId + 1));
+
+			// for each vertex under the stroke (until cut off)...
+			for (int h = runStart[r]; h < runStart[r + 1]; h++)
+			{
+				const int j = hits[h].vertexId;
+				if (j >= strand->numVertices())
+					break;
+
+				// random location
+				int d = rng.uniform(-fuzziness, fuzziness+1);
+
+				// the new tip and the vertex before it change alpha
+				const int newNumVerts = std::min(std::max(j+d+1, 1), strand->numVertices());
+				journal.saveStrand(r, newNumVerts - 2);
+
+				strand->trim(j+d);
+				numChanges++;
+			}
+		}
+	}, 16);
+
+	journal.endStroke();
+
+	return numChanges;
+}
+
+
+int StrokeTools::combStrands(HairStrandModel& model, int levelIdx, const std::vector<StrokeHit>& hits,
+							 XMFLOAT2* strokePts, int numStrokePts, float radius, float intensity,
+							 const XMFLOAT4X4& world, StrokeJournal& journal,
+							 int& firstModified, int& lastModified)
+{
+	firstModified = model.numStrands();
+	lastModified  = -1;
+
+	const int numPts = numStrokePts;
+	if (numPts < 2)
+		return 0;
+
+	std::vector<int> runStart, strandIds;
+	findStrokeRuns(hits, runStart, strandIds);
+
+	// Get transform matrices
+	XMMATRIX mWorld = XMLoadFloat4x4(&world);
+
+	// Compute inverse transform
+	XMVECTOR det;
+	XMMATRIX invWorld = XMMatrixInverse(&det, mWorld);
+
+	// smooth stroke
+	std::vector<XMFLOAT2> tempPts(numPts);
+	tempPts.front() = strokePts[0];
+	tempPts.back() = strokePts[numPts-1];
+	for (int pass = 0; pass < 5; pass++)
+	{
+		for (int i = 1; i < numPts - 1; i++)
+		{
+			tempPts[i].x = strokePts[i-1].x*0.25f + strokePts[i].x*0.5f + strokePts[i+1].x*0.25f;
+			tempPts[i].y = strokePts[i-1].y*0.25f + strokePts[i].y*0.5f + strokePts[i+1].y*0.25f;
+		}
+		memcpy(strokePts, tempPts.data(), sizeof(XMFLOAT2)*numPts);
+	}
+
+	// compute direction at each stroke point
+	std::vector<XMFLOAT2> strokeDirs(numPts);
+	strokeDirs[0].x = strokePts[1].x - strokePts[0].x;
+	strokeDirs[0].y = strokePts[1].y - strokePts[0].y;
+	for (int i = 1; i < numPts; i++)
+	{
+		strokeDirs[i].x = strokePts[i].x - strokePts[i-1].x;
+		strokeDirs[i].y = strokePts[i].y - strokePts[i-1].y;
+		strokeDirs[i].y = -strokeDirs[i].y;
+	}
+	// smooth direction
+	std::vector<XMFLOAT2> tempDirs(numPts);
+	tempDirs.front() = strokeDirs.front();
+	tempDirs.back() = strokeDirs.back();
+	for (int pass = 0; pass < 8; pass++)
+	{
+		tempDirs[0].x = 0.5f*(strokeDirs[0].x + strokeDirs[1].x);
+		tempDirs[0].y = 0.5f*(strokeDirs[0].y + strokeDirs[1].y);
+		tempDirs.back().x = 0.5f*(strokeDirs[numPts-1].x + strokeDirs[numPts-2].x);
+		tempDirs.back().x = 0.5f*(strokeDirs[numPts-1].y + strokeDirs[numPts-2].y);
+		for (int i = 1; i < numPts - 1; i++)
+		{
+			tempDirs[i].x = 0.333f*(strokeDirs[i-1].x + strokeDirs[i].x + strokeDirs[i+1].x);
+			tempDirs[i].y = 0.333f*(strokeDirs[i-1].y + strokeDirs[i].y + strokeDirs[i+1].y);
+		}
+		memcpy(strokeDirs.data(), tempDirs.data(), sizeof(XMFLOAT2)*numPts);
+	}
+	// normalize and apply intensity
+	for (int i = 0; i < numPts; i++)
+	{
+		float len = sqrtf(strokeDirs[i].x*strokeDirs[i].x + strokeDirs[i].y*strokeDirs[i].y);
+		if (len > 0.00001f)
+		{
+			strokeDirs[i].x *= intensity / len;
+			strokeDirs[i].y *= intensity / len;
+		}
+	}
+
+
+	const float sqRad = radius * radius;
+
+	// for each hair strand under the stroke
+	std::atomic<int> numChanges(0);
+
+	journal.beginStroke(&model, levelIdx, StrokeJournal::StrokeMove, strandIds);
+
+	const int numRuns = strandIds.size();
+	std::vector<char> isRunModified(numRuns, 0);
+
+	ParallelUtil::parallelFor(0, numRuns, [&](int begin, int end)
+	{
+		std::vector<XMFLOAT3> projPos, newProjPos;
+		projPos.reserve(NUM_UNISAM_VERTICES);
+		newProjPos.reserve(NUM_UNISAM_VERTICES);
+
+		std::vector<int> vertexHits;	// hit of each vertex, -1 if none
+
+		for (int r = begin; r < end; r++)
+		{
+			Strand* strand = model.getStrandAt(strandIds[r]);
+			StrandVertex* vertices = strand->vertices();
+			if (strand->numVertices() < 3)
+				continue;
+
+			vertexHits.assign(strand->numVertices(), -1);
+			for (int h = runStart[r]; h < runStart[r + 1]; h++)
+			{
+				if (hits[h].vertexId < strand->numVertices())
+					vertexHits[hits[h].vertexId] = h;
+			}
+
+			// Transform to world space
+			projPos.resize(strand->numVertices());
+			for (int j = 0; j < strand->numVertices(); j++)
+			{
+				XMVECTOR vec = XMLoadFloat3(&(vertices[j].position));
+				XMStoreFloat3(&(projPos[j]), XMVector3Transform(vec, mWorld));
+			}
+
+			newProjPos.resize(strand->numVertices());
+			newProjPos[0] = projPos[0];
+			newProjPos[1] = projPos[1];
+
+			// for each intermediate vertex...
+			bool isModified = false;
+			for (int j = 1; j < strand->numVertices() - 1; j++)
+			{
+				if (vertexHits[j] >= 0)
+				{
+					const StrokeHit& hit = hits[vertexHits[j]];
+
+					XMFLOAT2 newDir;
+					transformJointAngleXY(projPos.data(), newProjPos.data(), j, &newDir);
+
+					float dirLen = sqrtf(newDir.x*newDir.x + newDir.y*newDir.y);
+					if (dirLen > 0.0000001f)
+					{
+						newDir.x /= dirLen;
+						newDir.y /= dirLen;
+					}
+
+					// Add comb's influence (with a fall-off from stroke center)
+					float w = expf(-3.0f*hit.sqrDist/sqRad);
+					newDir.x += strokeDirs[hit.strokePt].x * w;
+					newDir.y += strokeDirs[hit.strokePt].y * w;
+
+					normalizeFloat2(newDir);
+
+					// update next vertex
+					newProjPos[j+1].x = newProjPos[j].x + newDir.x*dirLen;
+					newProjPos[j+1].y = newProjPos[j].y + newDir.y*dirLen;
+					newProjPos[j+1].z = projPos[j+1].z;
+
+					isModified = true;
+					numChanges++;
+				}
+				else
+				{
+					if (isModified)
+					{
+						XMFLOAT2 newDir;
+						transformJointAngleXY(projPos.data(), newProjPos.data(), j, &newDir);
+
+						newProjPos[j+1].x = newProjPos[j].x + newDir.x;
+						newProjPos[j+1].y = newProjPos[j].y + newDir.y;
+						newProjPos[j+1].z = projPos[j+1].z;
+					}
+					else
+						newProjPos[j+1] = projPos[j+1];
+				}
+			} // end for each vertex
+
+			if (!isModified)
+				continue;
+
+			isRunModified[r] = 1;
+			journal.saveStrand(r, 2);
+
+			// transform back to world space
+			for (int j = 2; j < strand->numVertices(); j++)
+			{
+				XMVECTOR vec = XMLoadFloat3(&(newProjPos[j]));
+				XMStoreFloat3(&(vertices[j].position), XMVector3Transform(vec, invWorld));
+			}
+		} // end for each strand
+	}, 16);
+
+	journal.endStroke();
+
+	// range of modified strands
+	for (int r = 0; r < numRuns; r++)
+	{
+		if (isRunModified[r])
+		{
+			firstModified = std::min(firstModified, strandIds[r]);
+			lastModified  = std::max(lastModified, strandIds[r]);
+		}
+	}
+
+	return numChanges;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector>
+
+#include "HairStrandModel.h"
+#include "ScreenGrid.h"
+
+class MorphBlender;
+class StrokeJournal;
+
+// Strand edits of the stroke tools on the vertices hit by a stroke (see
+// ScreenGrid::findStrokeHits). The hit strands are processed in parallel;
+// each edit records a stroke on level levelIdx of the model in the journal
+// and returns the number of changes. Buffers are left to the caller.
+class StrokeTools
+{
+public:
+
+	// Project the vertices of the model (their blended positions if pBlended)
+	// to the screen with the world transform, y pointing down, and build the
+	// stroke grid over them.
+	static void	buildStrokeGrid(const HairStrandModel& model, const MorphBlender* pBlended,
+								const XMFLOAT4X4& world, float cellSize, ScreenGrid& grid);
+
+	// start of the hits of each strand (plus the end) and the strands hit
+	static void	findStrokeRuns(const std::vector<StrokeHit>& hits, std::vector<int>& runStart,
+							   std::vector<int>& strandIds);
+
+	// Trim the hit strands to their root (changes are strands).
+	static int	deleteStrands(HairStrandModel& model, int levelIdx, const std::vector<StrokeHit>& hits,
+							  StrokeJournal& journal);
+
+	// Cut the hit strands at each hit vertex moved by a random offset within
+	// +-fuzziness, drawn per strand from seed so the cuts do not depend on
+	// threads (changes are cuts).
+	static int	cutStrands(HairStrandModel& model, int levelIdx, const std::vector<StrokeHit>& hits,
+						   int fuzziness, unsigned seed, StrokeJournal& journal);
+
+	// Bend the hit strands on screen (world transform) toward the direction of
+	// their nearest stroke point, with a fall-off from the stroke center. The
+	// stroke points are smoothed in place. Changes are vertices; the modified
+	// strands are within [firstModified, lastModified].
+	static int	combStrands(HairStrandModel& model, int levelIdx, const std::vector<StrokeHit>& hits,
+							XMFLOAT2* strokePts, int numStrokePts, float radius, float intensity,
+							const XMFLOAT4X4& world, StrokeJournal& journal,
+							int& firstModified, int& lastModified);
+};
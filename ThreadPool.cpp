@@ -0,0 +1,272 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+#ifdef _MSC_VER
+#define POOL_TLS	__declspec(thread)
+#else
+#define POOL_TLS	__thread
+#endif
+
+// pool and deque index of the current worker thread (-1 outside any pool)
+static POOL_TLS ThreadPool*	s_workerPool = NULL;
+static POOL_TLS int			s_workerIdx	 = -1;
+
+
+ThreadPool::ThreadPool(int numWorkers)
+	: m_numPending(0), m_stop(false)
+{
+	if (numWorkers <= 0)
+		numWorkers = std::max((int)std::thread::hardware_concurrency() - 1, 1);
+
+	for (int i = 0; i < numWorkers; i++)
+		m_queues.push_back(new WorkerQueue);
+
+	for (int i = 0; i < numWorkers; i++)
+		m_workers.push_back(std::thread(&ThreadPool::workerMain, this, i));
+}
+
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_wakeMutex);
+		m_stop = true;
+	}
+	m_wakeCond.notify_all();
+
+	for (int i = 0; i < m_workers.size(); i++)
+		m_workers[i].join();
+
+	for (int i = 0; i < m_queues.size(); i++)
+		delete m_queues[i];
+}
+
+
+ThreadPool& ThreadPool::global()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+
+void ThreadPool::submit(Task* task)
+{
+	if (s_workerPool == this)
+	{
+		WorkerQueue* queue = m_queues[s_workerIdx];
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		queue->tasks.push_back(task);
+	}
+	else
+	{
+		std::lock_guard<std::mutex> lock(m_sharedMutex);
+		m_sharedTasks.push_back(task);
+	}
+
+	{
+		// lock so a worker can't miss the wake-up between its check and wait
+		std::lock_guard<std::mutex> lock(m_wakeMutex);
+		m_numPending++;
+	}
+	m_wakeCond.notify_one();
+}
+
+
+namespace
+{
+	// Remove and return the newest (back) or oldest task of the group, or of
+	// any group if group is NULL.
+	template <class Task, class Group>
+	Task* takeTask(std::deque<Task*>& tasks, const Group* group, bool newest)
+	{
+		if (tasks.empty())
+			return NULL;
+
+		if (!group)
+		{
+			Task* task = newest ? tasks.back() : tasks.front();
+			if (newest)
+				tasks.pop_back();
+			else
+				tasks.pop_front();
+			return task;
+		}
+
+		const int n = tasks.size();
+		for (int k = 0; k < n; k++)
+		{
+			const int i = newest ? n - 1 - k : k;
+			if (tasks[i]->group == group)
+			{
+				Task* task = tasks[i];
+				tasks.erase(tasks.begin() + i);
+				return task;
+			}
+		}
+		return NULL;
+	}
+}
+
+
+ThreadPool::Task* ThreadPool::popTask(int workerIdx, TaskGroup* group)
+{
+	Task* task = NULL;
+
+	// own tasks, newest first
+	if (workerIdx >= 0)
+	{
+		WorkerQueue* queue = m_queues[workerIdx];
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		task = takeTask(queue->tasks, group, true);
+	}
+
+	// tasks from outside the pool, in submission order
+	if (!task)
+	{
+		std::lock_guard<std::mutex> lock(m_sharedMutex);
+		task = takeTask(m_sharedTasks, group, false);
+	}
+
+	// steal the oldest task of another worker
+	const int numQueues = m_queues.size();
+	for (int i = 1; !task && i <= numQueues; i++)
+	{
+		WorkerQueue* queue = m_queues[(std::max(workerIdx, 0) + i) % numQueues];
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		task = takeTask(queue->tasks, group, false);
+	}
+
+	if (task)
+		m_numPending--;
+
+	return task;
+}
+
+
+void ThreadPool::execute(Task* task)
+{
+	// the group must always hear of the task, whatever it threw
+	std::exception_ptr error;
+	try
+	{
+		task->func();
+	}
+	catch (...)
+	{
+		error = std::current_exception();
+	}
+
+	TaskGroup* group = task->group;
+	delete task;
+
+	group->taskDone(error);
+}
+
+
+bool ThreadPool::runOneTask(TaskGroup* group)
+{
+	if (m_numPending <= 0)
+		return false;
+
+	Task* task = popTask(s_workerPool == this ? s_workerIdx : -1, group);
+	if (!task)
+		return false;
+
+	execute(task);
+	return true;
+}
+
+
+void ThreadPool::workerMain(int workerIdx)
+{
+	s_workerPool = this;
+	s_workerIdx	 = workerIdx;
+
+	for (;;)
+	{
+		Task* task = popTask(workerIdx, NULL);
+		if (task)
+		{
+			execute(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_wakeMutex);
+		while (!m_stop && m_numPending <= 0)
+			m_wakeCond.wait(lock);
+
+		if (m_stop)
+			break;
+	}
+}
+
+
+TaskGroup::TaskGroup(ThreadPool& pool)
+	: m_pool(pool), m_numUnfinished(0)
+{
+}
+
+
+TaskGroup::~TaskGroup()
+{
+	waitAll();
+
+	if (m_error)
+		printf("ERROR: a task threw an exception that was never waited for!\n");
+}
+
+
+void TaskGroup::run(const std::function<void()>& func)
+{
+	ThreadPool::Task* task = new ThreadPool::Task;
+	task->func	= func;
+	task->group = this;
+
+	m_numUnfinished++;
+	m_pool.submit(task);
+}
+
+
+void TaskGroup::taskDone(std::exception_ptr error)
+{
+	// lock so wait() can't miss the notification between its check and wait
+	std::lock_guard<std::mutex> lock(m_doneMutex);
+	if (error && !m_error)
+		m_error = error;
+	if (--m_numUnfinished == 0)
+		m_doneCond.notify_all();
+}
+
+
+void TaskGroup::wait()
+{
+	waitAll();
+
+	if (m_error)
+	{
+		std::exception_ptr error = m_error;
+		m_error = std::exception_ptr();
+		std::rethrow_exception(error);
+	}
+}
+
+
+void TaskGroup::waitAll()
+{
+	while (m_numUnfinished > 0)
+	{
+		if (m_pool.runOneTask(this))
+			continue;
+
+		// the remaining tasks are running on other threads
+		std::unique_lock<std::mutex> lock(m_doneMutex);
+		if (m_numUnfinished > 0)
+			m_doneCond.wait_for(lock, std::chrono::milliseconds(1));
+	}
+
+	// taskDone() may still hold the lock after the last decrement
+	std::lock_guard<std::mutex> lock(m_doneMutex);
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+// Persistent work-stealing thread pool.
+//
+// Each worker owns a task deque: it pops its own tasks LIFO (cache-warm,
+// nested work first) and steals from the front of other workers' deques when
+// idle. Tasks submitted from outside the pool go to a shared FIFO queue, so
+// they start in submission order (submit the largest first for balance).
+// Threads waiting on a TaskGroup run pending tasks of that group instead of
+// blocking, never unrelated ones, so a short wait can't end up behind a long
+// foreign task and nested waits only go as deep as the groups are nested.
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TaskGroup;
+
+class ThreadPool
+{
+public:
+	// numWorkers <= 0 uses hardware concurrency - 1 (the waiting thread helps)
+	explicit ThreadPool(int numWorkers = 0);
+	~ThreadPool();
+
+	int		numWorkers() const { return m_workers.size(); }
+
+	// Shared pool used by ParallelUtil and TaskGroup by default
+	static ThreadPool&	global();
+
+private:
+
+	friend class TaskGroup;
+
+	struct Task
+	{
+		std::function<void()>	func;
+		TaskGroup*				group;
+	};
+
+	struct WorkerQueue
+	{
+		std::mutex			mutex;
+		std::deque<Task*>	tasks;
+	};
+
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator=(const ThreadPool&);
+
+	void	submit(Task* task);
+
+	// Run one pending task of the group if any (own deque, shared queue, then
+	// steal).
+	bool	runOneTask(TaskGroup* group);
+
+	// next task, of any group if group is NULL
+	Task*	popTask(int workerIdx, TaskGroup* group);
+	void	execute(Task* task);
+
+	void	workerMain(int workerIdx);
+
+	std::vector<std::thread>	m_workers;
+	std::vector<WorkerQueue*>	m_queues;		// one per worker
+
+	std::mutex					m_sharedMutex;
+	std::deque<Task*>			m_sharedTasks;	// submitted from outside the pool
+
+	std::mutex					m_wakeMutex;
+	std::condition_variable		m_wakeCond;
+	std::atomic<int>			m_numPending;	// queued, not yet started
+	bool						m_stop;
+};
+
+
+// A set of tasks that can be waited for together.
+class TaskGroup
+{
+public:
+	explicit TaskGroup(ThreadPool& pool = ThreadPool::global());
+	~TaskGroup();		// waits for unfinished tasks
+
+	void	run(const std::function<void()>& func);
+
+	// Wait until all tasks of the group have finished, running its pending
+	// tasks meanwhile. Rethrows the first exception thrown by one of them.
+	void	wait();
+
+private:
+
+	friend class ThreadPool;
+
+	TaskGroup(const TaskGroup&);
+	TaskGroup& operator=(const TaskGroup&);
+
+	void	taskDone(std::exception_ptr error);
+	void	waitAll();
+
+	ThreadPool&				m_pool;
+	std::atomic<int>		m_numUnfinished;
+	std::exception_ptr		m_error;		// first task exception
+
+	std::mutex				m_doneMutex;
+	std::condition_variable	m_doneCond;
+};
+
+
+// Flag shared with long-running tasks, which check it between work items and
+// stop early once it is set.
+class CancelToken
+{
+public:
+	CancelToken() : m_cancelled(false) {}
+
+	void	cancel()			{ m_cancelled = true; }
+	void	reset()				{ m_cancelled = false; }
+	bool	isCancelled() const	{ return m_cancelled; }
+
+private:
+	CancelToken(const CancelToken&);
+	CancelToken& operator=(const CancelToken&);
+
+	std::atomic<bool>	m_cancelled;
+};